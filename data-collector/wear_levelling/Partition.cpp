@@ -4,12 +4,14 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include "esp_log.h"
+#include "esp_flash_encrypt.h"
 #include "Partition.h"
 static const char *TAG = "wl_partition";
 
 Partition::Partition(const esp_partition_t *partition)
 {
     this->partition = partition;
+    this->calls = 0;
 }
 
 size_t Partition::chip_size()
@@ -26,6 +28,7 @@ esp_err_t Partition::erase_sector(size_t sector)
 
 esp_err_t Partition::erase_range(size_t start_address, size_t size)
 {
+    __atomic_fetch_add(&this->calls, 1, __ATOMIC_RELAXED);
     esp_err_t result = esp_partition_erase_range(this->partition, start_address, size);
     if (result == ESP_OK) {
         ESP_LOGV(TAG, "erase_range - start_address=0x%08x, size=0x%08x, result=0x%08x", start_address, size, result);
@@ -38,6 +41,7 @@ esp_err_t Partition::erase_range(size_t start_address, size_t size)
 esp_err_t Partition::write(size_t dest_addr, const void *src, size_t size)
 {
     esp_err_t result = ESP_OK;
+    __atomic_fetch_add(&this->calls, 1, __ATOMIC_RELAXED);
     result = esp_partition_write(this->partition, dest_addr, src, size);
     return result;
 }
@@ -45,15 +49,93 @@ esp_err_t Partition::write(size_t dest_addr, const void *src, size_t size)
 esp_err_t Partition::read(size_t src_addr, void *dest, size_t size)
 {
     esp_err_t result = ESP_OK;
+    // reads run concurrently with each other, see wl_read()
+    __atomic_fetch_add(&this->calls, 1, __ATOMIC_RELAXED);
     result = esp_partition_read(this->partition, src_addr, dest, size);
     return result;
 }
 
+// esp_partition has no vectored calls, entries continuing each other are done by one call instead
+esp_err_t Partition::readv(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(iov, count, true, &size);
+        result = Partition::read(iov[0].addr, iov[0].buf, size);
+        iov += n;
+        count -= n;
+    }
+    return result;
+}
+
+esp_err_t Partition::writev(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(iov, count, true, &size);
+        result = Partition::write(iov[0].addr, iov[0].buf, size);
+        iov += n;
+        count -= n;
+    }
+    return result;
+}
+
+esp_err_t Partition::erase_ranges(const wl_iovec_t *ranges, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(ranges, count, false, &size);
+        result = Partition::erase_range(ranges[0].addr, size);
+        ranges += n;
+        count -= n;
+    }
+    return result;
+}
+
+esp_err_t Partition::mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle)
+{
+    // the cache decrypts everything it reads when flash encryption is on, plain partitions have to be read
+    if (!this->partition->encrypted && esp_flash_encryption_enabled()) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    esp_partition_mmap_handle_t mmap_handle;
+    esp_err_t result = esp_partition_mmap(this->partition, addr, size, ESP_PARTITION_MMAP_DATA, ptr, &mmap_handle);
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "mmap - addr=0x%08x, size=0x%08x, result=0x%08x", addr, size, result);
+        return result;
+    }
+    *handle = mmap_handle;
+    return result;
+}
+
+void Partition::munmap(uint32_t handle)
+{
+    esp_partition_munmap(handle);
+}
+
 size_t Partition::sector_size()
 {
     return SPI_FLASH_SEC_SIZE;
 }
 
+bool Partition::encrypted()
+{
+    return this->partition->encrypted;
+}
+
+uint32_t Partition::call_count()
+{
+    return __atomic_load_n(&this->calls, __ATOMIC_RELAXED);
+}
+
+void Partition::reset_call_count()
+{
+    __atomic_store_n(&this->calls, 0, __ATOMIC_RELAXED);
+}
+
 Partition::~Partition()
 {
 
@@ -8,6 +8,7 @@
 #include "SPI_Flash.h"
 #include "spi_flash_mmap.h"
 #include "esp_flash.h"
+#include "esp_flash_encrypt.h"
 
 static const char *TAG = "spi_flash";
 
@@ -67,6 +68,69 @@ esp_err_t SPI_Flash::read(size_t src_addr, void *dest, size_t size)
     return result;
 }
 
+// esp_flash has no vectored calls, entries continuing each other are done by one call instead
+esp_err_t SPI_Flash::readv(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(iov, count, true, &size);
+        result = SPI_Flash::read(iov[0].addr, iov[0].buf, size);
+        iov += n;
+        count -= n;
+    }
+    return result;
+}
+
+esp_err_t SPI_Flash::writev(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(iov, count, true, &size);
+        result = SPI_Flash::write(iov[0].addr, iov[0].buf, size);
+        iov += n;
+        count -= n;
+    }
+    return result;
+}
+
+esp_err_t SPI_Flash::erase_ranges(const wl_iovec_t *ranges, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while ((count > 0) && (result == ESP_OK)) {
+        size_t size;
+        size_t n = contiguous(ranges, count, false, &size);
+        result = SPI_Flash::erase_range(ranges[0].addr, size);
+        ranges += n;
+        count -= n;
+    }
+    return result;
+}
+
+// spi_flash_mmap() maps whole MMU pages, the pointer is moved to addr in the first one
+esp_err_t SPI_Flash::mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle)
+{
+    if (esp_flash_encryption_enabled()) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t page_offset = addr % SPI_FLASH_MMU_PAGE_SIZE;
+    spi_flash_mmap_handle_t mmap_handle;
+    esp_err_t result = spi_flash_mmap(addr - page_offset, size + page_offset, SPI_FLASH_MMAP_DATA, ptr, &mmap_handle);
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "mmap - addr=0x%08x, size=0x%08x, result=0x%08x", addr, size, result);
+        return result;
+    }
+    *ptr = (const uint8_t *)*ptr + page_offset;
+    *handle = mmap_handle;
+    return result;
+}
+
+void SPI_Flash::munmap(uint32_t handle)
+{
+    spi_flash_munmap(handle);
+}
+
 size_t SPI_Flash::sector_size()
 {
     return SPI_FLASH_SEC_SIZE;
@@ -3,7 +3,9 @@
 #include <string.h>
 #include "esp_log.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 #include "crc32.h"
+#include "sdkconfig.h"
 
 static const char *TAG = "wl_advanced";
 
@@ -11,6 +13,23 @@ static const char *TAG = "wl_advanced";
 #define WL_CFG_CRC_CONST UINT32_MAX
 #endif // WL_CFG_CRC_CONST
 
+#ifndef WL_POS_VERIFY_WINDOW
+#define WL_POS_VERIFY_WINDOW 4
+#endif // WL_POS_VERIFY_WINDOW
+
+// Partitions with up to this many sectors map addresses through a precomputed table, see buildMappingTable()
+#ifndef WL_MAPPING_TABLE_MAX_SECTORS
+#ifdef CONFIG_WL_MAPPING_TABLE_MAX_SECTORS
+#define WL_MAPPING_TABLE_MAX_SECTORS CONFIG_WL_MAPPING_TABLE_MAX_SECTORS
+#else
+#define WL_MAPPING_TABLE_MAX_SECTORS 0
+#endif // CONFIG_WL_MAPPING_TABLE_MAX_SECTORS
+#endif // WL_MAPPING_TABLE_MAX_SECTORS
+
+#if WL_MAPPING_TABLE_MAX_SECTORS > 0x10000
+#error "WL_MAPPING_TABLE_MAX_SECTORS too big, table entries are 16 bit"
+#endif
+
 #define WL_RESULT_CHECK(result) \
     if (result != ESP_OK) { \
         ESP_LOGE(TAG,"%s(%d): result = 0x%08x", __FUNCTION__, __LINE__, result); \
@@ -20,11 +39,28 @@ static const char *TAG = "wl_advanced";
 WL_Advanced::WL_Advanced(): WL_Flash()
 {
     this->erase_count_buffer = NULL;
+    this->erase_count_dirty = NULL;
+    this->erase_count_log_addr = WL_ERASE_COUNT_LOG_NONE;
+    this->erase_count_log_generation = 0;
+    this->erase_count_log_version = 0;
+    this->erase_count_log_end = 0;
+    this->erase_count_log_torn = false;
+    this->erase_count_spare_erased = 0;
+    this->erase_count_spare_wanted = false;
+    memset(&this->feistel, 0, sizeof(this->feistel));
+    memset(&this->swap_or_not, 0, sizeof(this->swap_or_not));
+    this->mapping_table.entries = NULL;
+    this->mapping_table_feistel_keys = 0;
+    this->mapping_table_mapping = 0;
+    memset(this->mapping_table_mapping_keys, 0, sizeof(this->mapping_table_mapping_keys));
+    memset(&this->mapping_stats, 0, sizeof(this->mapping_stats));
 }
 
 WL_Advanced::~WL_Advanced()
 {
     free(this->erase_count_buffer);
+    free(this->erase_count_dirty);
+    free(this->mapping_table.entries);
 }
 
 esp_err_t WL_Advanced::config(wl_config_t *cfg, Flash_Access *flash_drv)
@@ -62,6 +98,7 @@ esp_err_t WL_Advanced::config(wl_config_t *cfg, Flash_Access *flash_drv)
     // and save their addresses
     this->addr_erase_counts1 = this->addr_state1 - 2 * this->erase_count_records_size;
     this->addr_erase_counts2 = this->addr_state1 - this->erase_count_records_size;
+    this->rotation.init(this->flash_size, this->cfg.page_size);
 
     ESP_LOGD(TAG, "%s: new flash_size=0x%x, addr_erase_counts1=0x%x, addr_erase_counts2=0x%x",
              __func__, this->flash_size, this->addr_erase_counts1, this->addr_erase_counts2);
@@ -81,35 +118,6 @@ esp_err_t WL_Advanced::init()
 
     this->initialized = false;
 
-    // calculate bits needed for sector addressing and in turn for Feistel network
-    // feistel_bit_width = log2(sector_count)
-    uint32_t sector_count = this->flash_size / this->cfg.sector_size;
-    for (this->feistel_bit_width = 0; sector_count; this->feistel_bit_width++) {
-        sector_count >>= 1;
-    }
-
-    // we are using 8 bit keys in Feistel network, where each key is XORed with half of sector address
-    // so if sector address has more than 16 bits, it cannot be split to two parts where each would be at max 8 bits long
-    // => such long sector addresses (for partition with more than 2^16 sectors) are currently not supported
-    // sidenote: extending key bit length is presumably possible, currently using only 3*8bits (for simplicity) out of 32bits randomly generated and saved in feistel_keys
-    if (this->feistel_bit_width > 16) {
-        ESP_LOGE(TAG, "%s: Wear leveled partition contains too many sectors for WL_Advanced!", __func__);
-        ESP_LOGE(TAG, "%s: Sector address cannot be properly randomized in current implementation of Feistel network.", __func__);
-        return ESP_ERR_NOT_SUPPORTED;
-    }
-
-    /*
-    * split bit width to | msb | lsb |
-    * if bit width not even, make lsb 1 longer (e.g. | 3 bits | 4bits |)
-    * lsb = ceil(feistel_bit_width / 2)
-    * msb = feistel_bit_width - lsb
-    * For usage of calculated bit widths see addressFeistelNetwork()
-    */
-    this->feistel_lsb_width = (this->feistel_bit_width + 1) / 2;
-    this->feistel_msb_width = this->feistel_bit_width - this->feistel_lsb_width;
-
-    ESP_LOGD(TAG, "%s: feistel_bit_width=%u, msb=%u, lsb=%u", __func__, this->feistel_bit_width, this->feistel_msb_width, this->feistel_lsb_width);
-
     wl_advanced_state_t *state_main = (wl_advanced_state_t *)&this->state;
     wl_advanced_state_t _state_copy;
     wl_advanced_state_t *state_copy = &_state_copy;
@@ -134,24 +142,9 @@ esp_err_t WL_Advanced::init()
     if ((crc1 == state_main->crc) && (crc2 == state_copy->crc)) {
         // states are individually valid
         if (crc1 != crc2) {
-            // second copy was not updated, rewrite it based on main
-            result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
+            // second copy was not updated, rewrite it based on main, copying pos update records as well
+            result = this->repairState(this->addr_state1, this->addr_state2, state_main, state_main->max_pos);
             WL_RESULT_CHECK(result);
-            result = this->flash_drv->write(this->addr_state2, state_main, sizeof(wl_advanced_state_t));
-            WL_RESULT_CHECK(result);
-
-            // copy pos update records as well
-            for (uint32_t i = 0; i < state_main->max_pos; i++) {
-                // read pos update record
-                result = this->flash_drv->read(this->addr_state1 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                WL_RESULT_CHECK(result);
-                // check it is valid
-                if (this->OkBuffSet(i) == true) {
-                    // if so, write it as second copy
-                    result = this->flash_drv->write(this->addr_state2 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                }
-            }
         }
 
         ESP_LOGV(TAG, "%s: both state CRC checks OK", __func__);
@@ -163,47 +156,36 @@ esp_err_t WL_Advanced::init()
         result = this->initSections();
         WL_RESULT_CHECK(result);
     } else {
-        // recover broken state (one CRC invalid)
+        // recover broken state (one CRC invalid), with all valid pos update records
         if (crc1 == state_main->crc) {
             // state main valid, rewrite copy
-            this->flash_drv->erase_range(this->addr_state2, this->state_size);
-            WL_RESULT_CHECK(result);
-            this->flash_drv->write(this->addr_state2, state_main, sizeof(wl_advanced_state_t));
+            result = this->repairState(this->addr_state1, this->addr_state2, state_main, state_main->max_pos);
             WL_RESULT_CHECK(result);
-
-            for (uint32_t i = 0; i < state_main->max_pos; i++) {
-                // read pos update record
-                result = this->flash_drv->read(this->addr_state1 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                WL_RESULT_CHECK(result);
-                // check it is valid
-                if (this->OkBuffSet(i) == true) {
-                    // if so, write it as second copy
-                    result = this->flash_drv->write(this->addr_state2 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                }
-            }
         } else {
-            // last case of only copy being valid => rewrite state main
-            this->flash_drv->erase_range(this->addr_state1, this->state_size);
-            WL_RESULT_CHECK(result);
-            this->flash_drv->write(this->addr_state1, state_copy, sizeof(wl_advanced_state_t));
+            // last case of only copy being valid => continue with the valid state and rewrite state main,
+            // pos update records are checked against device_id of the state
+            memcpy(state_main, state_copy, sizeof(wl_advanced_state_t));
+            result = this->repairState(this->addr_state2, this->addr_state1, state_main, state_main->max_pos);
             WL_RESULT_CHECK(result);
-
-            for (uint32_t i = 0; i < state_copy->max_pos; i++) {
-                // read pos update record
-                result = this->flash_drv->read(this->addr_state2 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                WL_RESULT_CHECK(result);
-                // check it is valid
-                if (this->OkBuffSet(i) == true) {
-                    // if so, write it as second copy
-                    result = this->flash_drv->write(this->addr_state1 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                }
-            }
         }
+        result = this->recoverPos();
+        WL_RESULT_CHECK(result);
     }
 
-    ESP_LOGI(TAG, "%s: pos=%u, max_pos=%u", __func__, state_main->pos, state_main->max_pos);
+    ESP_LOGI(TAG, "%s: pos=%u, max_pos=%u, mapping=%u", __func__, state_main->pos, state_main->max_pos, state_main->mapping);
+    if (state_main->mapping != WL_MAPPING_FEISTEL && state_main->mapping != WL_MAPPING_SWAP_OR_NOT) {
+        ESP_LOGE(TAG, "%s: unknown address mapping %u", __func__, state_main->mapping);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    this->prepareMapping();
+    // Feistel network uses 8 bit keys, where each key is XORed with half of sector address
+    // so if sector address has more than 16 bits, it cannot be split to two parts where each would be at max 8 bits long
+    // => partitions with more than 2^16 sectors are only supported with swap-or-not, which new partitions use anyway
+    if (state_main->mapping == WL_MAPPING_FEISTEL && this->feistel.bit_width > 16) {
+        ESP_LOGE(TAG, "%s: Wear leveled partition contains too many sectors for Feistel network address randomization", __func__);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    ESP_LOGD(TAG, "%s: feistel bit_width=%u, msb=%u, lsb=%u", __func__, this->feistel.bit_width, this->feistel.msb_width, this->feistel.lsb_width);
 
     // allocate buffer to store 2B number for each sector's erase count
     this->erase_count_buffer_size = state_main->max_pos * sizeof(uint16_t);
@@ -211,12 +193,31 @@ esp_err_t WL_Advanced::init()
     if (this->erase_count_buffer == NULL) {
         return ESP_ERR_NO_MEM;
     }
+    // and a bitmap of sectors with erase counts not saved to flash yet
+    this->erase_count_dirty = (uint32_t *)calloc((state_main->max_pos + 31) / 32, sizeof(uint32_t));
+    if (this->erase_count_dirty == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
     ESP_LOGD(TAG, "%s: allocated erase_count_buffer OK", __func__);
 
     // load existing erase counts to just allocated buffer
     result = this->readEraseCounts();
     WL_RESULT_CHECK(result);
+    // and add erases from pos update records written since the last dummy block loop,
+    // from now on updateWL() keeps the buffer up to date as it appends new records
+    result = this->updateEraseCounts();
+    WL_RESULT_CHECK(result);
+    // erase counts saved before in other than the current log format are compacted by the next save,
+    // so the other copy can be erased in advance (not for new partitions, whose copies are blank)
+    if (this->state.move_count != 0 || state_main->cycle_count != 0) {
+        this->erase_count_spare_wanted = (this->erase_count_log_addr == WL_ERASE_COUNT_LOG_NONE) || this->erase_count_log_torn
+                                         || (this->erase_count_log_version != WL_ERASE_COUNT_LOG_VERSION_BLOCKS);
+    }
 
+    // keys are final now, precompute the mapping if the partition is small enough
+    this->buildMappingTable();
+
+    this->publishMap();
     this->initialized = true;
     return ESP_OK;
 }
@@ -241,9 +242,16 @@ esp_err_t WL_Advanced::initSections()
 
     // will use only 3B for 3 stage Feistel network, each stage requires an 8bit (1B) key
     // generating full 32bit (4B) random value is convenient, no reason to mask out the not used byte
-    // for usage of keys see addressFeistelNetwork()
+    // for usage of keys see wl_mapping::Feistel
     advanced_state->feistel_keys = esp_random();
 
+    // new partitions use mapping without cycle walks, see wl_mapping::SwapOrNot
+    // whose key is feistel_keys together with mapping_keys
+    advanced_state->mapping = WL_MAPPING_SWAP_OR_NOT;
+    for (uint8_t i = 0; i < WL_MAPPING_KEY_WORDS; i++) {
+        advanced_state->mapping_keys[i] = esp_random();
+    }
+
     memset(advanced_state->reserved, 0, sizeof(advanced_state->reserved));
 
     this->state.max_pos = 1 + this->flash_size / this->cfg.page_size;
@@ -274,31 +282,56 @@ esp_err_t WL_Advanced::initSections()
     WL_RESULT_CHECK(result);
 
     uint8_t *keys = (uint8_t *)&advanced_state->feistel_keys;
-    ESP_LOGD(TAG, "%s: generated Feistel keys (%u, %u, %u) for bit with %u", __func__, keys[0], keys[1], keys[2], this->feistel_bit_width);
+    ESP_LOGD(TAG, "%s: generated Feistel keys (%u, %u, %u)", __func__, keys[0], keys[1], keys[2]);
 
     return result;
 }
 
 
 /*
- * Go through pos update records until the first with invalid CRC.
+ * Find the first pos update record with invalid CRC.
  * Assume that is the current position of dummy block
  * (pos points to 'after' last pos update record, see updateWl() pos increment).
  *
+ * Records are only appended, so valid ones form a prefix and its end can be binary searched.
+ * The last WL_POS_VERIFY_WINDOW records of the prefix are checked again; if any of them is broken
+ * (e.g. torn write), the prefix is not trusted and records are scanned one by one from the start.
+ *
  * (own recoverPos() needed to call WL_Advanced::OkBuffSet() as it implements different logic)
  */
 esp_err_t WL_Advanced::recoverPos()
 {
     esp_err_t result = ESP_OK;
 
-    uint32_t position = 0;
+    // records [0, low) valid, record high invalid or high == max_pos
+    uint32_t low = 0;
+    uint32_t high = this->state.max_pos;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        result = this->flash_drv->read(this->addr_state1 + sizeof(wl_advanced_state_t) + mid * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
+        WL_RESULT_CHECK(result);
+        if (this->OkBuffSet(mid) == true) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
 
-    for (uint32_t i = 0; i < this->state.max_pos; i++) {
-        position = i;
+    uint32_t position = low;
+    uint32_t window_start = (position > WL_POS_VERIFY_WINDOW) ? (position - WL_POS_VERIFY_WINDOW) : 0;
+    for (uint32_t i = window_start; i < position; i++) {
         result = this->flash_drv->read(this->addr_state1 + sizeof(wl_advanced_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
         WL_RESULT_CHECK(result);
         if (this->OkBuffSet(i) == false) {
-            // found invalid record => found position
+            ESP_LOGW(TAG, "%s: broken pos update record at %u, scanning all records", __func__, i);
+            for (position = 0; position < i; position++) {
+                result = this->flash_drv->read(this->addr_state1 + sizeof(wl_advanced_state_t) + position * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
+                WL_RESULT_CHECK(result);
+                if (this->OkBuffSet(position) == false) {
+                    // found invalid record => found position
+                    break;
+                }
+            }
             break;
         }
     }
@@ -328,14 +361,11 @@ void WL_Advanced::fillOkBuff(int sector)
     wl_sector_erase_record_t *record_buff = (wl_sector_erase_record_t *)this->temp_buff;
 
     size_t physical_sector = this->calcAddr(sector * this->cfg.sector_size) / this->cfg.sector_size;
-    ESP_LOGV(TAG, "%s: sector %u maps to %u", __func__, sector, physical_sector);
 
     record_buff->device_id = this->state.device_id;
     record_buff->pos = this->state.pos;
     record_buff->sector = physical_sector;
     record_buff->crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)record_buff, offsetof(wl_sector_erase_record_t, crc));
-
-    ESP_LOGD(TAG, "%s: device_id=%u, pos=%u, sector=%u, crc=%u", __func__, record_buff->device_id, record_buff->pos, record_buff->sector, record_buff->crc);
 }
 
 
@@ -375,6 +405,9 @@ bool WL_Advanced::OkBuffSet(int pos)
  *
  * For an incomplete triplet - 1~2 remaining pairs of (sector number, erase count) - fill the rest of record with 0
  * => as mentioned above, 0 erase count marks 'no value' record, used in readEraseCounts()
+ *
+ * Pairs hold 16 bit sector numbers below 0xFFFF, larger partitions are only stored as the erase count log,
+ * see saveEraseCounts().
  */
 esp_err_t WL_Advanced::writeEraseCounts(size_t erase_counts_addr)
 {
@@ -382,6 +415,10 @@ esp_err_t WL_Advanced::writeEraseCounts(size_t erase_counts_addr)
         ESP_LOGE(TAG, "%s: erase counts address 0x%x is invalid", __func__, erase_counts_addr);
         return ESP_ERR_INVALID_ARG;
     }
+    if (this->state.max_pos > 0xFFFF) {
+        ESP_LOGE(TAG, "%s: %u sectors don't fit (sector, erase count) pairs", __func__, this->state.max_pos);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
 
     esp_err_t result = ESP_OK;
 
@@ -432,7 +469,7 @@ esp_err_t WL_Advanced::writeEraseCounts(size_t erase_counts_addr)
     if (pair_index > 0) {
         ESP_LOGV(TAG, "%s: incomplete triplet for write at index %u", __func__, erase_count_index);
         erase_count_buff->crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)erase_count_buff, offsetof(wl_erase_count_t, crc));
-        result = this->flash_drv->write(this->addr_erase_counts1 + erase_count_index * sizeof(wl_erase_count_t), erase_count_buff, sizeof(wl_erase_count_t));
+        result = this->flash_drv->write(erase_counts_addr + erase_count_index * sizeof(wl_erase_count_t), erase_count_buff, sizeof(wl_erase_count_t));
         WL_RESULT_CHECK(result);
         ESP_LOGV(TAG, "%s: incomplete triplet written", __func__);
     }
@@ -457,27 +494,45 @@ esp_err_t WL_Advanced::writeEraseCounts(size_t erase_counts_addr)
  * save PER SECTOR erase counts, where every byte counts.
  *
  * This results in having to multiply the value in buffer by updaterate to get the real approximate of erase count for that sector.
+ *
+ * Flash is only scanned once after mount; updateWL() then increments the buffer itself for every record it appends,
+ * so at the dummy block loop the buffer is already up to date and only needs to be written.
+ *
+ * Only records before state.pos, as recoverPos() found it, are valid. They are read in large chunks
+ * and checked in RAM, as repairState() does.
  */
 esp_err_t WL_Advanced::updateEraseCounts()
 {
     esp_err_t result = ESP_OK;
     wl_sector_erase_record_t *record_buff = (wl_sector_erase_record_t *)this->temp_buff;
 
-    // go through all pos update records and tally up erase counts to buffer, incrementing existing counts
-    for (uint32_t i = 0; i < this->state.max_pos; i++) {
-        result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + i * sizeof(wl_sector_erase_record_t), record_buff, sizeof(wl_sector_erase_record_t));
-        WL_RESULT_CHECK(result);
-
-        if (this->OkBuffSet(i)) {
-            // increment erase count, indexing by sector number
-            this->erase_count_buffer[record_buff->sector]++;
-            ESP_LOGV(TAG, "%s: buffer OK at pos %u, sector [%u]++ => %u", __func__, i, record_buff->sector, this->erase_count_buffer[record_buff->sector]);
-        } else {
-            ESP_LOGD(TAG, "%s: found pos at %i", __func__, i);
+    size_t buff_size;
+    uint8_t *buff = this->getCopyBuffer(&buff_size);
+    // records are checked in temp_buff, so without a bigger buffer go one record at a time
+    size_t chunk_records = (buff == this->temp_buff) ? 1 : buff_size / this->cfg.wr_size;
+    // go through the pos update records and tally up erase counts to buffer, incrementing existing counts
+    for (uint32_t first = 0; first < this->state.pos; first += chunk_records) {
+        size_t count = this->state.pos - first;
+        if (count > chunk_records) {
+            count = chunk_records;
+        }
+        result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + first * this->cfg.wr_size, buff, count * this->cfg.wr_size);
+        if (result != ESP_OK) {
             break;
         }
+        for (size_t i = 0; i < count; i++) {
+            if (buff != this->temp_buff) {
+                memcpy(this->temp_buff, &buff[i * this->cfg.wr_size], this->cfg.wr_size);
+            }
+            if (this->OkBuffSet(first + i)) {
+                // increment erase count, indexing by sector number
+                this->countErase(record_buff->sector);
+                ESP_LOGV(TAG, "%s: buffer OK at pos %u, sector [%u]++ => %u", __func__, first + i, record_buff->sector, this->erase_count_buffer[record_buff->sector]);
+            }
+        }
     }
-
+    this->putCopyBuffer(buff);
+    WL_RESULT_CHECK(result);
     return result;
 }
 
@@ -499,6 +554,9 @@ esp_err_t WL_Advanced::updateEraseCounts()
  * Erase counts handled here are updaterate smaller then real ones - see updateEraseCounts()
  *
  * UINT16_MAX * updaterate is for sure greater then single sector erase lifetime, so 2B number for an erase count should be OK
+ *
+ * The above is the legacy format, with both copies holding the same records. A copy starting with a valid
+ * log header holds an erase count log instead (see saveEraseCounts()), which is replayed from the newer valid copy.
  */
 esp_err_t WL_Advanced::readEraseCounts()
 {
@@ -508,12 +566,49 @@ esp_err_t WL_Advanced::readEraseCounts()
     wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
 
     memset(this->erase_count_buffer, 0, this->erase_count_buffer_size);
+    if (this->erase_count_dirty != NULL) {
+        memset(this->erase_count_dirty, 0, (this->state.max_pos + 31) / 32 * sizeof(uint32_t));
+    }
+    this->erase_count_log_addr = WL_ERASE_COUNT_LOG_NONE;
+    this->erase_count_log_torn = false;
 
     if (this->state.move_count == 0 && advanced_state->cycle_count == 0) {
         ESP_LOGD(TAG, "%s: no erase counts in flash yet, as move_count=%u and cycle_count=%u", __func__, this->state.move_count, advanced_state->cycle_count);
         return ESP_OK;
     }
 
+    // look for erase count log, newer generation first
+    uint32_t generation1 = 0;
+    uint32_t generation2 = 0;
+    uint32_t version1 = 0;
+    uint32_t version2 = 0;
+    bool log1 = this->readEraseCountLogHeader(this->addr_erase_counts1, &generation1, &version1);
+    bool log2 = this->readEraseCountLogHeader(this->addr_erase_counts2, &generation2, &version2);
+    if (log1 && log2 && (int32_t)(generation2 - generation1) > 0) {
+        result = this->replayEraseCountLog(this->addr_erase_counts2, generation2, version2);
+        WL_RESULT_CHECK(result);
+        if (this->erase_count_log_addr == WL_ERASE_COUNT_LOG_NONE) {
+            result = this->replayEraseCountLog(this->addr_erase_counts1, generation1, version1);
+            WL_RESULT_CHECK(result);
+        }
+    } else if (log1 || log2) {
+        if (log1) {
+            result = this->replayEraseCountLog(this->addr_erase_counts1, generation1, version1);
+            WL_RESULT_CHECK(result);
+        }
+        if (log2 && this->erase_count_log_addr == WL_ERASE_COUNT_LOG_NONE) {
+            result = this->replayEraseCountLog(this->addr_erase_counts2, generation2, version2);
+            WL_RESULT_CHECK(result);
+        }
+    }
+    if (this->erase_count_log_addr != WL_ERASE_COUNT_LOG_NONE) {
+        ESP_LOGI(TAG, "%s: loaded erase counts from log at 0x%x, generation %u, version %u, %u records", __func__,
+                 this->erase_count_log_addr, this->erase_count_log_generation, this->erase_count_log_version, this->erase_count_log_end);
+        return ESP_OK;
+    }
+    // no usable log, legacy format follows
+    memset(this->erase_count_buffer, 0, this->erase_count_buffer_size);
+
     // go through saved erase counts in flash, checking CRCs with second copy as fallback
     // on CRC OK, save the 3 erase counts from one wl_erase_count_t to buffer, indexing by sector
     for (uint32_t i = 0; i < this->state.max_pos; i++) {
@@ -554,6 +649,476 @@ esp_err_t WL_Advanced::readEraseCounts()
     return result;
 }
 
+static bool eraseCountMarkerValid(const wl_erase_count_marker_t *marker, uint32_t magic, uint32_t value)
+{
+    return (marker->magic == magic) && (marker->value == value)
+           && (marker->crc == crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)marker, offsetof(wl_erase_count_marker_t, crc)));
+}
+
+static bool eraseCountRecordBlank(const void *record)
+{
+    const uint32_t *words = (const uint32_t *)record;
+    for (size_t i = 0; i < sizeof(wl_erase_count_t) / sizeof(uint32_t); i++) {
+        if (words[i] != UINT32_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// CRC of block header (without crc itself) followed by payload
+static uint32_t eraseCountBlockCrc(const wl_erase_count_block_t *block)
+{
+    uint8_t crc_data[WL_ERASE_COUNT_BLOCK_MAX];
+    memcpy(crc_data, block, offsetof(wl_erase_count_block_t, crc));
+    memcpy(&crc_data[offsetof(wl_erase_count_block_t, crc)], block + 1, block->payload_size);
+    return crc32::crc32_le(WL_CFG_CRC_CONST, crc_data, offsetof(wl_erase_count_block_t, crc) + block->payload_size);
+}
+
+// varint, 7 bits per byte starting with the lowest, MSB set on all but the last byte
+static bool readVarint(const uint8_t *data, size_t size, size_t *offset, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        if (*offset >= size) {
+            return false;
+        }
+        uint8_t byte = data[(*offset)++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void writeVarint(uint8_t *data, uint16_t *offset, uint32_t value)
+{
+    while (value >= 0x80) {
+        data[(*offset)++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    data[(*offset)++] = (uint8_t)value;
+}
+
+// number of 16 B records taken by a block, 0 if the block header is not sane
+static uint32_t eraseCountBlockRecords(const wl_erase_count_block_t *block)
+{
+    if (block->tag != WL_ERASE_COUNT_BLOCK_TAG || block->payload_size > WL_ERASE_COUNT_BLOCK_MAX - sizeof(wl_erase_count_block_t)) {
+        return 0;
+    }
+    return 1 + (block->payload_size + sizeof(wl_erase_count_t) - 1) / sizeof(wl_erase_count_t);
+}
+
+bool WL_Advanced::readEraseCountLogHeader(size_t erase_counts_addr, uint32_t *generation, uint32_t *version)
+{
+    wl_erase_count_marker_t header;
+    if (this->flash_drv->read(erase_counts_addr, &header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+    if (!eraseCountMarkerValid(&header, WL_ERASE_COUNT_LOG_MAGIC, header.value)) {
+        return false;
+    }
+    if (header.value != WL_ERASE_COUNT_LOG_VERSION_TRIPLETS && header.value != WL_ERASE_COUNT_LOG_VERSION_BLOCKS) {
+        ESP_LOGW(TAG, "%s: unknown erase count log version %u at 0x%x", __func__, header.value, erase_counts_addr);
+        return false;
+    }
+    *generation = header.generation;
+    *version = header.value;
+    return true;
+}
+
+/*
+ * Apply one entry of erase count log to the buffer
+ * version 1: triplet, see readEraseCounts()
+ * version 2: block of consecutive sectors, see writeEraseCountRecords()
+ * Entries with invalid CRC are skipped.
+ */
+void WL_Advanced::applyEraseCountEntry(const uint8_t *entry, uint32_t version)
+{
+    if (version == WL_ERASE_COUNT_LOG_VERSION_TRIPLETS) {
+        const wl_erase_count_t *record = (const wl_erase_count_t *)entry;
+        if (record->crc != crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)record, offsetof(wl_erase_count_t, crc))) {
+            return;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (record->pairs[j].erase_count != 0 && record->pairs[j].sector < this->state.max_pos) {
+                this->erase_count_buffer[record->pairs[j].sector] = record->pairs[j].erase_count;
+            }
+        }
+        return;
+    }
+
+    const wl_erase_count_block_t *block = (const wl_erase_count_block_t *)entry;
+    if (block->crc != eraseCountBlockCrc(block)) {
+        ESP_LOGW(TAG, "%s: broken block of %u sectors from %u", __func__, block->sector_count, block->base_sector);
+        return;
+    }
+    const uint8_t *payload = (const uint8_t *)(block + 1);
+    size_t offset = 0;
+    uint32_t sector = block->base_sector;
+    int32_t count = 0;
+    for (uint32_t i = 0; i < block->sector_count; i++) {
+        uint32_t gap = 0;
+        uint32_t zigzag = 0;
+        if ((i > 0 && !readVarint(payload, block->payload_size, &offset, &gap)) || !readVarint(payload, block->payload_size, &offset, &zigzag)) {
+            return;
+        }
+        if (i > 0) {
+            sector += gap + 1;
+        }
+        if (sector >= this->state.max_pos) {
+            return;
+        }
+        // zigzag decoded delta to count of previous sector
+        count += (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        this->erase_count_buffer[sector] = (uint16_t)count;
+    }
+}
+
+/*
+ * Replay erase count log of given copy into the buffer
+ *
+ * First pass finds the end of the log and its last commit record, second pass applies all entries
+ * before that commit; entries hold absolute erase counts, so later entries override earlier ones.
+ * Records after the last commit come from a save interrupted by power loss and are ignored.
+ *
+ * Records are read in chunks of at least WL_ERASE_COUNT_BLOCK_MAX, so every block fits the buffer;
+ * a block crossing the end of a chunk is read again at the start of the next one.
+ *
+ * On success erase_count_log_* describe the replayed copy. If the copy has no commit at all,
+ * erase_count_log_addr stays WL_ERASE_COUNT_LOG_NONE and the buffer is zeroed again.
+ */
+esp_err_t WL_Advanced::replayEraseCountLog(size_t erase_counts_addr, uint32_t generation, uint32_t version)
+{
+    esp_err_t result = ESP_OK;
+    uint32_t log_records = this->erase_count_records_size / sizeof(wl_erase_count_t);
+    uint32_t end = 1;
+    uint32_t last_commit = 0;
+
+    uint8_t block_buff[WL_ERASE_COUNT_BLOCK_MAX];
+    size_t buff_size;
+    uint8_t *pool_buff = this->getCopyBuffer(&buff_size);
+    uint8_t *buff = pool_buff;
+    if (buff_size < sizeof(block_buff)) {
+        buff = block_buff;
+        buff_size = sizeof(block_buff);
+    }
+    uint32_t chunk_records = buff_size / sizeof(wl_erase_count_t);
+
+    for (int pass = 0; pass < 2 && result == ESP_OK; pass++) {
+        uint32_t limit = (pass == 0) ? log_records : last_commit;
+        bool done = false;
+        uint32_t first = 1;
+        while (first < limit && !done) {
+            uint32_t count = limit - first;
+            if (count > chunk_records) {
+                count = chunk_records;
+            }
+            result = this->flash_drv->read(erase_counts_addr + first * sizeof(wl_erase_count_t), buff, count * sizeof(wl_erase_count_t));
+            if (result != ESP_OK) {
+                break;
+            }
+            uint32_t i = 0;
+            while (i < count) {
+                const uint8_t *entry = &buff[i * sizeof(wl_erase_count_t)];
+                if (pass == 0 && eraseCountRecordBlank(entry)) {
+                    done = true;
+                    break;
+                }
+                // markers have 0xFFFF in the first two bytes, which is neither block tag nor sector number
+                if (*(const uint16_t *)entry == UINT16_MAX) {
+                    if (pass == 0 && eraseCountMarkerValid((const wl_erase_count_marker_t *)entry, WL_ERASE_COUNT_COMMIT_MAGIC, first + i)
+                            && ((const wl_erase_count_marker_t *)entry)->generation == generation) {
+                        last_commit = first + i;
+                    }
+                    i++;
+                    continue;
+                }
+                uint32_t entry_records = 1;
+                if (version == WL_ERASE_COUNT_LOG_VERSION_BLOCKS) {
+                    entry_records = eraseCountBlockRecords((const wl_erase_count_block_t *)entry);
+                    if (entry_records == 0 || first + i + entry_records > limit) {
+                        // garbage, or block not fitting the log, go on record by record
+                        i++;
+                        continue;
+                    }
+                    if (i + entry_records > count) {
+                        // continue with the block in the next chunk
+                        break;
+                    }
+                }
+                if (pass == 1) {
+                    this->applyEraseCountEntry(entry, version);
+                }
+                i += entry_records;
+            }
+            first += i;
+            if (pass == 0) {
+                end = first;
+            }
+        }
+        if (last_commit == 0) {
+            break;
+        }
+    }
+    this->putCopyBuffer(pool_buff);
+    WL_RESULT_CHECK(result);
+
+    if (last_commit == 0) {
+        ESP_LOGW(TAG, "%s: no commit in erase count log at 0x%x", __func__, erase_counts_addr);
+        memset(this->erase_count_buffer, 0, this->erase_count_buffer_size);
+        return ESP_OK;
+    }
+
+    this->erase_count_log_addr = erase_counts_addr;
+    this->erase_count_log_generation = generation;
+    this->erase_count_log_version = version;
+    this->erase_count_log_end = end;
+    this->erase_count_log_torn = (end > last_commit + 1);
+    ESP_LOGD(TAG, "%s: addr=0x%x, generation=%u, version=%u, last_commit=%u, end=%u", __func__, erase_counts_addr, generation, version, last_commit, end);
+    return ESP_OK;
+}
+
+/*
+ * Write erase counts from the buffer as version 2 log entries starting at given record index,
+ * all non-zero ones or just those changed since the last save. Number of records is returned in written.
+ * With erase_counts_addr == WL_ERASE_COUNT_LOG_NONE nothing is written, only the records are counted.
+ *
+ * Sectors are stored in ascending order in blocks:
+ *
+ * | tag 2B | sector count 2B | base sector 4B | payload size 2B | reserved 2B | crc 4B | payload ... | padding to 16 B |
+ *
+ * Payload holds for every sector the gap to previous sector (sector - previous - 1, omitted for base sector)
+ * and its erase count as a zigzag encoded difference to the count of the previous sector (to 0 for the first one),
+ * both in varint format. Runs of sectors have zero gaps and neighbouring sectors are worn evenly, so a sector
+ * usually takes 2 B, compared to 16 B per 3 sectors of the triplets.
+ * A block with its payload is at most WL_ERASE_COUNT_BLOCK_MAX, a new one starts when it is full.
+ *
+ * Blocks are assembled in the copy buffer and written in as few writes as possible.
+ */
+esp_err_t WL_Advanced::writeEraseCountRecords(size_t erase_counts_addr, uint32_t index, bool dirty_only, uint32_t *written)
+{
+    esp_err_t result = ESP_OK;
+    bool dry_run = (erase_counts_addr == WL_ERASE_COUNT_LOG_NONE);
+    const size_t payload_max = WL_ERASE_COUNT_BLOCK_MAX - sizeof(wl_erase_count_block_t);
+
+    uint8_t block_buff[WL_ERASE_COUNT_BLOCK_MAX];
+    size_t buff_size = sizeof(block_buff);
+    uint8_t *pool_buff = NULL;
+    uint8_t *buff = block_buff;
+    if (!dry_run) {
+        pool_buff = this->getCopyBuffer(&buff_size);
+        buff = pool_buff;
+        if (buff_size < sizeof(block_buff)) {
+            buff = block_buff;
+            buff_size = sizeof(block_buff);
+        }
+    }
+    size_t used = 0;
+    wl_erase_count_block_t *block = NULL;
+    uint8_t *payload = NULL;
+    int32_t previous = 0;
+    uint32_t previous_sector = 0;
+
+    *written = 0;
+    for (uint32_t sector = 0; sector <= this->state.max_pos && result == ESP_OK; sector++) {
+        bool selected = false;
+        if (sector < this->state.max_pos && this->erase_count_buffer[sector] != 0) {
+            selected = true;
+            if (dirty_only && !(this->erase_count_dirty[sector / 32] & (1u << (sector % 32)))) {
+                selected = false;
+            }
+        }
+        // close the block at the end, or when the next sector might not fit (5 B gap, 3 B count)
+        if (block != NULL && ((sector == this->state.max_pos) || (selected && block->payload_size + 8 > payload_max))) {
+            memset(&payload[block->payload_size], 0, (sizeof(wl_erase_count_t) - block->payload_size % sizeof(wl_erase_count_t)) % sizeof(wl_erase_count_t));
+            block->crc = eraseCountBlockCrc(block);
+            used += eraseCountBlockRecords(block) * sizeof(wl_erase_count_t);
+            block = NULL;
+        }
+        // flush the buffer once another full block might not fit, or at the end
+        if (block == NULL && used > 0 && (used + WL_ERASE_COUNT_BLOCK_MAX > buff_size || sector == this->state.max_pos)) {
+            if (!dry_run) {
+                result = this->flash_drv->write(erase_counts_addr + (index + *written) * sizeof(wl_erase_count_t), buff, used);
+                if (result != ESP_OK) {
+                    break;
+                }
+            }
+            *written += used / sizeof(wl_erase_count_t);
+            used = 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        if (block == NULL) {
+            block = (wl_erase_count_block_t *)&buff[used];
+            payload = (uint8_t *)(block + 1);
+            block->tag = WL_ERASE_COUNT_BLOCK_TAG;
+            block->sector_count = 0;
+            block->base_sector = sector;
+            block->payload_size = 0;
+            block->reserved = 0;
+            previous = 0;
+        } else {
+            writeVarint(payload, &block->payload_size, sector - previous_sector - 1);
+        }
+        int32_t delta = (int32_t)this->erase_count_buffer[sector] - previous;
+        writeVarint(payload, &block->payload_size, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        block->sector_count++;
+        previous = this->erase_count_buffer[sector];
+        previous_sector = sector;
+    }
+    if (!dry_run) {
+        this->putCopyBuffer(pool_buff);
+    }
+    return result;
+}
+
+esp_err_t WL_Advanced::writeEraseCountMarker(size_t erase_counts_addr, uint32_t index, uint32_t magic, uint32_t generation, uint32_t value)
+{
+    wl_erase_count_marker_t marker;
+    marker.magic = magic;
+    marker.generation = generation;
+    marker.value = value;
+    marker.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&marker, offsetof(wl_erase_count_marker_t, crc));
+    return this->flash_drv->write(erase_counts_addr + index * sizeof(wl_erase_count_marker_t), &marker, sizeof(marker));
+}
+
+/*
+ * Save erase counts from buffer to flash, called when the dummy block finishes a loop
+ *
+ * The reserved erase count sectors hold an append-only log, in one copy at a time:
+ *
+ * | header (magic, generation, version, crc) | entry | entry | ... | commit | entry | ... | commit | free ...
+ *
+ * Entries hold absolute erase counts: blocks of consecutive sectors in version 2, see writeEraseCountRecords(),
+ * or wl_erase_count_t triplets in version 1 logs, which are still read, see readEraseCounts().
+ * Every save appends only the entries of sectors whose erase count changed since the last save,
+ * followed by a commit record, so usually no erase is needed at all.
+ *
+ * When the log is full (or ends with records of an interrupted save, or is of older version), it is compacted: the other copy
+ * is erased, all non-zero erase counts and a commit are written to it and the header with incremented
+ * generation comes last. Until then the previous copy stays valid, and it also remains as a backup afterwards.
+ * When the next append may not fit, the other copy is erased ahead of time by maintain() instead, so the loop
+ * that compacts only writes.
+ *
+ * If even a full snapshot doesn't fit the reserved sectors, both copies are written in the legacy format.
+ * That only happens for small partitions: a sector takes at most 4 B of a block (1 B gap when sectors
+ * are consecutive, 3 B count), so a block of at most 128 B holds 27 sectors or more, while 16 B per 3 sectors
+ * are reserved. Partitions with more than 0xFFFF sectors, which the legacy format can't address, always fit.
+ */
+esp_err_t WL_Advanced::saveEraseCounts()
+{
+    esp_err_t result = ESP_OK;
+    uint32_t log_records = this->erase_count_records_size / sizeof(wl_erase_count_t);
+    uint32_t written = 0;
+    uint32_t append_records = 0;
+    uint32_t snapshot_records = 0;
+    // count the records first, nothing is written here
+    result = this->writeEraseCountRecords(WL_ERASE_COUNT_LOG_NONE, 0, true, &append_records);
+    WL_RESULT_CHECK(result);
+    result = this->writeEraseCountRecords(WL_ERASE_COUNT_LOG_NONE, 0, false, &snapshot_records);
+    WL_RESULT_CHECK(result);
+
+    if (this->erase_count_log_addr != WL_ERASE_COUNT_LOG_NONE && !this->erase_count_log_torn
+            && this->erase_count_log_version == WL_ERASE_COUNT_LOG_VERSION_BLOCKS
+            && this->erase_count_log_end + append_records + 1 <= log_records) {
+        // if anything fails from here, records after the last commit are unknown => compact next time
+        this->erase_count_log_torn = true;
+        result = this->writeEraseCountRecords(this->erase_count_log_addr, this->erase_count_log_end, true, &written);
+        WL_RESULT_CHECK(result);
+        uint32_t commit = this->erase_count_log_end + written;
+        result = this->writeEraseCountMarker(this->erase_count_log_addr, commit, WL_ERASE_COUNT_COMMIT_MAGIC, this->erase_count_log_generation, commit);
+        WL_RESULT_CHECK(result);
+        this->erase_count_log_end = commit + 1;
+        this->erase_count_log_torn = false;
+        // the next loop likely appends about as much, compact to a pre-erased copy if that won't fit
+        this->erase_count_spare_wanted = (this->erase_count_log_end + written + 1 > log_records);
+        ESP_LOGD(TAG, "%s: appended %u records, log end %u/%u", __func__, written, this->erase_count_log_end, log_records);
+    } else if (snapshot_records + 2 <= log_records) {
+        size_t target = this->eraseCountSpare();
+        uint32_t generation = this->erase_count_log_generation + 1;
+        // erase what maintain() didn't get to
+        if (this->erase_count_spare_erased < this->erase_count_records_size) {
+            result = this->flash_drv->erase_range(target + this->erase_count_spare_erased, this->erase_count_records_size - this->erase_count_spare_erased);
+            WL_RESULT_CHECK(result);
+        }
+        this->erase_count_spare_erased = 0;
+        this->erase_count_spare_wanted = false;
+        // from now on the active log is either the old one or, after the header is written, the new one
+        // don't append to any of them until a compaction succeeds
+        this->erase_count_log_torn = true;
+        result = this->writeEraseCountRecords(target, 1, false, &written);
+        WL_RESULT_CHECK(result);
+        result = this->writeEraseCountMarker(target, 1 + written, WL_ERASE_COUNT_COMMIT_MAGIC, generation, 1 + written);
+        WL_RESULT_CHECK(result);
+        result = this->writeEraseCountMarker(target, 0, WL_ERASE_COUNT_LOG_MAGIC, generation, WL_ERASE_COUNT_LOG_VERSION_BLOCKS);
+        WL_RESULT_CHECK(result);
+        this->erase_count_log_addr = target;
+        this->erase_count_log_generation = generation;
+        this->erase_count_log_version = WL_ERASE_COUNT_LOG_VERSION_BLOCKS;
+        this->erase_count_log_end = 1 + written + 1;
+        this->erase_count_log_torn = false;
+        ESP_LOGD(TAG, "%s: compacted %u records to 0x%x, generation %u", __func__, written, target, generation);
+    } else {
+        result = this->writeEraseCounts(this->addr_erase_counts1);
+        WL_RESULT_CHECK(result);
+        result = this->writeEraseCounts(this->addr_erase_counts2);
+        WL_RESULT_CHECK(result);
+        this->erase_count_log_addr = WL_ERASE_COUNT_LOG_NONE;
+        this->erase_count_spare_erased = 0;
+        this->erase_count_spare_wanted = false;
+    }
+
+    memset(this->erase_count_dirty, 0, (this->state.max_pos + 31) / 32 * sizeof(uint32_t));
+    return result;
+}
+
+// copy of erase counts the next compaction writes to, see saveEraseCounts()
+size_t WL_Advanced::eraseCountSpare()
+{
+    return (this->erase_count_log_addr == this->addr_erase_counts1) ? this->addr_erase_counts2 : this->addr_erase_counts1;
+}
+
+/*
+ * Besides the state copy, erase the spare erase count copy sector by sector when the next save
+ * is expected to compact, see saveEraseCounts(). Whatever is left is erased by the compaction itself.
+ */
+uint32_t WL_Advanced::pendingSteps()
+{
+    uint32_t steps = WL_Flash::pendingSteps();
+    if (this->erase_count_spare_wanted) {
+        steps += (this->erase_count_records_size - this->erase_count_spare_erased) / this->cfg.sector_size;
+    }
+    return steps;
+}
+
+esp_err_t WL_Advanced::maintainStep()
+{
+    esp_err_t result = ESP_OK;
+    if (this->state_copy_pending) {
+        return WL_Flash::maintainStep();
+    }
+    if (this->erase_count_spare_wanted && this->erase_count_spare_erased < this->erase_count_records_size) {
+        result = this->flash_drv->erase_range(this->eraseCountSpare() + this->erase_count_spare_erased, this->cfg.sector_size);
+        WL_RESULT_CHECK(result);
+        this->erase_count_spare_erased += this->cfg.sector_size;
+        if (this->erase_count_spare_erased == this->erase_count_records_size) {
+            this->erase_count_spare_wanted = false;
+        }
+    }
+    return result;
+}
+
+void WL_Advanced::countErase(uint32_t sector)
+{
+    this->erase_count_buffer[sector]++;
+    if (this->erase_count_dirty != NULL) {
+        this->erase_count_dirty[sector / 32] |= 1u << (sector % 32);
+    }
+}
+
 /*
  * Every updaterate erases (which call this function) a new pos update record is written to flash
  * and dummy block moves by one position (pos increments)
@@ -563,8 +1128,11 @@ esp_err_t WL_Advanced::readEraseCounts()
  * This means that from the records in flash we can reconstruct which sectors caused the records to be written
  * And since pos update record is made every updaterate erases, one record => updaterate erases of sector in that record
  *
+ * The erase is also tallied straight away to the erase count buffer, which therefore always holds
+ * the erase counts from flash plus all pos update records written so far
+ *
  * After dummy block gets to the end of the partition, it loops back (pos => 0) and move_count is incremented
- * Also on this loop, info about sector erases from all pos update records is aggregated and written to relevant reserved sector
+ * Also on this loop, the aggregated erase counts in buffer are written to relevant reserved sector
  * so the records can be erased allowing for a new sequence of pos update records
  */
 esp_err_t WL_Advanced::updateWL(size_t sector)
@@ -578,7 +1146,13 @@ esp_err_t WL_Advanced::updateWL(size_t sector)
 
     // will move dummy sector by one
     this->state.access_count = 0;
-    ESP_LOGV(TAG, "%s - sector=0x%x, access_count= 0x%08x, pos= 0x%08x", __func__, sector, this->state.access_count, this->state.pos);
+    int64_t start_time = esp_timer_get_time();
+    // pos update records go to both state copies, the second one has to be rewritten after the last loop by now
+    result = this->finishStateCopy();
+    if (result != ESP_OK) {
+        this->state.access_count = this->state.max_count - 1; // we will update next time
+        return result;
+    }
 
     // copy data to dummy block
     size_t data_addr = this->state.pos + 1; // next block, [pos+1] copy to [pos]
@@ -588,28 +1162,23 @@ esp_err_t WL_Advanced::updateWL(size_t sector)
     data_addr = this->cfg.start_addr + data_addr * this->cfg.page_size;
 
     this->dummy_addr = this->cfg.start_addr + this->state.pos * this->cfg.page_size;
-    result = this->flash_drv->erase_range(this->dummy_addr, this->cfg.page_size);
+    // readers mapping to the page erased by the next move retry from here on, see WL_Flash::read()
+    this->beginMove();
+    result = this->eraseDummy();
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - erase wl dummy sector result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
 
-    // copy by temp_buff chunks
-    size_t copy_count = this->cfg.page_size / this->cfg.temp_buff_size;
-    for (size_t i = 0; i < copy_count; i++) {
-        result = this->flash_drv->read(data_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
-        if (result != ESP_OK) {
-            ESP_LOGE(TAG, "%s - not possible to read buffer, will try next time, result= 0x%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
-        }
-        result = this->flash_drv->write(this->dummy_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
-        if (result != ESP_OK) {
-            ESP_LOGE(TAG, "%s - not possible to write buffer, will try next time, result= 0x%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
-        }
+    // copy through the largest staging buffer available, see WL_Flash::copyPage()
+    result = this->copyPage(data_addr, this->dummy_addr, &this->dummy_blank);
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "%s - not possible to copy block, will try next time, result= 0x%08x", __func__, result);
+        this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
+        return result;
     }
     // done... dummy sector moved
 
@@ -624,6 +1193,7 @@ esp_err_t WL_Advanced::updateWL(size_t sector)
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - update position 1 result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
     // write a second copy
@@ -632,14 +1202,21 @@ esp_err_t WL_Advanced::updateWL(size_t sector)
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - update position 2 result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
 
+    // both records written => count the erase, temp_buff still holds the record, see fillOkBuff()
+    wl_sector_erase_record_t *record_buff = (wl_sector_erase_record_t *)this->temp_buff;
+    this->countErase(record_buff->sector);
+    this->trace(WL_TRACE_MOVE, sector * this->cfg.sector_size, this->dummy_addr - this->cfg.start_addr, this->cfg.page_size);
+
     wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
 
     // only after both pos update record written, consider pos moved
     this->state.pos++;
-    if (this->state.pos >= this->state.max_pos) {
+    bool wrapped = (this->state.pos >= this->state.max_pos);
+    if (wrapped) {
         // one loop of dummy sector through partition finished
         this->state.pos = 0;
         // incrementing move count shifts mapping, see calcAddr()
@@ -652,202 +1229,282 @@ esp_err_t WL_Advanced::updateWL(size_t sector)
             // and from that an estimate of sector wear-out
             advanced_state->cycle_count++;
         }
+    }
+    // readers can use the new mapping, the state is saved below
+    this->endMove();
+    if (wrapped) {
+        this->trace(WL_TRACE_STATE, WL_TRACE_NO_ADDR, this->addr_state1 - this->cfg.start_addr, this->state_size);
+        this->stats.wraps++;
         // write main state
         this->state.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&this->state, WL_STATE_CRC_LEN_V2);
 
-        // tally up (aggregate) overall per sector erase counts
-        result = this->updateEraseCounts();
-        WL_RESULT_CHECK(result);
-        // and write updated values to flash
-        result = this->writeEraseCounts(this->addr_erase_counts1);
-        WL_RESULT_CHECK(result);
-        // also a second copy
-        result = this->writeEraseCounts(this->addr_erase_counts2);
+        // erase counts in buffer already include all pos update records, save them to flash
+        int64_t persist_time = esp_timer_get_time();
+        result = this->saveEraseCounts();
         WL_RESULT_CHECK(result);
+        addTime(&this->stats.persist_time_us, &this->stats.persist_time_max_us, persist_time);
 
-        result = this->flash_drv->erase_range(this->addr_state1, this->state_size);
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state1, &this->state, sizeof(wl_state_t));
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state2, &this->state, sizeof(wl_state_t));
+        // main state now, the copy is rewritten by maintain(), see WL_Flash::saveWrapState()
+        result = this->saveWrapState();
         WL_RESULT_CHECK(result);
         ESP_LOGD(TAG, "%s - cycle_count= 0x%08x, move_count= 0x%08x, pos= 0x%08x, ", __func__, advanced_state->cycle_count, this->state.move_count, this->state.pos);
     }
     // Save structures to the flash... and check result
-    if (result == ESP_OK) {
-        ESP_LOGV(TAG, "%s - result= 0x%08x", __func__, result);
-    } else {
+    if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - result= 0x%08x", __func__, result);
     }
+    this->stats.dummy_moves++;
+    addTime(&this->stats.update_time_us, &this->stats.update_time_max_us, start_time);
     return result;
 }
 
 /*
- * F performed in every stage of Feistel network over msb and key for that stage
- * Current implementation: squaring of xor of inputs
+ * Same as WL_Flash::updateWLRange(), but every dummy move is recorded against the sector
+ * whose erase triggered it, exactly as a sequence of erase_sector() calls would do.
  */
-uint32_t WL_Advanced::feistelFunction(uint32_t msb, uint32_t key)
+esp_err_t WL_Advanced::updateWLRange(size_t start_sector, size_t count)
 {
-    ESP_LOGV(TAG, "%s: msb=0x%x, key=0x%x, xor=0x%x, return=0x%x",
-             __func__, msb, key, (msb ^ key), ((msb ^ key) * (msb ^ key)));
-    return (msb ^ key) * (msb ^ key);
+    esp_err_t result = ESP_OK;
+    while (count > 0) {
+        // number of erases up to and including the one that moves the dummy block
+        size_t until_move = 1;
+        if (this->state.access_count < this->state.max_count) {
+            until_move = this->state.max_count - this->state.access_count;
+        }
+        if (count < until_move) {
+            this->state.access_count += count;
+            break;
+        }
+        this->state.access_count = this->state.max_count - 1;
+        result = this->updateWL(start_sector + until_move - 1);
+        WL_RESULT_CHECK(result);
+        start_sector += until_move;
+        count -= until_move;
+    }
+    return result;
 }
 
 /*
- * Perform a randomized 1-to-1 mapping of given address using unbalanced 3-stage Feistel network
- *
- * Given address A which we can split into two parts, msb and lsb (can differ in lengths => unbalanced)
- * and randomly generated key for each stage, we can perform the following:
- *
- *                    stage 1           stage 2             stage 3
- *           msb -------|------\   /------|-------\   /-------|------> final msb
- *          /          \/      | s |     \/       | s |      \/                 \
- *   input /      F(msb, key1) | w | F(msb, key2) | w | F(msb, key3)             \ randomized
- * address \           |       | a |      |       | a |      |                   / address
- *          \         \/       | p |     \/       | p |     \/                  /
- *           lsb --->(XOR)--->/    \--->(XOR)--->/    \--->(XOR)-----> final lsb
- *
- * 1. Split the address to msb and lsb
- * 2. msb remains intact => msb stage output
- * 3. Do F(msb, <key for given stage>)
- * 4. XOR the output of F with lsb => lsb stage output
- * 5. swap lsb <-> msb
- * 6. Assemble address stage output from lsb and msb
- * 7. Repeat steps 1-6 for stage 2 and 3
- * 8. Final address stage output is the randomized address
+ * Initialize address randomizers from the keys in state, to be called whenever they change
  */
-size_t WL_Advanced::addressFeistelNetwork(size_t addr)
+void WL_Advanced::prepareMapping()
 {
     wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
-    uint8_t *keys = (uint8_t *)&advanced_state->feistel_keys;
+    uint32_t sector_count = this->flash_size / this->cfg.sector_size;
 
-    // mask for only lower lsb bits
-    uint32_t LSB_mask = ~( (~(size_t)0) << this->feistel_lsb_width );
+    this->feistel.init(advanced_state->feistel_keys, sector_count, this->cfg.sector_size);
+    this->swap_or_not.init(advanced_state->feistel_keys, advanced_state->mapping_keys, sector_count, this->cfg.sector_size);
+}
 
-    uint32_t msb, lsb, _msb, _lsb, randomized_sector_addr;
+/*
+ * Randomize sector address with the scheme stored in state, see WL_MAPPING_*
+ */
+size_t WL_Advanced::addressPermutation(size_t addr)
+{
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    if (advanced_state->mapping == WL_MAPPING_SWAP_OR_NOT) {
+        return this->swap_or_not.map(addr, &this->mapping_stats);
+    }
+    return this->feistel.map(addr, &this->mapping_stats);
+}
 
-round:
-    uint32_t sector_addr = addr / this->cfg.sector_size;
-    ESP_LOGD(TAG, "%s: sector_addr=0x%x", __func__, sector_addr);
+void WL_Advanced::getMappingStats(wl_mapping_stats_t *stats)
+{
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    *stats = this->mapping_stats;
+    stats->mapping = advanced_state->mapping;
+}
 
-    // 3 stages
-    for (uint8_t i = 0; i < 3; i++) {
+void WL_Advanced::get_stats(wl_stats_t *stats)
+{
+    WL_Flash::get_stats(stats);
+    stats->mapping_walks = this->mapping_stats.walks;
+}
 
-        // get separated and correctly shifted and masked lsb, msb values from current sector address
-        msb = sector_addr >> this->feistel_lsb_width;
-        lsb = sector_addr & LSB_mask;
+// mapping counters of getMappingStats() start over as well
+void WL_Advanced::reset_stats()
+{
+    WL_Flash::reset_stats();
+    this->mapping_stats.calls = 0;
+    this->mapping_stats.walks = 0;
+    this->mapping_stats.max_walk = 0;
+}
 
-        // msb output of this stage, stays intact
-        _msb = msb;
+/*
+ * Precompute addressPermutation() for every sector of the partition, so calcAddr() is a table lookup
+ *
+ * Used for partitions with at most WL_MAPPING_TABLE_MAX_SECTORS sectors, costs 2 B of RAM per sector
+ * (sector numbers fit, WL_MAPPING_TABLE_MAX_SECTORS is at most 2^16).
+ * The table is only rebuilt when the scheme or any of its keys differ from those it was built with.
+ * If the table can't be allocated, addresses are computed on every access as before.
+ */
+void WL_Advanced::buildMappingTable()
+{
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    uint32_t sector_count = this->flash_size / this->cfg.sector_size;
 
-        // lsb output of this stage
-        // perform F() on msb and key specific to this stage
-        // mask output of function to be |lsb| for XORing with lsb
-        _lsb = (lsb ^ (this->feistelFunction(msb, keys[i]) & LSB_mask));
+    if (sector_count > WL_MAPPING_TABLE_MAX_SECTORS) {
+        return;
+    }
+    if (this->mapping_table.entries != NULL && this->mapping_table_feistel_keys == advanced_state->feistel_keys
+            && this->mapping_table_mapping == advanced_state->mapping
+            && memcmp(this->mapping_table_mapping_keys, advanced_state->mapping_keys, sizeof(this->mapping_table_mapping_keys)) == 0) {
+        return;
+    }
+
+    // compute with the table out of the way
+    free(this->mapping_table.entries);
+    this->mapping_table.entries = NULL;
+    uint16_t *table = (uint16_t *)malloc(sector_count * sizeof(uint16_t));
+    if (table == NULL) {
+        ESP_LOGW(TAG, "%s: no memory for %u sectors, mapping computed on every access", __func__, sector_count);
+        return;
+    }
+    for (uint32_t sector = 0; sector < sector_count; sector++) {
+        table[sector] = this->addressPermutation(sector * this->cfg.sector_size) / this->cfg.sector_size;
+    }
+    this->mapping_table.sector.init(this->cfg.sector_size);
+    this->mapping_table.entries = table;
+    this->mapping_table_feistel_keys = advanced_state->feistel_keys;
+    this->mapping_table_mapping = advanced_state->mapping;
+    memcpy(this->mapping_table_mapping_keys, advanced_state->mapping_keys, sizeof(this->mapping_table_mapping_keys));
+    ESP_LOGI(TAG, "%s: mapping table for %u sectors built", __func__, sector_count);
+}
 
-        // assemble address, swapping msb and lsb
-        // full output of this stage
-        sector_addr = (_lsb << this->feistel_msb_width) | _msb;
-        ESP_LOGV(TAG, "%s: msb=0x%x, lsb=0x%x, sector_addr=0x%x", __func__, _msb, _lsb, sector_addr);
+/*
+ * Overrides WL_Flash::mapAddr(), so calcAddr() maps through the randomizer as well.
+ * The mapping is taken from map, readers pass a published snapshot instead of the live state.
+ * Randomizers work on whole sectors, so addr is expected sector aligned.
+ *
+ * Firstly randomize incoming address (1-to-1 mapping in available sector address space),
+ * then perform algebraic mapping based on move count and dummy sector position, see WL_Mapping.h.
+ * Each branch is a separate instantiation of the mapping, inlined here.
+ */
+size_t WL_Advanced::mapAddr(size_t addr, const wl_map_slot_t *map)
+{
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    if (this->mapping_table.entries != NULL) {
+        return wl_mapping::mapAddress(this->mapping_table, this->rotation, addr, map->move_count, map->pos, &this->mapping_stats);
+    } else if (advanced_state->mapping == WL_MAPPING_SWAP_OR_NOT) {
+        return wl_mapping::mapAddress(this->swap_or_not, this->rotation, addr, map->move_count, map->pos, &this->mapping_stats);
     }
+    return wl_mapping::mapAddress(this->feistel, this->rotation, addr, map->move_count, map->pos, &this->mapping_stats);
+}
 
-    // after 3 stages we get sufficiently randomized address
-    randomized_sector_addr = sector_addr;
-    ESP_LOGD(TAG, "%s: randomized_sector_addr=0x%x", __func__, randomized_sector_addr);
+/*
+ * The same choice as mapAddr() for a whole read(), write() or erase: the extent loops of each branch
+ * are instantiated with that randomizer, so no page of them goes through a virtual call, see WL_Flash::runMapped().
+ * calcExtent() adds any in-page offset back to the sector aligned addresses it maps.
+ */
+esp_err_t WL_Advanced::runExtents(wl_extents_op_t op, const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch)
+{
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    if (this->mapping_table.entries != NULL) {
+        return this->runMapped(this->mapping_table, &this->mapping_stats, op, iov, count, ptr, epoch);
+    } else if (advanced_state->mapping == WL_MAPPING_SWAP_OR_NOT) {
+        return this->runMapped(this->swap_or_not, &this->mapping_stats, op, iov, count, ptr, epoch);
+    }
+    return this->runMapped(this->feistel, &this->mapping_stats, op, iov, count, ptr, epoch);
+}
 
-    uint32_t sector_count = this->flash_size / this->cfg.sector_size;
-    /*
-     * === IMPORTANT CHECK  ===
-     * Feistel can generate addresses using full feistel_bit_width, so 0 to 2^feisteL_bit_width - 1
-     * but last few addresses of the partition belong to reserved sectors => those are not valid outputs of mapping
-     * If that happens, we need to "cycle walk" => do another round of 3-stage Feistel
-     * with the invalid randomized sector address we got as new input
-     *
-     * From what I understand and tested, this should always lead to a valid output (usually a single cycle walk is enough)
-     * Also the prevalence of cycle walks depends on how many sectors out of all in partition are reserved,
-     * as the randomization needs to "hit" one of them to require cycle walk
-     * Keys play a role in that, some key sets (3 keys for 3 stages) might not cycle walk at all
-     */
-    if (randomized_sector_addr >= sector_count) {
-        ESP_LOGW(TAG, "%s: randomized sector addr 0x%x outside of domain => another round", __func__, randomized_sector_addr);
-        addr = randomized_sector_addr * this->cfg.sector_size;
-        goto round;
-    }
-
-    return randomized_sector_addr * this->cfg.sector_size;
-}
-
-size_t WL_Advanced::calcAddr(size_t addr)
-{
-    // firstly randomize incoming address by using Feistel network
-    // it does 1-to-1 mapping of addresses in available sector address space
-    size_t intermediate_addr = this->addressFeistelNetwork(addr);
-
-    // with the randomized intermediate address, perform algebraic mapping based on move count
-    size_t result = (this->flash_size - this->state.move_count * this->cfg.page_size + intermediate_addr) % this->flash_size;
-    // and finally shift resulting physical sector address by one depending on current dummy sector position
-    size_t dummy_addr = this->state.pos * this->cfg.page_size;
-    if (result >= dummy_addr) {
-        result += this->cfg.page_size;
-    }
-    ESP_LOGV(TAG, "%s - addr= 0x%08x, intermediate_addr=0x%08x -> result= 0x%08x, dummy_addr= 0x%08x",
-             __func__, (uint32_t) addr, (uint32_t)intermediate_addr, (uint32_t) result, (uint32_t)dummy_addr);
+size_t WL_Advanced::calcLogicalAddr(size_t addr)
+{
+    size_t result = this->unmapAddr(addr, this->state.move_count, this->state.pos);
+    ESP_LOGV(TAG, "%s - addr= 0x%08x -> result= 0x%08x", __func__, (uint32_t) addr, (uint32_t) result);
     return result;
 }
 
-esp_err_t WL_Advanced::erase_sector(size_t sector)
+/*
+ * Un-rotate by move count and dummy sector position, then run the inverse randomizer.
+ * The table only holds the forward mapping, so the inverse is always computed.
+ */
+size_t WL_Advanced::unmapAddr(size_t addr, uint32_t move_count, uint32_t pos)
 {
-    esp_err_t result = ESP_OK;
-    if (!this->initialized) {
+    wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+    if (advanced_state->mapping == WL_MAPPING_SWAP_OR_NOT) {
+        return wl_mapping::unmapAddress(this->swap_or_not, this->rotation, addr, move_count, pos, &this->mapping_stats);
+    }
+    return wl_mapping::unmapAddress(this->feistel, this->rotation, addr, move_count, pos, &this->mapping_stats);
+}
+
+/*
+ * Both directions are filled in one pass over logical sectors, every physical sector except the dummy
+ * is hit exactly once as the mapping is 1-to-1. Uses the table when there is one.
+ *
+ * This is the mapping at the moment only. Every loop of the dummy block rotates it by a page, so over time
+ * a physical sector holds all logical sectors in turn and its erase count can't be attributed to the one
+ * mapped there now, see getLogicalEraseCounts() instead.
+ */
+esp_err_t WL_Advanced::getMappingSnapshot(uint32_t *logical_to_physical, uint32_t *physical_to_logical)
+{
+    if (!this->configured) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGV(TAG, "%s - sector= 0x%08x", __func__, (uint32_t) sector);
-    // pass sector to updateWl() so it can use it in pos update record
-    result = this->updateWL(sector);
-    WL_RESULT_CHECK(result);
-    size_t virt_addr = this->calcAddr(sector * this->cfg.sector_size);
-    result = this->flash_drv->erase_sector((this->cfg.start_addr + virt_addr) / this->cfg.sector_size);
-    WL_RESULT_CHECK(result);
-    return result;
+    uint32_t sector_count = this->flash_size / this->cfg.sector_size;
+
+    if (physical_to_logical != NULL) {
+        for (uint32_t i = 0; i < this->state.max_pos; i++) {
+            physical_to_logical[i] = WL_MAPPING_NO_SECTOR;
+        }
+    }
+    for (uint32_t sector = 0; sector < sector_count; sector++) {
+        uint32_t physical_sector = this->calcAddr(sector * this->cfg.sector_size) / this->cfg.sector_size;
+        if (logical_to_physical != NULL) {
+            logical_to_physical[sector] = physical_sector;
+        }
+        if (physical_to_logical != NULL && physical_sector < this->state.max_pos) {
+            physical_to_logical[physical_sector] = sector;
+        }
+    }
+    return ESP_OK;
 }
 
-esp_err_t WL_Advanced::write(size_t dest_addr, const void *src, size_t size)
+/*
+ * Tally the pos update records of the current dummy block loop by the logical sector whose erase wrote them.
+ *
+ * A record holds the physical sector from calcAddr() as fillOkBuff() computed it, with move_count of this loop
+ * (records are erased at every wrap, see saveWrapState()) and pos stored in the record itself,
+ * so mapping it back with the same values gives the logical sector exactly.
+ */
+esp_err_t WL_Advanced::getLogicalEraseCounts(uint32_t *counts)
 {
-    esp_err_t result = ESP_OK;
-    if (!this->initialized) {
+    if (!this->configured) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGD(TAG, "%s - dest_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) dest_addr, (uint32_t) size);
-    uint32_t count = (size - 1) / this->cfg.page_size;
-    for (size_t i = 0; i < count; i++) {
-        size_t virt_addr = this->calcAddr(dest_addr + i * this->cfg.page_size);
-        result = this->flash_drv->write(this->cfg.start_addr + virt_addr, &((uint8_t *)src)[i * this->cfg.page_size], this->cfg.page_size);
+    esp_err_t result = ESP_OK;
+    wl_sector_erase_record_t *record_buff = (wl_sector_erase_record_t *)this->temp_buff;
+
+    memset(counts, 0, this->flash_size / this->cfg.sector_size * sizeof(uint32_t));
+    for (uint32_t i = 0; i < this->state.pos; i++) {
+        result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + i * sizeof(wl_sector_erase_record_t), record_buff, sizeof(wl_sector_erase_record_t));
         WL_RESULT_CHECK(result);
+        if (!this->OkBuffSet(i)) {
+            break;
+        }
+        size_t logical_addr = this->unmapAddr(record_buff->sector * this->cfg.sector_size, this->state.move_count, record_buff->pos);
+        if (logical_addr != WL_MAPPING_NO_ADDR) {
+            counts[logical_addr / this->cfg.sector_size]++;
+        }
     }
-    size_t virt_addr_last = this->calcAddr(dest_addr + count * this->cfg.page_size);
-    result = this->flash_drv->write(this->cfg.start_addr + virt_addr_last, &((uint8_t *)src)[count * this->cfg.page_size], size - count * this->cfg.page_size);
-    WL_RESULT_CHECK(result);
-    return result;
+    return ESP_OK;
 }
 
-esp_err_t WL_Advanced::read(size_t src_addr, void *dest, size_t size)
+esp_err_t WL_Advanced::erase_sector(size_t sector)
 {
     esp_err_t result = ESP_OK;
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGD(TAG, "%s - src_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) src_addr, (uint32_t) size);
-    uint32_t count = (size - 1) / this->cfg.page_size;
-    for (size_t i = 0; i < count; i++) {
-        size_t virt_addr = this->calcAddr(src_addr + i * this->cfg.page_size);
-        ESP_LOGV(TAG, "%s - real_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) (this->cfg.start_addr + virt_addr), (uint32_t) size);
-        result = this->flash_drv->read(this->cfg.start_addr + virt_addr, &((uint8_t *)dest)[i * this->cfg.page_size], this->cfg.page_size);
-        WL_RESULT_CHECK(result);
+    // skipped erases of blank sectors aren't tallied, they don't wear the sector
+    if (this->sectorBlank(sector)) {
+        return result;
     }
-    size_t virt_addr_last = this->calcAddr(src_addr + count * this->cfg.page_size);
-    result = this->flash_drv->read(this->cfg.start_addr + virt_addr_last, &((uint8_t *)dest)[count * this->cfg.page_size], size - count * this->cfg.page_size);
+    // pass sector to updateWl() so it can use it in pos update record
+    result = this->updateWL(sector);
+    WL_RESULT_CHECK(result);
+    size_t virt_addr = this->calcAddr(sector * this->cfg.sector_size);
+    this->trace(WL_TRACE_ERASE, sector * this->cfg.sector_size, virt_addr, this->cfg.sector_size);
+    result = this->flash_drv->erase_sector((this->cfg.start_addr + virt_addr) / this->cfg.sector_size);
     WL_RESULT_CHECK(result);
     return result;
 }
@@ -862,6 +1519,9 @@ esp_err_t WL_Advanced::flush()
     // so after full loop, counting that every sector was erased additionally once
     // is actually a realistic approach
     result = this->updateWL(this->state.pos);
+    if (result == ESP_OK) {
+        result = this->finishStateCopy();
+    }
 
     wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
 
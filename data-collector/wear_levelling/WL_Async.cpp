@@ -0,0 +1,307 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include "esp_log.h"
+#include "freertos/semphr.h"
+#include "WL_Async.h"
+
+static const char *TAG = "wl_async";
+
+WL_Async::WL_Async(wl_handle_t handle)
+{
+    this->handle = handle;
+    this->sector_size = wl_sector_size(handle);
+    this->size = wl_size(handle);
+}
+
+WL_Async::~WL_Async()
+{
+    this->stop();
+}
+
+esp_err_t WL_Async::start(size_t queue_len, uint32_t stack_size, UBaseType_t priority)
+{
+    if (this->task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    this->pending = (wl_async_request_t *)malloc(queue_len * sizeof(wl_async_request_t));
+    this->queue = xQueueCreate(queue_len, sizeof(wl_async_request_t));
+    if ((this->pending != NULL) && (this->queue != NULL)) {
+        this->pending_max = queue_len;
+        this->pending_count = 0;
+        this->reads_ahead = 0;
+        if (xTaskCreate(WL_Async::taskMain, "wl_async", stack_size, this, priority, &this->task) == pdPASS) {
+            ESP_LOGD(TAG, "%s: handle %i, queue of %u requests", __func__, this->handle, queue_len);
+            return ESP_OK;
+        }
+        this->task = NULL;
+    }
+    ESP_LOGE(TAG, "%s: can't allocate worker for %u requests", __func__, queue_len);
+    if (this->queue != NULL) {
+        vQueueDelete(this->queue);
+        this->queue = NULL;
+    }
+    free(this->pending);
+    this->pending = NULL;
+    this->pending_max = 0;
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t WL_Async::post(const wl_async_request_t *request)
+{
+    if (this->task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // the caller can't be made to wait, that's what it posts for
+    if (xQueueSend(this->queue, request, 0) != pdTRUE) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t WL_Async::flush()
+{
+    if (this->task == NULL) {
+        return ESP_OK;
+    }
+    return this->wait(WL_ASYNC_FLUSH);
+}
+
+esp_err_t WL_Async::stop()
+{
+    if (this->task == NULL) {
+        return ESP_OK;
+    }
+    esp_err_t result = this->wait(WL_ASYNC_STOP);
+    this->task = NULL;
+    vQueueDelete(this->queue);
+    this->queue = NULL;
+    free(this->pending);
+    this->pending = NULL;
+    this->pending_max = 0;
+    return result;
+}
+
+static void give_semaphore(esp_err_t result, void *arg)
+{
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
+// Post op and block until the worker gets to it, unlike post() this waits for room in the queue
+esp_err_t WL_Async::wait(wl_async_op_t op)
+{
+    StaticSemaphore_t semaphore_buffer;
+    SemaphoreHandle_t semaphore = xSemaphoreCreateBinaryStatic(&semaphore_buffer);
+    wl_async_request_t request = {op, 0, 0, NULL, give_semaphore, semaphore, false};
+    xQueueSend(this->queue, &request, portMAX_DELAY);
+    xSemaphoreTake(semaphore, portMAX_DELAY);
+    vSemaphoreDelete(semaphore);
+    return ESP_OK;
+}
+
+void WL_Async::taskMain(void *arg)
+{
+    ((WL_Async *)arg)->run();
+    vTaskDelete(NULL);
+}
+
+void WL_Async::run()
+{
+    while (true) {
+        this->receive(this->pending_count == 0);
+        size_t index = this->pending_count;
+        // reads overtake queued erases, but not forever
+        if (this->reads_ahead < this->pending_max) {
+            index = this->nextRead();
+        }
+        if (index < this->pending_count) {
+            this->reads_ahead = (index > 0) ? this->reads_ahead + 1 : 0;
+            this->runTransfers(index, true);
+        } else {
+            this->reads_ahead = 0;
+            switch (this->pending[0].op) {
+            case WL_ASYNC_READ:
+            case WL_ASYNC_WRITE:
+                this->runTransfers(0, false);
+                break;
+            case WL_ASYNC_ERASE:
+                this->runErases();
+                break;
+            case WL_ASYNC_FLUSH:
+                this->complete(0, ESP_OK);
+                break;
+            case WL_ASYNC_STOP:
+                // the object may be gone as soon as stop() is woken up, nothing is touched after that
+                this->complete(0, ESP_OK);
+                return;
+            }
+        }
+        this->removeDone();
+    }
+}
+
+// Take everything posted so far, as far as there's room in pending
+void WL_Async::receive(bool block)
+{
+    TickType_t ticks = block ? portMAX_DELAY : 0;
+    while ((this->pending_count < this->pending_max)
+            && (xQueueReceive(this->queue, &this->pending[this->pending_count], ticks) == pdTRUE)) {
+        this->pending[this->pending_count].done = false;
+        this->pending_count++;
+        ticks = 0;
+    }
+}
+
+// Bytes a request touches, erases cover whole sectors as in wl_erase_range()
+void WL_Async::range(const wl_async_request_t *request, size_t *start, size_t *end)
+{
+    *start = request->addr;
+    *end = request->addr + request->size;
+    if (request->op == WL_ASYNC_ERASE) {
+        *start -= *start % this->sector_size;
+        *end = (*end + this->sector_size - 1) / this->sector_size * this->sector_size;
+    }
+}
+
+bool WL_Async::overlaps(const wl_async_request_t *a, const wl_async_request_t *b)
+{
+    size_t a_start, a_end, b_start, b_end;
+    this->range(a, &a_start, &a_end);
+    this->range(b, &b_start, &b_end);
+    return (a_start < b_end) && (b_start < a_end);
+}
+
+// Can the read at index go before the writes and erases posted ahead of it
+bool WL_Async::readAhead(size_t index)
+{
+    if (this->pending[index].op != WL_ASYNC_READ) {
+        return false;
+    }
+    for (size_t i = 0; i < index; i++) {
+        wl_async_op_t op = this->pending[i].op;
+        if (((op == WL_ASYNC_WRITE) || (op == WL_ASYNC_ERASE)) && this->overlaps(&this->pending[i], &this->pending[index])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t WL_Async::nextRead()
+{
+    size_t index = 0;
+    while ((index < this->pending_count) && !this->readAhead(index)) {
+        index++;
+    }
+    return index;
+}
+
+// Merged requests must not take a valid one down with them, out of bounds requests are issued alone
+bool WL_Async::inRange(size_t addr, size_t size)
+{
+    return (size > 0) && (addr <= this->size) && (size <= this->size - addr);
+}
+
+// Read or write pending[first] together with the following requests continuing it in flash and in memory
+void WL_Async::runTransfers(size_t first, bool ahead)
+{
+    const wl_async_request_t *request = &this->pending[first];
+    size_t last = first;
+    size_t size = request->size;
+    while (last + 1 < this->pending_count) {
+        const wl_async_request_t *next = &this->pending[last + 1];
+        if ((next->op != request->op)
+                || (next->addr != request->addr + size)
+                || ((uint8_t *)next->buff != (uint8_t *)request->buff + size)
+                || !this->inRange(request->addr, size + next->size)
+                || (ahead && !this->readAhead(last + 1))) {
+            break;
+        }
+        size += next->size;
+        last++;
+    }
+    esp_err_t result;
+    if (request->op == WL_ASYNC_READ) {
+        result = wl_read(this->handle, request->addr, request->buff, size);
+    } else {
+        result = wl_write(this->handle, request->addr, request->buff, size);
+    }
+    __atomic_fetch_add(&this->merged, last - first, __ATOMIC_RELAXED);
+    for (size_t i = first; i <= last; i++) {
+        this->complete(i, result);
+    }
+}
+
+/*
+ * Erase pending[0] together with the rest of the run of erases at the head of pending that overlap
+ * or adjoin it. Erased sectors don't depend on the order, so the union is erased by one call.
+ * Erases of the run outside the union stay pending, reads can go before them.
+ */
+void WL_Async::runErases()
+{
+    size_t count = 0;
+    while ((count < this->pending_count) && (this->pending[count].op == WL_ASYNC_ERASE)
+            && ((this->pending[count].addr % this->sector_size) == 0)
+            && ((this->pending[count].size % this->sector_size) == 0)
+            && this->inRange(this->pending[count].addr, this->pending[count].size)) {
+        count++;
+    }
+    if (count == 0) {
+        // unaligned or out of bounds, wl_erase_range() has the say
+        this->complete(0, wl_erase_range(this->handle, this->pending[0].addr, this->pending[0].size));
+        return;
+    }
+    size_t start = this->pending[0].addr;
+    size_t end = start + this->pending[0].size;
+    bool grown = true;
+    while (grown) {
+        grown = false;
+        for (size_t i = 1; i < count; i++) {
+            size_t other_start = this->pending[i].addr;
+            size_t other_end = other_start + this->pending[i].size;
+            if ((other_start <= end) && (other_end >= start) && ((other_start < start) || (other_end > end))) {
+                start = (other_start < start) ? other_start : start;
+                end = (other_end > end) ? other_end : end;
+                grown = true;
+            }
+        }
+    }
+    esp_err_t result = wl_erase_range(this->handle, start, end - start);
+    // the union is closed, every erase of the run touching it lies inside
+    size_t members = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((this->pending[i].addr >= start) && (this->pending[i].addr + this->pending[i].size <= end)) {
+            this->complete(i, result);
+            members++;
+        }
+    }
+    __atomic_fetch_add(&this->merged, members - 1, __ATOMIC_RELAXED);
+}
+
+void WL_Async::complete(size_t index, esp_err_t result)
+{
+    wl_async_request_t request = this->pending[index];
+    this->pending[index].done = true;
+    if (request.op <= WL_ASYNC_ERASE) {
+        __atomic_fetch_add(&this->requests, 1, __ATOMIC_RELAXED);
+        if ((result != ESP_OK) && (request.cb == NULL)) {
+            ESP_LOGE(TAG, "%s: op %i, addr 0x%08x, size 0x%08x, result 0x%x", __func__, request.op, request.addr, request.size, result);
+        }
+    }
+    if (request.cb != NULL) {
+        request.cb(result, request.arg);
+    }
+}
+
+void WL_Async::removeDone()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < this->pending_count; i++) {
+        if (!this->pending[i].done) {
+            this->pending[count++] = this->pending[i];
+        }
+    }
+    this->pending_count = count;
+}
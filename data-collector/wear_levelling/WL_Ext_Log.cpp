@@ -0,0 +1,583 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include "WL_Ext_Log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "crc32.h"
+
+static const char *TAG = "wl_ext_log";
+
+#define WL_EXT_RESULT_CHECK(result) \
+    if (result != ESP_OK) { \
+        ESP_LOGE(TAG,"%s(%d): result = 0x%08x", __FUNCTION__, __LINE__, result); \
+        return (result); \
+    }
+
+#ifndef WL_CFG_CRC_CONST
+#define WL_CFG_CRC_CONST UINT32_MAX
+#endif // WL_CFG_CRC_CONST
+
+#define WL_LOG_BLOCK_MAGIC  0x4b4c4257  // "WBLK"
+#define WL_LOG_TAG_MAGIC    0x47415457  // "WTAG"
+#define WL_LOG_KILL_MAGIC   0x4c494b57  // "WKIL"
+
+#define WL_LOG_UNMAPPED     UINT16_MAX
+#define WL_LOG_NO_BLOCK     UINT32_MAX
+#define WL_LOG_READ_BATCH   8           // slot extents per WL_Flash::readv() call
+
+// Blocks left without data beyond the two garbage collection needs, in percent of all blocks.
+// The more there are, the fewer live slots the collected blocks have left to move.
+#ifndef WL_LOG_SPARE_PERCENT
+#ifdef CONFIG_WL_LOG_SPARE_PERCENT
+#define WL_LOG_SPARE_PERCENT CONFIG_WL_LOG_SPARE_PERCENT
+#else
+#define WL_LOG_SPARE_PERCENT 10
+#endif // CONFIG_WL_LOG_SPARE_PERCENT
+#endif // WL_LOG_SPARE_PERCENT
+
+WL_Ext_Log::WL_Ext_Log(): WL_Flash()
+{
+    this->open_block = WL_LOG_NO_BLOCK;
+}
+
+WL_Ext_Log::~WL_Ext_Log()
+{
+    free(this->map);
+    free(this->blocks);
+    free(this->meta_buffer);
+    free(this->sector_buffer);
+}
+
+esp_err_t WL_Ext_Log::config(WL_Config_s *cfg, Flash_Access *flash_drv)
+{
+    wl_ext_cfg_t *config = (wl_ext_cfg_t *)cfg;
+
+    this->fat_sector_size = config->fat_sector_size;
+    this->flash_sector_size = cfg->sector_size;
+
+    esp_err_t result = WL_Flash::config(cfg, flash_drv);
+    WL_EXT_RESULT_CHECK(result);
+    // blank slots can't be told from written ones, so a log cut off by power loss couldn't be continued
+    if (flash_drv->encrypted()) {
+        ESP_LOGE(TAG, "%s: encrypted partitions are not supported", __func__);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    this->slots = this->flash_sector_size / this->fat_sector_size - 1;
+    this->meta_size = (1 + 2 * this->slots) * sizeof(wl_log_record_t);
+    if ((this->slots < 1) || (this->meta_size > this->fat_sector_size)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    this->blocks_count = WL_Flash::chip_size() / this->flash_sector_size;
+    uint32_t spare = 2 + this->blocks_count * WL_LOG_SPARE_PERCENT / 100;
+    if ((this->blocks_count <= spare) || (this->blocks_count * this->slots >= WL_LOG_UNMAPPED)) {
+        ESP_LOGE(TAG, "%s: %u blocks can't be used", __func__, this->blocks_count);
+        return ESP_ERR_INVALID_ARG;
+    }
+    this->sectors_count = (this->blocks_count - spare) * this->slots;
+
+    if (this->map == NULL) {
+        this->map = (uint16_t *)malloc(this->sectors_count * sizeof(uint16_t));
+        this->blocks = (wl_log_block_t *)malloc(this->blocks_count * sizeof(wl_log_block_t));
+        this->meta_buffer = (uint8_t *)malloc(this->meta_size);
+        this->sector_buffer = (uint32_t *)malloc(this->fat_sector_size);
+    }
+    if ((this->map == NULL) || (this->blocks == NULL) || (this->meta_buffer == NULL) || (this->sector_buffer == NULL)) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGD(TAG, "%s - %u blocks of %u slots, %u sectors", __func__, this->blocks_count, this->slots, this->sectors_count);
+    return ESP_OK;
+}
+
+/*
+ * Rebuild the map from the tags of all blocks. A tag without a kill record holds the current data of its
+ * fat sector, unless power was lost between writing a tag and the kill record of the old slot: of two such
+ * tags the one with the higher sequence number wins and the other one is killed now.
+ * The block with the highest sequence number was being appended to, see recoverOpen().
+ */
+esp_err_t WL_Ext_Log::init()
+{
+    esp_err_t result = WL_Flash::init();
+    WL_EXT_RESULT_CHECK(result);
+
+    for (uint32_t i = 0; i < this->sectors_count; i++) {
+        this->map[i] = WL_LOG_UNMAPPED;
+    }
+    this->free_blocks = 0;
+    this->open_block = WL_LOG_NO_BLOCK;
+    this->open_fill = 0;
+    this->seq = 0;
+    uint32_t last_block = WL_LOG_NO_BLOCK;
+    uint32_t min_erase_count = UINT32_MAX;
+    for (uint32_t i = 0; i < this->blocks_count; i++) {
+        result = this->scanBlock(i, &last_block);
+        WL_EXT_RESULT_CHECK(result);
+        if ((this->blocks[i].state != WL_LOG_DIRTY) && (this->blocks[i].erase_count < min_erase_count)) {
+            min_erase_count = this->blocks[i].erase_count;
+        }
+    }
+    // erase counts of blocks without a header are lost, don't let them look the least worn
+    for (uint32_t i = 0; i < this->blocks_count; i++) {
+        if ((this->blocks[i].state == WL_LOG_DIRTY) && (min_erase_count != UINT32_MAX)) {
+            this->blocks[i].erase_count = min_erase_count;
+        }
+    }
+    if (last_block != WL_LOG_NO_BLOCK) {
+        result = this->recoverOpen(last_block);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    ESP_LOGD(TAG, "%s - seq=0x%08x, free blocks=%u, open block=%u, fill=%u", __func__, this->seq, this->free_blocks, this->open_block, this->open_fill);
+    return ESP_OK;
+}
+
+esp_err_t WL_Ext_Log::scanBlock(uint32_t block, uint32_t *last_block)
+{
+    esp_err_t result = WL_Flash::read(block * this->flash_sector_size, this->meta_buffer, this->meta_size);
+    WL_EXT_RESULT_CHECK(result);
+    const wl_log_record_t *records = (const wl_log_record_t *)this->meta_buffer;
+    wl_log_block_t *info = &this->blocks[block];
+    info->live = 0;
+    if (!recordValid(&records[0], WL_LOG_BLOCK_MAGIC) || (records[0].seq != block)) {
+        // never used by the log, or power lost before the header was written after erase
+        info->erase_count = 0;
+        info->state = WL_LOG_DIRTY;
+        this->free_blocks++;
+        return ESP_OK;
+    }
+    info->erase_count = records[0].value;
+    info->state = WL_LOG_UNVERIFIED;
+    for (uint32_t i = 0; i < this->slots; i++) {
+        const wl_log_record_t *tag = &records[1 + 2 * i];
+        if (!isBlank(tag, sizeof(wl_log_record_t))) {
+            info->state = WL_LOG_USED;
+        }
+        if (!recordValid(tag, WL_LOG_TAG_MAGIC) || (tag->value >= this->sectors_count)) {
+            continue;
+        }
+        if (tag->seq >= this->seq) {
+            this->seq = tag->seq + 1;
+            *last_block = block;
+        }
+        if (recordValid(&records[2 + 2 * i], WL_LOG_KILL_MAGIC)) {
+            continue;
+        }
+        uint32_t slot = block * this->slots + i;
+        uint32_t sector = tag->value;
+        uint32_t other_slot = this->map[sector];
+        this->map[sector] = slot;
+        info->live++;
+        if (other_slot == WL_LOG_UNMAPPED) {
+            continue;
+        }
+        wl_log_record_t other;
+        result = WL_Flash::read(this->tagAddr(other_slot), &other, sizeof(other));
+        WL_EXT_RESULT_CHECK(result);
+        uint32_t loser = slot;
+        if (other.seq < tag->seq) {
+            loser = other_slot;
+        } else {
+            this->map[sector] = other_slot;
+        }
+        ESP_LOGW(TAG, "%s - sector %u in slots %u and %u, killing %u", __func__, sector, other_slot, slot, loser);
+        result = this->kill(loser, sector);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    if (info->state == WL_LOG_UNVERIFIED) {
+        this->free_blocks++;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Continue appending to the block written last. Slots after its last tag are still blank,
+ * except for one whose data was being written when power was lost, which is skipped.
+ */
+esp_err_t WL_Ext_Log::recoverOpen(uint32_t block)
+{
+    esp_err_t result = WL_Flash::read(block * this->flash_sector_size, this->meta_buffer, this->meta_size);
+    WL_EXT_RESULT_CHECK(result);
+    const wl_log_record_t *records = (const wl_log_record_t *)this->meta_buffer;
+    uint32_t fill = this->slots;
+    while ((fill > 0) && isBlank(&records[1 + 2 * (fill - 1)], sizeof(wl_log_record_t))) {
+        fill--;
+    }
+    for (uint32_t i = fill; i < this->slots; i++) {
+        result = WL_Flash::read(this->slotAddr(block * this->slots + i), this->sector_buffer, this->fat_sector_size);
+        WL_EXT_RESULT_CHECK(result);
+        if (!isBlank(this->sector_buffer, this->fat_sector_size)) {
+            fill = i + 1;
+        }
+    }
+    if (fill < this->slots) {
+        this->blocks[block].state = WL_LOG_OPEN;
+        this->open_block = block;
+        this->open_fill = fill;
+    }
+    return ESP_OK;
+}
+
+size_t WL_Ext_Log::slotAddr(uint32_t slot)
+{
+    return (slot / this->slots) * this->flash_sector_size + (slot % this->slots + 1) * this->fat_sector_size;
+}
+
+size_t WL_Ext_Log::tagAddr(uint32_t slot)
+{
+    return (slot / this->slots) * this->flash_sector_size + (1 + 2 * (slot % this->slots)) * sizeof(wl_log_record_t);
+}
+
+size_t WL_Ext_Log::killAddr(uint32_t slot)
+{
+    return this->tagAddr(slot) + sizeof(wl_log_record_t);
+}
+
+esp_err_t WL_Ext_Log::writeRecord(size_t addr, uint32_t magic, uint32_t value, uint32_t seq)
+{
+    wl_log_record_t record = {magic, value, seq, 0};
+    record.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)&record, offsetof(wl_log_record_t, crc));
+    return WL_Flash::write(addr, &record, sizeof(record));
+}
+
+bool WL_Ext_Log::recordValid(const wl_log_record_t *record, uint32_t magic)
+{
+    return (record->magic == magic)
+           && (record->crc == crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)record, offsetof(wl_log_record_t, crc)));
+}
+
+// Erase the block and write its header, the caller updates its state
+esp_err_t WL_Ext_Log::eraseBlock(uint32_t block)
+{
+    esp_err_t result = WL_Flash::erase_sector(block);
+    WL_EXT_RESULT_CHECK(result);
+    this->blocks[block].erase_count++;
+    this->blocks[block].live = 0;
+    result = this->writeRecord(block * this->flash_sector_size, WL_LOG_BLOCK_MAGIC, this->blocks[block].erase_count, block);
+    WL_EXT_RESULT_CHECK(result);
+    return result;
+}
+
+// Open the least erased free block for appending
+esp_err_t WL_Ext_Log::openBlock()
+{
+    uint32_t block = WL_LOG_NO_BLOCK;
+    for (uint32_t i = 0; i < this->blocks_count; i++) {
+        uint8_t state = this->blocks[i].state;
+        if ((state != WL_LOG_FREE) && (state != WL_LOG_UNVERIFIED) && (state != WL_LOG_DIRTY)) {
+            continue;
+        }
+        if ((block == WL_LOG_NO_BLOCK) || (this->blocks[i].erase_count < this->blocks[block].erase_count)) {
+            block = i;
+        }
+    }
+    if (block == WL_LOG_NO_BLOCK) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t result = ESP_OK;
+    wl_log_block_t *info = &this->blocks[block];
+    if (info->state == WL_LOG_UNVERIFIED) {
+        // data may have been written to it before power loss cut off its first tag
+        result = WL_Flash::read(block * this->flash_sector_size, this->sector_buffer, this->meta_size);
+        WL_EXT_RESULT_CHECK(result);
+        bool clean = isBlank((const uint8_t *)this->sector_buffer + sizeof(wl_log_record_t), this->meta_size - sizeof(wl_log_record_t));
+        for (uint32_t i = 0; clean && (i < this->slots); i++) {
+            result = WL_Flash::read(this->slotAddr(block * this->slots + i), this->sector_buffer, this->fat_sector_size);
+            WL_EXT_RESULT_CHECK(result);
+            clean = isBlank(this->sector_buffer, this->fat_sector_size);
+        }
+        info->state = clean ? WL_LOG_FREE : WL_LOG_DIRTY;
+    }
+    if (info->state == WL_LOG_DIRTY) {
+        result = this->eraseBlock(block);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    info->state = WL_LOG_OPEN;
+    this->free_blocks--;
+    this->open_block = block;
+    this->open_fill = 0;
+    return result;
+}
+
+// Take the next slot of the open block. The last free block is only opened for garbage collection.
+esp_err_t WL_Ext_Log::nextSlot(uint32_t *slot, bool collecting)
+{
+    if ((this->open_block != WL_LOG_NO_BLOCK) && (this->open_fill == this->slots)) {
+        this->blocks[this->open_block].state = WL_LOG_USED;
+        this->open_block = WL_LOG_NO_BLOCK;
+    }
+    if (this->open_block == WL_LOG_NO_BLOCK) {
+        if ((this->free_blocks == 0) || ((this->free_blocks == 1) && !collecting)) {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t result = this->openBlock();
+        WL_EXT_RESULT_CHECK(result);
+    }
+    *slot = this->open_block * this->slots + this->open_fill;
+    this->open_fill++;
+    return ESP_OK;
+}
+
+/*
+ * Open a block with room for a write, collecting blocks while only the last free block is left.
+ * No free block is left after power loss during garbage collection, which opened the last one:
+ * it's collected again before any write, the slots not moved yet fit in the room left.
+ */
+esp_err_t WL_Ext_Log::prepareSlot()
+{
+    esp_err_t result = ESP_OK;
+    while ((this->free_blocks == 0)
+            || (((this->open_block == WL_LOG_NO_BLOCK) || (this->open_fill == this->slots)) && (this->free_blocks <= 1))) {
+        result = this->collect();
+        WL_EXT_RESULT_CHECK(result);
+    }
+    if ((this->open_block != WL_LOG_NO_BLOCK) && (this->open_fill == this->slots)) {
+        this->blocks[this->open_block].state = WL_LOG_USED;
+        this->open_block = WL_LOG_NO_BLOCK;
+    }
+    if (this->open_block == WL_LOG_NO_BLOCK) {
+        result = this->openBlock();
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+/*
+ * Move the live slots of the used block with the fewest of them to the open block and erase it.
+ * Of blocks with as many live slots the least erased one goes first, so blocks holding data
+ * that's rewritten often don't wear out ahead of the rest.
+ * The fat sectors offered leave at least two blocks worth of slots dead or free, so with one free
+ * block left, some used block has fewer live slots than a block holds and collecting it gains space.
+ */
+esp_err_t WL_Ext_Log::collect()
+{
+    if ((this->open_block != WL_LOG_NO_BLOCK) && (this->open_fill == this->slots)) {
+        this->blocks[this->open_block].state = WL_LOG_USED;
+        this->open_block = WL_LOG_NO_BLOCK;
+    }
+    uint32_t victim = WL_LOG_NO_BLOCK;
+    for (uint32_t i = 0; i < this->blocks_count; i++) {
+        const wl_log_block_t *info = &this->blocks[i];
+        if (info->state != WL_LOG_USED) {
+            continue;
+        }
+        if ((victim == WL_LOG_NO_BLOCK) || (info->live < this->blocks[victim].live)
+                || ((info->live == this->blocks[victim].live) && (info->erase_count < this->blocks[victim].erase_count))) {
+            victim = i;
+        }
+    }
+    if ((victim == WL_LOG_NO_BLOCK) || (this->blocks[victim].live == this->slots)) {
+        ESP_LOGE(TAG, "%s: no block to collect", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t result = ESP_OK;
+    if (this->blocks[victim].live > 0) {
+        result = WL_Flash::read(victim * this->flash_sector_size, this->meta_buffer, this->meta_size);
+        WL_EXT_RESULT_CHECK(result);
+        const wl_log_record_t *records = (const wl_log_record_t *)this->meta_buffer;
+        for (uint32_t i = 0; i < this->slots; i++) {
+            const wl_log_record_t *tag = &records[1 + 2 * i];
+            uint32_t src = victim * this->slots + i;
+            if (!recordValid(tag, WL_LOG_TAG_MAGIC) || (tag->value >= this->sectors_count) || (this->map[tag->value] != src)) {
+                continue;
+            }
+            // the copy gets a new tag, the victim is erased without killing the old one
+            uint32_t dest;
+            result = this->nextSlot(&dest, true);
+            WL_EXT_RESULT_CHECK(result);
+            result = WL_Flash::read(this->slotAddr(src), this->sector_buffer, this->fat_sector_size);
+            WL_EXT_RESULT_CHECK(result);
+            result = WL_Flash::write(this->slotAddr(dest), this->sector_buffer, this->fat_sector_size);
+            WL_EXT_RESULT_CHECK(result);
+            result = this->writeRecord(this->tagAddr(dest), WL_LOG_TAG_MAGIC, tag->value, this->seq++);
+            WL_EXT_RESULT_CHECK(result);
+            this->map[tag->value] = dest;
+            this->blocks[dest / this->slots].live++;
+            this->stats.log_moves++;
+        }
+    }
+    result = this->eraseBlock(victim);
+    WL_EXT_RESULT_CHECK(result);
+    this->blocks[victim].state = WL_LOG_FREE;
+    this->free_blocks++;
+    this->stats.log_collections++;
+    return result;
+}
+
+esp_err_t WL_Ext_Log::kill(uint32_t slot, uint32_t sector)
+{
+    this->blocks[slot / this->slots].live--;
+    return this->writeRecord(this->killAddr(slot), WL_LOG_KILL_MAGIC, sector, 0);
+}
+
+/*
+ * Write size bytes at offset of a fat sector to a new slot. As on flash, a write can only clear bits,
+ * so the new data is the old one and src. If that changes nothing, nothing is written.
+ */
+esp_err_t WL_Ext_Log::writeSector(uint32_t sector, size_t offset, const uint8_t *src, size_t size)
+{
+    // collecting moves slots and opening a block may use the buffer, the old data is read after both
+    esp_err_t result = this->prepareSlot();
+    WL_EXT_RESULT_CHECK(result);
+    uint32_t old = this->map[sector];
+    uint8_t *data = (uint8_t *)this->sector_buffer;
+    if (old == WL_LOG_UNMAPPED) {
+        memset(data, 0xff, this->fat_sector_size);
+    } else {
+        result = WL_Flash::read(this->slotAddr(old), data, this->fat_sector_size);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    bool changed = false;
+    for (size_t i = 0; i < size; i++) {
+        uint8_t value = data[offset + i] & src[i];
+        changed |= (value != data[offset + i]);
+        data[offset + i] = value;
+    }
+    if (!changed) {
+        return ESP_OK;
+    }
+    uint32_t slot;
+    result = this->nextSlot(&slot, false);
+    WL_EXT_RESULT_CHECK(result);
+    result = WL_Flash::write(this->slotAddr(slot), data, this->fat_sector_size);
+    WL_EXT_RESULT_CHECK(result);
+    result = this->writeRecord(this->tagAddr(slot), WL_LOG_TAG_MAGIC, sector, this->seq++);
+    WL_EXT_RESULT_CHECK(result);
+    this->map[sector] = slot;
+    this->blocks[slot / this->slots].live++;
+    if (old != WL_LOG_UNMAPPED) {
+        result = this->kill(old, sector);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+size_t WL_Ext_Log::chip_size()
+{
+    return this->sectors_count * this->fat_sector_size;
+}
+
+size_t WL_Ext_Log::sector_size()
+{
+    return this->fat_sector_size;
+}
+
+esp_err_t WL_Ext_Log::erase_sector(size_t sector)
+{
+    return this->erase_range(sector * this->fat_sector_size, this->fat_sector_size);
+}
+
+// Erased fat sectors only lose their slot, no flash is erased
+esp_err_t WL_Ext_Log::erase_range(size_t start_address, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((start_address % this->fat_sector_size) != 0) {
+        result = ESP_ERR_INVALID_ARG;
+    }
+    if (((size % this->fat_sector_size) != 0) || (size == 0)) {
+        result = ESP_ERR_INVALID_ARG;
+    }
+    WL_EXT_RESULT_CHECK(result);
+
+    ESP_LOGV(TAG, "%s begin, addr = 0x%08x, size = %i", __func__, start_address, size);
+    for (size_t i = 0; i < size / this->fat_sector_size; i++) {
+        uint32_t sector = (start_address / this->fat_sector_size + i) % this->sectors_count;
+        uint32_t slot = this->map[sector];
+        if (slot == WL_LOG_UNMAPPED) {
+            continue;
+        }
+        this->map[sector] = WL_LOG_UNMAPPED;
+        result = this->kill(slot, sector);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+esp_err_t WL_Ext_Log::write(size_t dest_addr, const void *src, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const uint8_t *src_buff = (const uint8_t *)src;
+    while (size > 0) {
+        // addresses past chip_size() wrap around, as they do in WL_Flash
+        uint32_t sector = (dest_addr / this->fat_sector_size) % this->sectors_count;
+        size_t offset = dest_addr % this->fat_sector_size;
+        size_t count = this->fat_sector_size - offset;
+        if (count > size) {
+            count = size;
+        }
+        result = this->writeSector(sector, offset, src_buff, count);
+        WL_EXT_RESULT_CHECK(result);
+        dest_addr += count;
+        src_buff += count;
+        size -= count;
+    }
+    return result;
+}
+
+esp_err_t WL_Ext_Log::read(size_t src_addr, void *dest, size_t size)
+{
+    wl_iovec_t iov = {src_addr, dest, size};
+    return this->readv(&iov, 1);
+}
+
+// Slots of all entries go to WL_Flash::readv() as one list, fat sectors in consecutive slots of a block as one extent
+esp_err_t WL_Ext_Log::readv(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    wl_iovec_t batch[WL_LOG_READ_BATCH];
+    size_t batched = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t src_addr = iov[i].addr;
+        size_t size = iov[i].size;
+        uint8_t *dest_buff = (uint8_t *)iov[i].buf;
+        while (size > 0) {
+            uint32_t sector = (src_addr / this->fat_sector_size) % this->sectors_count;
+            size_t offset = src_addr % this->fat_sector_size;
+            uint32_t slot = this->map[sector];
+            size_t extent = this->fat_sector_size - offset;
+            for (uint32_t run = 1; (extent < size) && (sector + run < this->sectors_count); run++) {
+                uint32_t next = this->map[sector + run];
+                bool follows = (slot == WL_LOG_UNMAPPED) ? (next == WL_LOG_UNMAPPED)
+                               : ((next == slot + run) && ((slot + run) / this->slots == slot / this->slots));
+                if (!follows) {
+                    break;
+                }
+                extent += this->fat_sector_size;
+            }
+            if (extent > size) {
+                extent = size;
+            }
+            if (slot == WL_LOG_UNMAPPED) {
+                memset(dest_buff, 0xff, extent);
+            } else {
+                append(batch, &batched, this->slotAddr(slot) + offset, dest_buff, extent);
+            }
+            if (batched == WL_LOG_READ_BATCH) {
+                result = WL_Flash::readv(batch, batched);
+                WL_EXT_RESULT_CHECK(result);
+                batched = 0;
+            }
+            src_addr += extent;
+            dest_buff += extent;
+            size -= extent;
+        }
+    }
+    if (batched > 0) {
+        result = WL_Flash::readv(batch, batched);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
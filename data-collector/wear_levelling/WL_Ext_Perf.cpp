@@ -5,7 +5,10 @@
  */
 #include "WL_Ext_Perf.h"
 #include <stdlib.h>
+#include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 
 static const char *TAG = "wl_ext_perf";
 
@@ -15,9 +18,21 @@ static const char *TAG = "wl_ext_perf";
         return (result); \
     }
 
+// Erases of small sectors are merged in RAM for up to this long, 0 rewrites the flash sector on every erase
+#ifndef WL_MERGE_TIMEOUT_MS
+#ifdef CONFIG_WL_MERGE_TIMEOUT_MS
+#define WL_MERGE_TIMEOUT_MS CONFIG_WL_MERGE_TIMEOUT_MS
+#else
+#define WL_MERGE_TIMEOUT_MS 0
+#endif // CONFIG_WL_MERGE_TIMEOUT_MS
+#endif // WL_MERGE_TIMEOUT_MS
+
+#define WL_EXT_NO_MERGE UINT32_MAX
+
 WL_Ext_Perf::WL_Ext_Perf(): WL_Flash()
 {
     this->sector_buffer = NULL;
+    this->merge_base = WL_EXT_NO_MERGE;
 }
 
 WL_Ext_Perf::~WL_Ext_Perf()
@@ -38,15 +53,18 @@ esp_err_t WL_Ext_Perf::config(WL_Config_s *cfg, Flash_Access *flash_drv)
     }
 
     this->size_factor = this->flash_sector_size / this->fat_sector_size;
-    if (this->size_factor < 1) {
+    if ((this->size_factor < 1) || (this->size_factor > 32)) {
         return ESP_ERR_INVALID_ARG;
     }
+    // erased fat sectors merged in RAM read as 0xFF, an encrypted partition reads them differently
+    this->merge_timeout = flash_drv->encrypted() ? 0 : WL_MERGE_TIMEOUT_MS * 1000LL;
 
     return WL_Flash::config(cfg, flash_drv);
 }
 
 esp_err_t WL_Ext_Perf::init()
 {
+    this->merge_base = WL_EXT_NO_MERGE;
     return WL_Flash::init();
 }
 
@@ -61,6 +79,10 @@ size_t WL_Ext_Perf::sector_size()
 
 esp_err_t WL_Ext_Perf::erase_sector(size_t sector)
 {
+    if (this->mergeExpired()) {
+        esp_err_t result = this->flushMerge();
+        WL_EXT_RESULT_CHECK(result);
+    }
     return this->erase_sector_fit(sector, 1);
 }
 
@@ -70,26 +92,268 @@ esp_err_t WL_Ext_Perf::erase_sector_fit(uint32_t start_sector, uint32_t count)
     // This method works with one flash device sector and able to erase "count" of fatfs sectors from this sector
     esp_err_t result = ESP_OK;
 
+    uint32_t local_addr_base = start_sector / this->size_factor;
     uint32_t pre_check_start = start_sector % this->size_factor;
+    if (this->merge_timeout > 0) {
+        return this->mergeErase(local_addr_base, pre_check_start, count);
+    }
+
+    // Read the complete flash sector at once, the part to be erased is just not written back
+    bool blank;
+    result = this->readSector(local_addr_base, &blank);
+    WL_EXT_RESULT_CHECK(result);
+    if (blank) {
+        return ESP_OK;
+    }
+    return this->rewriteSector(local_addr_base, this->keptMask(pre_check_start, count));
+}
+
+// Erase flash sector local_addr_base and write back the fat sectors in mask from sector_buffer
+esp_err_t WL_Ext_Perf::rewriteSector(uint32_t local_addr_base, uint32_t mask)
+{
+    esp_err_t result = WL_Flash::erase_sector(local_addr_base); // erase comlete flash sector
+    WL_EXT_RESULT_CHECK(result);
+    // And write back only data that should not be erased...
+    result = this->writeBack(local_addr_base, mask);
+    WL_EXT_RESULT_CHECK(result);
+    return ESP_OK;
+}
+
+/*
+ * Read flash sector local_addr_base to sector_buffer with one mapped read.
+ * blank is set if blank check is on and the sector is blank, so there's nothing to erase.
+ */
+esp_err_t WL_Ext_Perf::readSector(uint32_t local_addr_base, bool *blank)
+{
+    esp_err_t result = WL_Flash::read(local_addr_base * this->flash_sector_size, this->sector_buffer, this->flash_sector_size);
+    WL_EXT_RESULT_CHECK(result);
+    *blank = this->blank_check && isBlank(this->sector_buffer, this->flash_sector_size);
+    if (*blank) {
+        this->stats.blank_erases++;
+    }
+    return result;
+}
+
+// Fat sectors of sector_buffer kept by erasing count of them from erase_start, with blank check only the ones with data
+uint32_t WL_Ext_Perf::keptMask(uint32_t erase_start, uint32_t count)
+{
+    uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < this->size_factor; i++) {
+        if ((i >= erase_start) && (i < erase_start + count)) {
+            continue;
+        }
+        if (this->blank_check && isBlank(&this->sector_buffer[i * words], this->fat_sector_size)) {
+            continue;
+        }
+        mask |= 1 << i;
+    }
+    return mask;
+}
 
+/*
+ * Write the fat sectors in mask from sector_buffer back to the erased flash sector local_addr_base.
+ * Every run of fat sectors is written at once.
+ */
+esp_err_t WL_Ext_Perf::writeBack(uint32_t local_addr_base, uint32_t mask)
+{
+    esp_err_t result = ESP_OK;
+    uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+    // a run ends at a cleared bit, so a 32 bit mask has at most 16 of them
+    wl_iovec_t runs[16];
+    size_t count = 0;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for (uint32_t i = 0; i <= this->size_factor; i++) {
+        if ((i < this->size_factor) && (mask & (1 << i))) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length++;
+        } else if (run_length > 0) {
+            runs[count++] = {local_addr_base * this->flash_sector_size + run_start * this->fat_sector_size,
+                             &this->sector_buffer[run_start * words], run_length * this->fat_sector_size
+                            };
+            run_length = 0;
+        }
+    }
+    if (count > 0) {
+        result = WL_Flash::writev(runs, count);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
 
-    for (int i = 0; i < this->size_factor; i++) {
-        if ((i < pre_check_start) || (i >= count + pre_check_start)) {
-            result = this->read(start_sector / this->size_factor * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * this->fat_sector_size / sizeof(uint32_t)], this->fat_sector_size);
-            WL_EXT_RESULT_CHECK(result);
+/*
+ * Erase fat sectors in the copy of flash sector local_addr_base in sector_buffer, the flash sector is rewritten
+ * once for all erases and writes merged into the copy by flushMerge(). A merge of another flash sector is flushed first.
+ */
+esp_err_t WL_Ext_Perf::mergeErase(uint32_t local_addr_base, uint32_t erase_start, uint32_t count)
+{
+    esp_err_t result = ESP_OK;
+    if (this->merge_base != local_addr_base) {
+        result = this->flushMerge();
+        WL_EXT_RESULT_CHECK(result);
+        bool blank;
+        result = this->readSector(local_addr_base, &blank);
+        WL_EXT_RESULT_CHECK(result);
+        if (blank) {
+            return ESP_OK;
         }
+        this->merge_base = local_addr_base;
+        this->merge_time = esp_timer_get_time();
+    } else {
+        this->stats.merged_erases++;
+    }
+    memset(&this->sector_buffer[erase_start * this->fat_sector_size / sizeof(uint32_t)], 0xff, count * this->fat_sector_size);
+    return result;
+}
+
+esp_err_t WL_Ext_Perf::flushMerge()
+{
+    if (this->merge_base == WL_EXT_NO_MERGE) {
+        return ESP_OK;
     }
+    uint32_t local_addr_base = this->merge_base;
+    this->merge_base = WL_EXT_NO_MERGE;
+    // merging is off on encrypted partitions, fat sectors erased in RAM are blank in flash after the rewrite
+    uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < this->size_factor; i++) {
+        if (!isBlank(&this->sector_buffer[i * words], this->fat_sector_size)) {
+            mask |= 1 << i;
+        }
+    }
+    return this->rewriteSector(local_addr_base, mask);
+}
+
+bool WL_Ext_Perf::mergeExpired()
+{
+    return (this->merge_base != WL_EXT_NO_MERGE) && (esp_timer_get_time() - this->merge_time >= this->merge_timeout);
+}
 
-    result = WL_Flash::erase_sector(start_sector / this->size_factor); // erase comlete flash sector
+// An expired merge is flushed by wl_maintain() as one step
+uint32_t WL_Ext_Perf::pendingSteps()
+{
+    return WL_Flash::pendingSteps() + (this->mergeExpired() ? 1 : 0);
+}
+
+esp_err_t WL_Ext_Perf::maintainStep()
+{
+    if (this->mergeExpired()) {
+        return this->flushMerge();
+    }
+    return WL_Flash::maintainStep();
+}
+
+esp_err_t WL_Ext_Perf::sync()
+{
+    return this->flushMerge();
+}
+
+esp_err_t WL_Ext_Perf::flush()
+{
+    esp_err_t result = this->flushMerge();
     WL_EXT_RESULT_CHECK(result);
-    // And write back only data that should not be erased...
-    for (int i = 0; i < this->size_factor; i++) {
-        if ((i < pre_check_start) || (i >= count + pre_check_start)) {
-            result = this->write(start_sector / this->size_factor * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * this->fat_sector_size / sizeof(uint32_t)], this->fat_sector_size);
-            WL_EXT_RESULT_CHECK(result);
+    return WL_Flash::flush();
+}
+
+// Lists not touching the merged flash sector go to WL_Flash whole, others entry by entry through write() and read()
+bool WL_Ext_Perf::mergeOverlaps(const wl_iovec_t *iov, size_t count)
+{
+    if (this->merge_base == WL_EXT_NO_MERGE) {
+        return false;
+    }
+    size_t merge_start = this->merge_base * this->flash_sector_size;
+    size_t merge_end = merge_start + this->flash_sector_size;
+    for (size_t i = 0; i < count; i++) {
+        if ((iov[i].size > 0) && (iov[i].addr < merge_end) && (iov[i].addr + iov[i].size > merge_start)) {
+            return true;
         }
     }
-    return ESP_OK;
+    return false;
+}
+
+esp_err_t WL_Ext_Perf::writev(const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    if (this->mergeExpired()) {
+        result = this->flushMerge();
+        WL_EXT_RESULT_CHECK(result);
+    }
+    if (this->mergeOverlaps(iov, count)) {
+        return Flash_Access::writev(iov, count);
+    }
+    return WL_Flash::writev(iov, count);
+}
+
+esp_err_t WL_Ext_Perf::readv(const wl_iovec_t *iov, size_t count)
+{
+    if (this->mergeOverlaps(iov, count)) {
+        return Flash_Access::readv(iov, count);
+    }
+    return WL_Flash::readv(iov, count);
+}
+
+// Writes to the merged flash sector go to its copy, as flash they can only clear bits
+esp_err_t WL_Ext_Perf::write(size_t dest_addr, const void *src, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (this->mergeExpired()) {
+        result = this->flushMerge();
+        WL_EXT_RESULT_CHECK(result);
+    }
+    if (this->merge_base == WL_EXT_NO_MERGE) {
+        return WL_Flash::write(dest_addr, src, size);
+    }
+    const uint8_t *src_buff = (const uint8_t *)src;
+    size_t merge_start = this->merge_base * this->flash_sector_size;
+    size_t merge_end = merge_start + this->flash_sector_size;
+    if ((dest_addr + size <= merge_start) || (dest_addr >= merge_end)) {
+        return WL_Flash::write(dest_addr, src, size);
+    }
+    if (dest_addr < merge_start) {
+        result = WL_Flash::write(dest_addr, src_buff, merge_start - dest_addr);
+        WL_EXT_RESULT_CHECK(result);
+        src_buff += merge_start - dest_addr;
+        size -= merge_start - dest_addr;
+        dest_addr = merge_start;
+    }
+    uint8_t *merge_buff = (uint8_t *)this->sector_buffer + (dest_addr - merge_start);
+    size_t count = (size < merge_end - dest_addr) ? size : merge_end - dest_addr;
+    for (size_t i = 0; i < count; i++) {
+        merge_buff[i] &= src_buff[i];
+    }
+    if (count < size) {
+        result = WL_Flash::write(merge_end, src_buff + count, size - count);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+esp_err_t WL_Ext_Perf::read(size_t src_addr, void *dest, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    size_t merge_start = this->merge_base * this->flash_sector_size;
+    size_t merge_end = merge_start + this->flash_sector_size;
+    if ((this->merge_base == WL_EXT_NO_MERGE) || (src_addr + size <= merge_start) || (src_addr >= merge_end)) {
+        return WL_Flash::read(src_addr, dest, size);
+    }
+    uint8_t *dest_buff = (uint8_t *)dest;
+    if (src_addr < merge_start) {
+        result = WL_Flash::read(src_addr, dest_buff, merge_start - src_addr);
+        WL_EXT_RESULT_CHECK(result);
+        dest_buff += merge_start - src_addr;
+        size -= merge_start - src_addr;
+        src_addr = merge_start;
+    }
+    size_t count = (size < merge_end - src_addr) ? size : merge_end - src_addr;
+    memcpy(dest_buff, (uint8_t *)this->sector_buffer + (src_addr - merge_start), count);
+    if (count < size) {
+        result = WL_Flash::read(merge_end, dest_buff + count, size - count);
+        WL_EXT_RESULT_CHECK(result);
+    }
+    return result;
 }
 
 esp_err_t WL_Ext_Perf::erase_range(size_t start_address, size_t size)
@@ -102,6 +366,10 @@ esp_err_t WL_Ext_Perf::erase_range(size_t start_address, size_t size)
         result = ESP_ERR_INVALID_ARG;
     }
     WL_EXT_RESULT_CHECK(result);
+    if (this->mergeExpired()) {
+        result = this->flushMerge();
+        WL_EXT_RESULT_CHECK(result);
+    }
 
     // The range to erase could be allocated in any possible way
     // ---------------------------------------------------------
@@ -146,11 +414,13 @@ esp_err_t WL_Ext_Perf::erase_range(size_t start_address, size_t size)
     ESP_LOGV(TAG, "%s rest_check_start = %i, pre_check_count=%i, rest_check_count=%i, post_check_count=%i\n", __func__, rest_check_start, pre_check_count, rest_check_count, post_check_count);
     if (rest_check_count > 0) {
         rest_check_count = rest_check_count / this->size_factor;
-        size_t start_sector = rest_check_start / this->flash_sector_size;
-        for (size_t i = 0; i < rest_check_count; i++) {
-            result = WL_Flash::erase_sector(start_sector + i);
-            WL_EXT_RESULT_CHECK(result);
+        // a merged flash sector erased as a whole has nothing left to write
+        uint32_t rest_base = rest_check_start / this->flash_sector_size;
+        if ((this->merge_base >= rest_base) && (this->merge_base < rest_base + rest_check_count)) {
+            this->merge_base = WL_EXT_NO_MERGE;
         }
+        result = WL_Flash::erase_range(rest_check_start, rest_check_count * this->flash_sector_size);
+        WL_EXT_RESULT_CHECK(result);
     }
     if (post_check_count != 0) {
         result = this->erase_sector_fit(post_check_start, post_check_count);
@@ -5,7 +5,10 @@
  */
 #include "WL_Ext_Safe.h"
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include "esp_log.h"
+#include "crc32.h"
 
 static const char *TAG = "wl_ext_safe";
 
@@ -28,7 +31,14 @@ static const char *TAG = "wl_ext_safe";
 #define WL_EXT_SAFE_OFFSET 16
 #endif // WL_EXT_SAFE_OFFSET
 
+#ifndef WL_CFG_CRC_CONST
+#define WL_CFG_CRC_CONST UINT32_MAX
+#endif // WL_CFG_CRC_CONST
 
+#define WL_EXT_SAFE_BEGIN   0x4e474257  // "WBGN"
+#define WL_EXT_SAFE_COMMIT  0x4d4d4357  // "WCMM"
+
+// Transaction of versions which dumped the whole flash sector, the only record in the state sector
 struct WL_Ext_Safe_State {
 public:
     uint32_t erase_begin;
@@ -37,6 +47,21 @@ public:
     uint32_t count;
 };
 
+// Journal record, a commit repeats its begin record
+struct WL_Ext_Safe_Record {
+public:
+    uint32_t magic;
+    uint32_t local_addr_base;
+    uint32_t saved;     // first dump slot << 16 | mask of the fat sectors saved there
+    uint32_t crc;
+};
+
+static bool recordValid(const WL_Ext_Safe_Record *record, uint32_t magic)
+{
+    return (record->magic == magic)
+           && (record->crc == crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)record, offsetof(WL_Ext_Safe_Record, crc)));
+}
+
 WL_Ext_Safe::WL_Ext_Safe(): WL_Ext_Perf()
 {
 }
@@ -51,6 +76,9 @@ esp_err_t WL_Ext_Safe::config(WL_Config_s *cfg, Flash_Access *flash_drv)
 
     result = WL_Ext_Perf::config(cfg, flash_drv);
     WL_EXT_RESULT_CHECK(result);
+    if (this->size_factor > 16) {
+        return ESP_ERR_INVALID_ARG;
+    }
     this->state_addr = WL_Flash::chip_size() - 2 * WL_Flash::sector_size();
     this->dump_addr = WL_Flash::chip_size() - 1 * WL_Flash::sector_size();
     return ESP_OK;
@@ -74,17 +102,23 @@ size_t WL_Ext_Safe::chip_size()
     return WL_Flash::chip_size() - 2 * this->flash_sector_size;
 }
 
+/*
+ * Replay the transaction left by power loss and find the free part of journal and dump sector.
+ * Records and dump slots are only written to blank flash, so they are used up to the last one that isn't blank.
+ * On encrypted partitions nothing reads as blank and both are erased by the next transaction.
+ */
 esp_err_t WL_Ext_Safe::recover()
 {
     esp_err_t result = ESP_OK;
 
-    WL_Ext_Safe_State state;
-    result = WL_Flash::read(this->state_addr, &state, sizeof(WL_Ext_Safe_State));
+    result = WL_Flash::read(this->state_addr, this->sector_buffer, this->flash_sector_size);
     WL_EXT_RESULT_CHECK(result);
-    ESP_LOGV(TAG, "%s recover, start_addr = 0x%08x, local_addr_base = 0x%08x, local_addr_shift = %i, count=%i", __func__, state.erase_begin, state.local_addr_base, state.local_addr_shift, state.count);
-
-    // check if we have transaction
-    if (state.erase_begin == WL_EXT_SAFE_OK) {
+    WL_Ext_Safe_State state;
+    memcpy(&state, this->sector_buffer, sizeof(WL_Ext_Safe_State));
+    // a state record torn by power loss has no shift and count yet, its flash sector wasn't erased then
+    if ((state.erase_begin == WL_EXT_SAFE_OK) && (state.local_addr_shift < this->size_factor)
+            && (state.count <= this->size_factor - state.local_addr_shift)) {
+        ESP_LOGV(TAG, "%s recover, start_addr = 0x%08x, local_addr_base = 0x%08x, local_addr_shift = %i, count=%i", __func__, state.erase_begin, state.local_addr_base, state.local_addr_shift, state.count);
 
         result = this->read(this->dump_addr, this->sector_buffer, this->flash_sector_size);
         WL_EXT_RESULT_CHECK(result);
@@ -93,60 +127,144 @@ esp_err_t WL_Ext_Safe::recover()
         WL_EXT_RESULT_CHECK(result);
 
         // And write back...
-        for (int i = 0; i < this->size_factor; i++) {
-            if ((i < state.local_addr_shift) || (i >= state.count + state.local_addr_shift)) {
-                result = this->write(state.local_addr_base * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * this->fat_sector_size / sizeof(uint32_t)], this->fat_sector_size);
-                WL_EXT_RESULT_CHECK(result);
-            }
-        }
-        // clear transaction
+        result = this->writeBack(state.local_addr_base, this->keptMask(state.local_addr_shift, state.count));
+        WL_EXT_RESULT_CHECK(result);
+        // clear transaction, the whole dump sector is taken
         result = WL_Flash::erase_range(this->state_addr, this->flash_sector_size);
+        this->journal_pos = 0;
+        this->dump_pos = this->size_factor;
+        return result;
+    }
+
+    const WL_Ext_Safe_Record *records = (const WL_Ext_Safe_Record *)this->sector_buffer;
+    WL_Ext_Safe_Record open = {};
+    this->journal_pos = 0;
+    for (uint32_t i = 0; i < this->flash_sector_size / sizeof(WL_Ext_Safe_Record); i++) {
+        if (!isBlank(&records[i], sizeof(WL_Ext_Safe_Record))) {
+            this->journal_pos = (i + 1) * sizeof(WL_Ext_Safe_Record);
+        }
+        if (recordValid(&records[i], WL_EXT_SAFE_BEGIN)) {
+            open = records[i];
+        } else if (recordValid(&records[i], WL_EXT_SAFE_COMMIT) && (records[i].local_addr_base == open.local_addr_base)
+                   && (records[i].saved == open.saved)) {
+            open.magic = 0;
+        }
+    }
+
+    result = WL_Flash::read(this->dump_addr, this->sector_buffer, this->flash_sector_size);
+    WL_EXT_RESULT_CHECK(result);
+    uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+    this->dump_pos = 0;
+    for (uint32_t i = 0; i < this->size_factor; i++) {
+        if (!isBlank(&this->sector_buffer[i * words], this->fat_sector_size)) {
+            this->dump_pos = i + 1;
+        }
+    }
+
+    if (open.magic == WL_EXT_SAFE_BEGIN) {
+        ESP_LOGV(TAG, "%s recover, local_addr_base = 0x%08x, saved = 0x%08x", __func__, open.local_addr_base, open.saved);
+        memset(this->sector_buffer, 0xff, this->flash_sector_size);
+        result = this->dumpSaved(open.saved >> 16, open.saved & 0xffff, true);
+        WL_EXT_RESULT_CHECK(result);
+        result = WL_Flash::erase_sector(open.local_addr_base); // erase comlete flash sector
+        WL_EXT_RESULT_CHECK(result);
+        result = this->writeBack(open.local_addr_base, open.saved & 0xffff);
+        WL_EXT_RESULT_CHECK(result);
+        if (this->journal_pos + sizeof(WL_Ext_Safe_Record) > this->flash_sector_size) {
+            result = WL_Flash::erase_sector(this->state_addr / this->flash_sector_size);
+            this->journal_pos = 0;
+        } else {
+            result = this->appendRecord(WL_EXT_SAFE_COMMIT, open.local_addr_base, open.saved);
+        }
     }
     return result;
 }
 
-esp_err_t WL_Ext_Safe::erase_sector_fit(uint32_t start_sector, uint32_t count)
+esp_err_t WL_Ext_Safe::appendRecord(uint32_t magic, uint32_t local_addr_base, uint32_t saved)
 {
-    esp_err_t result = ESP_OK;
+    WL_Ext_Safe_Record record = {magic, local_addr_base, saved, 0};
+    record.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)&record, offsetof(WL_Ext_Safe_Record, crc));
+    esp_err_t result = WL_Flash::write(this->state_addr + this->journal_pos, &record, sizeof(record));
+    WL_EXT_RESULT_CHECK(result);
+    this->journal_pos += sizeof(record);
+    return result;
+}
 
-    uint32_t local_addr_base = start_sector / this->size_factor;
-    uint32_t pre_check_start = start_sector % this->size_factor;
-    ESP_LOGV(TAG, "%s start_sector=0x%08x, count = %i", __func__, start_sector, count);
-    for (int i = 0; i < this->size_factor; i++) {
-        if ((i < pre_check_start) || (i >= count + pre_check_start)) {
-            result = this->read(start_sector / this->size_factor * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * this->fat_sector_size / sizeof(uint32_t)], this->fat_sector_size);
-            WL_EXT_RESULT_CHECK(result);
+/*
+ * Copy the fat sectors in mask between sector_buffer and the dump sector, where they take consecutive slots from slot.
+ * Every run of fat sectors is copied at once.
+ */
+esp_err_t WL_Ext_Safe::dumpSaved(uint32_t slot, uint32_t mask, bool restore)
+{
+    esp_err_t result = ESP_OK;
+    uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for (uint32_t i = 0; i <= this->size_factor; i++) {
+        if ((i < this->size_factor) && (mask & (1 << i))) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length++;
+            continue;
+        }
+        if (run_length == 0) {
+            continue;
         }
+        size_t dump_addr = this->dump_addr + slot * this->fat_sector_size;
+        if (restore) {
+            result = WL_Flash::read(dump_addr, &this->sector_buffer[run_start * words], run_length * this->fat_sector_size);
+        } else {
+            result = WL_Flash::write(dump_addr, &this->sector_buffer[run_start * words], run_length * this->fat_sector_size);
+        }
+        WL_EXT_RESULT_CHECK(result);
+        slot += run_length;
+        run_length = 0;
     }
+    return result;
+}
 
-    result = WL_Flash::erase_sector(this->dump_addr / this->flash_sector_size);
-    WL_EXT_RESULT_CHECK(result);
-    result = WL_Flash::write(this->dump_addr, this->sector_buffer, this->flash_sector_size);
-    WL_EXT_RESULT_CHECK(result);
-
-    WL_Ext_Safe_State state;
-    state.erase_begin = WL_EXT_SAFE_OK;
-    state.local_addr_base = local_addr_base;
-    state.local_addr_shift = pre_check_start;
-    state.count = count;
+/*
+ * Rewrite flash sector local_addr_base with the fat sectors in mask from sector_buffer as one transaction.
+ * A merge of erases and writes is flushed this way too, power loss leaves the flash sector as it was before
+ * the merge or with all of it.
+ */
+esp_err_t WL_Ext_Safe::rewriteSector(uint32_t local_addr_base, uint32_t mask)
+{
+    esp_err_t result = ESP_OK;
+    ESP_LOGV(TAG, "%s local_addr_base=0x%08x, mask = 0x%08x", __func__, local_addr_base, mask);
+    if (mask == 0) {
+        // nothing is kept, an interrupted erase leaves nothing to restore
+        return WL_Flash::erase_sector(local_addr_base);
+    }
+    uint32_t saved_count = __builtin_popcount(mask);
 
-    result = WL_Flash::erase_sector(this->state_addr / this->flash_sector_size);
+    // the last transaction is committed, full journal and dump sector can be erased
+    if (this->journal_pos + 2 * sizeof(WL_Ext_Safe_Record) > this->flash_sector_size) {
+        result = WL_Flash::erase_sector(this->state_addr / this->flash_sector_size);
+        WL_EXT_RESULT_CHECK(result);
+        this->journal_pos = 0;
+    }
+    if (this->dump_pos + saved_count > this->size_factor) {
+        result = WL_Flash::erase_sector(this->dump_addr / this->flash_sector_size);
+        WL_EXT_RESULT_CHECK(result);
+        this->dump_pos = 0;
+    }
+    result = this->dumpSaved(this->dump_pos, mask, false);
     WL_EXT_RESULT_CHECK(result);
-    result = WL_Flash::write(this->state_addr + 0, &state, sizeof(WL_Ext_Safe_State));
+    uint32_t saved = (this->dump_pos << 16) | mask;
+    this->dump_pos += saved_count;
+    result = this->appendRecord(WL_EXT_SAFE_BEGIN, local_addr_base, saved);
     WL_EXT_RESULT_CHECK(result);
 
     // Erase
     result = WL_Flash::erase_sector(local_addr_base); // erase comlete flash sector
     WL_EXT_RESULT_CHECK(result);
     // And write back...
-    for (int i = 0; i < this->size_factor; i++) {
-        if ((i < pre_check_start) || (i >= count + pre_check_start)) {
-            result = this->write(local_addr_base * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * this->fat_sector_size / sizeof(uint32_t)], this->fat_sector_size);
-            WL_EXT_RESULT_CHECK(result);
-        }
-    }
+    result = this->writeBack(local_addr_base, mask);
+    WL_EXT_RESULT_CHECK(result);
 
-    result = WL_Flash::erase_sector(this->state_addr / this->flash_sector_size);
+    result = this->appendRecord(WL_EXT_SAFE_COMMIT, local_addr_base, saved);
     WL_EXT_RESULT_CHECK(result);
 
     return ESP_OK;
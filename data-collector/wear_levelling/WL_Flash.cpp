@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include "esp_random.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 #include "WL_Flash.h"
 #include <stdlib.h>
 #include "crc32.h"
@@ -23,6 +25,48 @@ static const char *TAG = "wl_flash";
         return (result); \
     }
 
+// Number of pos records before the recovered position that are verified after the binary search
+#ifndef WL_POS_VERIFY_WINDOW
+#define WL_POS_VERIFY_WINDOW 4
+#endif // WL_POS_VERIFY_WINDOW
+
+// Dummy block relocation buffer shared by all instances, see copyPage()
+#ifndef WL_COPY_POOL_SIZE
+#ifdef CONFIG_WL_COPY_BUFFER_SIZE
+#define WL_COPY_POOL_SIZE CONFIG_WL_COPY_BUFFER_SIZE
+#else
+#define WL_COPY_POOL_SIZE 0
+#endif // CONFIG_WL_COPY_BUFFER_SIZE
+#endif // WL_COPY_POOL_SIZE
+
+// Skip erases of blank sectors and writes of blank data to erased pages, see sectorBlank()
+#ifndef WL_BLANK_CHECK
+#ifdef CONFIG_WL_BLANK_CHECK
+#define WL_BLANK_CHECK 1
+#else
+#define WL_BLANK_CHECK 0
+#endif // CONFIG_WL_BLANK_CHECK
+#endif // WL_BLANK_CHECK
+
+// Physical extents passed to flash_drv by one readv(), writev() or erase_ranges() call, on the stack
+#ifndef WL_IOV_BATCH
+#define WL_IOV_BATCH 8
+#endif // WL_IOV_BATCH
+
+// mmap() maps flash in ranges of whole pages of this size, as the MMU does
+#ifndef WL_MMAP_PAGE_SIZE
+#ifdef CONFIG_MMU_PAGE_SIZE
+#define WL_MMAP_PAGE_SIZE CONFIG_MMU_PAGE_SIZE
+#else
+#define WL_MMAP_PAGE_SIZE 0x10000
+#endif // CONFIG_MMU_PAGE_SIZE
+#endif // WL_MMAP_PAGE_SIZE
+
+static uint8_t *s_copy_pool = NULL;
+static size_t s_copy_pool_size = 0;
+static size_t s_copy_pool_users = 0;
+static bool s_copy_pool_busy = false;
+
 #ifndef _MSC_VER // MSVS has different format for this define
 static_assert(sizeof(wl_state_t) % 32 == 0, "wl_state_t structure size must be multiple of flash encryption unit size");
 #endif // _MSC_VER
@@ -34,7 +78,20 @@ WL_Flash::WL_Flash()
 
 WL_Flash::~WL_Flash()
 {
+    for (uint32_t i = 0; i < this->mmap_count; i++) {
+        this->flash_drv->munmap(this->mmap_windows[i].handle);
+    }
+    free(this->mmap_windows);
     free(this->temp_buff);
+    free(this->trace_buff);
+    if (this->copy_pool_user) {
+        s_copy_pool_users--;
+        if (s_copy_pool_users == 0) {
+            free(s_copy_pool);
+            s_copy_pool = NULL;
+            s_copy_pool_size = 0;
+        }
+    }
 }
 
 esp_err_t WL_Flash::config(wl_config_t *cfg, Flash_Access *flash_drv)
@@ -70,6 +127,8 @@ esp_err_t WL_Flash::config(wl_config_t *cfg, Flash_Access *flash_drv)
         result = ESP_ERR_INVALID_ARG;
     }
     WL_RESULT_CHECK(result);
+    // with flash encryption 0xFF data is stored encrypted and erased flash reads back as noise
+    this->blank_check = WL_BLANK_CHECK && !this->flash_drv->encrypted();
 
     this->state_size = this->cfg.sector_size;
     if (this->state_size < (sizeof(wl_state_t) + (this->cfg.full_mem_size / this->cfg.sector_size)*this->cfg.wr_size)) {
@@ -98,12 +157,50 @@ esp_err_t WL_Flash::config(wl_config_t *cfg, Flash_Access *flash_drv)
         result = ESP_ERR_INVALID_ARG;
     }
     WL_RESULT_CHECK(result);
+    this->rotation.init(this->flash_size, this->cfg.page_size);
 
     this->temp_buff = (uint8_t *)malloc(this->cfg.temp_buff_size);
     if (this->temp_buff == NULL) {
         result = ESP_ERR_NO_MEM;
     }
     WL_RESULT_CHECK(result);
+
+#if WL_TRACE_ENTRIES > 0
+    // tracing is a debugging aid, WL works without it
+    if (this->trace_buff == NULL) {
+        this->trace_buff = (wl_trace_entry_t *)malloc(WL_TRACE_ENTRIES * sizeof(wl_trace_entry_t));
+        if (this->trace_buff == NULL) {
+            ESP_LOGW(TAG, "%s - no memory for %u trace entries, tracing disabled", __func__, WL_TRACE_ENTRIES);
+        }
+    }
+#endif // WL_TRACE_ENTRIES
+
+    // Join the relocation pool. If a full page can't be allocated, try smaller sizes,
+    // relocation then just needs more driver calls. Without any pool temp_buff is used.
+    // Pages are copied in whole buffers, so the size is rounded down to a power of two dividing the page.
+    if (!this->copy_pool_user) {
+        if (s_copy_pool == NULL) {
+            size_t pool_size = WL_COPY_POOL_SIZE;
+            while ((pool_size & (pool_size - 1)) != 0) {
+                pool_size &= pool_size - 1;
+            }
+            if (pool_size != WL_COPY_POOL_SIZE) {
+                ESP_LOGW(TAG, "%s - copy buffer size %u is not a power of two, using %u", __func__,
+                         (uint32_t) WL_COPY_POOL_SIZE, (uint32_t) pool_size);
+            }
+            for (size_t size = pool_size; size > this->cfg.temp_buff_size; size /= 2) {
+                s_copy_pool = (uint8_t *)malloc(size);
+                if (s_copy_pool != NULL) {
+                    s_copy_pool_size = size;
+                    break;
+                }
+            }
+        }
+        this->copy_pool_user = true;
+        s_copy_pool_users++;
+    }
+    ESP_LOGI(TAG, "%s - dummy block copy buffer %u B, %u read/write pairs per page", __func__,
+             (uint32_t) this->copy_buffer_size(), (uint32_t) (this->cfg.page_size / this->copy_buffer_size()));
     this->configured = true;
     return ESP_OK;
 }
@@ -117,6 +214,8 @@ esp_err_t WL_Flash::init()
     }
     // If flow will be interrupted by error, then this flag will be false
     this->initialized = false;
+    // content of the dummy page is only known after a move, see updateWL()
+    this->dummy_blank = false;
     // Init states if it is first time...
     this->flash_drv->read(this->addr_state1, &this->state, sizeof(wl_state_t));
     wl_state_t sa_copy;
@@ -149,21 +248,8 @@ esp_err_t WL_Flash::init()
             WL_RESULT_CHECK(result);
         } else {
             if (crc1 != crc2) {// we did not update second structure.
-                result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
-                WL_RESULT_CHECK(result);
-                result = this->flash_drv->write(this->addr_state2, &this->state, sizeof(wl_state_t));
+                result = this->repairState(this->addr_state1, this->addr_state2, &this->state, this->state.max_pos);
                 WL_RESULT_CHECK(result);
-                for (size_t i = 0; i < ((this->cfg.full_mem_size / this->cfg.sector_size)*this->cfg.wr_size); i++) {
-                    bool pos_bits;
-                    result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                    pos_bits = this->OkBuffSet(i);
-                    if (pos_bits == true) {
-                        //this->fillOkBuff(i);
-                        result = this->flash_drv->write(this->addr_state2 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                        WL_RESULT_CHECK(result);
-                    }
-                }
             }
             ESP_LOGD(TAG, "%s: crc1=0x%08x, crc2 = 0x%08x, result= 0x%08x", __func__, crc1, crc2, (uint32_t)result);
             result = this->recoverPos();
@@ -183,42 +269,20 @@ esp_err_t WL_Flash::init()
     } else {
         // recover broken state
         if (crc1 == this->state.crc) {// we have to recover state 2
-            result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
-            WL_RESULT_CHECK(result);
-            result = this->flash_drv->write(this->addr_state2, &this->state, sizeof(wl_state_t));
+            result = this->repairState(this->addr_state1, this->addr_state2, &this->state, this->state.max_pos);
             WL_RESULT_CHECK(result);
-            for (size_t i = 0; i < ((this->cfg.full_mem_size / this->cfg.sector_size) * this->cfg.wr_size); i++) {
-                bool pos_bits;
-                result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                WL_RESULT_CHECK(result);
-                pos_bits = this->OkBuffSet(i);
-                if (pos_bits == true) {
-                    result = this->flash_drv->write(this->addr_state2 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                }
-            }
             result = this->flash_drv->read(this->addr_state2, &this->state, sizeof(wl_state_t));
             WL_RESULT_CHECK(result);
         } else { // we have to recover state 1
-            result = this->flash_drv->erase_range(this->addr_state1, this->state_size);
-            WL_RESULT_CHECK(result);
-            result = this->flash_drv->write(this->addr_state1, state_copy, sizeof(wl_state_t));
+            // pos records are checked against device_id of the state, so go on with the valid copy
+            memcpy(&this->state, state_copy, sizeof(wl_state_t));
+            result = this->repairState(this->addr_state2, this->addr_state1, &this->state, this->state.max_pos);
             WL_RESULT_CHECK(result);
-            for (size_t i = 0; i < ((this->cfg.full_mem_size / this->cfg.sector_size) * this->cfg.wr_size); i++) {
-                bool pos_bits;
-                result = this->flash_drv->read(this->addr_state2 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-
-                WL_RESULT_CHECK(result);
-                pos_bits = this->OkBuffSet(i);
-                if (pos_bits == true) {
-                    result = this->flash_drv->write(this->addr_state1 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-                    WL_RESULT_CHECK(result);
-                }
-            }
             result = this->flash_drv->read(this->addr_state1, &this->state, sizeof(wl_state_t));
             WL_RESULT_CHECK(result);
-            this->state.pos = this->state.max_pos - 1;
         }
+        result = this->recoverPos();
+        WL_RESULT_CHECK(result);
         // done. We have recovered the state
         // If we have a new configuration, we will overwrite it
         if (this->state.version != this->cfg.version) {
@@ -231,6 +295,7 @@ esp_err_t WL_Flash::init()
         ESP_LOGE(TAG, "%s: returned 0x%08x", __func__, (uint32_t)result);
         return result;
     }
+    this->publishMap();
     this->initialized = true;
     ESP_LOGD(TAG, "%s - move_count= 0x%08x", __func__, (uint32_t)this->state.move_count);
     return ESP_OK;
@@ -239,17 +304,39 @@ esp_err_t WL_Flash::init()
 esp_err_t WL_Flash::recoverPos()
 {
     esp_err_t result = ESP_OK;
-    size_t position = 0;
     ESP_LOGV(TAG, "%s start", __func__);
-    for (size_t i = 0; i < this->state.max_pos; i++) {
-        bool pos_bits;
-        position = i;
+    // OkBuffSet() is called non-virtually here, wlmon relies on this to tell base records from advanced ones
+    // Valid pos records form a prefix, so binary search for its end:
+    // records [0, low) are valid, record high is invalid or high == max_pos.
+    size_t low = 0;
+    size_t high = this->state.max_pos;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + mid * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
+        WL_RESULT_CHECK(result);
+        if (this->WL_Flash::OkBuffSet(mid) == true) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t position = low;
+    // Verify the last records of the prefix. If one of them is broken, the prefix
+    // can't be trusted, so fall back to a full scan for the first invalid record.
+    size_t window_start = (position > WL_POS_VERIFY_WINDOW) ? (position - WL_POS_VERIFY_WINDOW) : 0;
+    for (size_t i = window_start; i < position; i++) {
         result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + i * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
-        pos_bits = this->OkBuffSet(i);
         WL_RESULT_CHECK(result);
-        ESP_LOGV(TAG, "%s - check pos: result=0x%08x, position= %i, pos_bits= 0x%08x", __func__, (uint32_t)result, (uint32_t)position, (uint32_t)pos_bits);
-        if (pos_bits == false) {
-            break; // we have found position
+        if (this->WL_Flash::OkBuffSet(i) == false) {
+            ESP_LOGW(TAG, "%s - broken pos record at %i, scanning all records", __func__, (uint32_t)i);
+            for (position = 0; position < i; position++) {
+                result = this->flash_drv->read(this->addr_state1 + sizeof(wl_state_t) + position * this->cfg.wr_size, this->temp_buff, this->cfg.wr_size);
+                WL_RESULT_CHECK(result);
+                if (this->WL_Flash::OkBuffSet(position) == false) {
+                    break;
+                }
+            }
+            break;
         }
     }
 
@@ -426,7 +513,13 @@ esp_err_t WL_Flash::updateWL()
     }
     // Here we have to move the block and increase the state
     this->state.access_count = 0;
-    ESP_LOGV(TAG, "%s - access_count= 0x%08x, pos= 0x%08x", __func__, this->state.access_count, this->state.pos);
+    int64_t start_time = esp_timer_get_time();
+    // the record below also goes to the state copy, which has to be rewritten after the last wrap by now
+    result = this->finishStateCopy();
+    if (result != ESP_OK) {
+        this->state.access_count = this->state.max_count - 1; // we will update next time
+        return result;
+    }
     // copy data to dummy block
     size_t data_addr = this->state.pos + 1; // next block, [pos+1] copy to [pos]
     if (data_addr >= this->state.max_pos) {
@@ -434,27 +527,21 @@ esp_err_t WL_Flash::updateWL()
     }
     data_addr = this->cfg.start_addr + data_addr * this->cfg.page_size;
     this->dummy_addr = this->cfg.start_addr + this->state.pos * this->cfg.page_size;
-    result = this->flash_drv->erase_range(this->dummy_addr, this->cfg.page_size);
+    this->beginMove();
+    result = this->eraseDummy();
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - erase wl dummy sector result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
 
-    size_t copy_count = this->cfg.page_size / this->cfg.temp_buff_size;
-    for (size_t i = 0; i < copy_count; i++) {
-        result = this->flash_drv->read(data_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
-        if (result != ESP_OK) {
-            ESP_LOGE(TAG, "%s - not possible to read buffer, will try next time, result= 0x%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
-        }
-        result = this->flash_drv->write(this->dummy_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
-        if (result != ESP_OK) {
-            ESP_LOGE(TAG, "%s - not possible to write buffer, will try next time, result= 0x%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
-        }
+    result = this->copyPage(data_addr, this->dummy_addr, &this->dummy_blank);
+    if (result != ESP_OK) {
+        ESP_LOGE(TAG, "%s - not possible to copy block, will try next time, result= 0x%08x", __func__, result);
+        this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
+        return result;
     }
     // done... block moved.
     // Here we will update structures...
@@ -466,6 +553,7 @@ esp_err_t WL_Flash::updateWL()
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - update position 1 result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
     this->fillOkBuff(this->state.pos);
@@ -473,51 +561,346 @@ esp_err_t WL_Flash::updateWL()
     if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - update position 2 result= 0x%08x", __func__, result);
         this->state.access_count = this->state.max_count - 1; // we will update next time
+        this->endMove();
         return result;
     }
+    this->trace(WL_TRACE_MOVE, WL_TRACE_NO_ADDR, this->dummy_addr - this->cfg.start_addr, this->cfg.page_size);
 
     this->state.pos++;
-    if (this->state.pos >= this->state.max_pos) {
+    bool wrapped = (this->state.pos >= this->state.max_pos);
+    if (wrapped) {
         this->state.pos = 0;
         // one loop more
         this->state.move_count++;
         if (this->state.move_count >= (this->state.max_pos - 1)) {
             this->state.move_count = 0;
         }
+    }
+    // readers can use the new mapping from now on
+    this->endMove();
+    if (wrapped) {
+        this->trace(WL_TRACE_STATE, WL_TRACE_NO_ADDR, this->addr_state1 - this->cfg.start_addr, this->state_size);
+        this->stats.wraps++;
         // write main state
         this->state.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&this->state, WL_STATE_CRC_LEN_V2);
 
-        result = this->flash_drv->erase_range(this->addr_state1, this->state_size);
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state1, &this->state, sizeof(wl_state_t));
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state2, &this->state, sizeof(wl_state_t));
+        result = this->saveWrapState();
         WL_RESULT_CHECK(result);
         ESP_LOGD(TAG, "%s - move_count= 0x%08x, pos= 0x%08x, ", __func__, this->state.move_count, this->state.pos);
     }
     // Save structures to the flash... and check result
-    if (result == ESP_OK) {
-        ESP_LOGV(TAG, "%s - result= 0x%08x", __func__, result);
-    } else {
+    if (result != ESP_OK) {
         ESP_LOGE(TAG, "%s - result= 0x%08x", __func__, result);
     }
+    this->stats.dummy_moves++;
+    addTime(&this->stats.update_time_us, &this->stats.update_time_max_us, start_time);
     return result;
 }
 
-size_t WL_Flash::calcAddr(size_t addr)
+/*
+ * Write state with new move_count after a wrap. Only the main copy is written here, rewriting the copy
+ * is left to maintain() so the erase that finished the loop doesn't pay for both.
+ *
+ * Until the copy is rewritten it holds either the previous state with valid CRC, or is partly erased.
+ * Either way init() trusts the main copy and repairs the other one from it, same as when power is lost
+ * between the two writes. The copy has to be done before the next pos update record, see finishStateCopy().
+ */
+esp_err_t WL_Flash::saveWrapState()
 {
-    size_t result = (this->flash_size - this->state.move_count * this->cfg.page_size + addr) % this->flash_size;
-    size_t dummy_addr = this->state.pos * this->cfg.page_size;
-    if (result < dummy_addr) {
-    } else {
-        result += this->cfg.page_size;
+    esp_err_t result = ESP_OK;
+    result = this->flash_drv->erase_range(this->addr_state1, this->state_size);
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->write(this->addr_state1, &this->state, sizeof(wl_state_t));
+    WL_RESULT_CHECK(result);
+    // remember the header as written, access_count keeps changing until the copy is done
+    this->state_copy = this->state;
+    this->state_copy_erased = 0;
+    this->state_copy_pending = true;
+    return result;
+}
+
+// Run the remaining steps of the state copy rewrite, see saveWrapState()
+esp_err_t WL_Flash::finishStateCopy()
+{
+    esp_err_t result = ESP_OK;
+    while (this->state_copy_pending) {
+        result = WL_Flash::maintainStep();
+        WL_RESULT_CHECK(result);
     }
-    ESP_LOGV(TAG, "%s - addr= 0x%08x -> result= 0x%08x, dummy_addr= 0x%08x", __func__, (uint32_t) addr, (uint32_t) result, (uint32_t)dummy_addr);
     return result;
 }
 
+uint32_t WL_Flash::pendingSteps()
+{
+    if (!this->state_copy_pending) {
+        return 0;
+    }
+    // sectors left to erase and the header write
+    return (this->state_size - this->state_copy_erased) / this->cfg.sector_size + 1;
+}
+
+esp_err_t WL_Flash::maintainStep()
+{
+    esp_err_t result = ESP_OK;
+    if (!this->state_copy_pending) {
+        return result;
+    }
+    if (this->state_copy_erased < this->state_size) {
+        result = this->flash_drv->erase_range(this->addr_state2 + this->state_copy_erased, this->cfg.sector_size);
+        WL_RESULT_CHECK(result);
+        this->state_copy_erased += this->cfg.sector_size;
+        return result;
+    }
+    result = this->flash_drv->write(this->addr_state2, &this->state_copy, sizeof(wl_state_t));
+    WL_RESULT_CHECK(result);
+    this->state_copy_pending = false;
+    return result;
+}
+
+esp_err_t WL_Flash::maintain(uint32_t max_steps, uint32_t *pending)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (uint32_t i = 0; i < max_steps && this->pendingSteps() > 0; i++) {
+        result = this->maintainStep();
+        if (result != ESP_OK) {
+            break;
+        }
+        this->stats.maintenance_steps++;
+    }
+    if (pending != NULL) {
+        *pending = this->pendingSteps();
+    }
+    return result;
+}
+
+void WL_Flash::addTime(uint64_t *total, uint32_t *max, int64_t start)
+{
+    uint32_t time = (uint32_t)(esp_timer_get_time() - start);
+    *total += time;
+    if (time > *max) {
+        *max = time;
+    }
+}
+
+// Borrow the largest staging buffer available: caller supplied buffer, shared pool,
+// or temp_buff if the pool is missing or used by another instance at the moment.
+uint8_t *WL_Flash::getCopyBuffer(size_t *size)
+{
+    if (this->copy_buff != NULL) {
+        *size = this->copy_buff_size;
+        return this->copy_buff;
+    }
+    if ((s_copy_pool != NULL) && ((this->cfg.page_size % s_copy_pool_size) == 0)) {
+        if (!__atomic_test_and_set(&s_copy_pool_busy, __ATOMIC_ACQUIRE)) {
+            *size = s_copy_pool_size;
+            return s_copy_pool;
+        }
+    }
+    *size = this->cfg.temp_buff_size;
+    return this->temp_buff;
+}
+
+void WL_Flash::putCopyBuffer(uint8_t *buff)
+{
+    if (buff == s_copy_pool) {
+        __atomic_clear(&s_copy_pool_busy, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Copy a page to the erased page at dest_addr. With blank check, chunks of 0xFF are not written,
+ * the erased page already holds them. blank (can be NULL) is set if the whole page was blank,
+ * the source page then stays erased as the next dummy page, see eraseDummy().
+ */
+esp_err_t WL_Flash::copyPage(size_t src_addr, size_t dest_addr, bool *blank)
+{
+    esp_err_t result = ESP_OK;
+    size_t buff_size;
+    uint8_t *buff = this->getCopyBuffer(&buff_size);
+    bool page_blank = this->blank_check;
+    for (size_t offset = 0; offset < this->cfg.page_size; offset += buff_size) {
+        result = this->flash_drv->read(src_addr + offset, buff, buff_size);
+        if (result != ESP_OK) {
+            break;
+        }
+        if (this->blank_check && isBlank(buff, buff_size)) {
+            continue;
+        }
+        page_blank = false;
+        result = this->flash_drv->write(dest_addr + offset, buff, buff_size);
+        if (result != ESP_OK) {
+            break;
+        }
+    }
+    this->putCopyBuffer(buff);
+    if (page_blank && (result == ESP_OK)) {
+        this->stats.blank_copies++;
+    }
+    if (blank != NULL) {
+        *blank = page_blank && (result == ESP_OK);
+    }
+    return result;
+}
+
+// Erase the page at dummy_addr for a move, unless the last move left it blank
+esp_err_t WL_Flash::eraseDummy()
+{
+    if (this->dummy_blank) {
+        this->dummy_blank = false;
+        this->stats.blank_erases++;
+        return ESP_OK;
+    }
+    return this->flash_drv->erase_range(this->dummy_addr, this->cfg.page_size);
+}
+
+// Word-wide compare to 0xFF, buff is 4 byte aligned and size a multiple of 4 as all WL buffers
+bool WL_Flash::isBlank(const void *buff, size_t size)
+{
+    const uint32_t *words = (const uint32_t *)buff;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+        if (words[i] != UINT32_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Check if the sector reads as erased, so erasing it can be skipped. The skipped erase doesn't wear
+ * the sector and isn't counted as an erase: it doesn't bring the next dummy block move closer
+ * and in advanced mode isn't tallied to the sector. Always false without blank check.
+ */
+bool WL_Flash::sectorBlank(size_t sector)
+{
+    if (!this->blank_check) {
+        return false;
+    }
+    size_t buff_size;
+    uint8_t *buff = this->getCopyBuffer(&buff_size);
+    // data mostly shows in the first bytes, only blank sectors are read as a whole
+    size_t chunk = this->cfg.temp_buff_size;
+    bool blank = true;
+    for (size_t offset = 0; blank && (offset < this->cfg.sector_size); offset += chunk) {
+        if (offset > 0) {
+            chunk = this->cfg.sector_size - offset;
+            chunk = (chunk > buff_size) ? buff_size : chunk;
+        }
+        blank = (WL_Flash::read(sector * this->cfg.sector_size + offset, buff, chunk) == ESP_OK)
+                && isBlank(buff, chunk);
+    }
+    this->putCopyBuffer(buff);
+    if (blank) {
+        this->stats.blank_erases++;
+    }
+    return blank;
+}
+
+// Rewrite the state copy at dest_addr from the valid copy at src_addr: state_data as the header,
+// followed by all valid pos records of src_addr. Records are read in large chunks and checked in RAM,
+// every run of valid records is then written back with a single write.
+esp_err_t WL_Flash::repairState(size_t src_addr, size_t dest_addr, const void *state_data, uint32_t max_pos)
+{
+    esp_err_t result = this->flash_drv->erase_range(dest_addr, this->state_size);
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->write(dest_addr, state_data, sizeof(wl_state_t));
+    WL_RESULT_CHECK(result);
+
+    size_t buff_size;
+    uint8_t *buff = this->getCopyBuffer(&buff_size);
+    // records are checked in temp_buff, so without a bigger buffer go one record at a time
+    size_t chunk_records = (buff == this->temp_buff) ? 1 : buff_size / this->cfg.wr_size;
+    for (uint32_t first = 0; (first < max_pos) && (result == ESP_OK); first += chunk_records) {
+        size_t count = max_pos - first;
+        if (count > chunk_records) {
+            count = chunk_records;
+        }
+        result = this->flash_drv->read(src_addr + sizeof(wl_state_t) + first * this->cfg.wr_size, buff, count * this->cfg.wr_size);
+        if (result != ESP_OK) {
+            break;
+        }
+        size_t run_start = 0;
+        size_t run_length = 0;
+        for (size_t i = 0; i <= count; i++) {
+            bool valid = false;
+            if (i < count) {
+                if (buff != this->temp_buff) {
+                    memcpy(this->temp_buff, &buff[i * this->cfg.wr_size], this->cfg.wr_size);
+                }
+                valid = this->OkBuffSet(first + i);
+            }
+            if (valid) {
+                if (run_length == 0) {
+                    run_start = i;
+                }
+                run_length++;
+            } else if (run_length > 0) {
+                result = this->flash_drv->write(dest_addr + sizeof(wl_state_t) + (first + run_start) * this->cfg.wr_size, &buff[run_start * this->cfg.wr_size], run_length * this->cfg.wr_size);
+                if (result != ESP_OK) {
+                    break;
+                }
+                run_length = 0;
+            }
+        }
+    }
+    this->putCopyBuffer(buff);
+    ESP_LOGD(TAG, "%s - src_addr= 0x%08x, dest_addr= 0x%08x, result= 0x%08x", __func__, (uint32_t) src_addr, (uint32_t) dest_addr, result);
+    return result;
+}
+
+// Account count erases at once, as if erase_sector() was called for each sector from start_sector.
+// access_count advances in one step, dummy block still moves once every max_count erases.
+esp_err_t WL_Flash::updateWLRange(size_t start_sector, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    while (count > 0) {
+        // number of erases up to and including the one that moves the dummy block
+        size_t until_move = 1;
+        if (this->state.access_count < this->state.max_count) {
+            until_move = this->state.max_count - this->state.access_count;
+        }
+        if (count < until_move) {
+            this->state.access_count += count;
+            break;
+        }
+        this->state.access_count = this->state.max_count - 1;
+        result = this->updateWL();
+        WL_RESULT_CHECK(result);
+        start_sector += until_move;
+        count -= until_move;
+    }
+    return result;
+}
+
+size_t WL_Flash::mapAddr(size_t addr, const wl_map_slot_t *map)
+{
+    return wl_mapping::mapAddress(wl_mapping::Identity(), this->rotation, addr, map->move_count, map->pos, NULL);
+}
+
+// Map addr and return how many of the next size bytes stay physically contiguous,
+// so read/write can pass the whole run to flash_drv in one call.
+// Mapping only changes at page boundaries, so the run is extended page by page.
+template <class Randomizer>
+size_t WL_Flash::calcExtent(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size,
+                            size_t *phys_addr, const wl_map_slot_t *map)
+{
+    size_t page_offset = addr % this->cfg.page_size;
+    *phys_addr = wl_mapping::mapAddress(randomizer, this->rotation, addr - page_offset, map->move_count, map->pos, stats) + page_offset;
+    size_t extent = this->cfg.page_size - page_offset;
+    while (extent < size) {
+        if (wl_mapping::mapAddress(randomizer, this->rotation, addr + extent, map->move_count, map->pos, stats) != *phys_addr + extent) {
+            break;
+        }
+        extent += this->cfg.page_size;
+    }
+    if (extent > size) {
+        extent = size;
+    }
+    return extent;
+}
+
 
 size_t WL_Flash::chip_size()
 {
@@ -541,10 +924,13 @@ esp_err_t WL_Flash::erase_sector(size_t sector)
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGD(TAG, "%s - sector= 0x%08x", __func__, (uint32_t) sector);
+    if (this->sectorBlank(sector)) {
+        return result;
+    }
     result = this->updateWL();
     WL_RESULT_CHECK(result);
     size_t virt_addr = this->calcAddr(sector * this->cfg.sector_size);
+    this->trace(WL_TRACE_ERASE, sector * this->cfg.sector_size, virt_addr, this->cfg.sector_size);
     result = this->flash_drv->erase_sector((this->cfg.start_addr + virt_addr) / this->cfg.sector_size);
     WL_RESULT_CHECK(result);
     return result;
@@ -555,56 +941,429 @@ esp_err_t WL_Flash::erase_range(size_t start_address, size_t size)
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGD(TAG, "%s - start_address= 0x%08x, size= 0x%08x", __func__, (uint32_t) start_address, (uint32_t) size);
     size_t erase_count = (size + this->cfg.sector_size - 1) / this->cfg.sector_size;
     size_t start_sector = start_address / this->cfg.sector_size;
-    for (size_t i = 0; i < erase_count; i++) {
-        result = this->erase_sector(start_sector + i);
-        WL_RESULT_CHECK(result);
+    if (!this->blank_check) {
+        return this->eraseSectors(start_sector, erase_count);
+    }
+    // erase the runs of sectors in between blank ones, see sectorBlank()
+    size_t run_start = start_sector;
+    for (size_t sector = start_sector; sector <= start_sector + erase_count; sector++) {
+        if ((sector < start_sector + erase_count) && !this->sectorBlank(sector)) {
+            continue;
+        }
+        if (sector > run_start) {
+            result = this->eraseSectors(run_start, sector - run_start);
+            WL_RESULT_CHECK(result);
+        }
+        run_start = sector + 1;
     }
-    ESP_LOGV(TAG, "%s - result= 0x%08x", __func__, result);
     return result;
 }
 
-esp_err_t WL_Flash::write(size_t dest_addr, const void *src, size_t size)
+esp_err_t WL_Flash::eraseSectors(size_t start_sector, size_t erase_count)
 {
     esp_err_t result = ESP_OK;
+    // Do all dummy moves of the range first, the mapping is then fixed for the whole range.
+    // The end state is the same as erasing sector by sector, but physically contiguous
+    // sectors can be erased together and flash_drv may use block erase for them.
+    result = this->updateWLRange(start_sector, erase_count);
+    WL_RESULT_CHECK(result);
+    wl_iovec_t range = {start_sector * this->cfg.sector_size, NULL, erase_count * this->cfg.sector_size};
+    return this->runExtents(WL_EXTENTS_ERASE, &range, 1, NULL, NULL);
+}
+
+esp_err_t WL_Flash::write(size_t dest_addr, const void *src, size_t size)
+{
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
-    ESP_LOGD(TAG, "%s - dest_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) dest_addr, (uint32_t) size);
-    uint32_t count = (size - 1) / this->cfg.page_size;
-    for (size_t i = 0; i < count; i++) {
-        size_t virt_addr = this->calcAddr(dest_addr + i * this->cfg.page_size);
-        result = this->flash_drv->write(this->cfg.start_addr + virt_addr, &((uint8_t *)src)[i * this->cfg.page_size], this->cfg.page_size);
+    wl_iovec_t range = {dest_addr, (void *)src, size};
+    return this->runExtents(WL_EXTENTS_WRITE, &range, 1, NULL, NULL);
+}
+
+esp_err_t WL_Flash::read(size_t src_addr, void *dest, size_t size)
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    wl_iovec_t range = {src_addr, dest, size};
+    return this->runExtents(WL_EXTENTS_READ, &range, 1, NULL, NULL);
+}
+
+esp_err_t WL_Flash::readv(const wl_iovec_t *iov, size_t count)
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return this->runExtents(WL_EXTENTS_READV, iov, count, NULL, NULL);
+}
+
+esp_err_t WL_Flash::writev(const wl_iovec_t *iov, size_t count)
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return this->runExtents(WL_EXTENTS_WRITEV, iov, count, NULL, NULL);
+}
+
+// Without a randomizer addresses are only rotated, see WL_Advanced::runExtents() for the others
+esp_err_t WL_Flash::runExtents(wl_extents_op_t op, const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch)
+{
+    return this->runMapped(wl_mapping::Identity(), NULL, op, iov, count, ptr, epoch);
+}
+
+/*
+ * Operations mapping their ranges extent by extent are instantiated for each randomizer,
+ * so mapping a page is inlined into calcExtent(). read(), write(), eraseSectors() and mmap() pass a single range.
+ */
+template <class Randomizer>
+esp_err_t WL_Flash::runMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, wl_extents_op_t op,
+                              const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch)
+{
+    switch (op) {
+    case WL_EXTENTS_READ:
+        return this->readMapped(randomizer, stats, iov->addr, iov->buf, iov->size);
+    case WL_EXTENTS_READV:
+        return this->readvMapped(randomizer, stats, iov, count);
+    case WL_EXTENTS_WRITE:
+        return this->writeMapped(randomizer, stats, iov->addr, iov->buf, iov->size);
+    case WL_EXTENTS_WRITEV:
+        return this->writevMapped(randomizer, stats, iov, count);
+    case WL_EXTENTS_ERASE:
+        return this->eraseMapped(randomizer, stats, iov->addr, iov->size);
+    case WL_EXTENTS_MMAP:
+        return this->mmapMapped(randomizer, stats, iov->addr, iov->size, ptr, epoch);
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+template <class Randomizer>
+esp_err_t WL_Flash::eraseMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    wl_map_slot_t map = {this->state.move_count, this->state.pos};
+    // with a randomizer every sector is its own extent, physically adjacent ones are merged
+    wl_iovec_t ranges[WL_IOV_BATCH];
+    size_t count = 0;
+    while (size > 0) {
+        size_t phys_addr;
+        size_t extent = this->calcExtent(randomizer, stats, addr, size, &phys_addr, &map);
+        this->trace(WL_TRACE_ERASE, addr, phys_addr, extent);
+        append(ranges, &count, this->cfg.start_addr + phys_addr, NULL, extent);
+        addr += extent;
+        size -= extent;
+        if ((count == WL_IOV_BATCH) || (size == 0)) {
+            result = this->flash_drv->erase_ranges(ranges, count);
+            WL_RESULT_CHECK(result);
+            count = 0;
+        }
+    }
+    return result;
+}
+
+template <class Randomizer>
+esp_err_t WL_Flash::writeMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t dest_addr, const void *src, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    const uint8_t *src_buff = (const uint8_t *)src;
+    wl_map_slot_t map = {this->state.move_count, this->state.pos};
+    while (size > 0) {
+        size_t phys_addr;
+        size_t extent = this->calcExtent(randomizer, stats, dest_addr, size, &phys_addr, &map);
+        this->trace(WL_TRACE_WRITE, dest_addr, phys_addr, extent);
+        result = this->flash_drv->write(this->cfg.start_addr + phys_addr, src_buff, extent);
         WL_RESULT_CHECK(result);
+        dest_addr += extent;
+        src_buff += extent;
+        size -= extent;
+    }
+    return result;
+}
+
+/*
+ * Reads don't need the instance lock, they may run while another task erases or writes.
+ * The mapping is taken from the slot published by the last dummy block move, see readMap(),
+ * and the data read with it is only kept if no page it was read from got erased meanwhile.
+ * Otherwise the read is repeated with the new mapping, which can only happen if two moves
+ * started during the read.
+ */
+template <class Randomizer>
+esp_err_t WL_Flash::readMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t src_addr, void *dest, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    while (true) {
+        wl_map_slot_t map;
+        uint32_t seq = this->readMap(&map);
+        size_t addr = src_addr;
+        size_t remaining = size;
+        uint8_t *dest_buff = (uint8_t *)dest;
+        result = ESP_OK;
+        while (remaining > 0) {
+            size_t phys_addr;
+            size_t extent = this->calcExtent(randomizer, stats, addr, remaining, &phys_addr, &map);
+            this->trace(WL_TRACE_READ, addr, phys_addr, extent, &map);
+            result = this->flash_drv->read(this->cfg.start_addr + phys_addr, dest_buff, extent);
+            if (result != ESP_OK) {
+                break;
+            }
+            addr += extent;
+            dest_buff += extent;
+            remaining -= extent;
+        }
+        if (this->mapValid(seq)) {
+            break;
+        }
+        __atomic_fetch_add(&this->stats.read_retries, 1, __ATOMIC_RELAXED);
     }
-    size_t virt_addr_last = this->calcAddr(dest_addr + count * this->cfg.page_size);
-    result = this->flash_drv->write(this->cfg.start_addr + virt_addr_last, &((uint8_t *)src)[count * this->cfg.page_size], size - count * this->cfg.page_size);
     WL_RESULT_CHECK(result);
     return result;
 }
 
-esp_err_t WL_Flash::read(size_t src_addr, void *dest, size_t size)
+/*
+ * Extents of all entries are mapped with one snapshot, merged where they continue each other in flash
+ * and in memory, and read by one flash_drv->readv() call per WL_IOV_BATCH of them. As in read(), the whole
+ * list is read again if the snapshot got invalid meanwhile.
+ */
+template <class Randomizer>
+esp_err_t WL_Flash::readvMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, const wl_iovec_t *iov, size_t count)
 {
     esp_err_t result = ESP_OK;
-    if (!this->initialized) {
-        return ESP_ERR_INVALID_STATE;
+    while (true) {
+        wl_map_slot_t map;
+        uint32_t seq = this->readMap(&map);
+        wl_iovec_t batch[WL_IOV_BATCH];
+        size_t batched = 0;
+        result = ESP_OK;
+        for (size_t i = 0; (i < count) && (result == ESP_OK); i++) {
+            size_t addr = iov[i].addr;
+            size_t remaining = iov[i].size;
+            uint8_t *dest_buff = (uint8_t *)iov[i].buf;
+            while (remaining > 0) {
+                size_t phys_addr;
+                size_t extent = this->calcExtent(randomizer, stats, addr, remaining, &phys_addr, &map);
+                this->trace(WL_TRACE_READ, addr, phys_addr, extent, &map);
+                append(batch, &batched, this->cfg.start_addr + phys_addr, dest_buff, extent);
+                addr += extent;
+                dest_buff += extent;
+                remaining -= extent;
+                if (batched == WL_IOV_BATCH) {
+                    result = this->flash_drv->readv(batch, batched);
+                    batched = 0;
+                    if (result != ESP_OK) {
+                        break;
+                    }
+                }
+            }
+        }
+        if ((result == ESP_OK) && (batched > 0)) {
+            result = this->flash_drv->readv(batch, batched);
+        }
+        if (this->mapValid(seq)) {
+            break;
+        }
+        __atomic_fetch_add(&this->stats.read_retries, 1, __ATOMIC_RELAXED);
     }
-    ESP_LOGD(TAG, "%s - src_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) src_addr, (uint32_t) size);
-    uint32_t count = (size - 1) / this->cfg.page_size;
+    WL_RESULT_CHECK(result);
+    return result;
+}
+
+template <class Randomizer>
+esp_err_t WL_Flash::writevMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = ESP_OK;
+    wl_map_slot_t map = {this->state.move_count, this->state.pos};
+    wl_iovec_t batch[WL_IOV_BATCH];
+    size_t batched = 0;
     for (size_t i = 0; i < count; i++) {
-        size_t virt_addr = this->calcAddr(src_addr + i * this->cfg.page_size);
-        ESP_LOGV(TAG, "%s - real_addr= 0x%08x, size= 0x%08x", __func__, (uint32_t) (this->cfg.start_addr + virt_addr), (uint32_t) size);
-        result = this->flash_drv->read(this->cfg.start_addr + virt_addr, &((uint8_t *)dest)[i * this->cfg.page_size], this->cfg.page_size);
+        size_t addr = iov[i].addr;
+        size_t remaining = iov[i].size;
+        uint8_t *src_buff = (uint8_t *)iov[i].buf;
+        while (remaining > 0) {
+            size_t phys_addr;
+            size_t extent = this->calcExtent(randomizer, stats, addr, remaining, &phys_addr, &map);
+            this->trace(WL_TRACE_WRITE, addr, phys_addr, extent);
+            append(batch, &batched, this->cfg.start_addr + phys_addr, src_buff, extent);
+            addr += extent;
+            src_buff += extent;
+            remaining -= extent;
+            if (batched == WL_IOV_BATCH) {
+                result = this->flash_drv->writev(batch, batched);
+                WL_RESULT_CHECK(result);
+                batched = 0;
+            }
+        }
+    }
+    if (batched > 0) {
+        result = this->flash_drv->writev(batch, batched);
         WL_RESULT_CHECK(result);
     }
-    size_t virt_addr_last = this->calcAddr(src_addr + count * this->cfg.page_size);
-    result = this->flash_drv->read(this->cfg.start_addr + virt_addr_last, &((uint8_t *)dest)[count * this->cfg.page_size], size - count * this->cfg.page_size);
-    WL_RESULT_CHECK(result);
     return result;
 }
 
+// Make state.move_count and state.pos the mapping of readers, when no move is in progress (init)
+void WL_Flash::publishMap()
+{
+    this->map_slots[0].move_count = this->state.move_count;
+    this->map_slots[0].pos = this->state.pos;
+    __atomic_store_n(&this->map_seq, 0, __ATOMIC_RELEASE);
+}
+
+// To be called before the dummy page is erased
+void WL_Flash::beginMove()
+{
+    __atomic_fetch_add(&this->map_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Publish state.move_count and state.pos to readers, also if the move failed and they didn't change.
+ * The other slot is written, the current one may be in use by readers. Does nothing if no move is in progress.
+ */
+void WL_Flash::endMove()
+{
+    uint32_t seq = this->map_seq;
+    if ((seq & 1) == 0) {
+        return;
+    }
+    wl_map_slot_t *slot = &this->map_slots[((seq + 1) >> 1) & 1];
+    // readers that see the new values also see the odd seq from beginMove()
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->move_count, this->state.move_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->pos, this->state.pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&this->map_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the current mapping for a read, returns map_seq it belongs to. Never waits for a move,
+ * only retries if the slot was rewritten while being copied.
+ */
+uint32_t WL_Flash::readMap(wl_map_slot_t *map)
+{
+    while (true) {
+        uint32_t seq = __atomic_load_n(&this->map_seq, __ATOMIC_ACQUIRE);
+        const wl_map_slot_t *slot = &this->map_slots[(seq >> 1) & 1];
+        map->move_count = __atomic_load_n(&slot->move_count, __ATOMIC_RELAXED);
+        map->pos = __atomic_load_n(&slot->pos, __ATOMIC_RELAXED);
+        if (this->mapValid(seq)) {
+            return seq;
+        }
+    }
+}
+
+/*
+ * Whether the mapping of map_seq seq still holds. It keeps pointing to valid data until the move after the one
+ * that replaced it erases its page: seen from an idle seq (even), the next move only erases the current
+ * dummy page and the one after that starts at seq + 3. If seq was taken during a move, the next one starts
+ * at seq + 2. The same is when the slot of seq is rewritten.
+ */
+bool WL_Flash::mapValid(uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t now = __atomic_load_n(&this->map_seq, __ATOMIC_RELAXED);
+    return (now - seq) <= 2 - (seq & 1);
+}
+
+/*
+ * The pointer is taken with the mapping readers use, see readMap(). Data under it is valid as long as data read
+ * with that mapping would be: the move that relocates it leaves it in place and the move after that erases it.
+ */
+esp_err_t WL_Flash::mmap(size_t addr, size_t size, const void **ptr, uint32_t *epoch)
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // without shared reads, data moves by other means than dummy block moves
+    if (!this->shared_reads()) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if ((size == 0) || (addr + size > this->chip_size())) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    wl_iovec_t range = {addr, NULL, size};
+    return this->runExtents(WL_EXTENTS_MMAP, &range, 1, ptr, epoch);
+}
+
+template <class Randomizer>
+esp_err_t WL_Flash::mmapMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size,
+                               const void **ptr, uint32_t *epoch)
+{
+    esp_err_t result = ESP_OK;
+    wl_map_slot_t map;
+    uint32_t seq = this->readMap(&map);
+    size_t phys_addr;
+    if (this->calcExtent(randomizer, stats, addr, size, &phys_addr, &map) < size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *base;
+    result = this->mapExtent(phys_addr, size, &base);
+    if (result != ESP_OK) {
+        return result;
+    }
+    *ptr = base;
+    *epoch = seq;
+    return result;
+}
+
+// instantiated here for the randomizers WL_Advanced::runExtents() chooses from
+template esp_err_t WL_Flash::runMapped(const wl_mapping::Table &randomizer, wl_mapping_stats_t *stats, wl_extents_op_t op,
+                                       const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch);
+template esp_err_t WL_Flash::runMapped(const wl_mapping::Feistel &randomizer, wl_mapping_stats_t *stats, wl_extents_op_t op,
+                                       const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch);
+template esp_err_t WL_Flash::runMapped(const wl_mapping::SwapOrNot &randomizer, wl_mapping_stats_t *stats, wl_extents_op_t op,
+                                       const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch);
+
+/*
+ * Pointer to size bytes at phys_addr in memory-mapped flash. The pages holding them are mapped by the first call
+ * that needs them and stay mapped until destruction, pointers into them may still be in use.
+ */
+esp_err_t WL_Flash::mapExtent(size_t phys_addr, size_t size, const uint8_t **ptr)
+{
+    for (uint32_t i = 0; i < this->mmap_count; i++) {
+        const wl_mmap_window_t *window = &this->mmap_windows[i];
+        if ((phys_addr >= window->addr) && (phys_addr + size <= window->addr + window->size)) {
+            *ptr = window->base + (phys_addr - window->addr);
+            return ESP_OK;
+        }
+    }
+    if (this->mmap_count == this->mmap_capacity) {
+        uint32_t capacity = (this->mmap_capacity == 0) ? 4 : 2 * this->mmap_capacity;
+        wl_mmap_window_t *windows = (wl_mmap_window_t *)realloc(this->mmap_windows, capacity * sizeof(wl_mmap_window_t));
+        if (windows == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        this->mmap_windows = windows;
+        this->mmap_capacity = capacity;
+    }
+    // pages are counted from the start of the flash the driver accesses, within the partition
+    size_t start = this->cfg.start_addr + phys_addr;
+    size_t end = start + size;
+    start -= start % WL_MMAP_PAGE_SIZE;
+    end += (WL_MMAP_PAGE_SIZE - end % WL_MMAP_PAGE_SIZE) % WL_MMAP_PAGE_SIZE;
+    if (start < this->cfg.start_addr) {
+        start = this->cfg.start_addr;
+    }
+    if (end > this->cfg.start_addr + this->cfg.full_mem_size) {
+        end = this->cfg.start_addr + this->cfg.full_mem_size;
+    }
+    wl_mmap_window_t *window = &this->mmap_windows[this->mmap_count];
+    const void *base;
+    esp_err_t result = this->flash_drv->mmap(start, end - start, &base, &window->handle);
+    if (result != ESP_OK) {
+        return result;
+    }
+    window->addr = start - this->cfg.start_addr;
+    window->size = end - start;
+    window->base = (const uint8_t *)base;
+    this->mmap_count++;
+    *ptr = window->base + (phys_addr - window->addr);
+    return ESP_OK;
+}
+
+bool WL_Flash::mmap_valid(uint32_t epoch)
+{
+    return this->mapValid(epoch);
+}
+
 Flash_Access *WL_Flash::get_drv()
 {
     return this->flash_drv;
@@ -614,11 +1373,106 @@ wl_config_t *WL_Flash::get_cfg()
     return &this->cfg;
 }
 
+esp_err_t WL_Flash::set_copy_buffer(void *buff, size_t size)
+{
+    if (!this->configured) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((buff != NULL) && ((size == 0) || (size % this->cfg.wr_size != 0) || (this->cfg.page_size % size != 0))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    this->copy_buff = (uint8_t *)buff;
+    this->copy_buff_size = (buff != NULL) ? size : 0;
+    ESP_LOGD(TAG, "%s - dummy block copy buffer %u B, %u read/write pairs per page", __func__,
+             (uint32_t) this->copy_buffer_size(), (uint32_t) (this->cfg.page_size / this->copy_buffer_size()));
+    return ESP_OK;
+}
+
+size_t WL_Flash::copy_buffer_size()
+{
+    if (this->copy_buff != NULL) {
+        return this->copy_buff_size;
+    }
+    if ((s_copy_pool != NULL) && ((this->cfg.page_size % s_copy_pool_size) == 0)) {
+        return s_copy_pool_size;
+    }
+    return this->cfg.temp_buff_size;
+}
+
+void WL_Flash::get_stats(wl_stats_t *stats)
+{
+    *stats = this->stats;
+}
+
+void WL_Flash::reset_stats()
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+}
+
+esp_err_t WL_Flash::get_trace(wl_trace_entry_t *entries, size_t max_entries, size_t *count)
+{
+    if ((entries == NULL) || (count == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *count = 0;
+#if WL_TRACE_ENTRIES > 0
+    if (this->trace_buff == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t available = this->trace_full ? WL_TRACE_ENTRIES : this->trace_head;
+    if (max_entries > available) {
+        max_entries = available;
+    }
+    // the newest max_entries entries, starting with the oldest of them
+    size_t index = (this->trace_head + WL_TRACE_ENTRIES - max_entries) % WL_TRACE_ENTRIES;
+    for (size_t i = 0; i < max_entries; i++) {
+        entries[i] = this->trace_buff[index];
+        index++;
+        if (index == WL_TRACE_ENTRIES) {
+            index = 0;
+        }
+    }
+    *count = max_entries;
+    return ESP_OK;
+#else
+    (void)max_entries;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_TRACE_ENTRIES
+}
+
+// Print the trace as hex words, one entry per line, to be decoded by wltrace.py
+esp_err_t WL_Flash::dump_trace()
+{
+#if WL_TRACE_ENTRIES > 0
+    if (this->trace_buff == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t count = this->trace_full ? WL_TRACE_ENTRIES : this->trace_head;
+    size_t index = this->trace_full ? this->trace_head : 0;
+    for (size_t i = 0; i < count; i++) {
+        const wl_trace_entry_t *entry = &this->trace_buff[index];
+        printf("WLTRACE:%08x %08x %08x %08x %08x %08x\n", entry->timestamp, entry->op_size,
+               entry->logical_addr, entry->physical_addr, entry->pos, entry->move_count);
+        index++;
+        if (index == WL_TRACE_ENTRIES) {
+            index = 0;
+        }
+    }
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_TRACE_ENTRIES
+}
+
 esp_err_t WL_Flash::flush()
 {
     esp_err_t result = ESP_OK;
     this->state.access_count = this->state.max_count - 1;
     result = this->updateWL();
+    if (result == ESP_OK) {
+        // leave both state copies written
+        result = this->finishStateCopy();
+    }
     ESP_LOGD(TAG, "%s - result= 0x%08x, move_count= 0x%08x", __func__, result, this->state.move_count);
     return result;
 }
@@ -9,6 +9,7 @@
 
 #include "esp_log.h"
 #include "esp_partition.h"
+#include "wl_iovec.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -96,6 +97,10 @@ esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void *src, size_t
 *                   beginning of the partition.
 * @param size Size of data to be read, in bytes.
 *
+* With 4096 byte sectors (WL_SECTOR_SIZE_4096) reads do not take the instance lock,
+* so they run concurrently with each other and with wl_write() and wl_erase_range()
+* instead of waiting for dummy block moves. Other modes serialize reads as before.
+*
 * @return
 *       - ESP_OK, if data was read successfully;
 *       - ESP_ERR_INVALID_ARG, if src_offset exceeds partition size;
@@ -104,6 +109,85 @@ esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void *src, size_t
 */
 esp_err_t wl_read(wl_handle_t handle, size_t src_addr, void *dest, size_t size);
 
+/**
+* @brief Read a list of extents from the WL storage
+*
+* Same as calling wl_read() for every extent in order, but the instance lock (if reads take it)
+* and the address mapping are taken once for the whole list, and extents that continue each other
+* both in flash and in memory are read by one flash call. If the dummy block moves over the list
+* meanwhile, the whole list is read again, see wl_read().
+*
+* @param handle WL module instance that was initialized before
+* @param iov Extents to read, as src_addr, dest and size of wl_read()
+* @param count Number of extents
+*
+* @return
+*       - ESP_OK, if all extents were read successfully;
+*       - ESP_ERR_INVALID_ARG, if iov is NULL;
+*       - or the error of the first extent that failed, as wl_read() would return it.
+*/
+esp_err_t wl_readv(wl_handle_t handle, const wl_iovec_t *iov, size_t count);
+
+/**
+* @brief Write a list of extents to the WL storage
+*
+* Same as calling wl_write() for every extent in order, the instance lock is taken once for the whole list
+* and extents that continue each other both in flash and in memory are written by one flash call.
+* As for wl_write(), the extents need to be erased before.
+*
+* @param handle WL handle that are related to the partition
+* @param iov Extents to write, as dest_addr, src and size of wl_write()
+* @param count Number of extents
+*
+* @return
+*       - ESP_OK, if all extents were written successfully;
+*       - ESP_ERR_INVALID_ARG, if iov is NULL;
+*       - or the error of the first extent that failed, as wl_write() would return it.
+*/
+esp_err_t wl_writev(wl_handle_t handle, const wl_iovec_t *iov, size_t count);
+
+/**
+* @brief Get a pointer to data of the WL storage in memory-mapped flash
+*
+* Reading through the pointer avoids copying, for example for serving files that rarely change.
+* The MMU pages holding the data are mapped to the data address space by the first call that needs them,
+* they stay mapped until wl_unmount().
+*
+* The range needs to be one physically contiguous extent. It is, unless it crosses the dummy block or,
+* in advanced mode, a sector boundary. Dummy block moves relocate the data, the pointer keeps pointing to
+* valid data until wl_mmap_valid() with the returned epoch says otherwise. Check it after using the data
+* and, if it is no longer valid, call wl_mmap() again and repeat. Writes and erases of the range change
+* the data under the pointer as they would for wl_read().
+*
+* @param handle WL module handle that was initialized before
+* @param src_addr Address of the data, relative to the beginning of the partition
+* @param size Size of the data, in bytes
+* @param[out] out_ptr Pointer to the data
+* @param[out] out_epoch Epoch of the pointer, for wl_mmap_valid()
+*
+* @return
+*       - ESP_OK, if the pointer was returned;
+*       - ESP_ERR_INVALID_ARG, if the range is empty or goes out of bounds of the partition, or an out argument is NULL;
+*       - ESP_ERR_INVALID_SIZE, if the range is not physically contiguous, map it in smaller parts;
+*       - ESP_ERR_NO_MEM, if there was no memory to keep track of newly mapped pages;
+*       - ESP_ERR_NOT_SUPPORTED, with 512 byte sectors (WL_SECTOR_SIZE_512) or plain partitions on flash with encryption enabled;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid;
+*       - or one of error codes of esp_partition_mmap().
+*/
+esp_err_t wl_mmap(wl_handle_t handle, size_t src_addr, size_t size, const void **out_ptr, uint32_t *out_epoch);
+
+/**
+* @brief Whether a pointer returned by wl_mmap() still points to the data it was returned for
+*
+* Does not take the instance lock. Data read through the pointer before a call returning true is valid.
+*
+* @param handle WL module handle that was initialized before
+* @param epoch Epoch returned by wl_mmap() with the pointer
+*
+* @return true if no dummy block move erased the data under the pointer, false otherwise or if the handle is not valid
+*/
+bool wl_mmap_valid(wl_handle_t handle, uint32_t epoch);
+
 /**
 * @brief Get size of the WL storage
 *
@@ -120,6 +204,283 @@ size_t wl_size(wl_handle_t handle);
 */
 size_t wl_sector_size(wl_handle_t handle);
 
+/**
+* @brief Supply a buffer for copying the dummy block of the WL instance
+*
+* By default the dummy block is copied through a buffer shared by all instances,
+* see CONFIG_WL_COPY_BUFFER_SIZE. A dedicated buffer avoids falling back to small
+* chunks when the shared one is busy or could not be allocated.
+*
+* @param handle WL module handle that was initialized before
+* @param buffer Buffer to use until unmount, or NULL to return to the shared buffer
+* @param size Size of the buffer in bytes. Must divide the WL page size, which is
+*             the flash sector size (4096) for instances mounted by wl_mount(),
+*             and be a multiple of the write size (16).
+*
+* @return
+*       - ESP_OK, if the buffer will be used for next dummy block moves;
+*       - ESP_ERR_INVALID_ARG, if size is not usable;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_set_copy_buffer(wl_handle_t handle, void *buffer, size_t size);
+
+/**
+* @brief Buckets of wl_stats_t::erase_latency, bucket i > 0 counts calls taking [2^(i-1), 2^i) us, the last one anything longer
+*/
+#define WL_STATS_LATENCY_BUCKETS    24
+
+/**
+* @brief Performance counters of a WL instance, see wl_get_stats()
+*
+* Counted since mount or the last wl_reset_stats().
+*/
+typedef struct {
+    uint32_t reads;                 /*!< wl_read() and wl_readv() calls*/
+    uint32_t writes;                /*!< wl_write() and wl_writev() calls*/
+    uint32_t erases;                /*!< wl_erase_range() calls*/
+    uint64_t read_bytes;            /*!< bytes requested by wl_read() and wl_readv()*/
+    uint64_t write_bytes;           /*!< bytes requested by wl_write() and wl_writev()*/
+    uint64_t erase_bytes;           /*!< bytes requested by wl_erase_range()*/
+    uint32_t dummy_moves;           /*!< dummy block moves, one every updaterate erased sectors*/
+    uint32_t wraps;                 /*!< dummy block passes through the whole partition, each increments move_count*/
+    uint32_t mapping_walks;         /*!< Feistel cycle walks of address mapping (advanced mode only)*/
+    uint32_t driver_calls;          /*!< flash read, write and erase calls issued to the partition*/
+    uint64_t update_time_us;        /*!< total time of dummy block moves, including the main state rewrite at wraps*/
+    uint32_t update_time_max_us;    /*!< longest dummy block move*/
+    uint64_t persist_time_us;       /*!< total time of saving erase counts at wraps (advanced mode only)*/
+    uint32_t persist_time_max_us;   /*!< longest save of erase counts*/
+    uint32_t maintenance_steps;     /*!< deferred wrap maintenance steps run by wl_maintain() and after erases*/
+    uint32_t read_retries;          /*!< wl_read() extents read again because the dummy block moved twice meanwhile*/
+    uint32_t async_requests;        /*!< requests completed by the worker of wl_read_async(), wl_write_async() and wl_erase_range_async()*/
+    uint32_t async_merged;          /*!< of them, requests done by the call of another one, see wl_erase_range_async()*/
+    uint32_t blank_erases;          /*!< sector and dummy block erases skipped as the sector was blank already (CONFIG_WL_BLANK_CHECK)*/
+    uint32_t blank_copies;          /*!< dummy block moves of a blank page, which wrote nothing*/
+    uint32_t merged_erases;         /*!< small sector erases merged into the pending rewrite of their flash sector (CONFIG_WL_MERGE_TIMEOUT_MS)*/
+    uint32_t log_collections;       /*!< flash sectors erased by garbage collection (log sector mode only)*/
+    uint32_t log_moves;             /*!< sectors copied by garbage collection to free a flash sector (log sector mode only)*/
+    uint32_t erase_latency[WL_STATS_LATENCY_BUCKETS]; /*!< histogram of wl_erase_range() duration, see WL_STATS_LATENCY_BUCKETS*/
+} wl_stats_t;
+
+/**
+* @brief Get performance counters of the WL instance
+*
+* Counters are always kept, they only cost a few additions per operation,
+* a timer read per dummy block move and two per wl_erase_range().
+*
+* @param handle WL module handle that was initialized before
+* @param[out] stats Counters since mount or the last wl_reset_stats()
+*
+* @return
+*       - ESP_OK, if stats were copied;
+*       - ESP_ERR_INVALID_ARG, if stats is NULL;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_get_stats(wl_handle_t handle, wl_stats_t *stats);
+
+/**
+* @brief Zero performance counters of the WL instance
+*
+* @param handle WL module handle that was initialized before
+*
+* @return
+*       - ESP_OK, if stats were reset;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_reset_stats(wl_handle_t handle);
+
+/**
+* @brief Run maintenance deferred from the last dummy block wrap
+*
+* When the dummy block finishes a loop through the partition, only the main state is rewritten
+* by the erase that caused it. Rewriting the state copy and erasing reserved sectors for the next
+* erase counts save are left for later, each step being at most one flash sector erase.
+* Every wl_erase_range() runs CONFIG_WL_MAINTENANCE_STEPS of them and any left are finished
+* before the next dummy block move. Calling this from an idle task takes the steps off the erases.
+*
+* Data is safe at any point, power loss before the maintenance is done only makes next mount repair the state copy.
+*
+* @param handle WL module handle that was initialized before
+* @param max_steps Maximum number of steps to run
+* @param[out] pending Number of steps left, can be NULL
+*
+* @return
+*       - ESP_OK, if steps were run or there was nothing to do;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid;
+*       - or one of error codes from lower-level flash driver.
+*/
+esp_err_t wl_maintain(wl_handle_t handle, uint32_t max_steps, uint32_t *pending);
+
+/**
+* @brief Write erases and writes held in RAM to flash
+*
+* With CONFIG_WL_MERGE_TIMEOUT_MS set, small sector erases and the writes after them are merged in RAM
+* and written to flash after the timeout. This writes them now, for example before the device sleeps.
+* Unlike wl_unmount() it doesn't move the dummy block. Requests posted by wl_write_async() and
+* wl_erase_range_async() are not waited for, see wl_async_flush().
+*
+* @param handle WL module handle that was initialized before
+*
+* @return
+*       - ESP_OK, if everything was written or there was nothing to write;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid;
+*       - or one of error codes from lower-level flash driver.
+*/
+esp_err_t wl_flush(wl_handle_t handle);
+
+/**
+* @brief Operations recorded in the WL trace, see wl_get_trace()
+*/
+typedef enum {
+    WL_TRACE_READ = 1,  /*!< read of one physically contiguous extent*/
+    WL_TRACE_WRITE,     /*!< write of one physically contiguous extent*/
+    WL_TRACE_ERASE,     /*!< erase of one physically contiguous extent*/
+    WL_TRACE_MOVE,      /*!< dummy block moved, physical is the new copy, logical the sector whose erase triggered the move if known*/
+    WL_TRACE_STATE,     /*!< state rewritten after move_count changed*/
+} wl_trace_op_t;
+
+/**
+* @brief One WL trace entry, 24 bytes
+*
+* Addresses are relative to the partition start, pos and move_count are the values the mapping used.
+*/
+typedef struct {
+    uint32_t timestamp;     /*!< CPU cycle count*/
+    uint32_t op_size;       /*!< wl_trace_op_t in bits 31..24, size in bytes in bits 23..0 (saturated)*/
+    uint32_t logical_addr;  /*!< address as seen by the user of WL, WL_TRACE_NO_ADDR if none*/
+    uint32_t physical_addr; /*!< address actually accessed*/
+    uint32_t pos;           /*!< dummy block position*/
+    uint32_t move_count;    /*!< move count*/
+} wl_trace_entry_t;
+
+#define WL_TRACE_NO_ADDR            UINT32_MAX
+#define WL_TRACE_MAX_SIZE           0x00FFFFFF
+#define WL_TRACE_OP_SIZE(op, size)  (((uint32_t)(op) << 24) | (((size) < WL_TRACE_MAX_SIZE) ? (uint32_t)(size) : WL_TRACE_MAX_SIZE))
+#define WL_TRACE_ENTRY_OP(entry)    ((wl_trace_op_t)((entry)->op_size >> 24))
+#define WL_TRACE_ENTRY_SIZE(entry)  ((entry)->op_size & WL_TRACE_MAX_SIZE)
+
+/**
+* @brief Copy the most recent entries of the WL trace, oldest first
+*
+* Every read, write and erase extent and every dummy block move of the instance is recorded
+* to a RAM ring of CONFIG_WL_TRACE_ENTRIES entries, at the cost of a few stores.
+* Copying does not clear the ring.
+*
+* @param handle WL module handle that was initialized before
+* @param entries Buffer for the entries
+* @param max_entries Size of the buffer in entries
+* @param[out] count Number of entries copied
+*
+* @return
+*       - ESP_OK, if the entries were copied;
+*       - ESP_ERR_NOT_SUPPORTED, if tracing is disabled (CONFIG_WL_TRACE_ENTRIES is 0);
+*       - ESP_ERR_INVALID_ARG, if entries or count is NULL;
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_get_trace(wl_handle_t handle, wl_trace_entry_t *entries, size_t max_entries, size_t *count);
+
+/**
+* @brief Print the WL trace to stdout for decoding on host
+*
+* Entries are printed oldest first as lines of "WLTRACE:" followed by the entry in hex,
+* decode a captured console log with wltrace.py.
+*
+* @param handle WL module handle that was initialized before
+*
+* @return
+*       - ESP_OK, if the trace was printed;
+*       - ESP_ERR_NOT_SUPPORTED, if tracing is disabled (CONFIG_WL_TRACE_ENTRIES is 0);
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_dump_trace(wl_handle_t handle);
+
+/**
+* @brief Completion callback of wl_read_async(), wl_write_async() and wl_erase_range_async()
+*
+* Called from the worker task of the handle. Further requests of the handle wait for it to return,
+* so it should be short and must not call wl_async_flush() or wl_unmount(). Posting new requests is fine.
+*
+* @param result Result of the operation, as wl_read(), wl_write() or wl_erase_range() would return it
+* @param arg Argument given with the request
+*/
+typedef void (*wl_async_cb_t)(esp_err_t result, void *arg);
+
+/**
+* @brief Erase part of the WL storage in the background
+*
+* The request is queued for a worker task of the handle, started on the first asynchronous request
+* with CONFIG_WL_ASYNC_TASK_PRIORITY. Requests of the handle complete in the order they were posted,
+* except that a read goes before queued writes and erases it does not overlap. Queued erases following
+* each other are merged: overlapping and adjacent ranges are erased by one wl_erase_range() call.
+* Synchronous calls of the same handle can be used meanwhile.
+*
+* @param handle WL handle that are related to the partition
+* @param start_addr Address where erase operation should start, as for wl_erase_range()
+* @param size Size of the range which should be erased, as for wl_erase_range()
+* @param cb Called with the result, NULL if errors only need to be logged
+* @param arg Argument for cb, see wl_async_notify() for waking up a task instead
+*
+* @return
+*       - ESP_OK, if the request was queued;
+*       - ESP_ERR_NO_MEM, if the queue is full (CONFIG_WL_ASYNC_QUEUE_LEN) or the worker can't be started;
+*       - ESP_ERR_NOT_SUPPORTED, if asynchronous requests are disabled (CONFIG_WL_ASYNC_QUEUE_LEN is 0);
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_erase_range_async(wl_handle_t handle, size_t start_addr, size_t size, wl_async_cb_t cb, void *arg);
+
+/**
+* @brief Write data to the WL storage in the background, see wl_erase_range_async()
+*
+* Writes continuing the previous queued one both in storage and in memory are done by one wl_write() call.
+*
+* @param handle WL handle that are related to the partition
+* @param dest_addr Address where the data should be written, as for wl_write()
+* @param src Source buffer, it must stay valid and unchanged until cb is called
+* @param size Size of data to be written, in bytes
+* @param cb Called with the result, NULL if errors only need to be logged
+* @param arg Argument for cb
+*
+* @return same as wl_erase_range_async()
+*/
+esp_err_t wl_write_async(wl_handle_t handle, size_t dest_addr, const void *src, size_t size, wl_async_cb_t cb, void *arg);
+
+/**
+* @brief Read data from the WL storage in the background, see wl_erase_range_async()
+*
+* Reads continuing the previous queued one both in storage and in memory are done by one wl_read() call.
+*
+* @param handle WL handle that are related to the partition
+* @param src_addr Address of the data to be read, as for wl_read()
+* @param dest Destination buffer, it must stay valid until cb is called
+* @param size Size of data to be read, in bytes
+* @param cb Called with the result, NULL if errors only need to be logged
+* @param arg Argument for cb
+*
+* @return same as wl_erase_range_async()
+*/
+esp_err_t wl_read_async(wl_handle_t handle, size_t src_addr, void *dest, size_t size, wl_async_cb_t cb, void *arg);
+
+/**
+* @brief Wait until all asynchronous requests posted to the handle so far are completed
+*
+* @param handle WL handle that are related to the partition
+*
+* @return
+*       - ESP_OK, if the requests are done or there were none;
+*       - ESP_ERR_NOT_SUPPORTED, if asynchronous requests are disabled (CONFIG_WL_ASYNC_QUEUE_LEN is 0);
+*       - ESP_ERR_NOT_FOUND, if the handle is not valid.
+*/
+esp_err_t wl_async_flush(wl_handle_t handle);
+
+/**
+* @brief Completion callback notifying a task, for wl_read_async(), wl_write_async() and wl_erase_range_async()
+*
+* Pass the TaskHandle_t to notify as arg. The task receives the result as notification value,
+* for example with xTaskNotifyWait(0, 0, &value, portMAX_DELAY).
+*
+* @param result Result of the operation
+* @param arg TaskHandle_t of the task to notify
+*/
+void wl_async_notify(esp_err_t result, void *arg);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,29 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _wl_iovec_H_
+#define _wl_iovec_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+* @brief One extent of wl_readv() and wl_writev()
+*/
+typedef struct {
+    size_t addr;    /*!< address of the extent, relative to the beginning of the partition*/
+    void *buf;      /*!< buffer the extent is read to, or written from by wl_writev()*/
+    size_t size;    /*!< size of the extent, in bytes*/
+} wl_iovec_t;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _wl_iovec_H_
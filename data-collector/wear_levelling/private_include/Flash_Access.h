@@ -7,6 +7,7 @@
 #ifndef _Flash_Access_H_
 #define _Flash_Access_H_
 #include "esp_err.h"
+#include "wl_iovec.h"
 
 /**
 * @brief Universal flash access interface class
@@ -25,12 +26,95 @@ public:
 
     virtual size_t sector_size() = 0;
 
+    /*
+     * Lists of reads, writes (buf is the source) and erases (buf is not used) with the addresses and sizes
+     * of read(), write() and erase_range(), stopping at the first error. By default they are done one by one,
+     * drivers override them to pass a whole list to flash in as few calls as they can.
+     */
+    virtual esp_err_t readv(const wl_iovec_t *iov, size_t count)
+    {
+        esp_err_t result = ESP_OK;
+        for (size_t i = 0; (i < count) && (result == ESP_OK); i++) {
+            result = this->read(iov[i].addr, iov[i].buf, iov[i].size);
+        }
+        return result;
+    };
+    virtual esp_err_t writev(const wl_iovec_t *iov, size_t count)
+    {
+        esp_err_t result = ESP_OK;
+        for (size_t i = 0; (i < count) && (result == ESP_OK); i++) {
+            result = this->write(iov[i].addr, iov[i].buf, iov[i].size);
+        }
+        return result;
+    };
+    virtual esp_err_t erase_ranges(const wl_iovec_t *ranges, size_t count)
+    {
+        esp_err_t result = ESP_OK;
+        for (size_t i = 0; (i < count) && (result == ESP_OK); i++) {
+            result = this->erase_range(ranges[i].addr, ranges[i].size);
+        }
+        return result;
+    };
+
     virtual esp_err_t flush()
     {
         return ESP_OK;
     };
 
+    // data goes through flash encryption, erased flash doesn't read back as 0xFF then
+    virtual bool encrypted()
+    {
+        return false;
+    };
+
+    /*
+     * Map size bytes at addr to the data address space for reading, *ptr stays valid until munmap(*handle).
+     * Reading through it sees the same data as read(). Drivers of flash that can't be mapped don't support it.
+     */
+    virtual esp_err_t mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    };
+    virtual void munmap(uint32_t handle) {};
+
+    // Number of read, write and erase calls passed to the flash below, see wl_get_stats(). 0 if not counted.
+    virtual uint32_t call_count()
+    {
+        return 0;
+    };
+    virtual void reset_call_count() {};
+
     virtual ~Flash_Access() {};
+
+protected:
+    // Number of entries from iov[0] on that each continue the previous one in flash and, if buffers is set,
+    // in memory, so they can be done by one call. *size gets their total size.
+    static size_t contiguous(const wl_iovec_t *iov, size_t count, bool buffers, size_t *size)
+    {
+        size_t n = 1;
+        *size = iov[0].size;
+        while ((n < count) && (iov[n].addr == iov[0].addr + *size)
+                && (!buffers || ((uint8_t *)iov[n].buf == (uint8_t *)iov[0].buf + *size))) {
+            *size += iov[n].size;
+            n++;
+        }
+        return n;
+    }
+
+    // Add an entry to list, or extend the last one if the entry continues it in flash and in memory (always for erases, buf NULL)
+    static void append(wl_iovec_t *list, size_t *count, size_t addr, void *buf, size_t size)
+    {
+        if (*count > 0) {
+            wl_iovec_t *last = &list[*count - 1];
+            if ((last->addr + last->size == addr)
+                    && ((buf == NULL) || ((uint8_t *)last->buf + last->size == (uint8_t *)buf))) {
+                last->size += size;
+                return;
+            }
+        }
+        list[*count] = {addr, buf, size};
+        (*count)++;
+    }
 };
 
 #endif // _Flash_Access_H_
@@ -31,11 +31,24 @@ public:
     virtual esp_err_t write(size_t dest_addr, const void *src, size_t size);
     virtual esp_err_t read(size_t src_addr, void *dest, size_t size);
 
+    virtual esp_err_t readv(const wl_iovec_t *iov, size_t count);
+    virtual esp_err_t writev(const wl_iovec_t *iov, size_t count);
+    virtual esp_err_t erase_ranges(const wl_iovec_t *ranges, size_t count);
+
+    virtual esp_err_t mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle);
+    virtual void munmap(uint32_t handle);
+
     virtual size_t sector_size();
+    virtual bool encrypted();
+
+    // number of esp_partition read, write and erase calls, see wl_get_stats()
+    virtual uint32_t call_count();
+    virtual void reset_call_count();
 
     virtual ~Partition();
 protected:
     const esp_partition_t *partition;
+    uint32_t calls;
 
 };
 
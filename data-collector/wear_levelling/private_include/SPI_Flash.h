@@ -25,6 +25,11 @@ public:
     esp_err_t erase_range(size_t start_address, size_t size) override;
     esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
     esp_err_t read(size_t src_addr, void *dest, size_t size) override;
+    esp_err_t readv(const wl_iovec_t *iov, size_t count) override;
+    esp_err_t writev(const wl_iovec_t *iov, size_t count) override;
+    esp_err_t erase_ranges(const wl_iovec_t *ranges, size_t count) override;
+    esp_err_t mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle) override;
+    void munmap(uint32_t handle) override;
     size_t sector_size() override;
     ~SPI_Flash() override;
 };
@@ -12,11 +12,32 @@ public:
 
     esp_err_t erase_sector(size_t sector) override;
 
-    esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
-    esp_err_t read(size_t src_addr, void *dest, size_t size) override;
-
     esp_err_t flush() override;
 
+    void getMappingStats(wl_mapping_stats_t *stats);
+
+    void get_stats(wl_stats_t *stats) override;
+    void reset_stats() override;
+
+    /*
+     * Inverse of calcAddr(): physical address relative to partition start to logical address,
+     * WL_MAPPING_NO_ADDR if it lies in the dummy page
+     */
+    size_t calcLogicalAddr(size_t addr);
+
+    /*
+     * Snapshot of the current sector mapping, see calcAddr()
+     * logical_to_physical gets flash_size / sector_size entries, physical_to_logical state.max_pos entries
+     * (indexed the same as erase counts, WL_MAPPING_NO_SECTOR for the dummy page). Either can be NULL.
+     */
+    esp_err_t getMappingSnapshot(uint32_t *logical_to_physical, uint32_t *physical_to_logical);
+
+    /*
+     * Erases since the dummy block last wrapped per logical sector, in units of updaterate erases as erase counts
+     * counts gets flash_size / sector_size entries. Erase counts saved before are only known per physical sector.
+     */
+    esp_err_t getLogicalEraseCounts(uint32_t *counts);
+
 protected:
     // buffer of 2B numbers for counting per sector erase counts
     // incremented every `updaterate` erases
@@ -30,23 +51,61 @@ protected:
     size_t addr_erase_counts1;
     size_t addr_erase_counts2;
 
-    uint8_t feistel_bit_width;
-    uint8_t feistel_msb_width;
-    uint8_t feistel_lsb_width;
+    // erase count log, see saveEraseCounts()
+    // bit per sector, set when its erase count changed since the last save
+    uint32_t *erase_count_dirty;
+    // copy holding the active log (WL_ERASE_COUNT_LOG_NONE for none/legacy format), its generation,
+    // format version and index of the first free record
+    size_t erase_count_log_addr;
+    uint32_t erase_count_log_generation;
+    uint32_t erase_count_log_version;
+    uint32_t erase_count_log_end;
+    // records after the last commit found at mount, the log can't be appended to
+    bool erase_count_log_torn;
+    // the other copy is to be erased before the next compaction, and bytes of it already erased
+    bool erase_count_spare_wanted;
+    size_t erase_count_spare_erased;
+
+    // address randomizers initialized from state by prepareMapping(), see WL_Mapping.h
+    wl_mapping::Feistel feistel;
+    wl_mapping::SwapOrNot swap_or_not;
+
+    // precomputed addressPermutation() output sector for every sector, entries NULL if not used
+    // and the scheme and keys it was built with
+    wl_mapping::Table mapping_table;
+    uint32_t mapping_table_feistel_keys;
+    uint32_t mapping_table_mapping;
+    uint32_t mapping_table_mapping_keys[WL_MAPPING_KEY_WORDS];
+
+    wl_mapping_stats_t mapping_stats;
 
     virtual esp_err_t updateEraseCounts();
     virtual esp_err_t writeEraseCounts(size_t erase_counts_addr);
     virtual esp_err_t readEraseCounts();
-    virtual size_t addressFeistelNetwork(size_t addr);
-    virtual uint32_t feistelFunction(uint32_t L, uint32_t key);
+    virtual esp_err_t saveEraseCounts();
+    esp_err_t replayEraseCountLog(size_t erase_counts_addr, uint32_t generation, uint32_t version);
+    void applyEraseCountEntry(const uint8_t *entry, uint32_t version);
+    esp_err_t writeEraseCountRecords(size_t erase_counts_addr, uint32_t index, bool dirty_only, uint32_t *written);
+    esp_err_t writeEraseCountMarker(size_t erase_counts_addr, uint32_t index, uint32_t magic, uint32_t generation, uint32_t value);
+    bool readEraseCountLogHeader(size_t erase_counts_addr, uint32_t *generation, uint32_t *version);
+    void countErase(uint32_t sector);
+    size_t eraseCountSpare();
+    uint32_t pendingSteps() override;
+    esp_err_t maintainStep() override;
+    size_t addressPermutation(size_t addr);
+    void prepareMapping();
+    void buildMappingTable();
 
     esp_err_t config(wl_config_t *cfg, Flash_Access *flash_drv);
     esp_err_t updateWL(size_t sector);
-    size_t calcAddr(size_t addr);
+    esp_err_t updateWLRange(size_t start_sector, size_t count) override;
+    size_t mapAddr(size_t addr, const wl_map_slot_t *map) override;
+    esp_err_t runExtents(wl_extents_op_t op, const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch) override;
+    size_t unmapAddr(size_t addr, uint32_t move_count, uint32_t pos);
     esp_err_t recoverPos();
     esp_err_t initSections();
     void fillOkBuff(int sector);
-    bool OkBuffSet(int pos);
+    bool OkBuffSet(int pos) override;
 
 };
 
@@ -60,8 +119,10 @@ typedef struct WL_Advanced_State_s {
     uint32_t version;       /*!< state id used to identify the version of current library implementation*/
     uint32_t device_id;     /*!< ID of current WL instance*/
     uint32_t cycle_count;   /*!< move_count zeroing counter. Used to calculate approximate memory wear, together with pos and move_count */
-    uint32_t feistel_keys;  /*!< bit-packed 8bit keys for Feistel network address randomization */
-    uint32_t reserved[5];   /*!< Reserved space for future use*/
+    uint32_t feistel_keys;  /*!< bit-packed 8bit keys for Feistel network address randomization, or swap-or-not key */
+    uint32_t mapping;       /*!< address randomization scheme, WL_MAPPING_* */
+    uint32_t mapping_keys[WL_MAPPING_KEY_WORDS]; /*!< additional swap-or-not key words, see wl_mapping::SwapOrNot */
+    uint32_t reserved[1];   /*!< Reserved space for future use*/
     uint32_t crc;           /*!< CRC of structure*/
 } wl_advanced_state_t;
 
@@ -82,3 +143,32 @@ typedef struct WL_Erase_Count_s {
     uint32_t crc;
 } wl_erase_count_t;
 
+// log header and batch commit record in the erase count log, same size as wl_erase_count_t
+// low half of magic overlaps pairs[0].sector and is 0xFFFF, which is never a valid sector number
+typedef struct WL_Erase_Count_Marker_s {
+    uint32_t magic;         /*!< WL_ERASE_COUNT_LOG_MAGIC or WL_ERASE_COUNT_COMMIT_MAGIC*/
+    uint32_t generation;    /*!< log generation, incremented with every compaction*/
+    uint32_t value;         /*!< header: log format version, commit: index of the commit record itself*/
+    uint32_t crc;           /*!< CRC of structure*/
+} wl_erase_count_marker_t;
+
+// erase count log entry holding counts of ascending sectors, followed by payload_size bytes of encoded
+// sectors and counts padded to 16 B, see WL_Advanced::writeEraseCountRecords()
+typedef struct WL_Erase_Count_Block_s {
+    uint16_t tag;           /*!< WL_ERASE_COUNT_BLOCK_TAG*/
+    uint16_t sector_count;  /*!< number of sectors in the block*/
+    uint32_t base_sector;   /*!< first sector of the block*/
+    uint16_t payload_size;  /*!< size of encoded counts in bytes, without padding*/
+    uint16_t reserved;      /*!< Reserved space for future use*/
+    uint32_t crc;           /*!< CRC of structure (without crc) and payload*/
+} wl_erase_count_block_t;
+
+#define WL_ERASE_COUNT_LOG_MAGIC                0x4C45FFFF
+#define WL_ERASE_COUNT_COMMIT_MAGIC             0x4345FFFF
+#define WL_ERASE_COUNT_LOG_VERSION_TRIPLETS     1
+#define WL_ERASE_COUNT_LOG_VERSION_BLOCKS       2
+#define WL_ERASE_COUNT_LOG_NONE                 SIZE_MAX
+#define WL_ERASE_COUNT_BLOCK_TAG                0xEC02
+// maximum size of a block including payload, multiple of 16 B
+#define WL_ERASE_COUNT_BLOCK_MAX                128
+
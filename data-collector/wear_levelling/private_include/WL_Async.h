@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef _WL_Async_H_
+#define _WL_Async_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "wear_levelling.h"
+
+typedef enum {
+    WL_ASYNC_READ,
+    WL_ASYNC_WRITE,
+    WL_ASYNC_ERASE,
+    WL_ASYNC_FLUSH,     // completes after everything posted before it, see wl_async_flush()
+    WL_ASYNC_STOP,      // same, then the worker exits
+} wl_async_op_t;
+
+typedef struct WL_Async_Request_s {
+    wl_async_op_t op;
+    size_t addr;
+    size_t size;
+    void *buff;
+    wl_async_cb_t cb;
+    void *arg;
+    bool done;          // completed, to be removed from the pending list
+} wl_async_request_t;
+
+/**
+ * @brief Worker task of a WL handle, runs requests of wl_read_async(), wl_write_async() and
+ *        wl_erase_range_async() through the synchronous API
+ *
+ * Requests are taken from the queue to a pending list. Reads not overlapping an earlier pending write
+ * or erase go first, runs of erases are merged to fewer wl_erase_range() calls and contiguous reads
+ * or writes are issued as one call. Everything else completes in the order it was posted.
+ */
+class WL_Async
+{
+public:
+    WL_Async(wl_handle_t handle);
+    ~WL_Async();
+
+    esp_err_t start(size_t queue_len, uint32_t stack_size, UBaseType_t priority);
+    // doesn't wait, ESP_ERR_NO_MEM if the queue is full
+    esp_err_t post(const wl_async_request_t *request);
+    // wait for everything posted so far
+    esp_err_t flush();
+    // flush and delete the worker, start() again to restart
+    esp_err_t stop();
+
+    uint32_t requests = 0;  // completed requests, see wl_stats_t::async_requests
+    uint32_t merged = 0;    // requests done by the call of another one, see wl_stats_t::async_merged
+
+protected:
+    wl_handle_t handle;
+    size_t sector_size;
+    size_t size;
+    QueueHandle_t queue = NULL;
+    TaskHandle_t task = NULL;
+    wl_async_request_t *pending = NULL;
+    size_t pending_count = 0;
+    size_t pending_max = 0;
+    size_t reads_ahead = 0;     // reads served ahead since the head of pending moved, bounded by pending_max
+
+    static void taskMain(void *arg);
+    esp_err_t wait(wl_async_op_t op);
+    void run();
+    void receive(bool block);
+    void range(const wl_async_request_t *request, size_t *start, size_t *end);
+    bool overlaps(const wl_async_request_t *a, const wl_async_request_t *b);
+    bool readAhead(size_t index);
+    size_t nextRead();
+    bool inRange(size_t addr, size_t size);
+    void runTransfers(size_t first, bool ahead);
+    void runErases();
+    void complete(size_t index, esp_err_t result);
+    void removeDone();
+};
+
+#endif // _WL_Async_H_
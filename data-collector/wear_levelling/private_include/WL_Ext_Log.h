@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef _WL_Ext_Log_H_
+#define _WL_Ext_Log_H_
+
+#include "WL_Flash.h"
+#include "WL_Ext_Cfg.h"
+
+// 16 bytes written once, as everything written to an encrypted partition
+typedef struct WL_Log_Record_s {
+    uint32_t magic;     // kind of the record, see WL_Ext_Log.cpp
+    uint32_t value;     // block header: erase count, tag and kill record: fat sector
+    uint32_t seq;       // block header: block, tag: sequence number, kill record: 0
+    uint32_t crc;
+} wl_log_record_t;
+
+typedef enum {
+    WL_LOG_FREE,        // erased and got its header since mount
+    WL_LOG_UNVERIFIED,  // has a header and no tags, checked to be blank before it's opened
+    WL_LOG_DIRTY,       // no valid header, erased before it's opened
+    WL_LOG_OPEN,        // slots are being appended
+    WL_LOG_USED,        // full, or holds tags from before mount
+} wl_log_block_state_t;
+
+typedef struct WL_Log_Block_s {
+    uint32_t erase_count;
+    uint8_t live;       // slots holding the current data of a fat sector
+    uint8_t state;      // wl_log_block_state_t
+} wl_log_block_t;
+
+/**
+* @brief Fat sectors written out of place to an append log of WL_Flash sectors
+*
+* Every WL_Flash sector is a block of fat sector sized slots. The first slot holds the block header,
+* a tag and a kill record for each of the other slots, which hold data. Writing a fat sector appends
+* its data to the open block, then the tag naming the fat sector and a sequence number, then the kill
+* record of the slot with the old data. Erasing a fat sector only writes the kill record.
+*
+* When the log runs out of free blocks, garbage collection moves the live slots of the block with
+* the fewest of them to the open block and erases it. One free block is kept for that.
+* After a power loss each fat sector holds either the old or the new data, see init().
+*/
+class WL_Ext_Log : public WL_Flash
+{
+public:
+    WL_Ext_Log();
+    ~WL_Ext_Log() override;
+
+    esp_err_t config(WL_Config_s *cfg, Flash_Access *flash_drv) override;
+    esp_err_t init() override;
+
+    size_t chip_size() override;
+    size_t sector_size() override;
+
+    esp_err_t erase_sector(size_t sector) override;
+    esp_err_t erase_range(size_t start_address, size_t size) override;
+
+    esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
+    esp_err_t read(size_t src_addr, void *dest, size_t size) override;
+    esp_err_t readv(const wl_iovec_t *iov, size_t count) override;
+    // writes of single sectors can't be combined, the log appends them one by one
+    esp_err_t writev(const wl_iovec_t *iov, size_t count) override
+    {
+        return Flash_Access::writev(iov, count);
+    }
+
+    // every write changes the map
+    bool shared_reads() override
+    {
+        return false;
+    }
+
+protected:
+    uint32_t flash_sector_size;
+    uint32_t fat_sector_size;
+    uint32_t slots;             // data slots per block
+    uint32_t blocks_count;
+    uint32_t sectors_count;     // fat sectors offered, see chip_size()
+    uint32_t meta_size;         // header, tags and kill records at the start of a block
+    uint16_t *map = NULL;       // fat sector to block * slots + slot, WL_LOG_UNMAPPED if erased
+    wl_log_block_t *blocks = NULL;
+    uint32_t free_blocks = 0;   // FREE, UNVERIFIED or DIRTY
+    uint32_t open_block;        // WL_LOG_NO_BLOCK if none is open
+    uint32_t open_fill = 0;     // slots used in the open block
+    uint32_t seq = 0;           // sequence number of the next tag
+    uint8_t *meta_buffer = NULL;
+    uint32_t *sector_buffer = NULL;
+
+    size_t slotAddr(uint32_t slot);
+    size_t tagAddr(uint32_t slot);
+    size_t killAddr(uint32_t slot);
+    esp_err_t writeRecord(size_t addr, uint32_t magic, uint32_t value, uint32_t seq);
+    static bool recordValid(const wl_log_record_t *record, uint32_t magic);
+
+    esp_err_t scanBlock(uint32_t block, uint32_t *last_block);
+    esp_err_t recoverOpen(uint32_t block);
+    esp_err_t eraseBlock(uint32_t block);
+    esp_err_t openBlock();
+    esp_err_t nextSlot(uint32_t *slot, bool collecting);
+    esp_err_t prepareSlot();
+    esp_err_t collect();
+    esp_err_t kill(uint32_t slot, uint32_t sector);
+    esp_err_t writeSector(uint32_t sector, size_t offset, const uint8_t *src, size_t size);
+};
+
+#endif // _WL_Ext_Log_H_
@@ -25,13 +25,42 @@ public:
     esp_err_t erase_sector(size_t sector) override;
     esp_err_t erase_range(size_t start_address, size_t size) override;
 
+    esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
+    esp_err_t read(size_t src_addr, void *dest, size_t size) override;
+    esp_err_t writev(const wl_iovec_t *iov, size_t count) override;
+    esp_err_t readv(const wl_iovec_t *iov, size_t count) override;
+
+    esp_err_t flush() override;
+    esp_err_t sync() override;
+
+    // erasing a small sector rewrites the whole flash sector around it, readers have to wait for that
+    bool shared_reads() override
+    {
+        return false;
+    }
+
 protected:
     uint32_t flash_sector_size;
     uint32_t fat_sector_size;
     uint32_t size_factor;
     uint32_t *sector_buffer;
+    // flash sector held in sector_buffer with erases and writes merged into it, see mergeErase()
+    uint32_t merge_base;
+    int64_t merge_time;
+    int64_t merge_timeout = 0;  // in us, 0 if erases aren't merged
 
     virtual esp_err_t erase_sector_fit(uint32_t start_sector, uint32_t count);
+    virtual esp_err_t rewriteSector(uint32_t local_addr_base, uint32_t mask);
+    esp_err_t readSector(uint32_t local_addr_base, bool *blank);
+    uint32_t keptMask(uint32_t erase_start, uint32_t count);
+    esp_err_t writeBack(uint32_t local_addr_base, uint32_t mask);
+
+    esp_err_t mergeErase(uint32_t local_addr_base, uint32_t erase_start, uint32_t count);
+    esp_err_t flushMerge();
+    bool mergeExpired();
+    bool mergeOverlaps(const wl_iovec_t *iov, size_t count);
+    uint32_t pendingSteps() override;
+    esp_err_t maintainStep() override;
 
 };
 
@@ -10,6 +10,14 @@
 #include "WL_Ext_Cfg.h"
 #include "WL_Ext_Perf.h"
 
+/**
+* @brief Small sector erases which keep the rest of the flash sector over power loss
+*
+* The fat sectors kept by an erase are saved to the next free slots of the dump sector, then a begin
+* record is appended to the journal in the state sector, the flash sector is erased and written back
+* and a commit record is appended. Dump and state sector are erased only when they are full.
+* A begin record without a commit record is replayed at mount, see recover().
+*/
 class WL_Ext_Safe : public WL_Ext_Perf
 {
 public:
@@ -22,13 +30,17 @@ public:
     size_t chip_size() override;
 
 protected:
-    esp_err_t erase_sector_fit(uint32_t start_sector, uint32_t count) override;
+    esp_err_t rewriteSector(uint32_t local_addr_base, uint32_t mask) override;
 
     // Dump Sector
     uint32_t dump_addr; // dump buffer address
     uint32_t state_addr;// sectore where state of transaction will be stored
+    uint32_t journal_pos;   // offset of the next record in the state sector
+    uint32_t dump_pos;      // next free fat sector slot of the dump sector
 
     esp_err_t recover();
+    esp_err_t appendRecord(uint32_t magic, uint32_t local_addr_base, uint32_t saved);
+    esp_err_t dumpSaved(uint32_t slot, uint32_t mask, bool restore);
 };
 
 #endif // _WL_Ext_Safe_H_
@@ -7,9 +7,36 @@
 #define _WL_Flash_H_
 
 #include "esp_err.h"
+#include "wear_levelling.h"
 #include "Flash_Access.h"
 #include "WL_Config.h"
 #include "WL_State.h"
+#include "WL_Mapping.h"
+#include "WL_Trace.h"
+
+// values the address mapping depends on, see WL_Flash::readMap()
+typedef struct WL_Map_Slot_s {
+    uint32_t move_count;
+    uint32_t pos;
+} wl_map_slot_t;
+
+// operations mapping their address ranges extent by extent, see WL_Flash::runExtents()
+typedef enum {
+    WL_EXTENTS_READ,
+    WL_EXTENTS_READV,
+    WL_EXTENTS_WRITE,
+    WL_EXTENTS_WRITEV,
+    WL_EXTENTS_ERASE,
+    WL_EXTENTS_MMAP,
+} wl_extents_op_t;
+
+// pages of the partition mapped by one flash_drv->mmap() call, see WL_Flash::mapExtent()
+typedef struct WL_Mmap_Window_s {
+    size_t addr;            // physical address of the first page, relative to start_addr
+    size_t size;
+    const uint8_t *base;    // where the first page is mapped to
+    uint32_t handle;
+} wl_mmap_window_t;
 
 /**
 * @brief This class is used to make wear levelling for flash devices. Class implements Flash_Access interface
@@ -33,12 +60,53 @@ public :
 
     esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
     esp_err_t read(size_t src_addr, void *dest, size_t size) override;
+    esp_err_t readv(const wl_iovec_t *iov, size_t count) override;
+    esp_err_t writev(const wl_iovec_t *iov, size_t count) override;
 
     esp_err_t flush() override;
 
     Flash_Access *get_drv();
     wl_config_t *get_cfg();
 
+    esp_err_t set_copy_buffer(void *buff, size_t size);
+    size_t copy_buffer_size();
+
+    esp_err_t get_trace(wl_trace_entry_t *entries, size_t max_entries, size_t *count);
+    esp_err_t dump_trace();
+
+    // counters kept by WL itself, wl_get_stats() adds operation and driver call counts
+    virtual void get_stats(wl_stats_t *stats);
+    virtual void reset_stats();
+
+    /*
+     * Run up to max_steps steps of maintenance deferred from the last dummy block wrap,
+     * every step is at most one sector erase or one write. pending (can be NULL) gets the steps left.
+     */
+    esp_err_t maintain(uint32_t max_steps, uint32_t *pending);
+    // write erases and writes held in RAM to flash, unlike flush() without moving the dummy block
+    virtual esp_err_t sync()
+    {
+        return ESP_OK;
+    }
+    // read() can run concurrently with other operations, otherwise everything needs the instance lock
+    virtual bool shared_reads()
+    {
+        return true;
+    }
+
+    /*
+     * Pointer to size bytes at addr in memory-mapped flash, if they are one physically contiguous extent.
+     * The data stays there while mmap_valid(*epoch) holds. Only the pages holding it are mapped, see mapExtent().
+     */
+    esp_err_t mmap(size_t addr, size_t size, const void **ptr, uint32_t *epoch);
+    bool mmap_valid(uint32_t epoch);
+
+    // dummy block moves counted in stats, lets the caller tell if an operation moved the block
+    uint32_t dummy_moves()
+    {
+        return this->stats.dummy_moves;
+    }
+
 protected:
     bool configured = false;
     bool initialized = false;
@@ -53,21 +121,147 @@ protected:
     size_t index_state2;
 
     size_t flash_size;
+    // moves addresses by state.move_count and skips the dummy page, see calcAddr()
+    wl_mapping::Rotation rotation;
     uint32_t state_size;
     uint32_t cfg_size;
     uint8_t *temp_buff = NULL;
+    uint8_t *copy_buff = NULL;
+    size_t copy_buff_size = 0;
+    bool copy_pool_user = false;
     size_t dummy_addr;
     uint32_t pos_data[4];
+    // CONFIG_WL_BLANK_CHECK on a partition without encryption, see sectorBlank()
+    bool blank_check = false;
+    // the page at state.pos is erased, the last move copied a blank page from it
+    bool dummy_blank = false;
+
+    wl_stats_t stats = {};
+
+    // state copy to be rewritten after a wrap, see saveWrapState(): its header and how much of it is erased
+    wl_state_t state_copy;
+    bool state_copy_pending = false;
+    uint32_t state_copy_erased = 0;
+
+    /*
+     * Mapping published to read(), which doesn't take the instance lock: state.move_count and state.pos
+     * are copied to one of two slots and map_seq is incremented when a dummy block move starts
+     * and again when it ends, so it is odd while a move is in progress.
+     * The current slot is map_slots[(map_seq >> 1) & 1], see beginMove() and readMap().
+     */
+    wl_map_slot_t map_slots[2] = {};
+    uint32_t map_seq = 0;
+
+    // page ranges mapped by flash_drv->mmap() as mmap() needs them, until destruction
+    wl_mmap_window_t *mmap_windows = NULL;
+    uint32_t mmap_count = 0;
+    uint32_t mmap_capacity = 0;
+
+    // ring of WL_TRACE_ENTRIES trace entries, NULL if tracing is disabled or the ring could not be allocated
+    wl_trace_entry_t *trace_buff = NULL;
+    uint32_t trace_head = 0;
+    bool trace_full = false;
+
+    /*
+     * Record an event to the trace ring, meant for hot paths instead of ESP_LOGV: a few stores, no formatting.
+     * Compiled out with WL_TRACE_ENTRIES 0.
+     * Readers without the instance lock record too (see read()), so the slot is claimed atomically.
+     */
+    inline void trace(wl_trace_op_t op, size_t logical_addr, size_t physical_addr, size_t size, const wl_map_slot_t *map)
+    {
+#if WL_TRACE_ENTRIES > 0
+        if (this->trace_buff == NULL) {
+            return;
+        }
+        uint32_t head = __atomic_load_n(&this->trace_head, __ATOMIC_RELAXED);
+        uint32_t next;
+        do {
+            next = (head + 1 == WL_TRACE_ENTRIES) ? 0 : head + 1;
+        } while (!__atomic_compare_exchange_n(&this->trace_head, &head, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (next == 0) {
+            __atomic_store_n(&this->trace_full, true, __ATOMIC_RELAXED);
+        }
+        wl_trace_entry_t *entry = &this->trace_buff[head];
+        entry->timestamp = wl_trace_timestamp();
+        entry->op_size = WL_TRACE_OP_SIZE(op, size);
+        entry->logical_addr = logical_addr;
+        entry->physical_addr = physical_addr;
+        entry->pos = map->pos;
+        entry->move_count = map->move_count;
+#else
+        (void)op;
+        (void)logical_addr;
+        (void)physical_addr;
+        (void)size;
+        (void)map;
+#endif // WL_TRACE_ENTRIES
+    }
+
+    inline void trace(wl_trace_op_t op, size_t logical_addr, size_t physical_addr, size_t size)
+    {
+        wl_map_slot_t map = {this->state.move_count, this->state.pos};
+        this->trace(op, logical_addr, physical_addr, size, &map);
+    }
+
+    void publishMap();
+    void beginMove();
+    void endMove();
+    uint32_t readMap(wl_map_slot_t *map);
+    bool mapValid(uint32_t seq);
 
     esp_err_t initSections();
     esp_err_t updateWL();
+    esp_err_t saveWrapState();
+    esp_err_t finishStateCopy();
+    virtual uint32_t pendingSteps();
+    virtual esp_err_t maintainStep();
+    static void addTime(uint64_t *total, uint32_t *max, int64_t start);
+    esp_err_t copyPage(size_t src_addr, size_t dest_addr, bool *blank);
+    esp_err_t eraseDummy();
+    static bool isBlank(const void *buff, size_t size);
+    bool sectorBlank(size_t sector);
+    esp_err_t eraseSectors(size_t start_sector, size_t erase_count);
+    esp_err_t repairState(size_t src_addr, size_t dest_addr, const void *state_data, uint32_t max_pos);
+    uint8_t *getCopyBuffer(size_t *size);
+    void putCopyBuffer(uint8_t *buff);
+    virtual esp_err_t updateWLRange(size_t start_sector, size_t count);
     esp_err_t recoverPos();
-    size_t calcAddr(size_t addr);
+    size_t calcAddr(size_t addr)
+    {
+        wl_map_slot_t map = {this->state.move_count, this->state.pos};
+        return this->mapAddr(addr, &map);
+    }
+    virtual size_t mapAddr(size_t addr, const wl_map_slot_t *map);
+    /*
+     * Run op on the ranges in iov with the randomizer in use, chosen once per call, see runMapped().
+     * ptr and epoch are only used by mmap().
+     */
+    virtual esp_err_t runExtents(wl_extents_op_t op, const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch);
+    template <class Randomizer>
+    esp_err_t runMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, wl_extents_op_t op,
+                        const wl_iovec_t *iov, size_t count, const void **ptr, uint32_t *epoch);
+    template <class Randomizer>
+    esp_err_t readMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t src_addr, void *dest, size_t size);
+    template <class Randomizer>
+    esp_err_t readvMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, const wl_iovec_t *iov, size_t count);
+    template <class Randomizer>
+    esp_err_t writeMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t dest_addr, const void *src, size_t size);
+    template <class Randomizer>
+    esp_err_t writevMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, const wl_iovec_t *iov, size_t count);
+    template <class Randomizer>
+    esp_err_t eraseMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size);
+    template <class Randomizer>
+    esp_err_t mmapMapped(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size,
+                         const void **ptr, uint32_t *epoch);
+    template <class Randomizer>
+    size_t calcExtent(const Randomizer &randomizer, wl_mapping_stats_t *stats, size_t addr, size_t size,
+                      size_t *phys_addr, const wl_map_slot_t *map);
+    esp_err_t mapExtent(size_t phys_addr, size_t size, const uint8_t **ptr);
 
     esp_err_t updateVersion();
     esp_err_t updateV1_V2();
     void fillOkBuff(int n);
-    bool OkBuffSet(int n);
+    virtual bool OkBuffSet(int n);
 };
 
 #endif // _WL_Flash_H_
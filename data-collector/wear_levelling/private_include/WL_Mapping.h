@@ -0,0 +1,422 @@
+/*
+ * SPDX-FileCopyrightText: 2015-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef _WL_Mapping_H_
+#define _WL_Mapping_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Address mapping engine shared by WL_Flash, WL_Advanced, WLmon and wl-sim
+ *
+ * A mapping is composed at compile time from two policies, see wl_mapping::mapAddress():
+ *  - randomizer: permutes sector addresses 1:1 over the data area (Identity, Table, Feistel, SwapOrNot)
+ *  - rotator: moves the randomized address by move_count and skips the dummy page at pos (Rotation)
+ * Policies are plain structs initialized once from config and state, their map() is inline,
+ * so each combination is specialized and there is no virtual call or runtime division per step.
+ * unmap() of each policy is the inverse of its map(), see wl_mapping::unmapAddress().
+ *
+ * Kept free of ESP-IDF dependencies and logging, so the simulator can use it as is.
+ */
+
+// address randomization schemes, saved in wl_advanced_state_t.mapping
+#define WL_MAPPING_FEISTEL      0   /*!< 3 stage Feistel network with cycle walking, partitions created before swap-or-not*/
+#define WL_MAPPING_SWAP_OR_NOT  1   /*!< swap-or-not shuffle, fixed number of rounds*/
+
+// part of the on-flash format, changing it remaps sectors of existing partitions
+#define WL_SWAP_OR_NOT_ROUNDS   6
+
+// number of swap-or-not key words in wl_advanced_state_t besides feistel_keys
+#define WL_MAPPING_KEY_WORDS    3
+
+// physical address with no logical address mapped to it (the dummy page), see wl_mapping::unmapAddress()
+#define WL_MAPPING_NO_ADDR      SIZE_MAX
+// the same for sector numbers in mapping snapshots
+#define WL_MAPPING_NO_SECTOR    UINT32_MAX
+
+typedef struct WL_Mapping_Stats_s {
+    uint32_t mapping;       /*!< address randomization scheme in use, WL_MAPPING_* */
+    uint32_t calls;         /*!< number of computed mappings (not counting table lookups)*/
+    uint32_t walks;         /*!< total number of Feistel cycle walks*/
+    uint32_t max_walk;      /*!< longest cycle walk of a single mapping*/
+} wl_mapping_stats_t;
+
+namespace wl_mapping {
+
+/*
+ * Conversion between byte addresses and indexes of sectors or pages,
+ * shifting instead of dividing when the size is a power of 2 (it always is for SPI flash)
+ */
+struct Unit {
+    size_t size;
+    uint8_t shift;          // UNIT_NO_SHIFT if size is not a power of 2
+
+    static const uint8_t UNIT_NO_SHIFT = 0xFF;
+
+    void init(size_t unit_size)
+    {
+        this->size = unit_size;
+        this->shift = UNIT_NO_SHIFT;
+        for (uint8_t i = 0; i < sizeof(size_t) * 8; i++) {
+            if (((size_t)1 << i) == unit_size) {
+                this->shift = i;
+            }
+        }
+    }
+
+    inline uint32_t index(size_t addr) const
+    {
+        return (this->shift != UNIT_NO_SHIFT) ? (uint32_t)(addr >> this->shift) : (uint32_t)(addr / this->size);
+    }
+
+    inline size_t addr(uint32_t index) const
+    {
+        return (this->shift != UNIT_NO_SHIFT) ? ((size_t)index << this->shift) : ((size_t)index * this->size);
+    }
+};
+
+/*
+ * Randomizer without randomization, WL_Flash
+ */
+struct Identity {
+    inline size_t map(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        (void)stats;
+        return addr;
+    }
+
+    inline size_t unmap(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        (void)stats;
+        return addr;
+    }
+};
+
+/*
+ * Randomizer looking up precomputed output sector of another randomizer, see WL_Advanced::buildMappingTable()
+ * Forward only, unmap with the randomizer the table was built from.
+ */
+struct Table {
+    Unit sector;
+    uint16_t *entries;      // output sector for every sector, NULL if not used
+
+    inline size_t map(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        (void)stats;
+        return this->sector.addr(this->entries[this->sector.index(addr)]);
+    }
+};
+
+/*
+ * Readers map addresses concurrently (see WL_Flash::read()), but this is on every access, so the counters
+ * are plain relaxed loads and stores instead of atomic read-modify-writes. An increment racing with another
+ * one may get lost, which is fine for statistics.
+ */
+static inline void countMapping(wl_mapping_stats_t *stats, uint32_t walks)
+{
+    __atomic_store_n(&stats->calls, __atomic_load_n(&stats->calls, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    if (walks == 0) {
+        return;
+    }
+    __atomic_store_n(&stats->walks, __atomic_load_n(&stats->walks, __ATOMIC_RELAXED) + walks, __ATOMIC_RELAXED);
+    if (walks > __atomic_load_n(&stats->max_walk, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&stats->max_walk, walks, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Randomized 1-to-1 mapping of sector addresses using unbalanced 3-stage Feistel network
+ *
+ * Given address A which we can split into two parts, msb and lsb (can differ in lengths => unbalanced)
+ * and randomly generated key for each stage, we can perform the following:
+ *
+ *                    stage 1           stage 2             stage 3
+ *           msb -------|------\   /------|-------\   /-------|------> final msb
+ *          /          \/      | s |     \/       | s |      \/                 \
+ *   input /      F(msb, key1) | w | F(msb, key2) | w | F(msb, key3)             \ randomized
+ * address \           |       | a |      |       | a |      |                   / address
+ *          \         \/       | p |     \/       | p |     \/                  /
+ *           lsb --->(XOR)--->/    \--->(XOR)--->/    \--->(XOR)-----> final lsb
+ *
+ * 1. Split the address to msb and lsb
+ * 2. msb remains intact => msb stage output
+ * 3. Do F(msb, <key for given stage>)
+ * 4. XOR the output of F with lsb => lsb stage output
+ * 5. swap lsb <-> msb
+ * 6. Assemble address stage output from lsb and msb
+ * 7. Repeat steps 1-6 for stage 2 and 3
+ * 8. Final address stage output is the randomized address
+ *
+ * Keys are 8 bit, so sector addresses can have at most 16 bits, see init().
+ *
+ * The inverse runs the stages in reverse order: msb is intact in the stage output, so F(msb, key)
+ * can be computed again and XORed with lsb to get the stage input back.
+ */
+struct Feistel {
+    Unit sector;
+    uint32_t sector_count;
+    uint8_t keys[3];
+    uint8_t bit_width;      // log2(sector_count), rounded up
+    uint8_t msb_width;
+    uint8_t lsb_width;
+    uint32_t lsb_mask;
+    uint32_t msb_mask;
+    uint32_t walk_limit;
+
+    // keys are bit-packed 8bit keys of the 3 stages, lowest byte first
+    void init(uint32_t packed_keys, uint32_t sector_count, size_t sector_size)
+    {
+        this->sector.init(sector_size);
+        this->sector_count = sector_count;
+        for (uint8_t i = 0; i < 3; i++) {
+            this->keys[i] = (uint8_t)(packed_keys >> (8 * i));
+        }
+        for (this->bit_width = 0; sector_count; this->bit_width++) {
+            sector_count >>= 1;
+        }
+        /*
+         * split bit width to | msb | lsb |
+         * if bit width not even, make lsb 1 longer (e.g. | 3 bits | 4bits |)
+         */
+        this->lsb_width = (this->bit_width + 1) / 2;
+        this->msb_width = this->bit_width - this->lsb_width;
+        this->lsb_mask = ~((~(uint32_t)0) << this->lsb_width);
+        this->msb_mask = ~((~(uint32_t)0) << this->msb_width);
+        /*
+         * Feistel can generate addresses using full bit_width, so 0 to 2^bit_width - 1,
+         * but addresses from sector_count up are not valid outputs of mapping.
+         * If that happens, we need to "cycle walk" => do another round of 3-stage Feistel
+         * with the invalid randomized sector address we got as new input.
+         *
+         * Every stage is a bijection on bit_width bits, so is the whole network. Walking from a valid input,
+         * the walk can't return to an already visited output before reaching a valid one, so it passes through
+         * every invalid address at most once => at most 2^bit_width - sector_count walks.
+         * The same holds for the inverse network walking back from a valid output.
+         */
+        this->walk_limit = (this->bit_width < 32) ? (1u << this->bit_width) - this->sector_count : 0;
+    }
+
+    // F performed in every stage over msb and key for that stage: squaring of xor of inputs
+    static inline uint32_t function(uint32_t msb, uint32_t key)
+    {
+        return (msb ^ key) * (msb ^ key);
+    }
+
+    inline size_t map(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        uint32_t sector_addr = this->sector.index(addr);
+        uint32_t walks = 0;
+
+        while (true) {
+            for (uint8_t i = 0; i < 3; i++) {
+                uint32_t msb = sector_addr >> this->lsb_width;
+                uint32_t lsb = sector_addr & this->lsb_mask;
+                // msb stays intact, lsb is XORed with F() masked to |lsb|, then they are swapped
+                lsb ^= function(msb, this->keys[i]) & this->lsb_mask;
+                sector_addr = (lsb << this->msb_width) | msb;
+            }
+            if (sector_addr < this->sector_count) {
+                break;
+            }
+            if (walks >= this->walk_limit) {
+                // can't happen for a bijection, see init()
+                sector_addr = this->sector.index(addr);
+                break;
+            }
+            walks++;
+        }
+
+        countMapping(stats, walks);
+        return this->sector.addr(sector_addr);
+    }
+
+    inline size_t unmap(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        uint32_t sector_addr = this->sector.index(addr);
+        uint32_t walks = 0;
+
+        while (true) {
+            for (uint8_t i = 3; i > 0; i--) {
+                // stage output is | lsb ^ F(msb) | msb |, undo the swap and the XOR
+                uint32_t msb = sector_addr & this->msb_mask;
+                uint32_t lsb = sector_addr >> this->msb_width;
+                lsb ^= function(msb, this->keys[i - 1]) & this->lsb_mask;
+                sector_addr = (msb << this->lsb_width) | lsb;
+            }
+            if (sector_addr < this->sector_count) {
+                break;
+            }
+            if (walks >= this->walk_limit) {
+                sector_addr = this->sector.index(addr);
+                break;
+            }
+            walks++;
+        }
+
+        countMapping(stats, walks);
+        return this->sector.addr(sector_addr);
+    }
+};
+
+// murmur3 32 bit finalizer
+static inline uint32_t mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+/*
+ * Randomized 1-to-1 mapping of sectors over exactly [0, sector_count) using swap-or-not shuffle
+ *
+ * Every round r derives a key K_r from feistel_keys and mapping_keys and pairs sector x with its partner
+ * x' = (K_r - x) mod sector_count. The pair is swapped or not, decided by the top bit of (K_r ^ max(x, x'))
+ * multiplied by an odd constant. As both members of a pair get the same decision, every round is a bijection
+ * (an involution in fact), and so is the whole shuffle. Output is always in the domain, so no cycle walk is needed:
+ * each mapping takes exactly WL_SWAP_OR_NOT_ROUNDS rounds. Works on full 32 bit sector numbers.
+ * Being involutions, the rounds are inverted by running them in reverse order.
+ */
+struct SwapOrNot {
+    Unit sector;
+    uint32_t sector_count;
+    // round keys and their remainders modulo sector_count
+    uint32_t round_keys[WL_SWAP_OR_NOT_ROUNDS];
+    uint32_t offsets[WL_SWAP_OR_NOT_ROUNDS];
+
+    /*
+     * Round keys mix feistel_keys with one of mapping_keys in turn (none every WL_MAPPING_KEY_WORDS + 1 rounds),
+     * so the whole key is 128 bits wide.
+     */
+    void init(uint32_t feistel_keys, const uint32_t *mapping_keys, uint32_t sector_count, size_t sector_size)
+    {
+        this->sector.init(sector_size);
+        this->sector_count = sector_count;
+        for (uint32_t round = 0; round < WL_SWAP_OR_NOT_ROUNDS; round++) {
+            uint32_t key = feistel_keys;
+            if (round % (WL_MAPPING_KEY_WORDS + 1) != 0) {
+                key ^= mapping_keys[round % (WL_MAPPING_KEY_WORDS + 1) - 1];
+            }
+            this->round_keys[round] = mix32(key ^ ((round + 1) * 0x9E3779B9));
+            this->offsets[round] = this->round_keys[round] % sector_count;
+        }
+    }
+
+    // one round, its own inverse
+    inline uint32_t step(uint32_t sector_addr, uint32_t round) const
+    {
+        // (K_r - x) mod sector_count, with K_r mod sector_count precomputed and x < sector_count
+        uint32_t offset = this->offsets[round];
+        uint32_t partner = (sector_addr <= offset) ? offset - sector_addr : offset + (this->sector_count - sector_addr);
+        uint32_t high = (sector_addr > partner) ? sector_addr : partner;
+        if (((this->round_keys[round] ^ high) * 0x9E3779B1) >> 31) {
+            return partner;
+        }
+        return sector_addr;
+    }
+
+    inline size_t map(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        uint32_t sector_addr = this->sector.index(addr);
+
+        for (uint32_t round = 0; round < WL_SWAP_OR_NOT_ROUNDS; round++) {
+            sector_addr = this->step(sector_addr, round);
+        }
+
+        countMapping(stats, 0);
+        return this->sector.addr(sector_addr);
+    }
+
+    inline size_t unmap(size_t addr, wl_mapping_stats_t *stats) const
+    {
+        uint32_t sector_addr = this->sector.index(addr);
+
+        for (uint32_t round = WL_SWAP_OR_NOT_ROUNDS; round > 0; round--) {
+            sector_addr = this->step(sector_addr, round - 1);
+        }
+
+        countMapping(stats, 0);
+        return this->sector.addr(sector_addr);
+    }
+};
+
+/*
+ * Rotator of the base wear levelling: data area is moved back by one page every move_count
+ * and the dummy page at pos is skipped over.
+ * addr wraps modulo flash_size, move_count has to be below flash_size / page_size, as kept by updateWL().
+ */
+struct Rotation {
+    Unit page;
+    size_t flash_size;
+
+    void init(size_t flash_size, size_t page_size)
+    {
+        this->page.init(page_size);
+        this->flash_size = flash_size;
+    }
+
+    inline size_t map(size_t addr, uint32_t move_count, uint32_t pos) const
+    {
+        // (flash_size - move_count * page_size + addr) % flash_size
+        // addresses past flash_size wrap around as they always did, the subtraction below only covers one pass
+        if (addr >= this->flash_size) {
+            addr %= this->flash_size;
+        }
+        size_t back = this->page.addr(move_count);
+        size_t result = (addr >= back) ? addr - back : addr + (this->flash_size - back);
+        // shift by one page past the dummy
+        if (result >= this->page.addr(pos)) {
+            result += this->page.size;
+        }
+        return result;
+    }
+
+    // physical address relative to partition start back to the randomized address, WL_MAPPING_NO_ADDR for the dummy page
+    inline size_t unmap(size_t addr, uint32_t move_count, uint32_t pos) const
+    {
+        size_t dummy = this->page.addr(pos);
+        if (addr >= dummy) {
+            if (addr < dummy + this->page.size) {
+                return WL_MAPPING_NO_ADDR;
+            }
+            addr -= this->page.size;
+        }
+        // (addr + move_count * page_size) % flash_size
+        size_t back = this->page.addr(move_count);
+        return (addr < this->flash_size - back) ? addr + back : addr - (this->flash_size - back);
+    }
+};
+
+/*
+ * Logical address to physical address (relative to partition start)
+ */
+template <typename Randomizer, typename Rotator>
+inline size_t mapAddress(const Randomizer &randomizer, const Rotator &rotator, size_t addr,
+                         uint32_t move_count, uint32_t pos, wl_mapping_stats_t *stats)
+{
+    return rotator.map(randomizer.map(addr, stats), move_count, pos);
+}
+
+/*
+ * Physical address (relative to partition start) to logical address, inverse of mapAddress()
+ * WL_MAPPING_NO_ADDR if addr lies in the dummy page
+ */
+template <typename Randomizer, typename Rotator>
+inline size_t unmapAddress(const Randomizer &randomizer, const Rotator &rotator, size_t addr,
+                           uint32_t move_count, uint32_t pos, wl_mapping_stats_t *stats)
+{
+    size_t randomized = rotator.unmap(addr, move_count, pos);
+    if (randomized == WL_MAPPING_NO_ADDR) {
+        return WL_MAPPING_NO_ADDR;
+    }
+    return randomizer.unmap(randomized, stats);
+}
+
+} // namespace wl_mapping
+
+#endif // _WL_Mapping_H_
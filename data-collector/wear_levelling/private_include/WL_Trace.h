@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wear_levelling.h"
+
+// Number of entries in the trace ring of every instance, 0 compiles tracing out, see WL_Flash::trace()
+#ifndef WL_TRACE_ENTRIES
+#ifdef CONFIG_WL_TRACE_ENTRIES
+#define WL_TRACE_ENTRIES CONFIG_WL_TRACE_ENTRIES
+#else
+#define WL_TRACE_ENTRIES 0
+#endif // CONFIG_WL_TRACE_ENTRIES
+#endif // WL_TRACE_ENTRIES
+
+#if WL_TRACE_ENTRIES > 0
+#if defined(__XTENSA__) || defined(__riscv)
+#include "esp_cpu.h"
+
+static inline uint32_t wl_trace_timestamp()
+{
+    return (uint32_t)esp_cpu_get_cycle_count();
+}
+#else
+// host build of the tests has no cycle counter, microseconds do
+#include "esp_timer.h"
+
+static inline uint32_t wl_trace_timestamp()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+#endif // __XTENSA__ || __riscv
+#endif // WL_TRACE_ENTRIES
+
+#ifndef _MSC_VER
+static_assert(sizeof(wl_trace_entry_t) == 24, "wl_trace_entry_t is decoded by wltrace.py, keep its layout");
+#endif // _MSC_VER
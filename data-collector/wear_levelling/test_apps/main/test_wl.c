@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include <string.h>
+#include <stdlib.h>
 #include "unity.h"
 #include "unity_fixture.h"
 #include "wear_levelling.h"
@@ -51,6 +52,13 @@ TEST(wear_levelling, wl_unmount_doesnt_leak_memory)
     TEST_ASSERT_EQUAL(size_before, size_after);
 }
 
+#if CONFIG_WL_SECTOR_MODE_LOG
+// log mode keeps two flash sectors free for garbage collection
+#define TEST_MIN_PARTITION_SECTORS  7
+#else
+#define TEST_MIN_PARTITION_SECTORS  5
+#endif
+
 TEST(wear_levelling, wl_mount_checks_partition_params)
 {
     const esp_partition_t *test_partition = get_test_data_partition();
@@ -62,7 +70,7 @@ TEST(wear_levelling, wl_mount_checks_partition_params)
 
     esp_partition_erase_range(test_partition, 0, test_partition->size);
     // test small partition: result should be error
-    for (int i = 0; i < 5; i++) {
+    for (int i = 0; i < TEST_MIN_PARTITION_SECTORS; i++) {
         fake_partition.size = SPI_FLASH_SEC_SIZE * (i);
         size_before = xPortGetFreeHeapSize();
         TEST_ESP_ERR(ESP_ERR_INVALID_ARG, wl_mount(&fake_partition, &handle));
@@ -72,7 +80,7 @@ TEST(wear_levelling, wl_mount_checks_partition_params)
     }
 
     // test minimum size partition: result should be OK
-    fake_partition.size = SPI_FLASH_SEC_SIZE * 5;
+    fake_partition.size = SPI_FLASH_SEC_SIZE * TEST_MIN_PARTITION_SECTORS;
     size_before = xPortGetFreeHeapSize();
     TEST_ESP_OK(wl_mount(&fake_partition, &handle));
     wl_unmount(handle);
@@ -266,6 +274,457 @@ TEST(wear_levelling, write_doesnt_touch_other_sectors)
 }
 
 
+// Mount latency against partition size, with the dummy block moved all the way through the partition.
+// Every unmount flushes and moves the dummy block by one, so the recovered position grows with each mount.
+// Position recovery searches the pos records, so 8 times the sectors has to take well below 8 times as long.
+#define TEST_MOUNT_MIN_SECTORS  16
+#define TEST_MOUNT_MAX_SECTORS  128
+TEST(wear_levelling, mount_time_vs_partition_size)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+#if !CONFIG_WL_SECTOR_MODE_LOG
+    uint32_t min_sectors_avg_us = 0;
+#endif
+
+    for (int sectors = TEST_MOUNT_MIN_SECTORS; sectors <= TEST_MOUNT_MAX_SECTORS; sectors *= 2) {
+        fake_partition.size = SPI_FLASH_SEC_SIZE * sectors;
+        TEST_ASSERT_TRUE(fake_partition.size <= partition->size);
+        esp_partition_erase_range(&fake_partition, 0, fake_partition.size);
+
+        wl_handle_t handle;
+        TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+        wl_unmount(handle);
+
+        uint32_t max_us = 0;
+        uint32_t sum_us = 0;
+        for (int m = 0; m < sectors; m++) {
+            uint32_t start = esp_cpu_get_cycle_count();
+            TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+            uint32_t end = esp_cpu_get_cycle_count();
+            wl_unmount(handle);
+            uint32_t us = (end - start) / (esp_clk_cpu_freq() / 1000000);
+            sum_us += us;
+            if (us > max_us) {
+                max_us = us;
+            }
+        }
+        printf("partition %3i sectors: mount avg= %ius, max= %ius\n", sectors, sum_us / sectors, max_us);
+#if !CONFIG_WL_SECTOR_MODE_LOG
+        // log mode mounts by scanning the headers of all its blocks, which takes time linear in the partition size
+        if (sectors == TEST_MOUNT_MIN_SECTORS) {
+            min_sectors_avg_us = sum_us / sectors;
+        }
+        if (sectors == TEST_MOUNT_MAX_SECTORS) {
+            TEST_ASSERT_LESS_THAN(4 * min_sectors_avg_us, sum_us / sectors);
+        }
+#endif
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Erase latency while the dummy block loops through the whole partition a few times.
+// The erase which finishes a loop also saves the erase counts (advanced mode) and rewrites the main state,
+// the rest of the loop maintenance is done in steps by the following erases, or between them by wl_maintain()
+// in the idle pass. The worst case shows the loop cost and the median shows the cost of an ordinary erase.
+// The loop adds a few sector erases to the erase that finishes it (main state, dummy block, erase count log
+// compaction in advanced mode), but no scan of the partition, so the worst case stays within a small factor.
+#define TEST_LATENCY_SECTORS    16
+#define TEST_LATENCY_ERASES     (TEST_LATENCY_SECTORS * 16 * 3)
+#define TEST_LATENCY_MAX_FACTOR 5
+static void measure_erase_latency(wl_handle_t handle, uint32_t *latency_us, bool idle)
+{
+    size_t sectors = wl_size(handle) / SPI_FLASH_SEC_SIZE;
+    TEST_ESP_OK(wl_reset_stats(handle));
+    for (int m = 0; m < TEST_LATENCY_ERASES; m++) {
+        size_t addr = (m % sectors) * SPI_FLASH_SEC_SIZE;
+        uint32_t start = esp_cpu_get_cycle_count();
+        TEST_ESP_OK(wl_erase_range(handle, addr, SPI_FLASH_SEC_SIZE));
+        uint32_t end = esp_cpu_get_cycle_count();
+        latency_us[m] = (end - start) / (esp_clk_cpu_freq() / 1000000);
+        if (idle) {
+            TEST_ESP_OK(wl_maintain(handle, UINT32_MAX, NULL));
+        }
+    }
+
+    qsort(latency_us, TEST_LATENCY_ERASES, sizeof(uint32_t), compare_u32);
+    printf("%s: %i erases: median= %ius, p99= %ius, p99.9= %ius, max= %ius\n", idle ? "idle maintenance" : "maintenance on erase",
+           TEST_LATENCY_ERASES,
+           latency_us[TEST_LATENCY_ERASES / 2],
+           latency_us[TEST_LATENCY_ERASES * 99 / 100],
+           latency_us[TEST_LATENCY_ERASES * 999 / 1000],
+           latency_us[TEST_LATENCY_ERASES - 1]);
+#if !CONFIG_WL_BLANK_CHECK && !(CONFIG_WL_MERGE_TIMEOUT_MS > 0) && !CONFIG_WL_SECTOR_MODE_LOG
+    // otherwise most of the erases don't reach flash, and the median is no sector erase
+    // (log mode only writes a kill record, flash sectors are erased by garbage collection)
+    TEST_ASSERT_LESS_OR_EQUAL(TEST_LATENCY_MAX_FACTOR * latency_us[TEST_LATENCY_ERASES / 2], latency_us[TEST_LATENCY_ERASES - 1]);
+#endif
+
+    wl_stats_t stats;
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL(TEST_LATENCY_ERASES, stats.erases);
+    printf("erase latency histogram:");
+    for (int i = 0; i < WL_STATS_LATENCY_BUCKETS; i++) {
+        if (stats.erase_latency[i] != 0) {
+            printf(" <%ius: %u", 1 << i, stats.erase_latency[i]);
+        }
+    }
+    printf(", maintenance steps: %u\n", stats.maintenance_steps);
+}
+
+TEST(wear_levelling, erase_latency_over_dummy_wrap)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+
+    fake_partition.size = SPI_FLASH_SEC_SIZE * TEST_LATENCY_SECTORS;
+    esp_partition_erase_range(&fake_partition, 0, fake_partition.size);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+
+    uint32_t *latency_us = (uint32_t *)malloc(TEST_LATENCY_ERASES * sizeof(uint32_t));
+    TEST_ASSERT_NOT_NULL(latency_us);
+    measure_erase_latency(handle, latency_us, false);
+    measure_erase_latency(handle, latency_us, true);
+    free(latency_us);
+
+    // nothing left after idle maintenance
+    uint32_t pending;
+    TEST_ESP_OK(wl_maintain(handle, 0, &pending));
+    TEST_ASSERT_EQUAL(0, pending);
+    wl_unmount(handle);
+}
+
+// Lists are read and written as entry by entry, adjacent sectors read to one buffer take no more driver calls than one wl_read()
+TEST(wear_levelling, vectored_io)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    // advanced mode keeps fewer sectors for data
+    int sectors = wl_size(handle) / sector_size;
+    if (sectors > TEST_SECTORS_COUNT) {
+        sectors = TEST_SECTORS_COUNT;
+    }
+    size_t size = sector_size * sectors;
+    TEST_ESP_OK(wl_erase_range(handle, 0, size));
+
+    uint8_t *data = (uint8_t *)malloc(size);
+    uint8_t *read = (uint8_t *)malloc(size);
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_NOT_NULL(read);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    // sectors backwards, the first one in two pieces
+    wl_iovec_t iov[TEST_SECTORS_COUNT + 1];
+    for (int m = 0; m < sectors - 1; m++) {
+        size_t addr = (sectors - 1 - m) * sector_size;
+        iov[m] = (wl_iovec_t) {addr, data + addr, sector_size};
+    }
+    iov[sectors - 1] = (wl_iovec_t) {0, data, 100};
+    iov[sectors] = (wl_iovec_t) {100, data + 100, sector_size - 100};
+    TEST_ESP_OK(wl_writev(handle, iov, sectors + 1));
+
+    memset(read, 0, size);
+    for (int m = 0; m < sectors + 1; m++) {
+        iov[m].buf = read + iov[m].addr;
+    }
+    TEST_ESP_OK(wl_readv(handle, iov, sectors + 1));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, read, size);
+
+    wl_stats_t stats;
+    TEST_ESP_OK(wl_reset_stats(handle));
+    TEST_ESP_OK(wl_read(handle, 0, read, size));
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    uint32_t read_calls = stats.driver_calls;
+
+    memset(read, 0, size);
+    for (int m = 0; m < sectors; m++) {
+        iov[m] = (wl_iovec_t) {m * sector_size, read + m * sector_size, sector_size};
+    }
+    TEST_ESP_OK(wl_reset_stats(handle));
+    TEST_ESP_OK(wl_readv(handle, iov, sectors));
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, read, size);
+    TEST_ASSERT_EQUAL(1, stats.reads);
+    TEST_ASSERT_LESS_OR_EQUAL(read_calls, stats.driver_calls);
+
+    free(data);
+    free(read);
+    wl_unmount(handle);
+}
+
+#if CONFIG_WL_BLANK_CHECK && CONFIG_WL_SECTOR_SIZE_4096
+// Erasing blank sectors again is skipped and doesn't count towards dummy block moves
+TEST(wear_levelling, blank_erase_skipped)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    TEST_ESP_OK(wl_erase_range(handle, 0, sector_size * TEST_SECTORS_COUNT));
+    TEST_ESP_OK(wl_reset_stats(handle));
+
+    wl_stats_t stats;
+    for (int m = 0; m < 100; m++) {
+        TEST_ESP_OK(wl_erase_range(handle, 0, sector_size * TEST_SECTORS_COUNT));
+    }
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL(100 * TEST_SECTORS_COUNT, stats.blank_erases);
+    TEST_ASSERT_EQUAL(0, stats.dummy_moves);
+
+    uint32_t data = 0x12345678;
+    TEST_ESP_OK(wl_write(handle, sector_size, &data, sizeof(data)));
+    TEST_ESP_OK(wl_erase_range(handle, 0, sector_size * 2));
+    TEST_ESP_OK(wl_read(handle, sector_size, &data, sizeof(data)));
+    TEST_ASSERT_EQUAL_HEX32(UINT32_MAX, data);
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL(100 * TEST_SECTORS_COUNT + 1, stats.blank_erases);
+
+    wl_unmount(handle);
+}
+#endif // CONFIG_WL_BLANK_CHECK && CONFIG_WL_SECTOR_SIZE_4096
+
+#if CONFIG_WL_MERGE_TIMEOUT_MS > 0
+// FAT rewriting the sectors of one flash sector one by one rewrites the flash sector once, data is kept by unmount
+TEST(wear_levelling, merged_erases)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    size_t sectors = SPI_FLASH_SEC_SIZE / sector_size;
+    // none of the erases is skipped as blank
+    uint32_t zero = 0;
+    for (uint32_t m = 0; m < sectors; m++) {
+        TEST_ESP_OK(wl_write(handle, m * sector_size, &zero, sizeof(zero)));
+    }
+    TEST_ESP_OK(wl_reset_stats(handle));
+
+    for (uint32_t m = 0; m < sectors; m++) {
+        TEST_ESP_OK(wl_erase_range(handle, m * sector_size, sector_size));
+        TEST_ESP_OK(wl_write(handle, m * sector_size, &m, sizeof(m)));
+    }
+    wl_stats_t stats;
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL(sectors - 1, stats.merged_erases);
+    wl_unmount(handle);
+
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    for (uint32_t m = 0; m < sectors; m++) {
+        uint32_t data;
+        TEST_ESP_OK(wl_read(handle, m * sector_size, &data, sizeof(data)));
+        TEST_ASSERT_EQUAL(m, data);
+    }
+    wl_unmount(handle);
+}
+#endif // CONFIG_WL_MERGE_TIMEOUT_MS > 0
+
+#if CONFIG_WL_SECTOR_MODE_LOG
+// Rewriting one sector as FAT does (erase, then write) appends it to the log, flash sectors are only
+// erased by garbage collection. The last data is read back after remount.
+#define TEST_LOG_REWRITES   200
+
+TEST(wear_levelling, log_rewrites_erase_few_sectors)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+    esp_partition_erase_range(&fake_partition, 0, fake_partition.size);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    TEST_ESP_OK(wl_reset_stats(handle));
+
+    uint32_t data;
+    for (uint32_t m = 0; m < TEST_LOG_REWRITES; m++) {
+        TEST_ESP_OK(wl_erase_range(handle, sector_size, sector_size));
+        TEST_ESP_OK(wl_write(handle, sector_size, &m, sizeof(m)));
+    }
+    wl_stats_t stats;
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    printf("%i rewrites: %u flash sectors collected, %u sectors moved\n", TEST_LOG_REWRITES, stats.log_collections, stats.log_moves);
+    // a flash sector holds 7 sectors, every collection frees a whole flash sector of dead ones
+    TEST_ASSERT_LESS_OR_EQUAL(TEST_LOG_REWRITES * sector_size / (SPI_FLASH_SEC_SIZE - sector_size), stats.log_collections);
+    TEST_ASSERT_EQUAL(0, stats.log_moves);
+    wl_unmount(handle);
+
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    TEST_ESP_OK(wl_read(handle, sector_size, &data, sizeof(data)));
+    TEST_ASSERT_EQUAL(TEST_LOG_REWRITES - 1, data);
+    TEST_ESP_OK(wl_read(handle, 0, &data, sizeof(data)));
+    TEST_ASSERT_EQUAL_HEX32(UINT32_MAX, data);
+    wl_unmount(handle);
+}
+#endif // CONFIG_WL_SECTOR_MODE_LOG
+
+#if CONFIG_WL_ASYNC_QUEUE_LEN > 0
+// A logging loop posts every sample to the worker instead of waiting for flash.
+// Erases of a sector range are posted one by one and overlapping, the worker merges them,
+// samples are written from one buffer in pieces, which are merged to fewer writes as well.
+#define TEST_ASYNC_SECTORS  4
+#define TEST_ASYNC_PIECE    256
+
+static void count_completion(esp_err_t result, void *arg)
+{
+    TEST_ESP_OK(result);
+    (*(volatile uint32_t *)arg)++;
+}
+
+TEST(wear_levelling, async_requests)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    size_t size = sector_size * TEST_ASYNC_SECTORS;
+    uint8_t *data = (uint8_t *)malloc(size);
+    uint8_t *read = (uint8_t *)malloc(size);
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_NOT_NULL(read);
+    for (int i = 0; i < size; i++) {
+        data[i] = (uint8_t)rand();
+    }
+    TEST_ESP_OK(wl_reset_stats(handle));
+
+    volatile uint32_t completed = 0;
+    uint32_t posted = 0;
+    uint32_t max_post_us = 0;
+    for (int m = 0; m < TEST_ASYNC_SECTORS; m++) {
+        TEST_ESP_OK(wl_erase_range_async(handle, m * sector_size, sector_size, count_completion, (void *)&completed));
+        posted++;
+    }
+    TEST_ESP_OK(wl_erase_range_async(handle, sector_size, sector_size * 2, count_completion, (void *)&completed));
+    posted++;
+    for (int m = 0; m < size / TEST_ASYNC_PIECE; m++) {
+        uint32_t start = esp_cpu_get_cycle_count();
+        esp_err_t result = wl_write_async(handle, m * TEST_ASYNC_PIECE, data + m * TEST_ASYNC_PIECE, TEST_ASYNC_PIECE,
+                                          count_completion, (void *)&completed);
+        uint32_t us = (esp_cpu_get_cycle_count() - start) / (esp_clk_cpu_freq() / 1000000);
+        if (result == ESP_ERR_NO_MEM) {
+            // queue full, the logging loop would keep the sample for later
+            TEST_ESP_OK(wl_async_flush(handle));
+            m--;
+            continue;
+        }
+        TEST_ESP_OK(result);
+        posted++;
+        max_post_us = (us > max_post_us) ? us : max_post_us;
+    }
+
+    // read back with a notification instead of a callback
+    TEST_ESP_OK(wl_read_async(handle, 0, read, size, wl_async_notify, xTaskGetCurrentTaskHandle()));
+    uint32_t value;
+    TEST_ASSERT_EQUAL(pdTRUE, xTaskNotifyWait(0, 0, &value, portMAX_DELAY));
+    TEST_ESP_OK((esp_err_t)value);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, read, size);
+    TEST_ESP_OK(wl_async_flush(handle));
+    TEST_ASSERT_EQUAL(posted, completed);
+
+    wl_stats_t stats;
+    TEST_ESP_OK(wl_get_stats(handle, &stats));
+    printf("async: %u requests, %u merged, %u erase and %u write calls, longest post %uus\n",
+           stats.async_requests, stats.async_merged, stats.erases, stats.writes, max_post_us);
+    TEST_ASSERT_EQUAL(posted + 1, stats.async_requests);
+    TEST_ASSERT_TRUE(stats.async_merged > 0);
+    TEST_ASSERT_TRUE(stats.erases < TEST_ASYNC_SECTORS + 1);
+
+    free(data);
+    free(read);
+    // unmount completes anything still queued
+    TEST_ESP_OK(wl_erase_range_async(handle, 0, sector_size, NULL, NULL));
+    wl_unmount(handle);
+}
+#endif // CONFIG_WL_ASYNC_QUEUE_LEN > 0
+
+#if CONFIG_WL_SECTOR_SIZE_4096
+static void fill_mmap_sector(uint32_t *words, size_t sector_size, uint32_t sector)
+{
+    for (size_t i = 0; i < sector_size / sizeof(uint32_t); i++) {
+        words[i] = sector << 16 | i;
+    }
+}
+
+// Data under wl_mmap() pointers is the data of the sector as long as wl_mmap_valid() says so
+TEST(wear_levelling, mmap_reads)
+{
+    const esp_partition_t *partition = get_test_data_partition();
+    esp_partition_t fake_partition;
+    memcpy(&fake_partition, partition, sizeof(fake_partition));
+    fake_partition.size = SPI_FLASH_SEC_SIZE * (4 + TEST_SECTORS_COUNT);
+
+    wl_handle_t handle;
+    TEST_ESP_OK(wl_mount(&fake_partition, &handle));
+    size_t sector_size = wl_sector_size(handle);
+    // advanced mode keeps fewer sectors for data
+    uint32_t sectors = wl_size(handle) / sector_size;
+    if (sectors > TEST_SECTORS_COUNT) {
+        sectors = TEST_SECTORS_COUNT;
+    }
+    uint32_t *expected = (uint32_t *)malloc(sector_size);
+    uint32_t *read = (uint32_t *)malloc(sector_size);
+    TEST_ASSERT_NOT_NULL(expected);
+    TEST_ASSERT_NOT_NULL(read);
+    for (uint32_t m = 0; m < sectors; m++) {
+        fill_mmap_sector(expected, sector_size, m);
+        TEST_ESP_OK(wl_erase_range(handle, m * sector_size, sector_size));
+        TEST_ESP_OK(wl_write(handle, m * sector_size, expected, sector_size));
+    }
+
+    // the first half is read through pointers while the second half is rewritten, moving the dummy block
+    for (uint32_t k = 0; k < 400; k++) {
+        uint32_t sector = k % (sectors / 2);
+        const void *ptr;
+        uint32_t epoch;
+        TEST_ESP_OK(wl_mmap(handle, sector * sector_size, sector_size, &ptr, &epoch));
+        memcpy(read, ptr, sector_size);
+        uint32_t other = sectors / 2 + sector;
+        fill_mmap_sector(expected, sector_size, other);
+        TEST_ESP_OK(wl_erase_range(handle, other * sector_size, sector_size));
+        TEST_ESP_OK(wl_write(handle, other * sector_size, expected, sector_size));
+        if (!wl_mmap_valid(handle, epoch)) {
+            continue;
+        }
+        fill_mmap_sector(expected, sector_size, sector);
+        TEST_ASSERT_EQUAL_HEX32_ARRAY(expected, read, sector_size / sizeof(uint32_t));
+        TEST_ASSERT_EQUAL_HEX32_ARRAY(expected, ptr, sector_size / sizeof(uint32_t));
+    }
+    free(expected);
+    free(read);
+    wl_unmount(handle);
+}
+#endif // CONFIG_WL_SECTOR_SIZE_4096
+
 #if CONFIG_WL_SECTOR_SIZE_4096
 // This test runs for 4k sector size only, since the original (version 1) partition binary is generated this way
 extern const uint8_t test_partition_v1_bin_start[] asm("_binary_test_partition_v1_bin_start");
@@ -324,8 +783,24 @@ TEST_GROUP_RUNNER(wear_levelling)
     RUN_TEST_CASE(wear_levelling, wl_mount_checks_partition_params)
     RUN_TEST_CASE(wear_levelling, multiple_tasks_single_handle)
     RUN_TEST_CASE(wear_levelling, write_doesnt_touch_other_sectors)
+    RUN_TEST_CASE(wear_levelling, mount_time_vs_partition_size)
+    RUN_TEST_CASE(wear_levelling, erase_latency_over_dummy_wrap)
+    RUN_TEST_CASE(wear_levelling, vectored_io)
+#if CONFIG_WL_BLANK_CHECK && CONFIG_WL_SECTOR_SIZE_4096
+    RUN_TEST_CASE(wear_levelling, blank_erase_skipped)
+#endif
+#if CONFIG_WL_MERGE_TIMEOUT_MS > 0
+    RUN_TEST_CASE(wear_levelling, merged_erases)
+#endif
+#if CONFIG_WL_SECTOR_MODE_LOG
+    RUN_TEST_CASE(wear_levelling, log_rewrites_erase_few_sectors)
+#endif
+#if CONFIG_WL_ASYNC_QUEUE_LEN > 0
+    RUN_TEST_CASE(wear_levelling, async_requests)
+#endif
 
 #if CONFIG_WL_SECTOR_SIZE_4096
+    RUN_TEST_CASE(wear_levelling, mmap_reads)
     RUN_TEST_CASE(wear_levelling, version_update)
 #endif
 }
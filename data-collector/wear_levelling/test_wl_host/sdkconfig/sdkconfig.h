@@ -6,6 +6,8 @@
 #pragma once
 #define CONFIG_IDF_TARGET_ESP32 1
 #define CONFIG_WL_SECTOR_SIZE 4096
+#define CONFIG_WL_TRACE_ENTRIES 16
+#define CONFIG_WL_MAPPING_TABLE_MAX_SECTORS 1024
 #define CONFIG_LOG_DEFAULT_LEVEL 3
 #define CONFIG_PARTITION_TABLE_OFFSET 0x8000
 #define CONFIG_ESPTOOLPY_FLASHSIZE "8MB"
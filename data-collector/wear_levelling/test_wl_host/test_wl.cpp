@@ -6,12 +6,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "spi_flash_mmap.h"
 #include "esp_partition.h"
 #include "wear_levelling.h"
 #include "WL_Flash.h"
+#include "WL_Advanced.h"
+#include "WL_Ext_Cfg.h"
+#include "WL_Ext_Perf.h"
+#include "WL_Ext_Safe.h"
 #include "SpiFlash.h"
+#include "crc32.h"
 
 #include "catch.hpp"
 
@@ -21,6 +34,281 @@ extern "C" void _spi_flash_init(const char* chip_size, size_t block_size, size_t
 extern SpiFlash spiflash;
 
 #define TEST_COUNT_MAX 100
+#define WL_CFG_CRC_CONST UINT32_MAX
+// safe mode records, as WL_Ext_Safe.cpp writes them
+#define WL_EXT_SAFE_OK 0x12345678
+#define WL_EXT_SAFE_BEGIN 0x4e474257
+#define WL_EXT_SAFE_COMMIT 0x4d4d4357
+
+// Flash kept in a memory-mapped temporary file, mmap() points into the file mapping
+class File_Flash : public Flash_Access
+{
+public:
+    File_Flash(size_t size) : size(size)
+    {
+        char path[] = "/tmp/wl_flash_XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd >= 0);
+        unlink(path);
+        REQUIRE(ftruncate(fd, size) == 0);
+        this->mem = (uint8_t *)::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        REQUIRE(this->mem != MAP_FAILED);
+        close(fd);
+        memset(this->mem, 0xff, size);
+    }
+    ~File_Flash() override
+    {
+        ::munmap(this->mem, this->size);
+    }
+    size_t chip_size() override
+    {
+        return this->size;
+    }
+    size_t sector_size() override
+    {
+        return SPI_FLASH_SEC_SIZE;
+    }
+    esp_err_t erase_sector(size_t sector) override
+    {
+        return this->erase_range(sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    }
+    esp_err_t erase_range(size_t start_address, size_t size) override
+    {
+        size_t done = this->power(start_address, size, true);
+        memset(this->mem + start_address, 0xff, done);
+        return (done == size) ? ESP_OK : ESP_FAIL;
+    }
+    esp_err_t write(size_t dest_addr, const void *src, size_t size) override
+    {
+        size_t done = this->power(dest_addr, size, false);
+        for (size_t i = 0; i < done; i++) {
+            this->mem[dest_addr + i] &= ((const uint8_t *)src)[i];
+        }
+        return (done == size) ? ESP_OK : ESP_FAIL;
+    }
+    esp_err_t read(size_t src_addr, void *dest, size_t size) override
+    {
+        this->reads++;
+        memcpy(dest, this->mem + src_addr, size);
+        return ESP_OK;
+    }
+    esp_err_t mmap(size_t addr, size_t size, const void **ptr, uint32_t *handle) override
+    {
+        *ptr = this->mem + addr;
+        *handle = this->mapped;
+        this->mapped++;
+        this->mapped_bytes += size;
+        return ESP_OK;
+    }
+    void munmap(uint32_t handle) override
+    {
+        REQUIRE(handle < this->mapped);
+        this->unmapped++;
+    }
+    uint32_t reads = 0;
+    // mmap() and munmap() calls and the size of all mappings
+    uint32_t mapped = 0;
+    uint32_t unmapped = 0;
+    size_t mapped_bytes = 0;
+
+    /*
+     * Lose power at the n-th write or erase from now on, counting from 1. That operation only gets halfway,
+     * the ones after it fail without touching flash. With 0 power is back and stays on.
+     */
+    void cut_after(uint32_t n)
+    {
+        this->countdown = n;
+        this->powered = true;
+    }
+    // the operation power was lost at
+    bool cut_erase = false;
+    size_t cut_addr = 0;
+    size_t cut_size = 0;
+
+private:
+    size_t size;
+    uint8_t *mem;
+    uint32_t countdown = 0;
+    bool powered = true;
+
+    // bytes of an operation that reach flash
+    size_t power(size_t addr, size_t size, bool erase)
+    {
+        if (!this->powered) {
+            return 0;
+        }
+        if ((this->countdown == 0) || (--this->countdown > 0)) {
+            return size;
+        }
+        this->powered = false;
+        this->cut_erase = erase;
+        this->cut_addr = addr;
+        this->cut_size = size;
+        return size / 2;
+    }
+};
+
+// config() and init() as wl_mount() calls them, through the WL_Flash interface
+static esp_err_t test_mount(WL_Flash *wl, wl_ext_cfg_t *cfg, Flash_Access *flash)
+{
+    esp_err_t result = wl->config(cfg, flash);
+    if (result != ESP_OK) {
+        return result;
+    }
+    return wl->init();
+}
+
+// exposes what tests need to tell which flash operation a power cut hit
+template <class WL>
+class Test_WL : public WL
+{
+public:
+    size_t state1_addr()
+    {
+        return this->addr_state1;
+    }
+};
+
+// erase count log of WL_Advanced, saved and loaded directly instead of at dummy block wraps
+class Test_WL_Advanced : public WL_Advanced
+{
+public:
+    // calls of the virtual single address mapping, read() and write() choose their randomizer once instead
+    uint32_t map_addr_calls = 0;
+    size_t mapAddr(size_t addr, const wl_map_slot_t *map) override
+    {
+        this->map_addr_calls++;
+        return WL_Advanced::mapAddr(addr, map);
+    }
+    uint32_t move_count()
+    {
+        return this->state.move_count;
+    }
+    uint32_t erase_count_sectors()
+    {
+        return this->state.max_pos;
+    }
+    uint16_t *erase_counts()
+    {
+        return this->erase_count_buffer;
+    }
+    void set_erase_count(uint32_t sector, uint16_t count)
+    {
+        this->erase_count_buffer[sector] = count;
+        this->erase_count_dirty[sector / 32] |= 1u << (sector % 32);
+    }
+    esp_err_t save_erase_counts()
+    {
+        return this->saveEraseCounts();
+    }
+    esp_err_t load_erase_counts()
+    {
+        return this->readEraseCounts();
+    }
+    uint32_t pos()
+    {
+        return this->state.pos;
+    }
+    esp_err_t update_erase_counts()
+    {
+        return this->updateEraseCounts();
+    }
+    // as init() does with the scheme and keys read from state
+    void set_mapping(uint32_t mapping, uint32_t feistel_keys, uint32_t mapping_key)
+    {
+        wl_advanced_state_t *advanced_state = (wl_advanced_state_t *)&this->state;
+        advanced_state->mapping = mapping;
+        advanced_state->feistel_keys = feistel_keys;
+        advanced_state->mapping_keys[0] = mapping_key;
+        this->prepareMapping();
+        this->buildMappingTable();
+    }
+    uint32_t feistel_keys()
+    {
+        return ((wl_advanced_state_t *)&this->state)->feistel_keys;
+    }
+    bool mapping_table_built()
+    {
+        return this->mapping_table.entries != NULL;
+    }
+    bool mapping_table_matches()
+    {
+        for (uint32_t sector = 0; sector < this->flash_size / this->cfg.sector_size; sector++) {
+            if (this->mapping_table.entries[sector] != this->addressPermutation(sector * this->cfg.sector_size) / this->cfg.sector_size) {
+                return false;
+            }
+        }
+        return true;
+    }
+    esp_err_t write_legacy_erase_counts(size_t addr)
+    {
+        return this->writeEraseCounts(addr);
+    }
+    size_t erase_counts_addr(int copy)
+    {
+        return (copy == 1) ? this->addr_erase_counts1 : this->addr_erase_counts2;
+    }
+    size_t erase_counts_size()
+    {
+        return this->erase_count_records_size;
+    }
+    size_t log_addr()
+    {
+        return this->erase_count_log_addr;
+    }
+    uint32_t log_generation()
+    {
+        return this->erase_count_log_generation;
+    }
+    uint32_t log_version()
+    {
+        return this->erase_count_log_version;
+    }
+    uint32_t log_end()
+    {
+        return this->erase_count_log_end;
+    }
+    bool log_torn()
+    {
+        return this->erase_count_log_torn;
+    }
+};
+
+// small sector modes with blank check on or off, config() sets it from WL_BLANK_CHECK
+template <class WL>
+class Test_WL_Ext : public WL
+{
+public:
+    esp_err_t mount(wl_ext_cfg_t *cfg, Flash_Access *flash, bool blank_check)
+    {
+        esp_err_t result = this->config(cfg, flash);
+        if (result != ESP_OK) {
+            return result;
+        }
+        this->blank_check = blank_check;
+        return this->init();
+    }
+    // config() sets it from WL_MERGE_TIMEOUT_MS
+    void set_merge_timeout(int64_t timeout_us)
+    {
+        this->merge_timeout = timeout_us;
+    }
+};
+
+// configuration wl_mount() uses, for instances created directly on a test flash
+static void test_config(wl_ext_cfg_t *cfg, size_t full_mem_size, size_t fat_sector_size)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->full_mem_size = full_mem_size;
+    cfg->start_addr = 0;
+    cfg->version = 2;
+    cfg->sector_size = SPI_FLASH_SEC_SIZE;
+    cfg->page_size = SPI_FLASH_SEC_SIZE;
+    cfg->updaterate = 16;
+    cfg->temp_buff_size = 32;
+    cfg->wr_size = 16;
+    cfg->fat_sector_size = fat_sector_size;
+}
 
 TEST_CASE("write and read back data", "[wear_levelling]")
 {
@@ -95,6 +383,96 @@ TEST_CASE("write and read back data", "[wear_levelling]")
     free(read);
 }
 
+TEST_CASE("unaligned write and read back across pages", "[wear_levelling]")
+{
+    _spi_flash_init(CONFIG_ESPTOOLPY_FLASHSIZE, CONFIG_WL_SECTOR_SIZE * 16, CONFIG_WL_SECTOR_SIZE, CONFIG_WL_SECTOR_SIZE, "partition_table.bin");
+
+    esp_err_t result;
+    wl_handle_t wl_handle;
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
+
+    result = wl_mount(partition, &wl_handle);
+    REQUIRE(result == ESP_OK);
+
+    size_t sector_size = wl_sector_size(wl_handle);
+    size_t size = wl_size(wl_handle);
+
+    // start in the middle of a page and span several page boundaries
+    size_t offset = sector_size / 2 + 3;
+    size_t length = sector_size * 3 + 17;
+    REQUIRE(offset + length <= size);
+
+    uint8_t *data = (uint8_t *) malloc(length);
+    uint8_t *read = (uint8_t *) malloc(sector_size * 5);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (uint8_t)(i * 7 + 1);
+    }
+
+    REQUIRE(wl_erase_range(wl_handle, 0, sector_size * 5) == ESP_OK);
+    REQUIRE(wl_write(wl_handle, offset, data, length) == ESP_OK);
+
+    REQUIRE(wl_read(wl_handle, offset, read, length) == ESP_OK);
+    REQUIRE(memcmp(data, read, length) == 0);
+
+    // bytes around the written range must stay erased
+    REQUIRE(wl_read(wl_handle, 0, read, sector_size * 5) == ESP_OK);
+    for (size_t i = 0; i < sector_size * 5; i++) {
+        if (i < offset || i >= offset + length) {
+            REQUIRE(read[i] == 0xFF);
+        }
+    }
+
+    result = wl_unmount(wl_handle);
+    REQUIRE(result == ESP_OK);
+
+    free(data);
+    free(read);
+}
+
+TEST_CASE("wl_get_stats counts operations and partition calls", "[wear_levelling]")
+{
+    _spi_flash_init(CONFIG_ESPTOOLPY_FLASHSIZE, CONFIG_WL_SECTOR_SIZE * 16, CONFIG_WL_SECTOR_SIZE, CONFIG_WL_SECTOR_SIZE, "partition_table.bin");
+
+    wl_handle_t wl_handle;
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
+    REQUIRE(wl_mount(partition, &wl_handle) == ESP_OK);
+    size_t sector_size = wl_sector_size(wl_handle);
+    uint8_t *read = (uint8_t *) malloc(sector_size);
+    // log mode reads and erases sectors that were never written without flash calls
+    memset(read, 0x5a, sector_size);
+    REQUIRE(wl_write(wl_handle, 0, read, sector_size) == ESP_OK);
+    REQUIRE(wl_write(wl_handle, sector_size, read, sector_size) == ESP_OK);
+
+    wl_stats_t stats;
+    REQUIRE(wl_get_stats(wl_handle, &stats) == ESP_OK);
+    REQUIRE(stats.driver_calls > 0);
+    REQUIRE(wl_reset_stats(wl_handle) == ESP_OK);
+    REQUIRE(wl_get_stats(wl_handle, &stats) == ESP_OK);
+    REQUIRE(stats.reads == 0);
+    REQUIRE(stats.driver_calls == 0);
+
+    REQUIRE(wl_read(wl_handle, 0, read, sector_size) == ESP_OK);
+    REQUIRE(wl_read(wl_handle, sector_size, read, 100) == ESP_OK);
+    REQUIRE(wl_erase_range(wl_handle, 0, sector_size) == ESP_OK);
+    REQUIRE(wl_get_stats(wl_handle, &stats) == ESP_OK);
+    REQUIRE(stats.reads == 2);
+    REQUIRE(stats.read_bytes == sector_size + 100);
+    REQUIRE(stats.erases == 1);
+    REQUIRE(stats.erase_bytes == sector_size);
+    REQUIRE(stats.driver_calls >= 3);
+
+    // without merged erases nothing is held in RAM, wl_flush() has nothing to write
+    REQUIRE(wl_reset_stats(wl_handle) == ESP_OK);
+    REQUIRE(wl_flush(wl_handle) == ESP_OK);
+    REQUIRE(wl_get_stats(wl_handle, &stats) == ESP_OK);
+    REQUIRE(stats.driver_calls == 0);
+    REQUIRE(wl_flush(WL_INVALID_HANDLE) == ESP_ERR_NOT_FOUND);
+
+    REQUIRE(wl_unmount(wl_handle) == ESP_OK);
+    free(read);
+}
+
 TEST_CASE("power down test", "[wear_levelling]")
 {
     _spi_flash_init(CONFIG_ESPTOOLPY_FLASHSIZE, CONFIG_WL_SECTOR_SIZE * 16, CONFIG_WL_SECTOR_SIZE, CONFIG_WL_SECTOR_SIZE, "partition_table.bin");
@@ -213,3 +591,1242 @@ TEST_CASE("power down test", "[wear_levelling]")
     result = wl_unmount(wl_handle);
     REQUIRE(result == ESP_OK);
 }
+
+#define CONCURRENT_READERS 4
+#define CONCURRENT_ERASES 2000
+
+TEST_CASE("concurrent reads during erases", "[wear_levelling]")
+{
+    _spi_flash_init(CONFIG_ESPTOOLPY_FLASHSIZE, CONFIG_WL_SECTOR_SIZE * 16, CONFIG_WL_SECTOR_SIZE, CONFIG_WL_SECTOR_SIZE, "partition_table.bin");
+
+    wl_handle_t wl_handle;
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
+    REQUIRE(wl_mount(partition, &wl_handle) == ESP_OK);
+
+    size_t sector_size = wl_sector_size(wl_handle);
+    int32_t sectors_count = wl_size(wl_handle) / sector_size;
+    // readers check the first half, the second half is erased and written meanwhile
+    int32_t fixed_count = sectors_count / 2;
+    REQUIRE(fixed_count > 1);
+
+    uint32_t *sector_data = new uint32_t[sector_size / sizeof(uint32_t)];
+    for (int32_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl_erase_range(wl_handle, i * sector_size, sector_size) == ESP_OK);
+        for (uint32_t m = 0; m < sector_size / sizeof(uint32_t); m++) {
+            sector_data[m] = i * sector_size + m;
+        }
+        REQUIRE(wl_write(wl_handle, i * sector_size, sector_data, sector_size) == ESP_OK);
+    }
+    REQUIRE(wl_reset_stats(wl_handle) == ESP_OK);
+
+    std::atomic<bool> done(false);
+    std::atomic<uint32_t> errors(0);
+    std::vector<std::vector<uint32_t>> latency_us(CONCURRENT_READERS);
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < CONCURRENT_READERS; t++) {
+        readers.emplace_back([&, t]() {
+            // two sectors, so every other read crosses a page boundary
+            std::vector<uint32_t> buff(sector_size * 2 / sizeof(uint32_t));
+            uint32_t sector = t;
+            while (!done.load()) {
+                sector = (sector * 7 + 1) % (fixed_count - 1);
+                size_t offset = (sector & 1) ? sector_size / 2 : 0;
+                auto read_start = std::chrono::steady_clock::now();
+                if (wl_read(wl_handle, sector * sector_size + offset, buff.data(), sector_size) != ESP_OK) {
+                    errors++;
+                }
+                latency_us[t].push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - read_start).count());
+                for (uint32_t m = 0; m < sector_size / sizeof(uint32_t); m++) {
+                    uint32_t word = offset / sizeof(uint32_t) + m;
+                    uint32_t word_sector = sector + word / (sector_size / sizeof(uint32_t));
+                    if (buff[m] != word_sector * sector_size + word % (sector_size / sizeof(uint32_t))) {
+                        errors++;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+
+    for (int32_t k = 0; k < CONCURRENT_ERASES; k++) {
+        int32_t i = fixed_count + k % (sectors_count - fixed_count);
+        REQUIRE(wl_erase_range(wl_handle, i * sector_size, sector_size) == ESP_OK);
+        REQUIRE(wl_write(wl_handle, i * sector_size, sector_data, sector_size) == ESP_OK);
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint32_t> all;
+    for (auto &samples : latency_us) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    std::sort(all.begin(), all.end());
+    REQUIRE(all.size() > 0);
+
+    wl_stats_t stats;
+    REQUIRE(wl_get_stats(wl_handle, &stats) == ESP_OK);
+    printf("%d readers: %u reads in %.2f s (%.0f reads/s, %.1f MB/s), latency p50 %u us, p99 %u us, max %u us\n",
+           CONCURRENT_READERS, (uint32_t)all.size(), elapsed_s, all.size() / elapsed_s,
+           all.size() * sector_size / elapsed_s / 1e6,
+           all[all.size() / 2], all[all.size() * 99 / 100], all.back());
+    printf("dummy_moves %u, read_retries %u\n", stats.dummy_moves, stats.read_retries);
+    REQUIRE(errors == 0);
+    REQUIRE(stats.reads == all.size());
+
+    delete[] sector_data;
+    REQUIRE(wl_unmount(wl_handle) == ESP_OK);
+}
+
+TEST_CASE("memory-mapped reads follow dummy block moves", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 32);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 4;
+    WL_Flash wl;
+    REQUIRE(wl.config(&cfg, &flash) == ESP_OK);
+    REQUIRE(wl.init() == ESP_OK);
+
+    size_t sector_size = wl.sector_size();
+    int32_t sectors_count = wl.chip_size() / sector_size;
+    // pointers go to the first half, the second half is erased and written to move the dummy block
+    int32_t fixed_count = sectors_count / 2;
+    std::vector<uint32_t> sector_data(sector_size / sizeof(uint32_t));
+    for (int32_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl.erase_range(i * sector_size, sector_size) == ESP_OK);
+        for (uint32_t m = 0; m < sector_size / sizeof(uint32_t); m++) {
+            sector_data[m] = i * sector_size + m;
+        }
+        REQUIRE(wl.write(i * sector_size, sector_data.data(), sector_size) == ESP_OK);
+    }
+
+    const void *ptr[CONCURRENT_READERS];
+    uint32_t epoch[CONCURRENT_READERS];
+    uint32_t remaps = 0;
+    for (int32_t k = 0; k < CONCURRENT_ERASES; k++) {
+        for (int32_t t = 0; t < CONCURRENT_READERS; t++) {
+            int32_t sector = (k / 16 + t * 3) % fixed_count;
+            if ((k % 16 != 0) && wl.mmap_valid(epoch[t])) {
+                continue;
+            }
+            if (k % 16 != 0) {
+                remaps++;
+            }
+            REQUIRE(wl.mmap(sector * sector_size, sector_size, &ptr[t], &epoch[t]) == ESP_OK);
+        }
+        for (int32_t t = 0; t < CONCURRENT_READERS; t++) {
+            int32_t sector = (k / 16 + t * 3) % fixed_count;
+            const uint32_t *words = (const uint32_t *)ptr[t];
+            uint32_t m = k % (sector_size / sizeof(uint32_t));
+            uint32_t word = words[m];
+            if (wl.mmap_valid(epoch[t])) {
+                REQUIRE(word == sector * sector_size + m);
+            }
+        }
+        int32_t i = fixed_count + k % (sectors_count - fixed_count);
+        REQUIRE(wl.erase_range(i * sector_size, sector_size) == ESP_OK);
+        REQUIRE(wl.write(i * sector_size, sector_data.data(), sector_size) == ESP_OK);
+    }
+    REQUIRE(remaps > 0);
+
+    // all of the storage is contiguous unless the dummy block is in between
+    const void *all;
+    uint32_t all_epoch;
+    esp_err_t result = wl.mmap(0, wl.chip_size(), &all, &all_epoch);
+    REQUIRE(((result == ESP_OK) || (result == ESP_ERR_INVALID_SIZE)));
+    REQUIRE(wl.mmap(0, wl.chip_size() + 1, &all, &all_epoch) == ESP_ERR_INVALID_ARG);
+}
+
+TEST_CASE("memory-mapped reads map only the pages holding them", "[wear_levelling]")
+{
+    const size_t page_size = SPI_FLASH_MMU_PAGE_SIZE;
+    File_Flash flash(page_size * 4);
+    {
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+        WL_Flash wl;
+        REQUIRE(wl.config(&cfg, &flash) == ESP_OK);
+        REQUIRE(wl.init() == ESP_OK);
+        size_t sector_size = wl.sector_size();
+        int32_t sectors_count = wl.chip_size() / sector_size;
+        std::vector<uint32_t> sector_data(sector_size / sizeof(uint32_t));
+        for (int32_t i = 0; i < sectors_count; i++) {
+            REQUIRE(wl.erase_range(i * sector_size, sector_size) == ESP_OK);
+            for (uint32_t m = 0; m < sector_size / sizeof(uint32_t); m++) {
+                sector_data[m] = i * sector_size + m;
+            }
+            REQUIRE(wl.write(i * sector_size, sector_data.data(), sector_size) == ESP_OK);
+        }
+
+        const void *ptr;
+        uint32_t epoch;
+        REQUIRE(wl.mmap(sector_size, 16, &ptr, &epoch) == ESP_OK);
+        REQUIRE(flash.mapped == 1);
+        REQUIRE(flash.mapped_bytes == page_size);
+        REQUIRE(wl.mmap(sector_size + 16, 16, &ptr, &epoch) == ESP_OK);
+        REQUIRE(flash.mapped == 1);
+
+        // a sector never crosses a page, every page is mapped once
+        for (int32_t i = 0; i < sectors_count; i++) {
+            REQUIRE(wl.mmap(i * sector_size, sector_size, &ptr, &epoch) == ESP_OK);
+            const uint32_t *words = (const uint32_t *)ptr;
+            REQUIRE(words[0] == i * sector_size);
+            REQUIRE(words[sector_size / sizeof(uint32_t) - 1] == i * sector_size + sector_size / sizeof(uint32_t) - 1);
+        }
+        REQUIRE(flash.mapped <= 4);
+        REQUIRE(flash.mapped_bytes <= flash.chip_size());
+        REQUIRE(flash.unmapped == 0);
+    }
+    REQUIRE(flash.unmapped == flash.mapped);
+}
+
+// fill a sector with words that tell which pass k wrote it
+static void fill_sector(uint32_t *data, size_t sector_size, uint32_t sector, uint32_t k)
+{
+    for (uint32_t m = 0; m < sector_size / sizeof(uint32_t); m++) {
+        data[m] = (k * 0x9E3779B1) ^ (sector * sector_size + m);
+    }
+}
+
+TEST_CASE("erase_range reads back the same as erasing sector by sector", "[wear_levelling]")
+{
+    File_Flash range_flash(SPI_FLASH_SEC_SIZE * 32);
+    File_Flash sector_flash(SPI_FLASH_SEC_SIZE * 32);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, range_flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    WL_Flash range_wl;
+    WL_Flash sector_wl;
+    REQUIRE(range_wl.config(&cfg, &range_flash) == ESP_OK);
+    REQUIRE(range_wl.init() == ESP_OK);
+    REQUIRE(sector_wl.config(&cfg, &sector_flash) == ESP_OK);
+    REQUIRE(sector_wl.init() == ESP_OK);
+
+    size_t sector_size = range_wl.sector_size();
+    uint32_t sectors_count = range_wl.chip_size() / sector_size;
+    std::vector<uint32_t> data(sector_size / sizeof(uint32_t));
+    std::vector<uint32_t> range_data(sector_size / sizeof(uint32_t));
+    std::vector<uint32_t> sector_data(sector_size / sizeof(uint32_t));
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        fill_sector(data.data(), sector_size, i, 0);
+        REQUIRE(range_wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+        REQUIRE(sector_wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+    }
+
+    uint32_t seed = 1;
+    uint32_t crossed = 0;
+    for (uint32_t k = 1; k < 300; k++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t start = (seed >> 16) % sectors_count;
+        uint32_t count = 1 + (seed >> 8) % std::min<uint32_t>(8, sectors_count - start);
+        uint32_t moves = range_wl.dummy_moves();
+        REQUIRE(range_wl.erase_range(start * sector_size, count * sector_size) == ESP_OK);
+        for (uint32_t i = start; i < start + count; i++) {
+            REQUIRE(sector_wl.erase_sector(i) == ESP_OK);
+        }
+        // a move within the range copies pages the range erases afterwards
+        if (range_wl.dummy_moves() != moves) {
+            crossed++;
+        }
+        // leave the last sector of the range erased
+        for (uint32_t i = start; i + 1 < start + count; i++) {
+            fill_sector(data.data(), sector_size, i, k);
+            REQUIRE(range_wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+            REQUIRE(sector_wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+        }
+        for (uint32_t i = 0; i < sectors_count; i++) {
+            REQUIRE(range_wl.read(i * sector_size, range_data.data(), sector_size) == ESP_OK);
+            REQUIRE(sector_wl.read(i * sector_size, sector_data.data(), sector_size) == ESP_OK);
+            REQUIRE(range_data == sector_data);
+        }
+    }
+    REQUIRE(crossed > 0);
+    REQUIRE(range_wl.dummy_moves() == sector_wl.dummy_moves());
+}
+
+TEST_CASE("dummy block moves through a small copy buffer", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 4;
+    uint8_t copy_buff[64];
+    WL_Flash wl;
+    REQUIRE(wl.config(&cfg, &flash) == ESP_OK);
+    // has to divide the page and be a multiple of the write size
+    REQUIRE(wl.set_copy_buffer(copy_buff, 48) == ESP_ERR_INVALID_ARG);
+    REQUIRE(wl.set_copy_buffer(copy_buff, 8) == ESP_ERR_INVALID_ARG);
+    REQUIRE(wl.set_copy_buffer(copy_buff, sizeof(copy_buff)) == ESP_OK);
+    REQUIRE(wl.copy_buffer_size() == sizeof(copy_buff));
+    REQUIRE(wl.init() == ESP_OK);
+
+    size_t sector_size = wl.sector_size();
+    uint32_t sectors_count = wl.chip_size() / sector_size;
+    std::vector<uint32_t> data(sector_size / sizeof(uint32_t));
+    std::vector<uint32_t> written(sectors_count, 0);
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        fill_sector(data.data(), sector_size, i, 0);
+        REQUIRE(wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+    }
+    // every page goes through the buffer several times
+    for (uint32_t k = 1; wl.dummy_moves() < sectors_count * 3; k++) {
+        uint32_t i = k % sectors_count;
+        REQUIRE(wl.erase_sector(i) == ESP_OK);
+        fill_sector(data.data(), sector_size, i, k);
+        REQUIRE(wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+        written[i] = k;
+    }
+    std::vector<uint32_t> expected(sector_size / sizeof(uint32_t));
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl.read(i * sector_size, data.data(), sector_size) == ESP_OK);
+        fill_sector(expected.data(), sector_size, i, written[i]);
+        REQUIRE(data == expected);
+    }
+}
+
+/*
+ * Erase and rewrite sectors of a new instance one by one until power is lost at the n-th flash operation,
+ * then mount again and check that every sector but the one in progress holds what was last written to it,
+ * also after another round of rewrites. Returns false if the rewrites finished before the power cut.
+ */
+template <class WL>
+static bool rewrite_until_power_cut(File_Flash &flash, wl_ext_cfg_t *cfg, uint32_t n, uint32_t passes)
+{
+    WL wl;
+    REQUIRE(test_mount(&wl, cfg, &flash) == ESP_OK);
+    size_t sector_size = wl.sector_size();
+    uint32_t sectors_count = wl.chip_size() / sector_size;
+    std::vector<uint32_t> data(sector_size / sizeof(uint32_t));
+    std::vector<uint32_t> expected(sector_size / sizeof(uint32_t));
+    std::vector<uint32_t> written(sectors_count, 0);
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        fill_sector(data.data(), sector_size, i, 0);
+        REQUIRE(wl.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+    }
+
+    flash.cut_after(n);
+    int32_t busy = -1;
+    for (uint32_t k = 1; (k <= passes * sectors_count) && (busy < 0); k++) {
+        uint32_t i = k % sectors_count;
+        fill_sector(data.data(), sector_size, i, k);
+        if ((wl.erase_sector(i) != ESP_OK) || (wl.write(i * sector_size, data.data(), sector_size) != ESP_OK)) {
+            busy = i;
+        } else {
+            written[i] = k;
+        }
+    }
+    flash.cut_after(0);
+    if (busy < 0) {
+        return false;
+    }
+
+    WL remounted;
+    REQUIRE(test_mount(&remounted, cfg, &flash) == ESP_OK);
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        if ((int32_t)i == busy) {
+            continue;
+        }
+        REQUIRE(remounted.read(i * sector_size, data.data(), sector_size) == ESP_OK);
+        fill_sector(expected.data(), sector_size, i, written[i]);
+        REQUIRE(data == expected);
+    }
+    // position and move count have to be right for the following dummy block moves too
+    for (uint32_t k = 0; k < sectors_count * 2; k++) {
+        uint32_t i = k % sectors_count;
+        fill_sector(data.data(), sector_size, i, passes * sectors_count + 1 + k);
+        REQUIRE(remounted.erase_sector(i) == ESP_OK);
+        REQUIRE(remounted.write(i * sector_size, data.data(), sector_size) == ESP_OK);
+        written[i] = passes * sectors_count + 1 + k;
+    }
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        REQUIRE(remounted.read(i * sector_size, data.data(), sector_size) == ESP_OK);
+        fill_sector(expected.data(), sector_size, i, written[i]);
+        REQUIRE(data == expected);
+    }
+    return true;
+}
+
+// Power lost at every flash operation in turn, over a few dummy block wraps. This includes the erase of
+// the main state at a wrap, after which only the state copy is valid and the main state is rebuilt from it.
+template <class WL>
+static void power_cut_at_every_operation()
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 2;
+    Test_WL<WL> layout;
+    REQUIRE(((WL_Flash *)&layout)->config(&cfg, &flash) == ESP_OK);
+
+    uint32_t state1_cuts = 0;
+    for (uint32_t n = 1; ; n++) {
+        flash.erase_range(0, flash.chip_size());
+        if (!rewrite_until_power_cut<WL>(flash, &cfg, n, 4)) {
+            break;
+        }
+        if (flash.cut_erase && (flash.cut_addr == layout.state1_addr())) {
+            state1_cuts++;
+        }
+    }
+    REQUIRE(state1_cuts > 0);
+}
+
+TEST_CASE("power cut at every flash operation keeps data", "[wear_levelling]")
+{
+    power_cut_at_every_operation<WL_Flash>();
+    power_cut_at_every_operation<WL_Advanced>();
+}
+
+// erase count of a sector for the erase count tests, with runs of zeros at k == 0, even wear and jumps both ways
+static uint16_t test_erase_count(uint32_t sector, uint32_t k)
+{
+    if ((k == 0) && ((sector % 7 == 3) || ((sector >= 20) && (sector < 30)))) {
+        return 0;
+    }
+    if (sector % 13 == 0) {
+        return 0xFFFF - k;
+    }
+    if (sector % 17 == 0) {
+        return 1 + k;
+    }
+    return 1000 + (sector * 37 + k * 11) % 200;
+}
+
+// mount a new instance and erase until the dummy block wraps, as erase counts are only read after that,
+// then drop the erase counts the wrap saved, so that tests start with none
+static void mount_wrapped(Test_WL_Advanced &wl, wl_ext_cfg_t *cfg, File_Flash &flash)
+{
+    REQUIRE(test_mount(&wl, cfg, &flash) == ESP_OK);
+    for (uint32_t i = 0; (i < 100000) && (wl.move_count() == 0); i++) {
+        REQUIRE(wl.erase_sector(0) == ESP_OK);
+    }
+    REQUIRE(wl.move_count() != 0);
+    REQUIRE(flash.erase_range(wl.erase_counts_addr(1), wl.erase_counts_size()) == ESP_OK);
+    REQUIRE(flash.erase_range(wl.erase_counts_addr(2), wl.erase_counts_size()) == ESP_OK);
+    REQUIRE(wl.load_erase_counts() == ESP_OK);
+}
+
+static void check_erase_counts(Test_WL_Advanced &wl, const std::vector<uint16_t> &expected)
+{
+    REQUIRE(wl.load_erase_counts() == ESP_OK);
+    REQUIRE(std::equal(expected.begin(), expected.end(), wl.erase_counts()));
+}
+
+static void write_erase_count_marker(File_Flash &flash, size_t addr, uint32_t index, uint32_t magic, uint32_t generation, uint32_t value)
+{
+    wl_erase_count_marker_t marker;
+    marker.magic = magic;
+    marker.generation = generation;
+    marker.value = value;
+    marker.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&marker, offsetof(wl_erase_count_marker_t, crc));
+    REQUIRE(flash.write(addr + index * sizeof(marker), &marker, sizeof(marker)) == ESP_OK);
+}
+
+// (sector, erase count) triplet of the legacy format and version 1 logs, pairs with zero count are empty
+static void write_erase_count_triplet(File_Flash &flash, size_t addr, uint32_t index, const std::vector<uint16_t> &sectors, const std::vector<uint16_t> &counts)
+{
+    wl_erase_count_t record;
+    memset(&record, 0, sizeof(record));
+    for (size_t j = 0; j < sectors.size(); j++) {
+        record.pairs[j].sector = sectors[j];
+        record.pairs[j].erase_count = counts[j];
+    }
+    record.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&record, offsetof(wl_erase_count_t, crc));
+    REQUIRE(flash.write(addr + index * sizeof(record), &record, sizeof(record)) == ESP_OK);
+}
+
+TEST_CASE("erase counts are read from the legacy format and from version 1 logs", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 256);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.erase_count_sectors();
+    std::vector<uint16_t> expected(sectors);
+    std::vector<uint32_t> used;
+    for (uint32_t s = 0; s < sectors; s++) {
+        expected[s] = test_erase_count(s, 0);
+        wl.set_erase_count(s, expected[s]);
+        if (expected[s] != 0) {
+            used.push_back(s);
+        }
+    }
+    size_t addr1 = wl.erase_counts_addr(1);
+    size_t addr2 = wl.erase_counts_addr(2);
+    uint8_t zeros[sizeof(wl_erase_count_t)] = {0};
+
+    // legacy triplets in both copies, a broken triplet of the first copy is read from the second one
+    REQUIRE(wl.write_legacy_erase_counts(addr1) == ESP_OK);
+    REQUIRE(wl.write_legacy_erase_counts(addr2) == ESP_OK);
+    check_erase_counts(wl, expected);
+    REQUIRE(wl.log_addr() == WL_ERASE_COUNT_LOG_NONE);
+    REQUIRE(flash.write(addr1 + sizeof(wl_erase_count_t), zeros, sizeof(zeros)) == ESP_OK);
+    check_erase_counts(wl, expected);
+
+    // broken in both copies, the records end there
+    REQUIRE(flash.write(addr2 + sizeof(wl_erase_count_t), zeros, sizeof(zeros)) == ESP_OK);
+    std::vector<uint16_t> first_triplet(sectors, 0);
+    for (size_t j = 0; j < 3; j++) {
+        first_triplet[used[j]] = expected[used[j]];
+    }
+    check_erase_counts(wl, first_triplet);
+
+    // the next save replaces them with a log
+    for (uint32_t s = 0; s < sectors; s++) {
+        wl.set_erase_count(s, expected[s]);
+    }
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    REQUIRE(wl.log_addr() != WL_ERASE_COUNT_LOG_NONE);
+    check_erase_counts(wl, expected);
+
+    // version 1 log in the second copy: a snapshot and a save overriding one count, both committed,
+    // then a triplet of an interrupted save
+    uint32_t generation = wl.log_generation() + 1;
+    REQUIRE(flash.erase_range(addr2, wl.erase_counts_size()) == ESP_OK);
+    uint32_t index = 1;
+    for (size_t i = 0; i < used.size(); i += 3) {
+        std::vector<uint16_t> triplet_sectors;
+        std::vector<uint16_t> triplet_counts;
+        for (size_t j = i; (j < i + 3) && (j < used.size()); j++) {
+            triplet_sectors.push_back(used[j]);
+            triplet_counts.push_back(expected[used[j]]);
+        }
+        write_erase_count_triplet(flash, addr2, index++, triplet_sectors, triplet_counts);
+    }
+    write_erase_count_marker(flash, addr2, index, WL_ERASE_COUNT_COMMIT_MAGIC, generation, index);
+    index++;
+    write_erase_count_triplet(flash, addr2, index++, std::vector<uint16_t>(1, used[0]), std::vector<uint16_t>(1, 7));
+    write_erase_count_marker(flash, addr2, index, WL_ERASE_COUNT_COMMIT_MAGIC, generation, index);
+    index++;
+    write_erase_count_triplet(flash, addr2, index++, std::vector<uint16_t>(1, used[1]), std::vector<uint16_t>(1, 9));
+    write_erase_count_marker(flash, addr2, 0, WL_ERASE_COUNT_LOG_MAGIC, generation, WL_ERASE_COUNT_LOG_VERSION_TRIPLETS);
+    expected[used[0]] = 7;
+    check_erase_counts(wl, expected);
+    REQUIRE(wl.log_addr() == addr2);
+    REQUIRE(wl.log_version() == WL_ERASE_COUNT_LOG_VERSION_TRIPLETS);
+    REQUIRE(wl.log_torn());
+
+    // it is not appended to, but compacted to the other copy in the current version
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    check_erase_counts(wl, expected);
+    REQUIRE(wl.log_addr() == addr1);
+    REQUIRE(wl.log_generation() == generation + 1);
+    REQUIRE(wl.log_version() == WL_ERASE_COUNT_LOG_VERSION_BLOCKS);
+}
+
+// Power lost at every flash operation of a save appending to the log, the counts of the previous save
+// remain until a compaction writes the new ones
+TEST_CASE("power cut while appending erase counts keeps the previous save", "[wear_levelling]")
+{
+    uint32_t cuts = 0;
+    for (uint32_t n = 1; ; n++) {
+        File_Flash flash(SPI_FLASH_SEC_SIZE * 256);
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+        cfg.updaterate = 1;
+        Test_WL_Advanced wl;
+        mount_wrapped(wl, &cfg, flash);
+        uint32_t sectors = wl.erase_count_sectors();
+        std::vector<uint16_t> saved(sectors);
+        for (uint32_t s = 0; s < sectors; s++) {
+            saved[s] = test_erase_count(s, 0);
+            wl.set_erase_count(s, saved[s]);
+        }
+        REQUIRE(wl.save_erase_counts() == ESP_OK);
+        uint32_t generation = wl.log_generation();
+        std::vector<uint16_t> expected(saved);
+        for (uint32_t s = 0; s < 60; s++) {
+            expected[s] = test_erase_count(s, 1);
+            wl.set_erase_count(s, expected[s]);
+        }
+
+        flash.cut_after(n);
+        esp_err_t result = wl.save_erase_counts();
+        flash.cut_after(0);
+        REQUIRE(wl.log_generation() == generation);
+        if (result == ESP_OK) {
+            check_erase_counts(wl, expected);
+            REQUIRE(!wl.log_torn());
+            break;
+        }
+        cuts++;
+        check_erase_counts(wl, saved);
+        REQUIRE(wl.log_torn());
+        for (uint32_t s = 0; s < sectors; s++) {
+            wl.set_erase_count(s, expected[s]);
+        }
+        REQUIRE(wl.save_erase_counts() == ESP_OK);
+        REQUIRE(wl.log_generation() == generation + 1);
+        check_erase_counts(wl, expected);
+    }
+    REQUIRE(cuts >= 2);
+}
+
+TEST_CASE("erase count blocks read back through appends and compactions", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 256);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.erase_count_sectors();
+    std::vector<uint16_t> expected(sectors);
+    for (uint32_t s = 0; s < sectors; s++) {
+        expected[s] = test_erase_count(s, 0);
+        wl.set_erase_count(s, expected[s]);
+    }
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    REQUIRE(wl.log_version() == WL_ERASE_COUNT_LOG_VERSION_BLOCKS);
+    check_erase_counts(wl, expected);
+
+    // a few scattered sectors change with every save, until the log fills up and is compacted
+    uint32_t generation = wl.log_generation();
+    uint32_t appends = 0;
+    for (uint32_t k = 1; (k < 1000) && (wl.log_generation() == generation); k++) {
+        for (uint32_t j = 0; j < 5; j++) {
+            uint32_t s = (k * 7 + j * 31) % sectors;
+            expected[s] = test_erase_count(s, k);
+            wl.set_erase_count(s, expected[s]);
+        }
+        uint32_t end = wl.log_end();
+        REQUIRE(wl.save_erase_counts() == ESP_OK);
+        if (wl.log_generation() == generation) {
+            REQUIRE(wl.log_end() > end);
+            appends++;
+        }
+        check_erase_counts(wl, expected);
+    }
+    REQUIRE(appends > 0);
+    REQUIRE(wl.log_generation() == generation + 1);
+}
+
+// A block with broken payload is skipped, the other blocks of the same save still apply
+TEST_CASE("broken last erase count block loses only its sectors", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 256);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.erase_count_sectors();
+    std::vector<uint16_t> saved(sectors);
+    for (uint32_t s = 0; s < sectors; s++) {
+        saved[s] = test_erase_count(s, 0);
+        wl.set_erase_count(s, saved[s]);
+    }
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    std::vector<uint16_t> expected(saved);
+    for (uint32_t s = 0; s < 60; s++) {
+        expected[s] = test_erase_count(s, 1);
+        wl.set_erase_count(s, expected[s]);
+    }
+    uint32_t end = wl.log_end();
+    uint32_t generation = wl.log_generation();
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    REQUIRE(wl.log_generation() == generation);
+
+    // walk the appended blocks up to the commit
+    size_t addr = wl.log_addr();
+    wl_erase_count_block_t block;
+    uint32_t last = end;
+    for (uint32_t i = end; i + 1 < wl.log_end(); ) {
+        REQUIRE(flash.read(addr + i * sizeof(wl_erase_count_t), &block, sizeof(block)) == ESP_OK);
+        REQUIRE(block.tag == WL_ERASE_COUNT_BLOCK_TAG);
+        last = i;
+        i += 1 + (block.payload_size + sizeof(wl_erase_count_t) - 1) / sizeof(wl_erase_count_t);
+    }
+    REQUIRE(last > end);
+    REQUIRE(flash.read(addr + last * sizeof(wl_erase_count_t), &block, sizeof(block)) == ESP_OK);
+    uint8_t zeros[sizeof(wl_erase_count_t)] = {0};
+    REQUIRE(flash.write(addr + (last + 1) * sizeof(wl_erase_count_t), zeros, sizeof(zeros)) == ESP_OK);
+
+    for (uint32_t s = block.base_sector; s < block.base_sector + block.sector_count; s++) {
+        expected[s] = saved[s];
+    }
+    check_erase_counts(wl, expected);
+    REQUIRE(!wl.log_torn());
+}
+
+// Sector numbers past 16 bits don't fit the legacy triplets, the log has to hold a snapshot of random counts,
+// the worst case for its encoding
+TEST_CASE("erase counts of more than 65536 sectors are saved", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 70000);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.erase_count_sectors();
+    REQUIRE(sectors > 0x10000);
+    std::vector<uint16_t> expected(sectors);
+    uint32_t seed = 1;
+    for (uint32_t s = 0; s < sectors; s++) {
+        seed = seed * 1103515245 + 12345;
+        expected[s] = (seed >> 16) | 1;
+        wl.set_erase_count(s, expected[s]);
+    }
+    REQUIRE(wl.save_erase_counts() == ESP_OK);
+    REQUIRE(wl.log_addr() != WL_ERASE_COUNT_LOG_NONE);
+    check_erase_counts(wl, expected);
+}
+
+// The pos update records of the current loop hold physical sectors, mapped with a move count and pos
+// that change as the dummy block moves, and have to come back as the logical sectors that were erased
+TEST_CASE("erases since the last wrap are counted per logical sector", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 64);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.chip_size() / wl.sector_size();
+    uint32_t erases = wl.erase_count_sectors() - 2;
+    std::vector<uint32_t> expected(sectors, 0);
+    for (uint32_t k = 0; k < erases; k++) {
+        uint32_t sector = (k % 3 == 0) ? 7 : (k * 5) % sectors;
+        REQUIRE(wl.erase_sector(sector) == ESP_OK);
+        expected[sector]++;
+    }
+    std::vector<uint32_t> counts(sectors);
+    REQUIRE(wl.getLogicalEraseCounts(counts.data()) == ESP_OK);
+    REQUIRE(counts == expected);
+
+    // the next loop starts over
+    uint32_t move_count = wl.move_count();
+    for (uint32_t k = 0; wl.move_count() == move_count; k++) {
+        REQUIRE(wl.erase_sector(3) == ESP_OK);
+    }
+    REQUIRE(wl.getLogicalEraseCounts(counts.data()) == ESP_OK);
+    REQUIRE(counts == std::vector<uint32_t>(sectors, 0));
+}
+
+// Erases since the last wrap are added to the saved erase counts at mount, reading the records in copy buffer chunks
+TEST_CASE("erases since the last wrap are read back at mount", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 64);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    cfg.updaterate = 1;
+    Test_WL_Advanced wl;
+    mount_wrapped(wl, &cfg, flash);
+    uint32_t sectors = wl.chip_size() / wl.sector_size();
+    uint32_t erases = wl.erase_count_sectors() - 2;
+    for (uint32_t k = 0; k < erases; k++) {
+        REQUIRE(wl.erase_sector((k % 3 == 0) ? 7 : (k * 5) % sectors) == ESP_OK);
+    }
+    std::vector<uint16_t> expected(wl.erase_counts(), wl.erase_counts() + wl.erase_count_sectors());
+
+    // one record a chunk as with temp_buff alone, 4 records a chunk leave a part of one at the end
+    const size_t buffer_sizes[] = {cfg.wr_size, 4 * cfg.wr_size, SPI_FLASH_SEC_SIZE};
+    std::vector<uint8_t> buffer(SPI_FLASH_SEC_SIZE);
+    for (int b = 0; b < 3; b++) {
+        Test_WL_Advanced remounted;
+        REQUIRE(((WL_Flash *)&remounted)->config(&cfg, &flash) == ESP_OK);
+        REQUIRE(remounted.set_copy_buffer(buffer.data(), buffer_sizes[b]) == ESP_OK);
+        REQUIRE(((WL_Flash *)&remounted)->init() == ESP_OK);
+        REQUIRE(std::equal(expected.begin(), expected.end(), remounted.erase_counts()));
+
+        // records from the recovered pos on are never read
+        uint32_t pos = remounted.pos();
+        REQUIRE(pos % 4 != 0);
+        size_t chunk = buffer_sizes[b] / cfg.wr_size;
+        flash.reads = 0;
+        REQUIRE(remounted.update_erase_counts() == ESP_OK);
+        REQUIRE(flash.reads == (pos + chunk - 1) / chunk);
+    }
+}
+
+// Another partition, or the same one formatted again, can keep feistel_keys and still map differently
+TEST_CASE("mapping table is rebuilt when the scheme or any key changes", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    Test_WL_Advanced wl;
+    REQUIRE(test_mount(&wl, &cfg, &flash) == ESP_OK);
+    REQUIRE(wl.mapping_table_built());
+    REQUIRE(wl.mapping_table_matches());
+
+    uint32_t keys = wl.feistel_keys();
+    wl.set_mapping(WL_MAPPING_SWAP_OR_NOT, keys, 0x12345678);
+    REQUIRE(wl.mapping_table_matches());
+    wl.set_mapping(WL_MAPPING_SWAP_OR_NOT, keys, 0x87654321);
+    REQUIRE(wl.mapping_table_matches());
+    wl.set_mapping(WL_MAPPING_FEISTEL, keys, 0x87654321);
+    REQUIRE(wl.mapping_table_matches());
+    wl.set_mapping(WL_MAPPING_FEISTEL, keys ^ 0x10101, 0x87654321);
+    REQUIRE(wl.mapping_table_matches());
+}
+
+TEST_CASE("reads and writes map their pages without a virtual call per page", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    Test_WL_Advanced wl;
+    REQUIRE(test_mount(&wl, &cfg, &flash) == ESP_OK);
+    size_t size = wl.chip_size();
+    std::vector<uint32_t> data(size / sizeof(uint32_t));
+    for (uint32_t m = 0; m < data.size(); m++) {
+        data[m] = m * 0x9E3779B1;
+    }
+    wl.map_addr_calls = 0;
+    REQUIRE(wl.write(0, data.data(), size) == ESP_OK);
+    std::vector<uint32_t> read(data.size());
+    REQUIRE(wl.read(0, read.data(), size) == ESP_OK);
+    REQUIRE(read == data);
+    std::fill(read.begin(), read.end(), 0);
+    wl_iovec_t iov[2] = {{0, read.data(), size / 2}, {size / 2, &read[data.size() / 2], size / 2}};
+    REQUIRE(wl.readv(iov, 2) == ESP_OK);
+    REQUIRE(read == data);
+    REQUIRE(wl.map_addr_calls == 0);
+}
+
+#if CONFIG_WL_TRACE_ENTRIES > 0
+// More reads than the ring holds, the newest ones have to come out oldest first
+TEST_CASE("trace ring keeps the newest entries in order", "[wear_levelling]")
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), SPI_FLASH_SEC_SIZE);
+    WL_Flash wl;
+    REQUIRE(test_mount(&wl, &cfg, &flash) == ESP_OK);
+    uint32_t sectors = wl.chip_size() / wl.sector_size();
+    const size_t ring = CONFIG_WL_TRACE_ENTRIES;
+    std::vector<wl_trace_entry_t> entries(ring + 4);
+    size_t count = 0;
+    uint8_t byte;
+
+    // whatever mount recorded comes first
+    REQUIRE(wl.get_trace(entries.data(), entries.size(), &count) == ESP_OK);
+    size_t first = count;
+    REQUIRE(first + ring / 2 <= ring);
+    for (uint32_t i = 0; i < ring / 2; i++) {
+        REQUIRE(wl.read((i % sectors) * wl.sector_size(), &byte, 1) == ESP_OK);
+    }
+    REQUIRE(wl.get_trace(entries.data(), entries.size(), &count) == ESP_OK);
+    REQUIRE(count == first + ring / 2);
+    for (uint32_t i = 0; i < ring / 2; i++) {
+        REQUIRE(WL_TRACE_ENTRY_OP(&entries[first + i]) == WL_TRACE_READ);
+        REQUIRE(entries[first + i].logical_addr == (i % sectors) * wl.sector_size());
+    }
+
+    // wrap the ring a few times over, ending in the middle of it
+    uint32_t total = ring / 2 + 3 * ring + 5;
+    for (uint32_t i = ring / 2; i < total; i++) {
+        REQUIRE(wl.read((i % sectors) * wl.sector_size(), &byte, 1) == ESP_OK);
+    }
+    REQUIRE(wl.get_trace(entries.data(), entries.size(), &count) == ESP_OK);
+    REQUIRE(count == ring);
+    for (uint32_t j = 0; j < ring; j++) {
+        REQUIRE(entries[j].logical_addr == ((total - ring + j) % sectors) * wl.sector_size());
+    }
+    // fewer entries requested are the newest ones
+    REQUIRE(wl.get_trace(entries.data(), 3, &count) == ESP_OK);
+    REQUIRE(count == 3);
+    for (uint32_t j = 0; j < 3; j++) {
+        REQUIRE(entries[j].logical_addr == ((total - 3 + j) % sectors) * wl.sector_size());
+    }
+}
+#endif // CONFIG_WL_TRACE_ENTRIES
+
+// contents of every fat sector of a small sector mode test, one of each flash sector is left erased
+static void fill_fat_sectors(std::vector<uint8_t> &data, size_t fat_sector_size, uint32_t size_factor)
+{
+    for (size_t i = 0; i < data.size(); i++) {
+        uint32_t fat_sector = i / fat_sector_size;
+        data[i] = (fat_sector % size_factor == 3) ? 0xff : (uint8_t)(fat_sector * 7 + i * 13 + 1);
+    }
+}
+
+// Erase ranges of 512 B sectors inside and across flash sectors, the other sectors of a flash sector have to stay
+template <class WL>
+static void partial_erase_keeps_neighbours(bool blank_check)
+{
+    File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+    wl_ext_cfg_t cfg;
+    test_config(&cfg, flash.chip_size(), 512);
+    Test_WL_Ext<WL> wl;
+    REQUIRE(wl.mount(&cfg, &flash, blank_check) == ESP_OK);
+    size_t fat_sector_size = wl.sector_size();
+    uint32_t factor = SPI_FLASH_SEC_SIZE / fat_sector_size;
+    std::vector<uint8_t> expected(wl.chip_size());
+    std::vector<uint8_t> data(wl.chip_size());
+    fill_fat_sectors(expected, fat_sector_size, factor);
+    REQUIRE(wl.write(0, expected.data(), expected.size()) == ESP_OK);
+
+    // first, last, single, a run next to the erased one, across flash sectors, whole flash sector and a blank one
+    const uint32_t ranges[][2] = {
+        {0, 1}, {factor - 1, 1}, {factor + 5, 1}, {factor + 1, 2}, {2 * factor + 6, 4},
+        {4 * factor, factor}, {4 * factor + 2, 1}, {5 * factor + 2, 1}, {5 * factor + 2, 1},
+    };
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        REQUIRE(wl.erase_range(ranges[r][0] * fat_sector_size, ranges[r][1] * fat_sector_size) == ESP_OK);
+        memset(&expected[ranges[r][0] * fat_sector_size], 0xff, ranges[r][1] * fat_sector_size);
+        REQUIRE(wl.read(0, data.data(), data.size()) == ESP_OK);
+        REQUIRE(data == expected);
+    }
+    REQUIRE(wl.erase_sector(6 * factor + 4) == ESP_OK);
+    memset(&expected[(6 * factor + 4) * fat_sector_size], 0xff, fat_sector_size);
+    REQUIRE(wl.read(0, data.data(), data.size()) == ESP_OK);
+    REQUIRE(data == expected);
+}
+
+TEST_CASE("erasing small sectors keeps the rest of the flash sector", "[wear_levelling]")
+{
+    partial_erase_keeps_neighbours<WL_Ext_Perf>(false);
+    partial_erase_keeps_neighbours<WL_Ext_Perf>(true);
+    partial_erase_keeps_neighbours<WL_Ext_Safe>(false);
+    partial_erase_keeps_neighbours<WL_Ext_Safe>(true);
+}
+
+// Power lost at every flash operation of a partial erase in safe mode, recover() at the next mount has to
+// finish it or leave it undone, keeping all other sectors
+static void partial_erase_power_cut(bool blank_check)
+{
+    uint32_t cuts = 0;
+    for (uint32_t n = 1; ; n++) {
+        File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), 512);
+        Test_WL_Ext<WL_Ext_Safe> wl;
+        REQUIRE(wl.mount(&cfg, &flash, blank_check) == ESP_OK);
+        size_t fat_sector_size = wl.sector_size();
+        uint32_t factor = SPI_FLASH_SEC_SIZE / fat_sector_size;
+        std::vector<uint8_t> expected(wl.chip_size());
+        std::vector<uint8_t> data(wl.chip_size());
+        fill_fat_sectors(expected, fat_sector_size, factor);
+        REQUIRE(wl.write(0, expected.data(), expected.size()) == ESP_OK);
+
+        size_t erase_addr = (factor + 1) * fat_sector_size;
+        size_t erase_size = 4 * fat_sector_size;
+        flash.cut_after(n);
+        esp_err_t result = wl.erase_range(erase_addr, erase_size);
+        flash.cut_after(0);
+        if (result == ESP_OK) {
+            break;
+        }
+        cuts++;
+
+        Test_WL_Ext<WL_Ext_Safe> remounted;
+        REQUIRE(remounted.mount(&cfg, &flash, blank_check) == ESP_OK);
+        REQUIRE(remounted.read(0, data.data(), data.size()) == ESP_OK);
+        std::vector<uint8_t> erased(expected);
+        memset(&erased[erase_addr], 0xff, erase_size);
+        REQUIRE(((data == expected) || (data == erased)));
+
+        // journal and dump sector are usable again
+        REQUIRE(remounted.erase_range(erase_addr, erase_size) == ESP_OK);
+        REQUIRE(remounted.read(0, data.data(), data.size()) == ESP_OK);
+        REQUIRE(data == erased);
+    }
+    REQUIRE(cuts >= 4);
+}
+
+TEST_CASE("power cut during a small sector erase keeps the rest of the flash sector", "[wear_levelling]")
+{
+    partial_erase_power_cut(false);
+    partial_erase_power_cut(true);
+}
+
+// safe mode with its journal readable and the erase of versions which saved the whole flash sector
+class Test_WL_Safe : public Test_WL_Ext<WL_Ext_Safe>
+{
+public:
+    uint32_t journal_position()
+    {
+        return this->journal_pos;
+    }
+    void read_state_sector(std::vector<uint32_t> &words)
+    {
+        words.resize(this->flash_sector_size / sizeof(uint32_t));
+        REQUIRE(WL_Flash::read(this->state_addr, words.data(), this->flash_sector_size) == ESP_OK);
+    }
+    // erase_sector_fit() of those versions, with a single state record and the whole flash sector in the dump
+    esp_err_t legacy_erase(uint32_t start_sector, uint32_t count)
+    {
+        esp_err_t result = ESP_OK;
+        uint32_t local_addr_base = start_sector / this->size_factor;
+        uint32_t pre_check_start = start_sector % this->size_factor;
+        uint32_t words = this->fat_sector_size / sizeof(uint32_t);
+        // only the kept fat sectors were read, the others keep what an earlier erase left in the buffer
+        memset(this->sector_buffer, 0x5a, this->flash_sector_size);
+        for (uint32_t i = 0; i < this->size_factor; i++) {
+            if ((i < pre_check_start) || (i >= count + pre_check_start)) {
+                result = WL_Flash::read(local_addr_base * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * words], this->fat_sector_size);
+                if (result != ESP_OK) {
+                    return result;
+                }
+            }
+        }
+        uint32_t state[4] = {WL_EXT_SAFE_OK, local_addr_base, pre_check_start, count};
+        if ((result = WL_Flash::erase_sector(this->dump_addr / this->flash_sector_size)) != ESP_OK
+                || (result = WL_Flash::write(this->dump_addr, this->sector_buffer, this->flash_sector_size)) != ESP_OK
+                || (result = WL_Flash::erase_sector(this->state_addr / this->flash_sector_size)) != ESP_OK
+                || (result = WL_Flash::write(this->state_addr, state, sizeof(state))) != ESP_OK
+                || (result = WL_Flash::erase_sector(local_addr_base)) != ESP_OK) {
+            return result;
+        }
+        for (uint32_t i = 0; i < this->size_factor; i++) {
+            if ((i < pre_check_start) || (i >= count + pre_check_start)) {
+                result = WL_Flash::write(local_addr_base * this->flash_sector_size + i * this->fat_sector_size, &this->sector_buffer[i * words], this->fat_sector_size);
+                if (result != ESP_OK) {
+                    return result;
+                }
+            }
+        }
+        return WL_Flash::erase_sector(this->state_addr / this->flash_sector_size);
+    }
+};
+
+// Mount again losing power at every flash operation of the mount until one gets through, then read all data
+static void remount_with_cuts(File_Flash &flash, wl_ext_cfg_t *cfg, bool blank_check, std::vector<uint8_t> &data)
+{
+    for (uint32_t m = 1; ; m++) {
+        Test_WL_Safe wl;
+        flash.cut_after(m);
+        esp_err_t result = wl.mount(cfg, &flash, blank_check);
+        flash.cut_after(0);
+        if (result == ESP_OK) {
+            break;
+        }
+    }
+    Test_WL_Safe wl;
+    REQUIRE(wl.mount(cfg, &flash, blank_check) == ESP_OK);
+    REQUIRE(wl.read(0, data.data(), data.size()) == ESP_OK);
+}
+
+// Data written to the range after recovery stays over the next mount, which can erase the range again
+static void check_after_recovery(File_Flash &flash, wl_ext_cfg_t *cfg, bool blank_check, size_t addr, size_t size,
+                                 const std::vector<uint8_t> &data, const std::vector<uint8_t> &erased)
+{
+    std::vector<uint8_t> written(data);
+    std::vector<uint8_t> read(data.size());
+    Test_WL_Safe wl;
+    REQUIRE(wl.mount(cfg, &flash, blank_check) == ESP_OK);
+    if (data == erased) {
+        for (size_t i = addr; i < addr + size; i++) {
+            written[i] = (uint8_t)(i * 3 + 5);
+        }
+        REQUIRE(wl.write(addr, &written[addr], size) == ESP_OK);
+    }
+    Test_WL_Safe remounted;
+    REQUIRE(remounted.mount(cfg, &flash, blank_check) == ESP_OK);
+    REQUIRE(remounted.read(0, read.data(), read.size()) == ESP_OK);
+    REQUIRE(read == written);
+    REQUIRE(remounted.erase_range(addr, size) == ESP_OK);
+    Test_WL_Safe erased_again;
+    REQUIRE(erased_again.mount(cfg, &flash, blank_check) == ESP_OK);
+    REQUIRE(erased_again.read(0, read.data(), read.size()) == ESP_OK);
+    REQUIRE(read == erased);
+}
+
+/*
+ * Power lost at every flash operation of a safe mode erase after before committed ones. The last record in
+ * the journal tells what the next mount has to do: replay a begin record, also with a torn commit record,
+ * and leave the flash sector as it was with a torn begin record or none.
+ */
+static void journal_power_cut(bool blank_check, uint32_t before)
+{
+    const uint32_t records = SPI_FLASH_SEC_SIZE / (4 * sizeof(uint32_t));
+    uint32_t replayed = 0;
+    uint32_t torn_begin = 0;
+    uint32_t torn_commit = 0;
+    uint32_t full = 0;
+    for (uint32_t n = 1; ; n++) {
+        File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), 512);
+        Test_WL_Safe wl;
+        REQUIRE(wl.mount(&cfg, &flash, blank_check) == ESP_OK);
+        size_t fat_sector_size = wl.sector_size();
+        uint32_t factor = SPI_FLASH_SEC_SIZE / fat_sector_size;
+        std::vector<uint8_t> expected(wl.chip_size());
+        std::vector<uint8_t> data(wl.chip_size());
+        fill_fat_sectors(expected, fat_sector_size, factor);
+        REQUIRE(wl.write(0, expected.data(), expected.size()) == ESP_OK);
+        for (uint32_t i = 0; i < before; i++) {
+            REQUIRE(wl.erase_range(0, fat_sector_size) == ESP_OK);
+        }
+        memset(&expected[0], 0xff, (before > 0) ? fat_sector_size : 0);
+        REQUIRE(wl.journal_position() == before * 2 * 4 * sizeof(uint32_t));
+
+        size_t erase_addr = (factor + 1) * fat_sector_size;
+        size_t erase_size = 4 * fat_sector_size;
+        std::vector<uint8_t> erased(expected);
+        memset(&erased[erase_addr], 0xff, erase_size);
+        flash.cut_after(n);
+        esp_err_t result = wl.erase_range(erase_addr, erase_size);
+        flash.cut_after(0);
+        if (result == ESP_OK) {
+            break;
+        }
+
+        std::vector<uint32_t> journal;
+        wl.read_state_sector(journal);
+        const uint32_t *last = NULL;
+        uint32_t last_index = 0;
+        for (uint32_t i = 0; i < records; i++) {
+            const uint32_t *record = &journal[i * 4];
+            if ((record[0] & record[1] & record[2] & record[3]) != UINT32_MAX) {
+                last = record;
+                last_index = i;
+            }
+        }
+        const std::vector<uint8_t> *after = &expected;
+        if (last != NULL) {
+            bool valid = last[3] == crc32::crc32_le(WL_CFG_CRC_CONST, (const uint8_t *)last, 3 * sizeof(uint32_t));
+            if ((last[0] == WL_EXT_SAFE_BEGIN) && valid) {
+                replayed++;
+                after = &erased;
+            } else if (last[0] == WL_EXT_SAFE_BEGIN) {
+                torn_begin++;
+            } else if ((last[0] == WL_EXT_SAFE_COMMIT) && !valid) {
+                torn_commit++;
+                full += (last_index == records - 1);
+                after = &erased;
+            }
+        }
+        remount_with_cuts(flash, &cfg, blank_check, data);
+        REQUIRE(data == *after);
+        check_after_recovery(flash, &cfg, blank_check, erase_addr, erase_size, data, erased);
+    }
+    REQUIRE(replayed >= 2);
+    REQUIRE(torn_begin == 1);
+    REQUIRE(torn_commit == 1);
+    REQUIRE(full == ((before * 2 + 2 == records) ? 1 : 0));
+}
+
+TEST_CASE("safe mode replays an erase cut by power loss from its journal", "[wear_levelling]")
+{
+    journal_power_cut(false, 0);
+    journal_power_cut(true, 0);
+    // the commit record of the next erase takes the last record of the journal
+    journal_power_cut(false, SPI_FLASH_SEC_SIZE / (8 * sizeof(uint32_t)) - 1);
+    journal_power_cut(true, SPI_FLASH_SEC_SIZE / (8 * sizeof(uint32_t)) - 1);
+}
+
+// Power lost at every flash operation of an erase by a version which saved the whole flash sector
+static void legacy_power_cut(bool blank_check)
+{
+    uint32_t replayed = 0;
+    uint32_t torn = 0;
+    for (uint32_t n = 1; ; n++) {
+        File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), 512);
+        Test_WL_Safe wl;
+        REQUIRE(wl.mount(&cfg, &flash, blank_check) == ESP_OK);
+        size_t fat_sector_size = wl.sector_size();
+        uint32_t factor = SPI_FLASH_SEC_SIZE / fat_sector_size;
+        std::vector<uint8_t> expected(wl.chip_size());
+        std::vector<uint8_t> data(wl.chip_size());
+        fill_fat_sectors(expected, fat_sector_size, factor);
+        REQUIRE(wl.write(0, expected.data(), expected.size()) == ESP_OK);
+
+        size_t erase_addr = (factor + 1) * fat_sector_size;
+        size_t erase_size = 4 * fat_sector_size;
+        std::vector<uint8_t> erased(expected);
+        memset(&erased[erase_addr], 0xff, erase_size);
+        flash.cut_after(n);
+        esp_err_t result = wl.legacy_erase(factor + 1, 4);
+        flash.cut_after(0);
+
+        std::vector<uint32_t> state;
+        wl.read_state_sector(state);
+        remount_with_cuts(flash, &cfg, blank_check, data);
+        if ((state[0] == WL_EXT_SAFE_OK) && (state[2] < factor)) {
+            replayed++;
+            REQUIRE(data == erased);
+        } else if (state[0] == WL_EXT_SAFE_OK) {
+            // torn before the flash sector was erased
+            torn++;
+            REQUIRE(data == expected);
+        } else {
+            REQUIRE(((data == expected) || (data == erased)));
+        }
+        check_after_recovery(flash, &cfg, blank_check, erase_addr, erase_size, data, erased);
+        if (result == ESP_OK) {
+            REQUIRE(data == erased);
+            break;
+        }
+    }
+    REQUIRE(replayed >= 2);
+    REQUIRE(torn == 1);
+}
+
+TEST_CASE("safe mode replays an erase cut by power loss in the previous format", "[wear_levelling]")
+{
+    legacy_power_cut(false);
+    legacy_power_cut(true);
+}
+
+/*
+ * Erases and writes merged in RAM reach flash only by sync(), which wl_flush() calls. Power lost at every
+ * flash operation of it leaves the flash sector with its data from before the first merged erase or all of them.
+ */
+static void merged_power_cut(bool blank_check)
+{
+    uint32_t cuts = 0;
+    for (uint32_t n = 1; ; n++) {
+        File_Flash flash(SPI_FLASH_SEC_SIZE * 16);
+        wl_ext_cfg_t cfg;
+        test_config(&cfg, flash.chip_size(), 512);
+        Test_WL_Safe wl;
+        REQUIRE(wl.mount(&cfg, &flash, blank_check) == ESP_OK);
+        wl.set_merge_timeout(60 * 1000000LL);
+        size_t fat_sector_size = wl.sector_size();
+        uint32_t factor = SPI_FLASH_SEC_SIZE / fat_sector_size;
+        std::vector<uint8_t> expected(wl.chip_size());
+        std::vector<uint8_t> data(wl.chip_size());
+        fill_fat_sectors(expected, fat_sector_size, factor);
+        REQUIRE(wl.write(0, expected.data(), expected.size()) == ESP_OK);
+        const uint8_t *image;
+        uint32_t handle;
+        REQUIRE(flash.mmap(0, flash.chip_size(), (const void **)&image, &handle) == ESP_OK);
+        std::vector<uint8_t> before(image, image + flash.chip_size());
+
+        // two erases and a write of the same flash sector
+        size_t base = factor * fat_sector_size;
+        std::vector<uint8_t> merged(expected);
+        REQUIRE(wl.erase_range(base + fat_sector_size, 2 * fat_sector_size) == ESP_OK);
+        REQUIRE(wl.erase_range(base + 5 * fat_sector_size, fat_sector_size) == ESP_OK);
+        memset(&merged[base + fat_sector_size], 0xff, 2 * fat_sector_size);
+        memset(&merged[base + 5 * fat_sector_size], 0xff, fat_sector_size);
+        for (size_t i = base + fat_sector_size; i < base + 2 * fat_sector_size; i++) {
+            merged[i] = (uint8_t)(i * 3 + 5);
+        }
+        REQUIRE(wl.write(base + fat_sector_size, &merged[base + fat_sector_size], fat_sector_size) == ESP_OK);
+        REQUIRE(wl.read(0, data.data(), data.size()) == ESP_OK);
+        REQUIRE(data == merged);
+        REQUIRE(memcmp(image, before.data(), before.size()) == 0);
+
+        flash.cut_after(n);
+        esp_err_t result = wl.sync();
+        flash.cut_after(0);
+        remount_with_cuts(flash, &cfg, blank_check, data);
+        if (result == ESP_OK) {
+            REQUIRE(data == merged);
+            break;
+        }
+        cuts++;
+        REQUIRE(((data == expected) || (data == merged)));
+    }
+    REQUIRE(cuts >= 4);
+}
+
+TEST_CASE("power cut while writing merged erases keeps all or none of them", "[wear_levelling]")
+{
+    merged_power_cut(false);
+    merged_power_cut(true);
+}
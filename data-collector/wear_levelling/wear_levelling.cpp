@@ -5,18 +5,52 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <new>
 #include <sys/lock.h>
+#include "esp_timer.h"
 #include "wear_levelling.h"
 #include "WL_Config.h"
 #include "WL_Ext_Cfg.h"
 #include "WL_Flash.h"
 #include "WL_Ext_Perf.h"
 #include "WL_Ext_Safe.h"
+#include "WL_Ext_Log.h"
 #include "WL_Advanced.h"
 #include "SPI_Flash.h"
 #include "Partition.h"
 
+// length of the queue of every handle's asynchronous worker, 0 disables wl_*_async()
+#ifndef WL_ASYNC_QUEUE_LEN
+#ifdef CONFIG_WL_ASYNC_QUEUE_LEN
+#define WL_ASYNC_QUEUE_LEN CONFIG_WL_ASYNC_QUEUE_LEN
+#else
+#define WL_ASYNC_QUEUE_LEN 0
+#endif // CONFIG_WL_ASYNC_QUEUE_LEN
+#endif // WL_ASYNC_QUEUE_LEN
+
+#if WL_ASYNC_QUEUE_LEN > 0
+#include "WL_Async.h"
+
+#ifndef WL_ASYNC_TASK_STACK_SIZE
+#ifdef CONFIG_WL_ASYNC_TASK_STACK_SIZE
+#define WL_ASYNC_TASK_STACK_SIZE CONFIG_WL_ASYNC_TASK_STACK_SIZE
+#else
+#define WL_ASYNC_TASK_STACK_SIZE 3072
+#endif // CONFIG_WL_ASYNC_TASK_STACK_SIZE
+#endif // WL_ASYNC_TASK_STACK_SIZE
+
+#ifndef WL_ASYNC_TASK_PRIORITY
+#ifdef CONFIG_WL_ASYNC_TASK_PRIORITY
+#define WL_ASYNC_TASK_PRIORITY CONFIG_WL_ASYNC_TASK_PRIORITY
+#else
+#define WL_ASYNC_TASK_PRIORITY 5
+#endif // CONFIG_WL_ASYNC_TASK_PRIORITY
+#endif // WL_ASYNC_TASK_PRIORITY
+#else
+class WL_Async;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+
 #ifndef MAX_WL_HANDLES
 #define MAX_WL_HANDLES 8
 #endif // MAX_WL_HANDLES
@@ -41,9 +75,20 @@
 #define WL_CURRENT_VERSION  2
 #endif //WL_CURRENT_VERSION
 
+// deferred wrap maintenance steps run after every wl_erase_range(), see wl_maintain()
+#ifndef WL_MAINTENANCE_STEPS
+#ifdef CONFIG_WL_MAINTENANCE_STEPS
+#define WL_MAINTENANCE_STEPS CONFIG_WL_MAINTENANCE_STEPS
+#else
+#define WL_MAINTENANCE_STEPS 1
+#endif // CONFIG_WL_MAINTENANCE_STEPS
+#endif // WL_MAINTENANCE_STEPS
+
 typedef struct {
     WL_Flash *instance;
     _lock_t lock;
+    wl_stats_t stats;   // operation counts, the rest is kept by instance, see wl_get_stats()
+    WL_Async *async;    // worker of wl_*_async(), started by the first request
 } wl_instance_t;
 
 static wl_instance_t s_instances[MAX_WL_HANDLES];
@@ -51,6 +96,11 @@ static _lock_t s_instances_lock;
 static const char *TAG = "wear_levelling";
 
 static esp_err_t check_handle(wl_handle_t handle, const char *func);
+static void count_latency(wl_stats_t *stats, int64_t start);
+static size_t iov_bytes(const wl_iovec_t *iov, size_t count);
+#if WL_ASYNC_QUEUE_LEN > 0
+static esp_err_t async_post(wl_handle_t handle, wl_async_request_t *request, const char *func);
+#endif // WL_ASYNC_QUEUE_LEN > 0
 
 esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
 {
@@ -110,6 +160,15 @@ esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
         goto out;
     }
     wl_flash = new (wl_flash_ptr) WL_Ext_Safe();
+#elif CONFIG_WL_SECTOR_MODE == 2
+    wl_flash_ptr = malloc(sizeof(WL_Ext_Log));
+
+    if (wl_flash_ptr == NULL) {
+        result = ESP_ERR_NO_MEM;
+        ESP_LOGE(TAG, "%s: can't allocate WL_Ext_Log", __func__);
+        goto out;
+    }
+    wl_flash = new (wl_flash_ptr) WL_Ext_Log();
 #else
     wl_flash_ptr = malloc(sizeof(WL_Ext_Perf));
 
@@ -154,6 +213,7 @@ esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
         goto out;
     }
     s_instances[*out_handle].instance = wl_flash;
+    memset(&s_instances[*out_handle].stats, 0, sizeof(wl_stats_t));
     _lock_init(&s_instances[*out_handle].lock);
     _lock_release(&s_instances_lock);
     return ESP_OK;
@@ -178,14 +238,23 @@ esp_err_t wl_unmount(wl_handle_t handle)
     _lock_acquire(&s_instances_lock);
     result = check_handle(handle, __func__);
     if (result == ESP_OK) {
+#if WL_ASYNC_QUEUE_LEN > 0
+        // queued requests are done first, the worker uses the instance
+        if (s_instances[handle].async != NULL) {
+            s_instances[handle].async->~WL_Async();
+            free(s_instances[handle].async);
+            s_instances[handle].async = NULL;
+        }
+#endif // WL_ASYNC_QUEUE_LEN > 0
         // We have to flush state of the component
         result = s_instances[handle].instance->flush();
         // We use placement new in wl_mount, so call destructor directly
+        // the instance goes first, it releases what it got from the driver (see wl_mmap())
         Flash_Access *drv = s_instances[handle].instance->get_drv();
-        drv->~Flash_Access();
-        free(drv);
         s_instances[handle].instance->~WL_Flash();
         free(s_instances[handle].instance);
+        drv->~Flash_Access();
+        free(drv);
         s_instances[handle].instance = NULL;
         _lock_close(&s_instances[handle].lock); // also zeroes the lock variable
     }
@@ -200,7 +269,16 @@ esp_err_t wl_erase_range(wl_handle_t handle, size_t start_addr, size_t size)
         return result;
     }
     _lock_acquire(&s_instances[handle].lock);
+    int64_t start = esp_timer_get_time();
+    uint32_t moves = s_instances[handle].instance->dummy_moves();
     result = s_instances[handle].instance->erase_range(start_addr, size);
+    // an erase which moved the dummy block already took longer, maintenance waits for the next one
+    if (result == ESP_OK && WL_MAINTENANCE_STEPS > 0 && s_instances[handle].instance->dummy_moves() == moves) {
+        result = s_instances[handle].instance->maintain(WL_MAINTENANCE_STEPS, NULL);
+    }
+    count_latency(&s_instances[handle].stats, start);
+    s_instances[handle].stats.erases++;
+    s_instances[handle].stats.erase_bytes += size;
     _lock_release(&s_instances[handle].lock);
     return result;
 }
@@ -213,6 +291,8 @@ esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void *src, size_t
     }
     _lock_acquire(&s_instances[handle].lock);
     result = s_instances[handle].instance->write(dest_addr, src, size);
+    s_instances[handle].stats.writes++;
+    s_instances[handle].stats.write_bytes += size;
     _lock_release(&s_instances[handle].lock);
     return result;
 }
@@ -223,12 +303,87 @@ esp_err_t wl_read(wl_handle_t handle, size_t src_addr, void *dest, size_t size)
     if (result != ESP_OK) {
         return result;
     }
+    // the instance maps against a published snapshot and retries when the dummy block moved over it,
+    // see WL_Flash::read(); as for locked calls, unmounting meanwhile is up to the caller
+    if (s_instances[handle].instance->shared_reads()) {
+        result = s_instances[handle].instance->read(src_addr, dest, size);
+        __atomic_fetch_add(&s_instances[handle].stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s_instances[handle].stats.read_bytes, (uint64_t)size, __ATOMIC_RELAXED);
+        return result;
+    }
     _lock_acquire(&s_instances[handle].lock);
     result = s_instances[handle].instance->read(src_addr, dest, size);
+    s_instances[handle].stats.reads++;
+    s_instances[handle].stats.read_bytes += size;
     _lock_release(&s_instances[handle].lock);
     return result;
 }
 
+esp_err_t wl_readv(wl_handle_t handle, const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    if (iov == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // as in wl_read()
+    if (s_instances[handle].instance->shared_reads()) {
+        result = s_instances[handle].instance->readv(iov, count);
+        __atomic_fetch_add(&s_instances[handle].stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s_instances[handle].stats.read_bytes, (uint64_t)iov_bytes(iov, count), __ATOMIC_RELAXED);
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->readv(iov, count);
+    s_instances[handle].stats.reads++;
+    s_instances[handle].stats.read_bytes += iov_bytes(iov, count);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_writev(wl_handle_t handle, const wl_iovec_t *iov, size_t count)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    if (iov == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->writev(iov, count);
+    s_instances[handle].stats.writes++;
+    s_instances[handle].stats.write_bytes += iov_bytes(iov, count);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_mmap(wl_handle_t handle, size_t src_addr, size_t size, const void **out_ptr, uint32_t *out_epoch)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    if ((out_ptr == NULL) || (out_epoch == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->mmap(src_addr, size, out_ptr, out_epoch);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+bool wl_mmap_valid(wl_handle_t handle, uint32_t epoch)
+{
+    if (check_handle(handle, __func__) != ESP_OK) {
+        return false;
+    }
+    // lock-free as wl_read(), the epoch is the map sequence of the pointer
+    return s_instances[handle].instance->mmap_valid(epoch);
+}
+
 size_t wl_size(wl_handle_t handle)
 {
     esp_err_t err = check_handle(handle, __func__);
@@ -253,6 +408,235 @@ size_t wl_sector_size(wl_handle_t handle)
     return result;
 }
 
+esp_err_t wl_set_copy_buffer(wl_handle_t handle, void *buffer, size_t size)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->set_copy_buffer(buffer, size);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_get_stats(wl_handle_t handle, wl_stats_t *stats)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    const wl_stats_t *ops = &s_instances[handle].stats;
+    s_instances[handle].instance->get_stats(stats);
+    // shared readers count without the lock, see wl_read()
+    stats->reads = __atomic_load_n(&ops->reads, __ATOMIC_RELAXED);
+    stats->writes = ops->writes;
+    stats->erases = ops->erases;
+    stats->read_bytes = __atomic_load_n(&ops->read_bytes, __ATOMIC_RELAXED);
+    stats->write_bytes = ops->write_bytes;
+    stats->erase_bytes = ops->erase_bytes;
+    memcpy(stats->erase_latency, ops->erase_latency, sizeof(stats->erase_latency));
+    stats->driver_calls = s_instances[handle].instance->get_drv()->call_count();
+#if WL_ASYNC_QUEUE_LEN > 0
+    if (s_instances[handle].async != NULL) {
+        stats->async_requests = __atomic_load_n(&s_instances[handle].async->requests, __ATOMIC_RELAXED);
+        stats->async_merged = __atomic_load_n(&s_instances[handle].async->merged, __ATOMIC_RELAXED);
+    }
+#endif // WL_ASYNC_QUEUE_LEN > 0
+    _lock_release(&s_instances[handle].lock);
+    return ESP_OK;
+}
+
+esp_err_t wl_reset_stats(wl_handle_t handle)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    memset(&s_instances[handle].stats, 0, sizeof(wl_stats_t));
+    s_instances[handle].instance->reset_stats();
+    s_instances[handle].instance->get_drv()->reset_call_count();
+#if WL_ASYNC_QUEUE_LEN > 0
+    if (s_instances[handle].async != NULL) {
+        __atomic_store_n(&s_instances[handle].async->requests, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s_instances[handle].async->merged, 0, __ATOMIC_RELAXED);
+    }
+#endif // WL_ASYNC_QUEUE_LEN > 0
+    _lock_release(&s_instances[handle].lock);
+    return ESP_OK;
+}
+
+esp_err_t wl_get_trace(wl_handle_t handle, wl_trace_entry_t *entries, size_t max_entries, size_t *count)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->get_trace(entries, max_entries, count);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_dump_trace(wl_handle_t handle)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->dump_trace();
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_maintain(wl_handle_t handle, uint32_t max_steps, uint32_t *pending)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->maintain(max_steps, pending);
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_flush(wl_handle_t handle)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    result = s_instances[handle].instance->sync();
+    _lock_release(&s_instances[handle].lock);
+    return result;
+}
+
+esp_err_t wl_erase_range_async(wl_handle_t handle, size_t start_addr, size_t size, wl_async_cb_t cb, void *arg)
+{
+#if WL_ASYNC_QUEUE_LEN > 0
+    wl_async_request_t request = {WL_ASYNC_ERASE, start_addr, size, NULL, cb, arg, false};
+    return async_post(handle, &request, __func__);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+}
+
+esp_err_t wl_write_async(wl_handle_t handle, size_t dest_addr, const void *src, size_t size, wl_async_cb_t cb, void *arg)
+{
+#if WL_ASYNC_QUEUE_LEN > 0
+    // the worker only reads from src, see WL_Async::runTransfers()
+    wl_async_request_t request = {WL_ASYNC_WRITE, dest_addr, size, (void *)src, cb, arg, false};
+    return async_post(handle, &request, __func__);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+}
+
+esp_err_t wl_read_async(wl_handle_t handle, size_t src_addr, void *dest, size_t size, wl_async_cb_t cb, void *arg)
+{
+#if WL_ASYNC_QUEUE_LEN > 0
+    wl_async_request_t request = {WL_ASYNC_READ, src_addr, size, dest, cb, arg, false};
+    return async_post(handle, &request, __func__);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+}
+
+esp_err_t wl_async_flush(wl_handle_t handle)
+{
+#if WL_ASYNC_QUEUE_LEN > 0
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    WL_Async *async = __atomic_load_n(&s_instances[handle].async, __ATOMIC_ACQUIRE);
+    if (async == NULL) {
+        return ESP_OK;
+    }
+    return async->flush();
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+}
+
+void wl_async_notify(esp_err_t result, void *arg)
+{
+#if WL_ASYNC_QUEUE_LEN > 0
+    xTaskNotify((TaskHandle_t)arg, (uint32_t)result, eSetValueWithOverwrite);
+#else
+    (void)result;
+    (void)arg;
+#endif // WL_ASYNC_QUEUE_LEN > 0
+}
+
+#if WL_ASYNC_QUEUE_LEN > 0
+// Post to the worker of the handle, starting it on the first request
+static esp_err_t async_post(wl_handle_t handle, wl_async_request_t *request, const char *func)
+{
+    esp_err_t result = check_handle(handle, func);
+    if (result != ESP_OK) {
+        return result;
+    }
+    WL_Async *async = __atomic_load_n(&s_instances[handle].async, __ATOMIC_ACQUIRE);
+    if (async == NULL) {
+        // same lock as wl_unmount(), which deletes the worker
+        _lock_acquire(&s_instances_lock);
+        result = check_handle(handle, func);
+        async = s_instances[handle].async;
+        if ((result == ESP_OK) && (async == NULL)) {
+            // placement new as in wl_mount(), to recover from out of memory
+            void *async_ptr = malloc(sizeof(WL_Async));
+            if (async_ptr == NULL) {
+                result = ESP_ERR_NO_MEM;
+            } else {
+                async = new (async_ptr) WL_Async(handle);
+                result = async->start(WL_ASYNC_QUEUE_LEN, WL_ASYNC_TASK_STACK_SIZE, WL_ASYNC_TASK_PRIORITY);
+                if (result == ESP_OK) {
+                    __atomic_store_n(&s_instances[handle].async, async, __ATOMIC_RELEASE);
+                } else {
+                    async->~WL_Async();
+                    free(async);
+                }
+            }
+        }
+        _lock_release(&s_instances_lock);
+        if (result != ESP_OK) {
+            return result;
+        }
+    }
+    return async->post(request);
+}
+#endif // WL_ASYNC_QUEUE_LEN > 0
+
+// log2 histogram, see WL_STATS_LATENCY_BUCKETS
+static void count_latency(wl_stats_t *stats, int64_t start)
+{
+    uint32_t time = (uint32_t)(esp_timer_get_time() - start);
+    uint32_t bucket = 0;
+    while (time > 0 && bucket < WL_STATS_LATENCY_BUCKETS - 1) {
+        time >>= 1;
+        bucket++;
+    }
+    stats->erase_latency[bucket]++;
+}
+
+static size_t iov_bytes(const wl_iovec_t *iov, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += iov[i].size;
+    }
+    return size;
+}
+
 static esp_err_t check_handle(wl_handle_t handle, const char *func)
 {
     if (handle == WL_INVALID_HANDLE) {
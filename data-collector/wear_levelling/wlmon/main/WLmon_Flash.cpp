@@ -12,9 +12,13 @@ static const char *TAG = "wlmon";
 WLmon_Flash::WLmon_Flash()
 {
     this->wl_mode = WL_MODE_UNDEFINED;
+    this->logical_erase_counts = NULL;
 }
 
-WLmon_Flash::~WLmon_Flash() {}
+WLmon_Flash::~WLmon_Flash()
+{
+    free(this->logical_erase_counts);
+}
 
 esp_err_t WLmon_Flash::checkStateCRC(wl_state_t *state)
 {
@@ -50,6 +54,10 @@ esp_err_t WLmon_Flash::reconstruct(wl_config_t *cfg, Flash_Access *flash_drv)
     } else {
         this->wl_mode = WL_MODE_BASE;
     }
+    // round keys for mapping logical sectors the same way WL_Advanced does
+    if (this->wl_mode == WL_MODE_ADVANCED) {
+        this->prepareMapping();
+    }
 
     this->temp_buff = (uint8_t *) malloc(this->cfg.temp_buff_size);
     if (this->temp_buff == NULL) {
@@ -84,6 +92,16 @@ esp_err_t WLmon_Flash::reconstruct(wl_config_t *cfg, Flash_Access *flash_drv)
         WL_RESULT_CHECK(result);
 
         ESP_LOGD(TAG, "%s: updated erase counts", __func__);
+
+        // pos is recovered, so the records of the current loop are known => attribute them to logical sectors
+        this->logical_erase_counts = (uint32_t *)malloc(this->flash_size / this->cfg.sector_size * sizeof(uint32_t));
+        if (this->logical_erase_counts == NULL) {
+            result = ESP_ERR_NO_MEM;
+        }
+        WL_RESULT_CHECK(result);
+
+        result = this->getLogicalEraseCounts(this->logical_erase_counts);
+        WL_RESULT_CHECK(result);
     }
 
     return ESP_OK;
@@ -158,10 +176,11 @@ int WLmon_Flash::write_wl_state_json(char *s, size_t n)
         retval = snprintf(s, n,
                           "{\"pos\":\"0x%x\",\"max_pos\":\"0x%x\",\"move_count\":\"0x%x\",\
 \"access_count\":\"0x%x\",\"max_count\":\"0x%x\",\"block_size\":\"0x%x\",\
-\"version\":\"0x%x\",\"device_id\":\"0x%x\",\"cycle_count\":\"0x%x\",\"feistel_keys\":[\"0x%x\",\"0x%x\",\"0x%x\"],\"crc\":\"0x%x\"}",
+\"version\":\"0x%x\",\"device_id\":\"0x%x\",\"cycle_count\":\"0x%x\",\"feistel_keys\":[\"0x%x\",\"0x%x\",\"0x%x\"],\"mapping\":\"0x%x\",\"mapping_keys\":[\"0x%x\",\"0x%x\",\"0x%x\"],\"crc\":\"0x%x\"}",
                           this->state.pos, this->state.max_pos, this->state.move_count, this->state.access_count,
                           this->state.max_count, this->state.block_size, this->state.version, this->state.device_id,
-                          advanced_state->cycle_count, keys[0], keys[1], keys[2], this->state.crc);
+                          advanced_state->cycle_count, keys[0], keys[1], keys[2], advanced_state->mapping,
+                          advanced_state->mapping_keys[0], advanced_state->mapping_keys[1], advanced_state->mapping_keys[2], this->state.crc);
 
     } else {
 
@@ -205,6 +224,36 @@ int WLmon_Flash::write_wl_erase_counts_json(char *s, size_t n)
     return total_retval;
 }
 
+/*
+ * Erase counts since the dummy block last wrapped keyed by the logical sector (address / sector_size as seen
+ * by the user of WL) that was erased, see WL_Advanced::getLogicalEraseCounts()
+ */
+int WLmon_Flash::write_wl_logical_erase_counts_json(char *s, size_t n)
+{
+    int retval, total_retval = 0;
+    bool written = false;
+
+    retval = snprintf(s, n, "{");
+    SNPRINTF_RETVAL_CHECK(retval, s, n);
+    total_retval += retval;
+
+    // "logical_sector_num":"erase_count",...
+    for (uint32_t i = 0; i < this->flash_size / this->cfg.sector_size; i++) {
+        if (this->logical_erase_counts[i] != 0) {
+            retval = snprintf(s, n, "%s\"%u\":\"%u\"", written ? "," : "", i, this->logical_erase_counts[i]);
+            SNPRINTF_RETVAL_CHECK(retval, s, n);
+            total_retval += retval;
+            written = true;
+        }
+    }
+
+    retval = snprintf(s, n, "}");
+    SNPRINTF_RETVAL_CHECK(retval, s, n);
+    total_retval += retval;
+
+    return total_retval;
+}
+
 int WLmon_Flash::write_wl_mode_json(char *s, size_t n)
 {
     int retval;
@@ -240,8 +289,8 @@ esp_err_t WLmon_Flash::resize_json_buffer(char **buffer, uint32_t *new_size)
     // max len of one sector_num:erase_count pair in JSON
     uint8_t single_erase_count_len = sizeof("\"n\":\"100000\",") + ascii_digits;
 
-    // max len for all sectors
-    uint32_t erase_counts_len = single_erase_count_len * sector_count;
+    // max len for all sectors, twice: by physical and by logical sector
+    uint32_t erase_counts_len = 2 * single_erase_count_len * sector_count;
 
     ESP_LOGV(TAG, "%s: sector_count=%u, ascii_digits=%u, ascii_erase_count=%u, erase_counts_json_max_len=%u",
              __func__, sector_count, ascii_digits, single_erase_count_len, erase_counts_len);
@@ -298,6 +347,12 @@ esp_err_t WLmon_Flash::write_wl_status_json(char *s, size_t n)
 
         retval = write_wl_erase_counts_json(s, n);
         SNPRINTF_RETVAL_CHECK(retval, s, n);
+
+        retval = snprintf(s, n, ",\"logical_erase_counts\":");
+        SNPRINTF_RETVAL_CHECK(retval, s, n);
+
+        retval = write_wl_logical_erase_counts_json(s, n);
+        SNPRINTF_RETVAL_CHECK(retval, s, n);
     }
 
     retval = snprintf(s, n, "}\n");
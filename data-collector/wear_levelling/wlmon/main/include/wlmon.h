@@ -74,11 +74,14 @@ private:
     int write_wl_state_json(char *s, size_t n);
     int write_wl_mode_json(char *s, size_t n);
     int write_wl_erase_counts_json(char *s, size_t n);
+    int write_wl_logical_erase_counts_json(char *s, size_t n);
 
     esp_err_t recoverPos();
     esp_err_t checkStateCRC(wl_state_t *state);
 
     wl_mode_t wl_mode;
+    // erases of the current dummy block loop per logical sector, see WL_Advanced::getLogicalEraseCounts()
+    uint32_t *logical_erase_counts;
 };
 
 /**
@@ -391,7 +391,7 @@ def create_mode_config_state_layout(wl_mode, config, state):
 
     state_content = [[]]
     for key in state:
-        if key == 'feistel_keys':
+        if key in ('feistel_keys', 'mapping_keys'):
             value = f'{int(state[key][0], base=16), int(state[key][1], base=16), int(state[key][2], base=16)}'
         else:
             value = f'{int(state[key], base=16)}'
@@ -406,6 +406,8 @@ def create_mode_config_state_layout(wl_mode, config, state):
 def create_advanced_layout(json_dict):
     wl_mode = json_dict.pop('wl_mode')
     erase_counts = json_dict.pop('erase_counts')
+    # not reported by older wlmon
+    logical_erase_counts = json_dict.pop('logical_erase_counts', {})
 
     config = json_dict.pop('config')
     state = json_dict.pop('state')
@@ -449,6 +451,9 @@ def create_advanced_layout(json_dict):
         # else if they are equal, show one value
         right_layout += selectable_text(f'Overall erase count: {overall_ec_records}')
 
+    right_layout += [[sg.HorizontalSeparator()]]
+    right_layout += create_hottest_logical_sectors_layout(logical_erase_counts, updaterate, int(config['sector_size'], base=16))
+
     right_layout += [[sg.HorizontalSeparator()]]
     right_layout += buttons_layout
 
@@ -459,6 +464,17 @@ def create_advanced_layout(json_dict):
 
     return layout, heatmap, fig, ax
 
+def create_hottest_logical_sectors_layout(logical_erase_counts, updaterate, sector_size, count=10):
+    # list logical sectors (as addressed by the filesystem) with the most erases, to locate the write pattern behind them
+    # only erases since the dummy block last wrapped are known per logical sector
+    layout = [[]]
+    layout += selectable_text('Hottest logical sectors since last wrap:')
+    hottest = sorted(logical_erase_counts.items(), key=lambda item: int(item[1]), reverse=True)[:count]
+    for sector_num_str, erase_count_str in hottest:
+        sector_num = int(sector_num_str)
+        layout += selectable_text(f'{sector_num} (offset {hex(sector_num * sector_size)}): {updaterate * int(erase_count_str)}')
+    return layout
+
 def create_base_layout(json_dict):
     wl_mode = json_dict.pop('wl_mode')
     config = json_dict.pop('config')
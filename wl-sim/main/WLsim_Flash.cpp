@@ -1,8 +1,10 @@
 #include <cmath>
+#include <cstring>
 #include "esp_log.h"
 #include "esp_err.h"
 
 #include "wl_sim.h"
+#include "WL_Mapping.h"
 
 #define SECTOR_ERASE_ENDURANCE 100000
 
@@ -12,6 +14,7 @@ static const char *TAG = "WLsim_Flash";
  * BEWARE THIS FILE CONTAINS A SIMPLIFIED COPY OF WL_Advanced FUNCTIONALITY FOR SIMULATION PURPOSES ONLY
  * DO NOT REFER TO THIS IMPLEMENTATION FOR UNDERSTANDING FEISTEL NETWORK ADDRESS RANDOMIZATION OR ANYTHING OTHER THAN SIMULATION
  * FOR THIS REASON COMMENTS ARE SPARSE AND VARIABLES ARE SOMEWHAT A MESS
+ * (address mapping itself is not a copy, it is the same WL_Mapping.h as in WL_Advanced)
  */
 
 // exported for zeroing in main on simulated restart
@@ -30,116 +33,93 @@ static uint32_t cycle_count = 0;
 // we need to make space for additional dummy sector which can also be the result of mapping
 static uint32_t erase_counts[SECTOR_COUNT + 1] = {0};
 
-// 3 keys for 3 stage unbalanced Feistel network
-static uint8_t keys[3] = {0};
-// bit lengths of full sector address (B) and lengths of two parts for splitting in Feistel network (MSB, LSB)
-static uint8_t B = 0, MSB = 0, LSB = 0;
+// address mapping policies, the same code as WL_Advanced uses, see WL_Mapping.h
+static wl_mapping::Feistel feistel_randomizer;
+static wl_mapping::SwapOrNot swap_or_not_randomizer;
+static wl_mapping::Rotation rotation = [] {
+    wl_mapping::Rotation r;
+    r.init(FLASH_SIZE, PAGE_SIZE);
+    return r;
+}();
 // counters for debug and simulation output purposes
-static uint32_t feistel_calls = 0;
-static uint32_t feistel_cycle_walks;
-// was Feistel initialized and should be used in calcAddr?
+static wl_mapping_stats_t stats = {0};
+// was Feistel or swap-or-not initialized and should be used in calcAddr?
 static bool feistel = false;
+static bool swap_or_not_enabled = false;
 
-void init_feistel(bool verbose)
+uint32_t get_feistel_max_walk()
 {
-    feistel = true;
+    return stats.max_walk;
+}
 
-    uint16_t sector_count = SECTOR_COUNT;
-    if (verbose) {
-        ESP_LOGI(TAG, "%s: SECTOR_COUNT=%u", __func__, sector_count);
-        ESP_LOGI(TAG, "sizeof(size_t)=%u", sizeof(size_t));
-    }
+void reset_feistel_stats()
+{
+    memset(&stats, 0, sizeof(stats));
+}
 
-    // B = log2(sector_count)
-    for (B = 0; sector_count; B++) {
-        sector_count >>= 1;
-    }
+// round keys derived from a single 32 bit key for simplicity, as with zeroed mapping_keys
+void init_swap_or_not(bool verbose)
+{
+    static const uint32_t mapping_keys[WL_MAPPING_KEY_WORDS] = {0};
 
-    LSB = (B + 1) / 2;
-    MSB = B - LSB;
+    swap_or_not_enabled = true;
+    uint32_t key = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    swap_or_not_randomizer.init(key, mapping_keys, SECTOR_COUNT, SECTOR_SIZE);
     if (verbose) {
-        ESP_LOGI(TAG, "%s: B=%u, MSB=%u, LSB=%u", __func__, B, MSB, LSB);
+        ESP_LOGI(TAG, "%s: generated key 0x%x", __func__, key);
     }
+}
 
-    uint8_t key_len = (B + 1) / 2;
-
-    if (verbose) {
-        ESP_LOGI(TAG, "%s: key_len=%u", __func__, key_len);
-    }
+void init_feistel(bool verbose)
+{
+    feistel = true;
 
+    // 3 keys for 3 stage unbalanced Feistel network
+    uint32_t keys = 0;
     for (uint8_t i = 0; i < 3; i++) {
-        keys[i] = rand() % UINT8_MAX;
+        keys |= (uint32_t)(rand() % UINT8_MAX) << (8 * i);
     }
+    feistel_randomizer.init(keys, SECTOR_COUNT, SECTOR_SIZE);
 
     if (verbose) {
-        ESP_LOGI(TAG, "%s: generated 8bit keys (%u, %u, %u) ", __func__, keys[0], keys[1], keys[2]);
+        ESP_LOGI(TAG, "%s: SECTOR_COUNT=%u", __func__, SECTOR_COUNT);
+        ESP_LOGI(TAG, "%s: B=%u, MSB=%u, LSB=%u", __func__, feistel_randomizer.bit_width, feistel_randomizer.msb_width, feistel_randomizer.lsb_width);
+        ESP_LOGI(TAG, "%s: generated 8bit keys (%u, %u, %u) ", __func__, feistel_randomizer.keys[0], feistel_randomizer.keys[1], feistel_randomizer.keys[2]);
     }
 }
 
-static uint32_t feistel_function(uint32_t msb, uint32_t key)
+size_t feistel_network(size_t logical_addr)
 {
-    //ESP_LOGV(TAG, "%s: msb=0x%x key=0x%x", __func__, msb, key);
-    //ESP_LOGV(TAG, "%s: msb xor key = 0x%x", __func__, (msb ^ key));
-    ESP_LOGV(TAG, "%s: return (msb xor key)^2 = 0x%x", __func__, (msb ^ key) * (msb ^ key));
-    return (msb ^ key) * (msb ^ key);
+    return feistel_randomizer.map(logical_addr, &stats);
 }
 
-size_t feistel_network(size_t logical_addr)
+size_t swap_or_not(size_t logical_addr)
 {
-    feistel_calls++;
-    size_t addr = logical_addr;
-
-round:
-    size_t sector_addr = addr / SECTOR_SIZE;
-
-    //               |       B       |
-    //               |<-MSB->|<-LSB->|
-    // logical_addr: |  msb  |  lsb  |
-
-    size_t LSB_mask = ~( (~(size_t)0) << LSB );
-
-    size_t msb, lsb, _msb, _lsb, randomized_addr;
-
-    for (uint8_t i = 0; i < 3; i++) {
-        msb = sector_addr >> LSB;
-        lsb = sector_addr & LSB_mask;
-
-        _msb = msb;
-        // mask output of F to also be |LSB| for XORing with lsb
-        _lsb = (lsb ^ (feistel_function(msb, keys[i]) & LSB_mask));
-
-        // swap lsb and msb
-        sector_addr = (_lsb << MSB) | _msb;
-        ESP_LOGV(TAG, "%s: msb=0x%x lsb=0x%x sector_addr=0x%x", __func__, _msb, _lsb, sector_addr);
-    }
-    randomized_addr = sector_addr;
-    ESP_LOGD(TAG, "%s: randomized_addr=0x%x", __func__, randomized_addr);
+    return swap_or_not_randomizer.map(logical_addr, &stats);
+}
 
-    if (randomized_addr >= SECTOR_COUNT) {
-        addr = randomized_addr * SECTOR_SIZE;
-        feistel_cycle_walks++;
-        goto round;
-    }
+size_t feistel_network_inverse(size_t physical_addr)
+{
+    return feistel_randomizer.unmap(physical_addr, &stats);
+}
 
-    return randomized_addr * SECTOR_SIZE;
+size_t swap_or_not_inverse(size_t physical_addr)
+{
+    return swap_or_not_randomizer.unmap(physical_addr, &stats);
 }
 
 size_t calcAddr(size_t addr)
 {
-    size_t intermediate_addr = addr;
-    if (feistel) {
-        intermediate_addr = feistel_network(addr);
-    }
-
-    size_t result = (FLASH_SIZE - move_count * PAGE_SIZE + intermediate_addr) % FLASH_SIZE;
-    size_t dummy_addr = pos * PAGE_SIZE;
-
-    if (result < dummy_addr) {
+    size_t result;
+    if (swap_or_not_enabled) {
+        result = wl_mapping::mapAddress(swap_or_not_randomizer, rotation, addr, move_count, pos, &stats);
+    } else if (feistel) {
+        result = wl_mapping::mapAddress(feistel_randomizer, rotation, addr, move_count, pos, &stats);
     } else {
-        result += PAGE_SIZE;
+        result = wl_mapping::mapAddress(wl_mapping::Identity(), rotation, addr, move_count, pos, &stats);
     }
 
-    ESP_LOGV(TAG, "%s - addr= 0x%08x -> result= 0x%08x, dummy_addr= 0x%08x", __func__, (uint32_t) addr, (uint32_t) result, (uint32_t)dummy_addr);
+    ESP_LOGV(TAG, "%s - addr= 0x%08x -> result= 0x%08x, dummy_addr= 0x%08x", __func__, (uint32_t) addr, (uint32_t) result, (uint32_t)(pos * PAGE_SIZE));
     return result;
 }
 
@@ -203,7 +183,9 @@ esp_err_t erase_range(size_t start_address, size_t size)
              __func__, (uint32_t) start_address, (uint32_t) size, (uint32_t) erase_count, (uint32_t) start_sector);
 
     for (size_t i = 0; i < erase_count; i++) {
-        result = erase_sector(start_sector + i);
+        // address and block size functions can reach past the last sector, wrap around
+        // as mapping is only defined for sectors 0 ~ SECTOR_COUNT-1 (real WL would reject such erase)
+        result = erase_sector((start_sector + i) % SECTOR_COUNT);
         if (result != ESP_OK) {
             // will propagate fail return code
             break;
@@ -221,8 +203,9 @@ void print_vars()
     ESP_LOGD(TAG, "move_count = %lu", move_count);
     ESP_LOGD(TAG, "cycle_count = %u", cycle_count);
     if (feistel) {
-        ESP_LOGI(TAG, "feistel_calls = %lu", feistel_calls);
-        ESP_LOGI(TAG, "feistel cycle walks = %u", feistel_cycle_walks);
+        ESP_LOGI(TAG, "feistel_calls = %u", stats.calls);
+        ESP_LOGI(TAG, "feistel cycle walks = %u", stats.walks);
+        ESP_LOGI(TAG, "feistel max walk = %u", stats.max_walk);
     }
 }
 
@@ -253,7 +236,7 @@ void print_output()
     // and +1 for dummy sector here as well
     double NE = ((double)sum / (double)(SECTOR_ERASE_ENDURANCE * (SECTOR_COUNT + 1)) * 100);
 
-    printf("NE %f cycle_walks %u restarted %u feistel_calls %u\n", NE, feistel_cycle_walks, restarted, feistel_calls);
+    printf("NE %f cycle_walks %u restarted %u feistel_calls %u\n", NE, stats.walks, restarted, stats.calls);
 }
 
 void print_reconstructed()
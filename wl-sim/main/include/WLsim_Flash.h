@@ -4,6 +4,12 @@
 
 void init_feistel(bool verbose);
 size_t feistel_network(size_t logical_addr);
+size_t feistel_network_inverse(size_t physical_addr);
+void init_swap_or_not(bool verbose);
+size_t swap_or_not(size_t logical_addr);
+size_t swap_or_not_inverse(size_t physical_addr);
+uint32_t get_feistel_max_walk();
+void reset_feistel_stats();
 esp_err_t erase_range(size_t start_address, size_t size);
 
 void print_output();
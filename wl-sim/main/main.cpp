@@ -6,6 +6,7 @@
 #include "wl_sim_random.h"
 #include "wl_sim.h"
 #include "WLsim_Flash.h"
+#include "WL_Mapping.h"
 
 static const char *TAG = "wl-sim";
 
@@ -24,8 +25,7 @@ int main(int argc, char **argv)
 
     // if single argument 'test', run the mapping correctness test
     if (argc == 2 && strcmp(argv[1], "test") == 0) {
-        feistel_test();
-        return 0;
+        return feistel_test() == 0 ? 0 : 1;
     }
 
     // otherwise require all args for a simulation run
@@ -33,7 +33,7 @@ int main(int argc, char **argv)
     // for Feistel enabled, zipf address access and zipf block size with maximum of 10 and 0 per mille chance for restart
     if (argc != 6) {
         printf("Need simulation params as arguments:\n\
-\tMAPPING_ALG: f for Feistel, b for base mapping alg\n\
+\tMAPPING_ALG: f for Feistel, s for swap-or-not, b for base mapping alg\n\
 \tADDRESS_FUNC: z for zipf, c for const\n\
 \tBLOCKS_SIZE_FUNC: z for zipf, c for const\n\
 \tBLOCK_SIZE: N for max erase block size\n\
@@ -44,8 +44,11 @@ int main(int argc, char **argv)
     // argument parsing
 
     bool enable_feistel = false;
+    bool enable_swap_or_not = false;
     if (strcmp(argv[1], "f") == 0) {
         enable_feistel = true;
+    } else if (strcmp(argv[1], "s") == 0) {
+        enable_swap_or_not = true;
     } else if (strcmp(argv[1], "b") == 0) {
         // enable_feistel already false
     } else {
@@ -97,6 +100,9 @@ int main(int argc, char **argv)
     if (enable_feistel) {
         init_feistel(false);
     }
+    if (enable_swap_or_not) {
+        init_swap_or_not(false);
+    }
 
     // runs until any sector reaches erase lifetime, see erase_sector()
     while (erase_range(addr_func(FLASH_SIZE), ERASE_SIZE * block_func(erase_block_size)) == ESP_OK) {
@@ -119,64 +125,124 @@ int main(int argc, char **argv)
     return 0;
 }
 
-// test that feistel indeed maps 1:1, that no two sectors map to the same one
-int feistel_test()
-{
-    // generate keys etc.
-    init_feistel(true);
-    ESP_LOGI(TAG, "Feistel initialized");
+// number of random key sets the mapping test goes through for each algorithm
+#define MAPPING_TEST_KEY_SETS 10000
 
-    // per sector tracker of how many times given sector was the output of Feistel network
+// check that mapping_func maps all sectors 1:1, that no two sectors map to the same one
+// and that inverse_func maps them back
+// returns number of errors
+static uint32_t mapping_test_keys(address_function_t mapping_func, address_function_t inverse_func)
+{
+    // per sector tracker of how many times given sector was the output of mapping
     uint8_t occurences[SECTOR_COUNT] = {0};
-
-    uint32_t nonzeros = 0;
-    size_t addr, sector_addr;
+    uint32_t errors = 0;
 
     // go through all sectors
     for (uint32_t i = 0; i < SECTOR_COUNT; i++) {
-        // get the randomized mapping for sector given by i
-        addr = feistel_network(i * SECTOR_SIZE);
-
         // sector_addr ~ sector index (0, 1, 2 ~ SECTOR_COUNT-1)
-        sector_addr = addr / SECTOR_SIZE;
+        size_t sector_addr = mapping_func(i * SECTOR_SIZE) / SECTOR_SIZE;
 
-        // if Feistel mapped given sector outside of possible indices, report error
+        // if mapped given sector outside of possible indices, report error
         if (sector_addr >= SECTOR_COUNT) {
-            ESP_LOGE(TAG, "sector_addr=%u", sector_addr);
+            ESP_LOGE(TAG, "sector 0x%x mapped to 0x%x", i, sector_addr);
+            errors++;
+            continue;
         }
-
-        // now use the fact that sector_addr ~ index
-        // and mark that given sector was the output of Feistel
         occurences[sector_addr]++;
-        nonzeros++;
+
+        if (inverse_func(sector_addr * SECTOR_SIZE) != i * SECTOR_SIZE) {
+            ESP_LOGE(TAG, "sector 0x%x mapped to 0x%x, inverse gives 0x%x", i, sector_addr, inverse_func(sector_addr * SECTOR_SIZE) / SECTOR_SIZE);
+            errors++;
+        }
     }
-    // sector_count should equal nonzeros
-    ESP_LOGI(TAG, "after feistel: sector_count=%u, nonzeros=%u", SECTOR_COUNT, nonzeros);
-    nonzeros = 0;
 
-    // now do second go through all sectors and this time check that from previous loop
-    // each sector was the output of Feistel exactly once => 1-to-1 mapping
+    // each sector must have been the output exactly once => 1-to-1 mapping
     for (uint32_t i = 0; i < SECTOR_COUNT; i++) {
-        // sector_addr ~ i
-        if (occurences[i] != 0) {
-            nonzeros++;
-            // if given sector occurred multiple times, that is an error as mapping should be 1:1
-            if (occurences[i] > 1) {
-                ESP_LOGE(TAG, "sector 0x%x occured %u times", i, occurences[i]);
-            } else {
-                // this is the correct state, nonzero occurrence but not greater than 1
-            }
-        // any other state is also erroneous
-        } else if (occurences[i] == 0) {
-            ESP_LOGE(TAG, "sector 0x%x occured %u times", i, occurences[i]);
-        } else {
+        if (occurences[i] != 1) {
             ESP_LOGE(TAG, "sector 0x%x occured %u times", i, occurences[i]);
+            errors++;
         }
     }
-    // once again sector_count should equal nonzeros
-    ESP_LOGI(TAG, "after occurences: sector_count=%u, nonzeros=%u", SECTOR_COUNT, nonzeros);
-    print_vars();
 
-    return 0;
+    return errors;
+}
+
+// check that un-rotating gives back the rotated address for every move_count and dummy position,
+// and that the dummy page is the only one without a logical address
+// returns number of errors
+static uint32_t rotation_test()
+{
+    wl_mapping::Rotation rotation;
+    rotation.init(FLASH_SIZE, PAGE_SIZE);
+    wl_mapping::Identity identity;
+    uint32_t errors = 0;
+
+    for (uint32_t move_count = 0; move_count < MAX_POS - 1; move_count++) {
+        for (uint32_t pos = 0; pos < MAX_POS; pos++) {
+            for (size_t addr = 0; addr < FLASH_SIZE; addr += PAGE_SIZE) {
+                size_t physical = wl_mapping::mapAddress(identity, rotation, addr, move_count, pos, NULL);
+                if (wl_mapping::unmapAddress(identity, rotation, physical, move_count, pos, NULL) != addr) {
+                    ESP_LOGE(TAG, "move_count=%u pos=%u: 0x%x -> 0x%x does not map back", move_count, pos, addr, physical);
+                    errors++;
+                }
+            }
+            if (wl_mapping::unmapAddress(identity, rotation, pos * PAGE_SIZE, move_count, pos, NULL) != WL_MAPPING_NO_ADDR) {
+                ESP_LOGE(TAG, "move_count=%u pos=%u: dummy page maps back to a logical address", move_count, pos);
+                errors++;
+            }
+        }
+    }
+    ESP_LOGI(TAG, "rotation: %u move counts x %u positions, errors=%u", MAX_POS - 1, MAX_POS, errors);
+
+    return errors;
 }
 
+// test that Feistel and swap-or-not indeed map 1:1 and back for many different keys,
+// that Feistel cycle walking stays within its bound and that rotation can be undone
+int feistel_test()
+{
+    uint32_t errors = 0, max_walk = 0;
+
+    // B = log2(SECTOR_COUNT) as in init_feistel()
+    uint32_t B = 0;
+    for (uint32_t sector_count = SECTOR_COUNT; sector_count; sector_count >>= 1) {
+        B++;
+    }
+    // each 3-stage network is a bijection on B bits => a walk can pass every out of range address at most once
+    uint32_t walk_bound = (1u << B) - SECTOR_COUNT;
+
+    for (uint32_t k = 0; k < MAPPING_TEST_KEY_SETS; k++) {
+        init_feistel(k == 0);
+        reset_feistel_stats();
+        errors += mapping_test_keys(&feistel_network, &feistel_network_inverse);
+        if (get_feistel_max_walk() > max_walk) {
+            max_walk = get_feistel_max_walk();
+        }
+    }
+    ESP_LOGI(TAG, "Feistel: %u key sets, sector_count=%u, max walk=%u (bound %u), errors=%u",
+             MAPPING_TEST_KEY_SETS, SECTOR_COUNT, max_walk, walk_bound, errors);
+    if (max_walk > walk_bound) {
+        ESP_LOGE(TAG, "Feistel max walk %u over bound %u", max_walk, walk_bound);
+        errors++;
+    }
+
+    // swap-or-not always takes WL_SWAP_OR_NOT_ROUNDS rounds, only bijectivity needs checking
+    uint32_t swap_or_not_errors = 0;
+    for (uint32_t k = 0; k < MAPPING_TEST_KEY_SETS; k++) {
+        init_swap_or_not(k == 0);
+        swap_or_not_errors += mapping_test_keys(&swap_or_not, &swap_or_not_inverse);
+    }
+    ESP_LOGI(TAG, "swap-or-not: %u key sets, sector_count=%u, rounds=%u, errors=%u",
+             MAPPING_TEST_KEY_SETS, SECTOR_COUNT, WL_SWAP_OR_NOT_ROUNDS, swap_or_not_errors);
+    errors += swap_or_not_errors;
+
+    errors += rotation_test();
+
+    if (errors != 0) {
+        ESP_LOGE(TAG, "mapping test FAILED with %u errors", errors);
+        return -1;
+    }
+    ESP_LOGI(TAG, "mapping test OK");
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#! /usr/bin/env python3
+
+__version__ = "0.1"
+
+import argparse
+import sys
+from collections import Counter
+
+# wl_trace_op_t from wear_levelling.h
+TRACE_OPS = {1: 'read', 2: 'write', 3: 'erase', 4: 'move', 5: 'state'}
+TRACE_NO_ADDR = 0xFFFFFFFF
+TRACE_PREFIX = 'WLTRACE:'
+
+def parse_entries(lines):
+    """
+    Collect trace entries from console output of wl_dump_trace(), other lines are skipped.
+    Every entry is a line of six hex words: timestamp, op_size, logical_addr, physical_addr, pos, move_count.
+    """
+    entries = list()
+    for line in lines:
+        start = line.find(TRACE_PREFIX)
+        if start < 0:
+            continue
+        words = line[start + len(TRACE_PREFIX):].split()
+        if len(words) != 6:
+            print(f'Skipping malformed line: {line.strip()}', file=sys.stderr)
+            continue
+        timestamp, op_size, logical_addr, physical_addr, pos, move_count = (int(word, base=16) for word in words)
+        entries.append({
+            'timestamp': timestamp,
+            'op': TRACE_OPS.get(op_size >> 24, f'op{op_size >> 24}'),
+            'size': op_size & 0x00FFFFFF,
+            'logical_addr': logical_addr,
+            'physical_addr': physical_addr,
+            'pos': pos,
+            'move_count': move_count,
+        })
+    return entries
+
+def print_entries(entries, cpu_mhz):
+    """
+    Print entries with time in microseconds since the first one, cycle counter wraps are accounted for.
+    """
+    print(f'{"time [us]":>12} {"delta [us]":>10} {"op":<6} {"size":>8} {"logical":>10} {"physical":>10} {"pos":>6} {"move_count":>10}')
+    elapsed = 0
+    previous = None
+    for entry in entries:
+        delta = 0 if previous is None else (entry['timestamp'] - previous) & 0xFFFFFFFF
+        previous = entry['timestamp']
+        elapsed += delta
+        logical = '-' if entry['logical_addr'] == TRACE_NO_ADDR else hex(entry['logical_addr'])
+        print(f'{elapsed / cpu_mhz:12.1f} {delta / cpu_mhz:10.1f} {entry["op"]:<6} {entry["size"]:8} {logical:>10} '
+              f'{hex(entry["physical_addr"]):>10} {entry["pos"]:6} {entry["move_count"]:10}')
+
+def print_summary(entries, sector_size, count):
+    """
+    Print operation totals and the logical sectors written and erased most often,
+    which are the ones to look for in the application.
+    """
+    ops = Counter(entry['op'] for entry in entries)
+    print(', '.join(f'{op}: {ops[op]}' for op in sorted(ops)))
+    for op, verb in (('erase', 'erased'), ('write', 'written')):
+        sectors = Counter()
+        for entry in entries:
+            if entry['op'] != op or entry['logical_addr'] == TRACE_NO_ADDR:
+                continue
+            # extents can span several sectors
+            first = entry['logical_addr'] // sector_size
+            last = (entry['logical_addr'] + max(entry['size'], 1) - 1) // sector_size
+            for sector in range(first, last + 1):
+                sectors[sector] += 1
+        if not sectors:
+            continue
+        print(f'Most {verb} logical sectors:')
+        for sector, hits in sectors.most_common(count):
+            print(f'  {sector:6} (offset {hex(sector * sector_size)}): {hits}')
+
+def main():
+    """
+    Main function for wltrace
+    """
+    parser = argparse.ArgumentParser(
+        description=f"wltrace.py v{__version__} - Decoder for wear levelling traces printed by wl_dump_trace()",
+        prog="wltrace",
+    )
+    parser.add_argument(
+        "log",
+        help="Captured console output, - for stdin"
+    )
+    parser.add_argument(
+        "--cpu-mhz",
+        help="CPU frequency for converting cycle timestamps to microseconds",
+        type=int,
+        default=240
+    )
+    parser.add_argument(
+        "--sector-size",
+        help="Sector size of the partition for the summary",
+        type=int,
+        default=4096
+    )
+    parser.add_argument(
+        "--summary",
+        help="Only print the summary, not every entry",
+        action="store_true"
+    )
+    parser.add_argument(
+        "--top",
+        help="Number of hottest sectors listed in the summary",
+        type=int,
+        default=10
+    )
+
+    args = parser.parse_args(sys.argv[1:])
+
+    if args.log == '-':
+        entries = parse_entries(sys.stdin)
+    else:
+        with open(args.log, errors='replace') as log:
+            entries = parse_entries(log)
+
+    if not entries:
+        print('No trace entries found, was the log captured with wl_dump_trace() and CONFIG_WL_TRACE_ENTRIES > 0?')
+        return 1
+
+    if not args.summary:
+        print_entries(entries, args.cpu_mhz)
+        print()
+    print_summary(entries, args.sector_size, args.top)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())